@@ -3,6 +3,7 @@ function lutro.load()
 	spriteCount = 0
 
 	spriteImg = lutro.graphics.newImage("logo.png")
+	spriteBatch = lutro.graphics.newSpriteBatch(spriteImg, 1000)
 	lutro.graphics.setBackgroundColor(54, 172, 248)
 
 	procreate(30,70)
@@ -11,13 +12,7 @@ function lutro.load()
 end
 
 function lutro.draw()
-	for index,value in ipairs(sprites) do
-		local tempSpriteId = value[1]
-		local tempSpritePosX = value[2]
-		local tempSpritePosY = value[3]
-
-		lutro.graphics.draw(spriteImg, tempSpritePosX, tempSpritePosY)
-	end
+	lutro.graphics.draw(spriteBatch)
 
 	lutro.graphics.print("Sprites: " .. spriteCount, 20, 10)
 	lutro.graphics.print("FPS " .. lutro.timer.getFPS(), 20, 30)
@@ -54,6 +49,7 @@ function lutro.update(dt)
 
 		local sprite = {tempSpriteId, tempSpritePosX, tempSpritePosY, tempSpriteSpeedX, tempSpriteSpeedY }
 		sprites[index] = sprite
+		spriteBatch:set(index, tempSpritePosX, tempSpritePosY)
 	end
 
 	if lutro.joystick.isDown(1, 1) or lutro.joystick.isDown(1, 0) or lutro.joystick.isDown(1, 2) then
@@ -74,4 +70,5 @@ function procreate(x, y)
 	local sprite = {spriteId, spritePosX, spritePosY, spriteSpeedX, spriteSpeedY }
 
 	table.insert(sprites, sprite)
+	spriteBatch:add(spritePosX, spritePosY)
 end
\ No newline at end of file
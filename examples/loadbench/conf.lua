@@ -0,0 +1,4 @@
+function lutro.conf(t)
+	t.width = 320
+	t.height = 240
+end
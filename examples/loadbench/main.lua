@@ -0,0 +1,45 @@
+-- Times loading a 4096x1024 sprite sheet, as it is, premultiplied, then
+-- from the disk cache. Each load misses the decoded image cache, purged.
+local loads = 10
+
+local function load(premultiplied)
+	local start = lutro.timer.getTime()
+	local data = lutro.image.newImageData("sheet.png", { premultiplied = premultiplied })
+	local elapsed = lutro.timer.getTime() - start
+	data = nil
+	collectgarbage()
+	lutro.image.purgeCache()
+	return elapsed
+end
+
+local function bench(premultiplied)
+	local total = 0
+	for i = 1, loads do
+		total = total + load(premultiplied)
+	end
+	return total / loads * 1000
+end
+
+function lutro.load()
+	lutro.image.setCacheBudget(0)
+	straight = bench(false)
+	premultiplied = bench(true)
+
+	-- the first load writes the file the others map.
+	if lutro.image.setDiskCache(true) then
+		load(true)
+		mapped = bench(true)
+		lutro.image.setDiskCache(false)
+	end
+
+	print(string.format("sheet.png: %.2f ms, premultiplied %.2f ms, from disk %s", straight, premultiplied,
+		mapped and string.format("%.2f ms", mapped) or "unavailable"))
+end
+
+function lutro.draw()
+	lutro.graphics.print(string.format("straight %.2f ms", straight), 20, 10)
+	lutro.graphics.print(string.format("premultiplied %.2f ms", premultiplied), 20, 30)
+	if mapped then
+		lutro.graphics.print(string.format("from disk %.2f ms", mapped), 20, 50)
+	end
+end
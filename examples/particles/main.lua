@@ -0,0 +1,34 @@
+-- Times ParticleSystem:update on its own, apart from drawing.
+function lutro.load()
+	spark = lutro.graphics.newImage("spark.png")
+	system = lutro.graphics.newParticleSystem(spark, 20000)
+	system:setPosition(160, 200)
+	system:setEmissionRate(4000)
+	system:setParticleLifetime(3, 5)
+	system:setSpeed(40, 120)
+	system:setDirection(-math.pi / 2)
+	system:setSpread(math.pi / 3)
+	system:setLinearAcceleration(-5, 30, 5, 60)
+	system:setColors(255, 240, 120, 255, 255, 90, 20, 200, 80, 20, 20, 0)
+	system:setSizes(1, 0.6)
+
+	updateTime = 0
+	updates = 0
+	lutro.graphics.setBackgroundColor(16, 16, 32)
+	font = lutro.graphics.newImageFont("../benchmark/font.png", " abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789.,!?-+/")
+	lutro.graphics.setFont(font)
+end
+
+function lutro.update(dt)
+	local start = lutro.timer.getTime()
+	system:update(dt)
+	updateTime = updateTime + lutro.timer.getTime() - start
+	updates = updates + 1
+end
+
+function lutro.draw()
+	lutro.graphics.draw(system)
+	lutro.graphics.print("Particles " .. system:getCount(), 10, 10)
+	lutro.graphics.print(("Update %d us"):format(updateTime / updates * 1000000), 10, 30)
+	lutro.graphics.print("FPS " .. lutro.timer.getFPS(), 10, 50)
+end
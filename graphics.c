@@ -1,18 +1,42 @@
 #include "graphics.h"
 #include "image.h"
 #include "lutro.h"
+#include "painter_blend.h"
+#include "painter_queue.h"
+#include "painter_dirty.h"
+#include "painter_cache.h"
+#include "painter_atlas.h"
+#include "image_cache.h"
+#include "lutro_workers.h"
 #include <compat/strl.h>
 #include <retro_miscellaneous.h>
 
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
 
 static int def_canv = LUA_NOREF;
 static int cur_canv = LUA_NOREF;
 static bitmap_t  *fbbmp;
+// frontend memory for the next frame, see lutro_graphics_lend_framebuffer.
+static void *lent_data;
+static size_t lent_pitch;
+// the frame packed to 16 bits, see settings.pixel_format.
+static uint16_t *packed_frame;
+
+// deferred rendering of the default canvas, see settings.deferred_draw.
+static pntr_queue_t *draw_queue;
+static pntr_dirty_t *frame_dirty;
+// scaled and rotated sprites of every canvas, see lutro.graphics.setSpriteCacheBudget.
+static pntr_cache_t *sprite_cache;
+static int frame_refs = LUA_NOREF;
+static int frame_ref_count;
+static const void *frame_ref_last;
 //static uint32_t current_color;
 //static uint32_t background_color;
 
+#define OPTNUMBER(L, ndx, def) (lua_isnumber(L, ndx) ? lua_tonumber(L, ndx) : def)
+
 static void set_ref(lua_State *L, int *ref)
 {
    if (*ref != LUA_NOREF)
@@ -29,16 +53,36 @@ static int canvas_setFilter(lua_State *L)
    return 0;
 }
 
+static int canvas_newImageData(lua_State *L)
+{
+   gfx_Canvas* self = (gfx_Canvas*)luaL_checkudata(L, 1, "Canvas");
+   bitmap_t *src = self->target;
+
+   // pending deferred draws must land before the pixels are read.
+   if (self->queue)
+      lutro_graphics_flush();
+
+   bitmap_t *dst = (bitmap_t*)image_data_create_from_dimensions(L, src->width, src->height, 0);
+
+   for (unsigned y = 0; y < src->height; ++y)
+      memcpy(dst->data + y * (dst->pitch >> 2), src->data + y * (src->pitch >> 2), src->width * sizeof(uint32_t));
+
+   return 1;
+}
+
 static gfx_Canvas *new_canvas(lua_State *L)
 {
    gfx_Canvas* self = (gfx_Canvas*)lua_newuserdata(L, sizeof(gfx_Canvas));
    memset(self, 0, sizeof(*self));
+   self->font_ref = LUA_NOREF;
+   self->cache = sprite_cache;
 
    if (luaL_newmetatable(L, "Canvas") != 0)
    {
       static luaL_Reg canvas_funcs[] = {
          { "type",      canvas_type },
          { "setFilter", canvas_setFilter },
+         { "newImageData", canvas_newImageData },
          { "__gc",      canvas_gc },
          {NULL, NULL}
       };
@@ -65,8 +109,22 @@ static gfx_Canvas *get_canvas_ref(lua_State *L, int ref)
 
 void lutro_graphics_init(lua_State *L)
 {
+   pntr_blend_init();
+
+   if (settings.deferred_draw && !draw_queue)
+   {
+      lutro_workers_init(settings.draw_threads);
+      draw_queue = pntr_queue_new();
+   }
+
+   if (!frame_dirty)
+      frame_dirty = pntr_dirty_new();
+
+   if (!sprite_cache)
+      sprite_cache = pntr_cache_new(0);
+
    // TODO: power of two framebuffers
-   new_canvas(L);
+   new_canvas(L)->dirty = frame_dirty;
    lua_pushvalue(L, -1);
    set_ref(L, &def_canv);
    set_ref(L, &cur_canv);
@@ -78,16 +136,30 @@ void lutro_graphics_reinit(lua_State *L)
 {
    gfx_Canvas *canvas;
 
+   lutro_graphics_flush();
+
    if (!(fbbmp && fbbmp->width == settings.width && fbbmp->height == settings.height)) {
        if (fbbmp)
-           lutro_free(fbbmp->data);
+       {
+           lutro_free(settings.framebuffer);
+           lutro_free(packed_frame);
+           packed_frame = NULL;
+       }
        else
            fbbmp = (bitmap_t*)lutro_calloc(1, sizeof(bitmap_t));
 
+       // lent memory has the size of the screen it was lent for.
+       lent_data = NULL;
+       if (frame_dirty)
+           pntr_dirty_forget(frame_dirty);
+
        settings.pitch_pixels = settings.width;
        settings.pitch        = settings.pitch_pixels * sizeof(uint32_t);
        settings.framebuffer  = (uint32_t*)lutro_calloc(1, settings.pitch * settings.height);
 
+       if (settings.pixel_format == RETRO_PIXEL_FORMAT_RGB565)
+           packed_frame = (uint16_t*)lutro_calloc((size_t)settings.width * settings.height, sizeof(uint16_t));
+
        fbbmp->data   = settings.framebuffer;
        fbbmp->height = settings.height;
        fbbmp->width  = settings.width;
@@ -100,11 +172,113 @@ void lutro_graphics_reinit(lua_State *L)
    lua_pop(L, 1);
 }
 
+void lutro_graphics_deinit(void)
+{
+   pntr_queue_free(draw_queue);
+   draw_queue = NULL;
+   lutro_workers_deinit();
+
+   pntr_dirty_free(frame_dirty);
+   frame_dirty = NULL;
+
+   pntr_cache_free(sprite_cache);
+   sprite_cache = NULL;
+
+   // the Lua state these referred to is gone, along with the default canvas.
+   def_canv = cur_canv = frame_refs = LUA_NOREF;
+   fbbmp = NULL;
+   lent_data = NULL;
+
+   lutro_free(packed_frame);
+   packed_frame = NULL;
+}
+
+void lutro_graphics_flush(void)
+{
+   if (draw_queue)
+      pntr_queue_flush(draw_queue);
+}
+
+// points the default canvas at other pixels than those drawn last.
+static void move_framebuffer(uint32_t *data, size_t pitch)
+{
+   fbbmp->data  = data;
+   fbbmp->pitch = pitch;
+   pntr_dirty_forget(frame_dirty);
+}
+
+// points the default canvas back at lutro's own buffer, along with the
+// frame drawn last, which the dirty tracker keeps knowing.
+static void reclaim_framebuffer(void)
+{
+   const uint8_t *src = (const uint8_t*)fbbmp->data;
+   uint8_t *dst = (uint8_t*)settings.framebuffer;
+
+   for (unsigned y = 0; y < fbbmp->height; y++)
+      memcpy(dst + y * settings.pitch, src + y * fbbmp->pitch, fbbmp->width * sizeof(uint32_t));
+
+   fbbmp->data  = settings.framebuffer;
+   fbbmp->pitch = settings.pitch;
+}
+
+void lutro_graphics_lend_framebuffer(void *data, size_t pitch)
+{
+   lent_data  = data;
+   lent_pitch = pitch;
+
+   // the lent memory is the frontend's again once the frame is handed over.
+   if (!data && fbbmp && fbbmp->data != settings.framebuffer)
+      reclaim_framebuffer();
+}
+
+const void *lutro_graphics_framebuffer(size_t *pitch)
+{
+   if (settings.pixel_format != RETRO_PIXEL_FORMAT_RGB565)
+   {
+      *pitch = fbbmp->pitch;
+      return fbbmp->data;
+   }
+
+   // the painter keeps drawing 32 bits pixels, packed as the frame is
+   // handed over, straight into the lent memory if any.
+   uint8_t *data = lent_data ? lent_data : (uint8_t*)packed_frame;
+   *pitch = lent_data ? lent_pitch : fbbmp->width * sizeof(uint16_t);
+
+   const uint8_t *src = (const uint8_t*)fbbmp->data;
+   for (unsigned y = 0; y < fbbmp->height; y++)
+      pntr_pack_rgb565((uint16_t*)(data + y * *pitch), (const uint32_t*)(src + y * fbbmp->pitch), fbbmp->width);
+
+   return data;
+}
+
 void lutro_graphics_begin_frame(lua_State *L)
 {
    gfx_Canvas* canvas = get_canvas_ref(L, cur_canv);
-   pntr_clear(canvas);
+   rect_t screen = { 0, 0, fbbmp->width, fbbmp->height };
+
+   // lent memory holds anything but the last frame, even when lent again,
+   // so it is only drawn into when the frame starts by clearing all of it.
+   if (lent_data && settings.pixel_format == RETRO_PIXEL_FORMAT_XRGB8888
+         && canvas->target == fbbmp && memcmp(&canvas->clip, &screen, sizeof(rect_t)) == 0)
+      move_framebuffer(lent_data, lent_pitch);
+
+   if (canvas->dirty)
+      pntr_dirty_clear(canvas);
+   else
+      pntr_clear(canvas);
    lua_pop(L, 1);
+
+   if (draw_queue)
+   {
+      canvas = get_canvas_ref(L, def_canv);
+      pntr_queue_begin(draw_queue, canvas);
+      lua_pop(L, 1);
+
+      lua_newtable(L);
+      set_ref(L, &frame_refs);
+      frame_ref_count = 0;
+      frame_ref_last  = NULL;
+   }
 }
 
 void lutro_graphics_end_frame(lua_State *L)
@@ -112,6 +286,53 @@ void lutro_graphics_end_frame(lua_State *L)
    gfx_Canvas* canvas = get_canvas_ref(L, cur_canv);
    pntr_origin(canvas, true);
    lua_pop(L, 1);
+
+   if (draw_queue)
+   {
+      pntr_queue_end(draw_queue);
+      luaL_unref(L, LUA_REGISTRYINDEX, frame_refs);
+      frame_refs = LUA_NOREF;
+   }
+
+   // the sprites dropped during the frame may have been queued until now.
+   pntr_cache_collect(sprite_cache);
+}
+
+bool lutro_graphics_frame_changed(lua_State *L)
+{
+   gfx_Canvas* canvas = get_canvas_ref(L, def_canv);
+   bool changed = canvas->dirty ? pntr_dirty_compare(canvas) : true;
+   lua_pop(L, 1);
+
+   return changed;
+}
+
+// deferred draws read their bitmap at the end of the frame, so the object
+// owning it must not be collected before.
+static void keep_until_flush(lua_State *L, int ndx)
+{
+   const void *ptr = lua_topointer(L, ndx);
+
+   if (frame_refs == LUA_NOREF || ptr == frame_ref_last)
+      return;
+
+   frame_ref_last = ptr;
+   lua_rawgeti(L, LUA_REGISTRYINDEX, frame_refs);
+   lua_pushvalue(L, ndx);
+   lua_rawseti(L, -2, ++frame_ref_count);
+   lua_pop(L, 1);
+}
+
+// deferred glyphs read the atlas of the font of the canvas at the end of
+// the frame, and another font may be set until then.
+static void keep_font_until_flush(lua_State *L, gfx_Canvas *canvas)
+{
+   if (!canvas->queue)
+      return;
+
+   lua_rawgeti(L, LUA_REGISTRYINDEX, canvas->font_ref);
+   keep_until_flush(L, lua_gettop(L));
+   lua_pop(L, 1);
 }
 
 static int img_getData(lua_State *L)
@@ -149,6 +370,81 @@ static int img_setFilter(lua_State *L)
    return 0;
 }
 
+/* lutro extension, the colors of indexed images, the first at index 0. */
+static int img_getPalette(lua_State *L)
+{
+   gfx_Image* self = (gfx_Image*)luaL_checkudata(L, 1, "Image");
+   bitmap_t *bmp = self->data;
+
+   if (!bmp->indices)
+      return 0;
+
+   lua_createtable(L, BITMAP_PALETTE_SIZE, 0);
+   for (int i = 0; i < BITMAP_PALETTE_SIZE; i++)
+   {
+      uint32_t color = bmp->premultiplied ? pntr_unpremultiply(bmp->palette[i]) : bmp->palette[i];
+
+      lua_createtable(L, 4, 0);
+      lua_pushnumber(L, (color & RED_MASK) >> RED_SHIFT);
+      lua_rawseti(L, -2, 1);
+      lua_pushnumber(L, (color & GREEN_MASK) >> GREEN_SHIFT);
+      lua_rawseti(L, -2, 2);
+      lua_pushnumber(L, (color & BLUE_MASK) >> BLUE_SHIFT);
+      lua_rawseti(L, -2, 3);
+      lua_pushnumber(L, (color & ALPHA_MASK) >> ALPHA_SHIFT);
+      lua_rawseti(L, -2, 4);
+      lua_rawseti(L, -2, i + 1);
+   }
+
+   return 1;
+}
+
+/* lutro extension, replaces the colors of an indexed image from index first
+ * (0 by default) on, which every Image sharing its ImageData then uses. */
+static int img_setPalette(lua_State *L)
+{
+   int n = lua_gettop(L);
+
+   if (n != 2 && n != 3)
+      return luaL_error(L, "Image:setPalette requires 1 or 2 arguments, %d given.", n - 1);
+
+   gfx_Image* self = (gfx_Image*)luaL_checkudata(L, 1, "Image");
+   luaL_checktype(L, 2, LUA_TTABLE);
+   int first = luaL_optint(L, 3, 0);
+
+   if (!self->data->indices)
+      return luaL_error(L, "Image:setPalette requires an indexed image.");
+
+   int count = lua_objlen(L, 2);
+   if (first < 0 || first + count > BITMAP_PALETTE_SIZE)
+      return luaL_error(L, "Image:setPalette colors %d to %d are out of the palette.", first, first + count - 1);
+
+   uint32_t colors[BITMAP_PALETTE_SIZE];
+   for (int i = 0; i < count; i++)
+   {
+      lua_rawgeti(L, 2, i + 1);
+      luaL_checktype(L, -1, LUA_TTABLE);
+
+      int c[4];
+      for (int j = 0; j < 4; j++)
+      {
+         lua_rawgeti(L, -1, j + 1);
+         c[j] = j < 3 ? luaL_checkint(L, -1) : luaL_optint(L, -1, 255);
+         lua_pop(L, 1);
+      }
+      lua_pop(L, 1);
+
+      colors[i] = (c[3] << 24) | (c[0] << 16) | (c[1] << 8) | c[2];
+   }
+
+   // the image may have been drawn to the deferred frame with its former colors.
+   lutro_graphics_flush();
+   image_cache_detach(self->data);
+   bitmap_set_palette(self->data, colors, first, count);
+
+   return 0;
+}
+
 static int img_gc(lua_State *L)
 {
    gfx_Image* self = (gfx_Image*)luaL_checkudata(L, 1, "Image");
@@ -164,12 +460,18 @@ static int img_gc(lua_State *L)
    return 0;
 }
 
+static void push_image_meta(lua_State *L, gfx_Image *self);
+
 static int gfx_newImage(lua_State *L)
 {
    int n = lua_gettop(L);
 
-   if (n != 1)
-      return luaL_error(L, "lutro.graphics.newImage requires 1 arguments, %d given.", n);
+   if (n != 1 && n != 2)
+      return luaL_error(L, "lutro.graphics.newImage requires 1 or 2 arguments, %d given.", n);
+
+   unsigned given;
+   unsigned flags = image_check_flags(L, 2, &given);
+   bool premultiplied = (flags & IMAGE_PREMULTIPLIED) != 0;
 
    gfx_Image *self = (gfx_Image*)lua_newuserdata(L, sizeof(gfx_Image));;
 
@@ -182,15 +484,38 @@ static int gfx_newImage(lua_State *L)
 
       lua_pushvalue(L, 1);
       self->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+      // the pixels are shared with the ImageData, whose getPixel and
+      // setPixel convert them back and forth, and keep their form unless
+      // told otherwise.
+      if ((given & IMAGE_PREMULTIPLIED) && self->data->premultiplied != premultiplied)
+      {
+         lutro_graphics_flush();
+         image_cache_detach(self->data);
+         bitmap_set_premultiplied(self->data, premultiplied);
+      }
    }
    else
    {
       const char* path = luaL_checkstring(L, 1);
-      self->data = (bitmap_t*)image_data_create_from_path(L, path);
+      self->data = (bitmap_t*)image_data_create_from_path(L, path, flags);
       self->ref = luaL_ref(L, LUA_REGISTRYINDEX);
    }
 
-   self->data->pitch = self->data->width << 2;
+   push_image_meta(L, self);
+
+   return 1;
+}
+
+// turns the userdata on top of the stack into an Image drawing self->data.
+static void push_image_meta(lua_State *L, gfx_Image *self)
+{
+   // bitmaps on an atlas page keep the pitch of the page.
+   if (!self->data->indices && !self->data->atlas)
+      self->data->pitch = self->data->width << 2;
+
+   if (!self->data->spans)
+      bitmap_build_spans(self->data);
 
    if (luaL_newmetatable(L, "Image") != 0)
    {
@@ -200,6 +525,8 @@ static int gfx_newImage(lua_State *L)
          { "getHeight",     img_getHeight },
          { "getDimensions", img_getDimensions },
          { "setFilter",     img_setFilter },
+         { "getPalette",    img_getPalette },
+         { "setPalette",    img_setPalette },
          { "__gc",          img_gc },
          {NULL, NULL}
       };
@@ -215,6 +542,105 @@ static int gfx_newImage(lua_State *L)
    }
 
    lua_setmetatable(L, -2);
+}
+
+static gfx_Atlas *check_atlas(lua_State *L, int ndx)
+{
+   return (gfx_Atlas*)luaL_checkudata(L, ndx, "Atlas");
+}
+
+static int atlas_type(lua_State *L)
+{
+   check_atlas(L, 1);
+   lua_pushstring(L, "Atlas");
+   return 1;
+}
+
+// same as lutro.graphics.newImage(path[, settings]), packing small 32 bits
+// images into the pages.
+static int atlas_newImage(lua_State *L)
+{
+   gfx_Atlas *self = check_atlas(L, 1);
+   const char *path = luaL_checkstring(L, 2);
+   unsigned given;
+   unsigned flags = image_check_flags(L, 3, &given);
+
+   gfx_Image *image = (gfx_Image*)lua_newuserdata(L, sizeof(gfx_Image));
+   image->data = (bitmap_t*)image_data_create_in_atlas(L, path, flags, self->atlas, self->limit);
+   image->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+   push_image_meta(L, image);
+
+   return 1;
+}
+
+static int atlas_getPageCount(lua_State *L)
+{
+   lua_pushnumber(L, pntr_atlas_page_count(check_atlas(L, 1)->atlas));
+   return 1;
+}
+
+static int atlas_getPageSize(lua_State *L)
+{
+   lua_pushnumber(L, pntr_atlas_page_size(check_atlas(L, 1)->atlas));
+   return 1;
+}
+
+static int atlas_getLimit(lua_State *L)
+{
+   lua_pushnumber(L, check_atlas(L, 1)->limit);
+   return 1;
+}
+
+// the pages live on as long as images placed on them do.
+static int atlas_gc(lua_State *L)
+{
+   gfx_Atlas *self = check_atlas(L, 1);
+   if (self->atlas)
+      pntr_atlas_release(self->atlas);
+   self->atlas = NULL;
+   return 0;
+}
+
+static int gfx_newAtlas(lua_State *L)
+{
+   int n = lua_gettop(L);
+
+   if (n > 2)
+      return luaL_error(L, "lutro.graphics.newAtlas requires 0 to 2 arguments, %d given.", n);
+
+   int size  = luaL_optint(L, 1, 512);
+   int limit = luaL_optint(L, 2, MIN(size, 64));
+
+   if (size <= 0 || size > 4096)
+      return luaL_error(L, "lutro.graphics.newAtlas requires a page size between 1 and 4096, %d given.", size);
+   if (limit <= 0 || limit > size)
+      return luaL_error(L, "lutro.graphics.newAtlas requires a limit between 1 and the page size, %d given.", limit);
+
+   gfx_Atlas *self = (gfx_Atlas*)lua_newuserdata(L, sizeof(gfx_Atlas));
+   self->atlas = pntr_atlas_new(size);
+   self->limit = limit;
+
+   if (luaL_newmetatable(L, "Atlas") != 0)
+   {
+      static luaL_Reg atlas_funcs[] = {
+         { "type",         atlas_type },
+         { "newImage",     atlas_newImage },
+         { "getPageCount", atlas_getPageCount },
+         { "getPageSize",  atlas_getPageSize },
+         { "getLimit",     atlas_getLimit },
+         { "__gc",         atlas_gc },
+         {NULL, NULL}
+      };
+
+      lua_pushvalue(L, -1);
+
+      lua_setfield(L, -2, "__index");
+
+      luaL_setfuncs(L, atlas_funcs, 0);
+   }
+
+   lua_setmetatable(L, -2);
 
    return 1;
 }
@@ -311,6 +737,8 @@ static int canvas_type(lua_State *L)
 static int canvas_gc(lua_State *L)
 {
    gfx_Canvas* self = get_canvas_ndx(L, 1);
+   luaL_unref(L, LUA_REGISTRYINDEX, self->font_ref);
+   self->font_ref = LUA_NOREF;
    if (self->target) {
        if (self->target->data) {
            lutro_free(self->target->data);
@@ -349,6 +777,50 @@ static int gfx_newCanvas(lua_State *L)
    return 1;
 }
 
+// for unit testing purposes only: calls fn with the draws to canvas going
+// through a queue of their own, flushed before returning as at the end of
+// a frame, so that tests can compare deferred rendering against immediate
+// rendering outside a frame.
+static int gfx_drawDeferred(lua_State *L)
+{
+   gfx_Canvas *canvas = get_canvas_ndx(L, 1);
+   luaL_checktype(L, 2, LUA_TFUNCTION);
+
+   pntr_queue_t *frame_queue = draw_queue;
+   pntr_queue_t *attached = canvas->queue;
+   pntr_queue_t *queue = pntr_queue_new();
+   int refs = frame_refs, ref_count = frame_ref_count;
+   const void *ref_last = frame_ref_last;
+
+   lutro_graphics_flush();
+   draw_queue = queue;
+   pntr_queue_begin(queue, canvas);
+
+   // the objects drawn are kept until the flush, as within a frame.
+   lua_newtable(L);
+   frame_refs = luaL_ref(L, LUA_REGISTRYINDEX);
+   frame_ref_count = 0;
+   frame_ref_last  = NULL;
+
+   lua_pushvalue(L, 2);
+   int status = lua_pcall(L, 0, 0, 0);
+
+   pntr_queue_end(queue);
+   pntr_queue_free(queue);
+   draw_queue = frame_queue;
+   canvas->queue = attached;
+
+   luaL_unref(L, LUA_REGISTRYINDEX, frame_refs);
+   frame_refs      = refs;
+   frame_ref_count = ref_count;
+   frame_ref_last  = ref_last;
+
+   if (status != 0)
+      return lua_error(L);
+
+   return 0;
+}
+
 static int gfx_setCanvas(lua_State *L)
 {
    int n = lua_gettop(L);
@@ -363,7 +835,10 @@ static int gfx_setCanvas(lua_State *L)
    }
    else if (n == 1)
    {
-      get_canvas_ndx(L, 1);
+      // the canvas may have been drawn to the deferred frame already.
+      if (!get_canvas_ndx(L, 1)->queue)
+         lutro_graphics_flush();
+
       lua_pushvalue(L, 1);
       set_ref(L, &cur_canv);
    }
@@ -393,9 +868,9 @@ static int font_type(lua_State *L)
 
 static int font_getWidth(lua_State *L)
 {
+   font_t* self = (font_t*)luaL_checkudata(L, 1, "Font");
    const char* text = luaL_checkstring(L, 2);
-   gfx_Canvas *canvas = get_canvas_ref(L, cur_canv);
-   lua_pushnumber(L, pntr_text_width(canvas, text));
+   lua_pushnumber(L, font_text_width(self, text));
    return 1;
 }
 
@@ -416,6 +891,7 @@ static int font_gc(lua_State *L)
                    lutro_free(self->atlas.data);
                    self->atlas.data = NULL;
                }
+               bitmap_free_spans(&self->atlas);
                lutro_free(self->owner);
                self->owner = NULL;
            }
@@ -512,6 +988,10 @@ static int gfx_setFont(lua_State *L)
    font_t* font = (font_t*)luaL_checkudata(L, 1, "Font");
    canvas->font = font;
 
+   // the canvas draws with the font until another one is set.
+   lua_pushvalue(L, 1);
+   set_ref(L, &canvas->font_ref);
+
    return 0;
 }
 
@@ -536,81 +1016,248 @@ static int gfx_getFont(lua_State *L)
    return 1;
 }
 
-static int gfx_setColor(lua_State *L)
+static gfx_Text *check_text(lua_State *L, int ndx)
 {
-   int n = lua_gettop(L);
-   gfx_Canvas *canvas;
-   gfx_Color c;
-
-   if (n != 1 && n != 3 && n != 4)
-      return luaL_error(L, "lutro.graphics.setColor requires 1, 3 or 4 arguments, %d given.", n);
-
-   if (lua_istable(L, 1))
-   {
-      for (int i = 1; i <= 4; i++)
-         lua_rawgeti(L, 1, i);
+   return (gfx_Text*)luaL_checkudata(L, ndx, "Text");
+}
 
-      c.r = luaL_checkint(L, -4);
-      c.g = luaL_checkint(L, -3);
-      c.b = luaL_checkint(L, -2);
-      c.a = luaL_optint(L, -1, 255);
+static int text_type(lua_State *L)
+{
+   check_text(L, 1);
+   lua_pushstring(L, "Text");
+   return 1;
+}
 
-      lua_pop(L, 4);
-   }
-   else
-   {
-      c.r = luaL_checkint(L, 1);
-      c.g = luaL_checkint(L, 2);
-      c.b = luaL_checkint(L, 3);
-      c.a = luaL_optint(L, 4, 255);
-   }
+// appends text aligned like lutro.graphics.printf would.
+static int text_add_aligned(lua_State *L, gfx_Text *self, int x, int y, int limit, const char *align)
+{
+   const char* text = luaL_checkstring(L, 2);
 
-   canvas = get_canvas_ref(L, cur_canv);
-   canvas->foreground = (c.a<<24) | (c.r<<16) | (c.g<<8) | c.b;
+   if (!strcmp(align, "right"))
+      x += limit - font_text_width(self->font, text);
+   else if (!strcmp(align, "center"))
+      x += limit/2 - font_text_width(self->font, text)/2;
+   else if (strcmp(align, "left"))
+      return luaL_error(L, "Text alignments are : left, center or right");
 
+   text_layout_add(&self->layout, self->font, text, x, y, limit);
    return 0;
 }
 
-static int gfx_getColor(lua_State *L)
+static int text_set(lua_State *L)
 {
-   int n = lua_gettop(L);
-   gfx_Canvas *canvas;
-   gfx_Color c;
+   gfx_Text *self = check_text(L, 1);
 
-   if (n != 0)
-      return luaL_error(L, "lutro.graphics.getColor requires 0 arguments, %d given.", n);
+   text_layout_clear(&self->layout);
+   if (!lua_isnoneornil(L, 2))
+      text_layout_add(&self->layout, self->font, luaL_checkstring(L, 2), 0, 0, 0);
 
-   canvas = get_canvas_ref(L, cur_canv);
-   c.a = (canvas->foreground >> ALPHA_SHIFT) & 0xff;
-   c.r = (canvas->foreground >> RED_SHIFT) & 0xff;
-   c.g = (canvas->foreground >> GREEN_SHIFT) & 0xff;
-   c.b = (canvas->foreground >> BLUE_SHIFT) & 0xff;
+   return 0;
+}
 
-   lua_pushnumber(L, c.r);
-   lua_pushnumber(L, c.g);
-   lua_pushnumber(L, c.b);
-   lua_pushnumber(L, c.a);
+static int text_setf(lua_State *L)
+{
+   gfx_Text *self = check_text(L, 1);
+   int limit = luaL_checknumber(L, 3);
+   const char *align = luaL_checkstring(L, 4);
 
-   return 4;
+   text_layout_clear(&self->layout);
+   return text_add_aligned(L, self, 0, 0, limit, align);
 }
 
-static int gfx_setBackgroundColor(lua_State *L)
+static int text_add(lua_State *L)
 {
-   int n = lua_gettop(L);
-   gfx_Canvas *canvas;
+   gfx_Text *self = check_text(L, 1);
+   const char* text = luaL_checkstring(L, 2);
+   int x = OPTNUMBER(L, 3, 0);
+   int y = OPTNUMBER(L, 4, 0);
 
-   if (n != 1 && n != 3 && n != 4)
-      return luaL_error(L, "lutro.graphics.setBackgroundColor requires 1, 3 or 4 arguments, %d given.", n);
+   text_layout_add(&self->layout, self->font, text, x, y, 0);
+   return 0;
+}
 
-   gfx_Color c;
+static int text_addf(lua_State *L)
+{
+   gfx_Text *self = check_text(L, 1);
+   int limit = luaL_checknumber(L, 3);
+   const char *align = luaL_checkstring(L, 4);
+   int x = OPTNUMBER(L, 5, 0);
+   int y = OPTNUMBER(L, 6, 0);
 
-   if (lua_istable(L, 1))
-   {
-      for (int i = 1; i <= 4; i++)
-         lua_rawgeti(L, 1, i);
+   return text_add_aligned(L, self, x, y, limit, align);
+}
 
-      c.r = luaL_checkint(L, -4);
-      c.g = luaL_checkint(L, -3);
+static int text_clear(lua_State *L)
+{
+   gfx_Text *self = check_text(L, 1);
+   text_layout_clear(&self->layout);
+   return 0;
+}
+
+// the extent of the glyphs from the position the text is drawn at.
+static int text_getWidth(lua_State *L)
+{
+   gfx_Text *self = check_text(L, 1);
+   const rect_t *b = &self->layout.bounds;
+   lua_pushnumber(L, self->layout.count ? MAX(b->x + b->width, 0) : 0);
+   return 1;
+}
+
+static int text_getHeight(lua_State *L)
+{
+   gfx_Text *self = check_text(L, 1);
+   const rect_t *b = &self->layout.bounds;
+   lua_pushnumber(L, self->layout.count ? MAX(b->y + b->height, 0) : 0);
+   return 1;
+}
+
+static int text_getDimensions(lua_State *L)
+{
+   text_getWidth(L);
+   text_getHeight(L);
+   return 2;
+}
+
+static int text_getFont(lua_State *L)
+{
+   gfx_Text *self = check_text(L, 1);
+   lua_rawgeti(L, LUA_REGISTRYINDEX, self->font_ref);
+   return 1;
+}
+
+static int text_gc(lua_State *L)
+{
+   gfx_Text *self = check_text(L, 1);
+   text_layout_free(&self->layout);
+   luaL_unref(L, LUA_REGISTRYINDEX, self->font_ref);
+   self->font_ref = LUA_NOREF;
+   return 0;
+}
+
+static int gfx_newText(lua_State *L)
+{
+   int n = lua_gettop(L);
+
+   if (n < 1 || n > 2)
+      return luaL_error(L, "lutro.graphics.newText requires 1 or 2 arguments, %d given.", n);
+
+   font_t *font = (font_t*)luaL_checkudata(L, 1, "Font");
+
+   gfx_Text *self = (gfx_Text*)lua_newuserdata(L, sizeof(gfx_Text));
+   self->font = font;
+   text_layout_init(&self->layout, NULL, 0);
+
+   // the font must outlive the text, which draws from its atlas.
+   lua_pushvalue(L, 1);
+   self->font_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+   if (n == 2)
+      text_layout_add(&self->layout, font, luaL_checkstring(L, 2), 0, 0, 0);
+
+   if (luaL_newmetatable(L, "Text") != 0)
+   {
+      static luaL_Reg text_funcs[] = {
+         { "type",          text_type },
+         { "set",           text_set },
+         { "setf",          text_setf },
+         { "add",           text_add },
+         { "addf",          text_addf },
+         { "clear",         text_clear },
+         { "getWidth",      text_getWidth },
+         { "getHeight",     text_getHeight },
+         { "getDimensions", text_getDimensions },
+         { "getFont",       text_getFont },
+         { "__gc",          text_gc },
+         {NULL, NULL}
+      };
+
+      lua_pushvalue(L, -1);
+
+      lua_setfield(L, -2, "__index");
+
+      luaL_setfuncs(L, text_funcs, 0);
+   }
+
+   lua_setmetatable(L, -2);
+
+   return 1;
+}
+
+static int gfx_setColor(lua_State *L)
+{
+   int n = lua_gettop(L);
+   gfx_Canvas *canvas;
+   gfx_Color c;
+
+   if (n != 1 && n != 3 && n != 4)
+      return luaL_error(L, "lutro.graphics.setColor requires 1, 3 or 4 arguments, %d given.", n);
+
+   if (lua_istable(L, 1))
+   {
+      for (int i = 1; i <= 4; i++)
+         lua_rawgeti(L, 1, i);
+
+      c.r = luaL_checkint(L, -4);
+      c.g = luaL_checkint(L, -3);
+      c.b = luaL_checkint(L, -2);
+      c.a = luaL_optint(L, -1, 255);
+
+      lua_pop(L, 4);
+   }
+   else
+   {
+      c.r = luaL_checkint(L, 1);
+      c.g = luaL_checkint(L, 2);
+      c.b = luaL_checkint(L, 3);
+      c.a = luaL_optint(L, 4, 255);
+   }
+
+   canvas = get_canvas_ref(L, cur_canv);
+   canvas->foreground = (c.a<<24) | (c.r<<16) | (c.g<<8) | c.b;
+
+   return 0;
+}
+
+static int gfx_getColor(lua_State *L)
+{
+   int n = lua_gettop(L);
+   gfx_Canvas *canvas;
+   gfx_Color c;
+
+   if (n != 0)
+      return luaL_error(L, "lutro.graphics.getColor requires 0 arguments, %d given.", n);
+
+   canvas = get_canvas_ref(L, cur_canv);
+   c.a = (canvas->foreground >> ALPHA_SHIFT) & 0xff;
+   c.r = (canvas->foreground >> RED_SHIFT) & 0xff;
+   c.g = (canvas->foreground >> GREEN_SHIFT) & 0xff;
+   c.b = (canvas->foreground >> BLUE_SHIFT) & 0xff;
+
+   lua_pushnumber(L, c.r);
+   lua_pushnumber(L, c.g);
+   lua_pushnumber(L, c.b);
+   lua_pushnumber(L, c.a);
+
+   return 4;
+}
+
+static int gfx_setBackgroundColor(lua_State *L)
+{
+   int n = lua_gettop(L);
+   gfx_Canvas *canvas;
+
+   if (n != 1 && n != 3 && n != 4)
+      return luaL_error(L, "lutro.graphics.setBackgroundColor requires 1, 3 or 4 arguments, %d given.", n);
+
+   gfx_Color c;
+
+   if (lua_istable(L, 1))
+   {
+      for (int i = 1; i <= 4; i++)
+         lua_rawgeti(L, 1, i);
+
+      c.r = luaL_checkint(L, -4);
+      c.g = luaL_checkint(L, -3);
       c.b = luaL_checkint(L, -2);
       c.a = luaL_optint(L, -1, 255);
 
@@ -753,11 +1400,10 @@ static int gfx_circle(lua_State *L)
    int x = luaL_checknumber(L, 2);
    int y = luaL_checknumber(L, 3);
    int radius = luaL_checknumber(L, 4);
+   // faceted only when a segment count is given, exact otherwise.
    int nb_segments = 0;
    if (n == 5)
      nb_segments = luaL_checknumber(L, 5);
-   if (nb_segments <= 0)
-     nb_segments = MAX(10, radius);
 
    canvas = get_canvas_ref(L, cur_canv);
 
@@ -771,145 +1417,1225 @@ static int gfx_circle(lua_State *L)
    }
    else
    {
-      return luaL_error(L, "lutro.graphics.circle's available modes are : fill or line", n);
+      return luaL_error(L, "lutro.graphics.circle's available modes are : fill or line", n);
+   }
+
+   return 0;
+}
+
+static int gfx_ellipse(lua_State *L)
+{
+   int n = lua_gettop(L);
+   gfx_Canvas *canvas;
+
+   if ((n != 5) && (n != 6))
+      return luaL_error(L, "lutro.graphics.ellipse requires 5 or 6 arguments, %d given.", n);
+
+   const char* mode = luaL_checkstring(L, 1);
+   int x = luaL_checknumber(L, 2);
+   int y = luaL_checknumber(L, 3);
+   int x_radius = luaL_checknumber(L, 4);
+   int y_radius = luaL_checknumber(L, 5);
+   // faceted only when a segment count is given, exact otherwise.
+   int nb_segments = 0;
+   if (n == 6)
+     nb_segments = luaL_checknumber(L, 6);
+
+   canvas = get_canvas_ref(L, cur_canv);
+
+   if (!strcmp(mode, "fill"))
+   {
+      pntr_fill_ellipse(canvas, x, y, x_radius, y_radius, nb_segments);
+   }
+   else if (!strcmp(mode, "line"))
+   {
+      pntr_strike_ellipse(canvas, x, y, x_radius, y_radius, nb_segments);
+   }
+   else
+   {
+      return luaL_error(L, "lutro.graphics.circle's available modes are : fill or line", n);
+   }
+
+   return 0;
+}
+
+static int gfx_point(lua_State *L)
+{
+   int n = lua_gettop(L);
+   gfx_Canvas *canvas;
+
+   if (n != 2)
+      return luaL_error(L, "lutro.graphics.point requires 2 arguments, %d given.", n);
+
+   int x = luaL_checknumber(L, 1);
+   int y = luaL_checknumber(L, 2);
+
+   canvas = get_canvas_ref(L, cur_canv);
+   pntr_plot(canvas, x, y);
+
+   return 0;
+}
+
+/**
+ * lutro.graphics.points(x, y, ... )
+ *
+ * https://love2d.org/wiki/love.graphics.points
+ */
+static int gfx_points(lua_State *L)
+{
+   int n = lua_gettop(L), i, x, y;
+   gfx_Canvas *canvas;
+
+   if (n == 1) {
+      // TODO: Implement drawing Point tables https://love2d.org/wiki/love.graphics.points
+      return luaL_error(L, "lutro.graphics.points does not currently support drawing Point types in a table.");
+   }
+   if (n < 2)
+      return luaL_error(L, "lutro.graphics.points requires at least 2 arguments, %d given.", n);
+   if (n & 1)
+      return luaL_error(L, "lutro.graphics.points requires an even amount of arguments, %d arguments given.", n);
+
+   canvas = get_canvas_ref(L, cur_canv);
+
+   for (i = 1; i < n; i += 2)
+   {
+      x = luaL_checknumber(L, i);
+      y = luaL_checknumber(L, i + 1);
+
+      pntr_plot(canvas, x, y);
+   }
+
+   return 0;
+}
+
+static int gfx_line(lua_State *L)
+{
+   int n = lua_gettop(L);
+   gfx_Canvas *canvas;
+
+   if (n != 4)
+      return luaL_error(L, "lutro.graphics.line requires 4 arguments, %d given.", n);
+
+   int x1 = luaL_checknumber(L, 1);
+   int y1 = luaL_checknumber(L, 2);
+   int x2 = luaL_checknumber(L, 3);
+   int y2 = luaL_checknumber(L, 4);
+
+   canvas = get_canvas_ref(L, cur_canv);
+
+   pntr_strike_line(canvas, x1, y1, x2, y2);
+
+   return 0;
+}
+
+/* TODO: move this elsewhere, we will certainly need it a lot */
+void *checkudata (lua_State *L, int ud, const char *tname) {
+   void *p = lua_touserdata(L, ud);
+   if (p != NULL)
+   {  /* value is a userdata? */
+      if (lua_getmetatable(L, ud))
+      {  /* does it have a metatable? */
+         lua_getfield(L, LUA_REGISTRYINDEX, tname);  /* get correct metatable */
+         if (lua_rawequal(L, -1, -2))
+         {  /* does it have the correct mt? */
+            lua_pop(L, 2);  /* remove both metatables */
+            return p;
+         }
+         lua_pop(L, 2);
+      }
+   }
+   return NULL; /* to avoid warnings */
+}
+
+// reads the x, y, r, sx, sy, ox, oy arguments of lutro.graphics.draw
+// following index start, (x, y) coming back as the place of the top-left
+// corner of the image once its origin offset is taken off. Sprites sit on
+// whole pixels, their x and y being truncated first.
+static void check_placement(lua_State *L, int start, bool whole, float *px, float *py, float *pr, float *psx, float *psy)
+{
+   float x = whole ? (int)OPTNUMBER(L, start + 1, 0) : OPTNUMBER(L, start + 1, 0);
+   float y = whole ? (int)OPTNUMBER(L, start + 2, 0) : OPTNUMBER(L, start + 2, 0);
+   float r = OPTNUMBER(L, start + 3, 0);
+   float sx = OPTNUMBER(L, start + 4, 1);
+   float sy = OPTNUMBER(L, start + 5, sx);
+   int ox = OPTNUMBER(L, start + 6, 0);
+   int oy = OPTNUMBER(L, start + 7, 0);
+   // TODO: Make use of the kx ky shearing numbers in lutro.graphics.draw()
+   // int kx = OPTNUMBER(L, start + 8, 0);
+   // int ky = OPTNUMBER(L, start + 9, 0);
+
+#ifndef HAVE_TRANSFORM
+   // if transformations are not enabled, we set them to default values here
+   // in order to prevent them from having any unexpected effects whatsoever.
+   sx = 1;
+   sy = 1;
+   r = 0;
+#endif
+
+   // the origin offset turns along with the image, which rotates about (x, y).
+   float cr = cosf(r);
+   float sr = sinf(r);
+
+   *px  = x - (ox * sx * cr - oy * sy * sr);
+   *py  = y - (ox * sx * sr + oy * sy * cr);
+   *pr  = r;
+   *psx = sx;
+   *psy = sy;
+}
+
+// reads the draw arguments following index start into sprite, all but its
+// source rect.
+static void check_draw_args(lua_State *L, int start, sprite_t *sprite)
+{
+   float x, y;
+
+   check_placement(L, start, true, &x, &y, &sprite->r, &sprite->sx, &sprite->sy);
+   sprite->x = x;
+   sprite->y = y;
+}
+
+static gfx_SpriteBatch *check_batch(lua_State *L, int ndx)
+{
+   return (gfx_SpriteBatch*)luaL_checkudata(L, ndx, "SpriteBatch");
+}
+
+static int batch_type(lua_State *L)
+{
+   check_batch(L, 1);
+   lua_pushstring(L, "SpriteBatch");
+   return 1;
+}
+
+// reads the optional quad and the draw arguments from index ndx on.
+static void check_sprite(lua_State *L, gfx_SpriteBatch *self, int ndx, sprite_t *sprite)
+{
+   const bitmap_t *data = self->image->data;
+   gfx_Quad *quad = (gfx_Quad*)checkudata(L, ndx, "Quad");
+
+   check_draw_args(L, quad ? ndx : ndx - 1, sprite);
+
+   if (quad)
+   {
+      rect_t src = { quad->x, quad->y, quad->w, quad->h };
+      sprite->src = src;
+   }
+   else
+   {
+      rect_t src = { 0, 0, (int)data->width, (int)data->height };
+      sprite->src = src;
+   }
+}
+
+static int batch_add(lua_State *L)
+{
+   gfx_SpriteBatch *self = check_batch(L, 1);
+
+   // the buffer grows past the size the batch was created with as needed.
+   if (self->count == self->capacity)
+   {
+      self->capacity = MAX(self->capacity * 2, 16);
+      self->sprites  = lutro_realloc(self->sprites, self->capacity * sizeof(sprite_t));
+   }
+
+   // the sprite only counts once its arguments are read without error.
+   check_sprite(L, self, 2, &self->sprites[self->count]);
+   self->count++;
+
+   lua_pushnumber(L, self->count);
+   return 1;
+}
+
+static int batch_set(lua_State *L)
+{
+   gfx_SpriteBatch *self = check_batch(L, 1);
+   int id = luaL_checkint(L, 2);
+
+   if (id < 1 || id > (int)self->count)
+      return luaL_error(L, "SpriteBatch:set invalid sprite index %d.", id);
+
+   check_sprite(L, self, 3, &self->sprites[id - 1]);
+   return 0;
+}
+
+static int batch_clear(lua_State *L)
+{
+   gfx_SpriteBatch *self = check_batch(L, 1);
+   self->count = 0;
+   return 0;
+}
+
+static int batch_flush(lua_State *L)
+{
+   check_batch(L, 1);
+   return 0;
+}
+
+static int batch_getCount(lua_State *L)
+{
+   gfx_SpriteBatch *self = check_batch(L, 1);
+   lua_pushnumber(L, self->count);
+   return 1;
+}
+
+static int batch_getBufferSize(lua_State *L)
+{
+   gfx_SpriteBatch *self = check_batch(L, 1);
+   lua_pushnumber(L, self->capacity);
+   return 1;
+}
+
+static int batch_getTexture(lua_State *L)
+{
+   gfx_SpriteBatch *self = check_batch(L, 1);
+   lua_rawgeti(L, LUA_REGISTRYINDEX, self->image_ref);
+   return 1;
+}
+
+static int batch_gc(lua_State *L)
+{
+   gfx_SpriteBatch *self = check_batch(L, 1);
+   lutro_free(self->sprites);
+   self->sprites = NULL;
+   luaL_unref(L, LUA_REGISTRYINDEX, self->image_ref);
+   self->image_ref = LUA_NOREF;
+   return 0;
+}
+
+static int gfx_newSpriteBatch(lua_State *L)
+{
+   int n = lua_gettop(L);
+
+   if (n < 1 || n > 3)
+      return luaL_error(L, "lutro.graphics.newSpriteBatch requires 1 to 3 arguments, %d given.", n);
+
+   gfx_Image *image = (gfx_Image*)luaL_checkudata(L, 1, "Image");
+   int capacity = luaL_optint(L, 2, 1000);
+
+   if (capacity <= 0)
+      return luaL_error(L, "lutro.graphics.newSpriteBatch requires a positive size, %d given.", capacity);
+
+   gfx_SpriteBatch *self = (gfx_SpriteBatch*)lua_newuserdata(L, sizeof(gfx_SpriteBatch));
+   self->image    = image;
+   self->sprites  = lutro_malloc(capacity * sizeof(sprite_t));
+   self->count    = 0;
+   self->capacity = capacity;
+
+   lua_pushvalue(L, 1);
+   self->image_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+   if (luaL_newmetatable(L, "SpriteBatch") != 0)
+   {
+      static luaL_Reg batch_funcs[] = {
+         { "type",          batch_type },
+         { "add",           batch_add },
+         { "set",           batch_set },
+         { "clear",         batch_clear },
+         { "flush",         batch_flush },
+         { "getCount",      batch_getCount },
+         { "getBufferSize", batch_getBufferSize },
+         { "getTexture",    batch_getTexture },
+         { "getImage",      batch_getTexture },
+         { "__gc",          batch_gc },
+         {NULL, NULL}
+      };
+
+      lua_pushvalue(L, -1);
+
+      lua_setfield(L, -2, "__index");
+
+      luaL_setfuncs(L, batch_funcs, 0);
+   }
+
+   lua_setmetatable(L, -2);
+
+   return 1;
+}
+
+static gfx_TileLayer *check_layer(lua_State *L, int ndx)
+{
+   return (gfx_TileLayer*)luaL_checkudata(L, ndx, "TileLayer");
+}
+
+static int layer_type(lua_State *L)
+{
+   check_layer(L, 1);
+   lua_pushstring(L, "TileLayer");
+   return 1;
+}
+
+// tiles are numbered in reading order from 1 in the atlas, 0 being empty.
+static unsigned layer_tile_count(const gfx_TileLayer *self)
+{
+   const bitmap_t *atlas = self->image->data;
+   return (atlas->width / self->layer.tile_width) * (atlas->height / self->layer.tile_height);
+}
+
+static uint16_t check_tile(lua_State *L, gfx_TileLayer *self, int ndx)
+{
+   int tile = luaL_checkint(L, ndx);
+   unsigned count = layer_tile_count(self);
+
+   if (tile < 0 || (unsigned)tile > count)
+      return luaL_error(L, "TileLayer invalid tile %d, the atlas has %u.", tile, count);
+   // cells hold 16 bits tile numbers.
+   if (tile > UINT16_MAX)
+      return luaL_error(L, "TileLayer invalid tile %d, tiles past %d are out of reach.", tile, UINT16_MAX);
+
+   return tile;
+}
+
+// the cell at 1-based column x and row y.
+static uint16_t *check_cell(lua_State *L, gfx_TileLayer *self, int ndx)
+{
+   int x = luaL_checkint(L, ndx);
+   int y = luaL_checkint(L, ndx + 1);
+
+   if (x < 1 || x > (int)self->layer.width || y < 1 || y > (int)self->layer.height)
+      luaL_error(L, "TileLayer cell %d,%d out of the %dx%d map.", x, y, self->layer.width, self->layer.height);
+
+   return &self->layer.tiles[(y - 1) * self->layer.width + x - 1];
+}
+
+static int layer_setTile(lua_State *L)
+{
+   gfx_TileLayer *self = check_layer(L, 1);
+   uint16_t *cell = check_cell(L, self, 2);
+   *cell = check_tile(L, self, 4);
+   return 0;
+}
+
+static int layer_getTile(lua_State *L)
+{
+   gfx_TileLayer *self = check_layer(L, 1);
+   lua_pushnumber(L, *check_cell(L, self, 2));
+   return 1;
+}
+
+// sets the cells from a table of rows of tiles, as many as it holds.
+static int layer_setTiles(lua_State *L)
+{
+   gfx_TileLayer *self = check_layer(L, 1);
+   luaL_checktype(L, 2, LUA_TTABLE);
+
+   int rows = MIN(lua_objlen(L, 2), self->layer.height);
+
+   for (int y = 0; y < rows; y++)
+   {
+      lua_rawgeti(L, 2, y + 1);
+      luaL_checktype(L, -1, LUA_TTABLE);
+
+      uint16_t *cells = self->layer.tiles + y * self->layer.width;
+      int cols = MIN(lua_objlen(L, -1), self->layer.width);
+
+      for (int x = 0; x < cols; x++)
+      {
+         lua_rawgeti(L, -1, x + 1);
+         cells[x] = check_tile(L, self, -1);
+         lua_pop(L, 1);
+      }
+
+      lua_pop(L, 1);
+   }
+
+   return 0;
+}
+
+static int layer_fill(lua_State *L)
+{
+   gfx_TileLayer *self = check_layer(L, 1);
+   uint16_t tile = check_tile(L, self, 2);
+
+   for (unsigned i = 0; i < self->layer.width * self->layer.height; i++)
+      self->layer.tiles[i] = tile;
+
+   return 0;
+}
+
+static int layer_getDimensions(lua_State *L)
+{
+   gfx_TileLayer *self = check_layer(L, 1);
+   lua_pushnumber(L, self->layer.width);
+   lua_pushnumber(L, self->layer.height);
+   return 2;
+}
+
+static int layer_getTileDimensions(lua_State *L)
+{
+   gfx_TileLayer *self = check_layer(L, 1);
+   lua_pushnumber(L, self->layer.tile_width);
+   lua_pushnumber(L, self->layer.tile_height);
+   return 2;
+}
+
+static int layer_getTileCount(lua_State *L)
+{
+   gfx_TileLayer *self = check_layer(L, 1);
+   lua_pushnumber(L, layer_tile_count(self));
+   return 1;
+}
+
+static int layer_getImage(lua_State *L)
+{
+   gfx_TileLayer *self = check_layer(L, 1);
+   lua_rawgeti(L, LUA_REGISTRYINDEX, self->image_ref);
+   return 1;
+}
+
+static int layer_gc(lua_State *L)
+{
+   gfx_TileLayer *self = check_layer(L, 1);
+   lutro_free(self->layer.tiles);
+   self->layer.tiles = NULL;
+   luaL_unref(L, LUA_REGISTRYINDEX, self->image_ref);
+   self->image_ref = LUA_NOREF;
+   return 0;
+}
+
+static int gfx_newTileLayer(lua_State *L)
+{
+   int n = lua_gettop(L);
+
+   if (n != 5)
+      return luaL_error(L, "lutro.graphics.newTileLayer requires 5 arguments, %d given.", n);
+
+   gfx_Image *image = (gfx_Image*)luaL_checkudata(L, 1, "Image");
+   int tile_width  = luaL_checkint(L, 2);
+   int tile_height = luaL_checkint(L, 3);
+   int width  = luaL_checkint(L, 4);
+   int height = luaL_checkint(L, 5);
+
+   if (tile_width <= 0 || tile_height <= 0)
+      return luaL_error(L, "lutro.graphics.newTileLayer requires a positive tile size, %dx%d given.", tile_width, tile_height);
+   if (width <= 0 || height <= 0)
+      return luaL_error(L, "lutro.graphics.newTileLayer requires a positive map size, %dx%d given.", width, height);
+   if (width > INT_MAX / height)
+      return luaL_error(L, "lutro.graphics.newTileLayer map size %dx%d is too large.", width, height);
+
+   gfx_TileLayer *self = (gfx_TileLayer*)lua_newuserdata(L, sizeof(gfx_TileLayer));
+   self->image = image;
+   self->layer.tiles       = lutro_calloc((size_t)width * height, sizeof(uint16_t));
+   self->layer.width       = width;
+   self->layer.height      = height;
+   self->layer.tile_width  = tile_width;
+   self->layer.tile_height = tile_height;
+
+   lua_pushvalue(L, 1);
+   self->image_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+   if (luaL_newmetatable(L, "TileLayer") != 0)
+   {
+      static luaL_Reg layer_funcs[] = {
+         { "type",               layer_type },
+         { "setTile",            layer_setTile },
+         { "getTile",            layer_getTile },
+         { "setTiles",           layer_setTiles },
+         { "fill",               layer_fill },
+         { "getDimensions",      layer_getDimensions },
+         { "getTileDimensions",  layer_getTileDimensions },
+         { "getTileCount",       layer_getTileCount },
+         { "getImage",           layer_getImage },
+         { "__gc",               layer_gc },
+         {NULL, NULL}
+      };
+
+      lua_pushvalue(L, -1);
+
+      lua_setfield(L, -2, "__index");
+
+      luaL_setfuncs(L, layer_funcs, 0);
+   }
+
+   lua_setmetatable(L, -2);
+
+   return 1;
+}
+
+static gfx_ParticleSystem *check_particles(lua_State *L, int ndx)
+{
+   return (gfx_ParticleSystem*)luaL_checkudata(L, ndx, "ParticleSystem");
+}
+
+static int ps_type(lua_State *L)
+{
+   check_particles(L, 1);
+   lua_pushstring(L, "ParticleSystem");
+   return 1;
+}
+
+// reads a min and an optional max defaulting to min from index ndx on.
+static void check_range(lua_State *L, int ndx, float *min, float *max)
+{
+   *min = luaL_checknumber(L, ndx);
+   *max = luaL_optnumber(L, ndx + 1, *min);
+}
+
+static int push_range(lua_State *L, float min, float max)
+{
+   lua_pushnumber(L, min);
+   lua_pushnumber(L, max);
+   return 2;
+}
+
+static int ps_start(lua_State *L)
+{
+   check_particles(L, 1)->ps.active = true;
+   return 0;
+}
+
+static int ps_stop(lua_State *L)
+{
+   particles_stop(&check_particles(L, 1)->ps);
+   return 0;
+}
+
+static int ps_pause(lua_State *L)
+{
+   check_particles(L, 1)->ps.active = false;
+   return 0;
+}
+
+static int ps_reset(lua_State *L)
+{
+   particles_reset(&check_particles(L, 1)->ps);
+   return 0;
+}
+
+static int ps_isActive(lua_State *L)
+{
+   lua_pushboolean(L, check_particles(L, 1)->ps.active);
+   return 1;
+}
+
+// paused systems stopped emitting part way through the emitter lifetime.
+static int ps_isPaused(lua_State *L)
+{
+   particles_t *ps = &check_particles(L, 1)->ps;
+   lua_pushboolean(L, !ps->active && ps->emitter_left < ps->emitter_lifetime);
+   return 1;
+}
+
+static int ps_isStopped(lua_State *L)
+{
+   particles_t *ps = &check_particles(L, 1)->ps;
+   lua_pushboolean(L, !ps->active && ps->emitter_left >= ps->emitter_lifetime);
+   return 1;
+}
+
+static int ps_emit(lua_State *L)
+{
+   gfx_ParticleSystem *self = check_particles(L, 1);
+   int count = luaL_checkint(L, 2);
+
+   if (count > 0)
+      particles_emit(&self->ps, count);
+   return 0;
+}
+
+static int ps_update(lua_State *L)
+{
+   gfx_ParticleSystem *self = check_particles(L, 1);
+   particles_update(&self->ps, luaL_checknumber(L, 2));
+   return 0;
+}
+
+static int ps_setEmissionRate(lua_State *L)
+{
+   gfx_ParticleSystem *self = check_particles(L, 1);
+   float rate = luaL_checknumber(L, 2);
+
+   if (rate < 0)
+      return luaL_error(L, "ParticleSystem:setEmissionRate invalid rate %f.", rate);
+
+   self->ps.rate = rate;
+   return 0;
+}
+
+static int ps_getEmissionRate(lua_State *L)
+{
+   lua_pushnumber(L, check_particles(L, 1)->ps.rate);
+   return 1;
+}
+
+static int ps_setEmitterLifetime(lua_State *L)
+{
+   gfx_ParticleSystem *self = check_particles(L, 1);
+   self->ps.emitter_lifetime = self->ps.emitter_left = luaL_checknumber(L, 2);
+   return 0;
+}
+
+static int ps_getEmitterLifetime(lua_State *L)
+{
+   lua_pushnumber(L, check_particles(L, 1)->ps.emitter_lifetime);
+   return 1;
+}
+
+static int ps_setParticleLifetime(lua_State *L)
+{
+   gfx_ParticleSystem *self = check_particles(L, 1);
+   check_range(L, 2, &self->ps.life_min, &self->ps.life_max);
+   return 0;
+}
+
+static int ps_getParticleLifetime(lua_State *L)
+{
+   gfx_ParticleSystem *self = check_particles(L, 1);
+   return push_range(L, self->ps.life_min, self->ps.life_max);
+}
+
+static int ps_setSpeed(lua_State *L)
+{
+   gfx_ParticleSystem *self = check_particles(L, 1);
+   check_range(L, 2, &self->ps.speed_min, &self->ps.speed_max);
+   return 0;
+}
+
+static int ps_getSpeed(lua_State *L)
+{
+   gfx_ParticleSystem *self = check_particles(L, 1);
+   return push_range(L, self->ps.speed_min, self->ps.speed_max);
+}
+
+static int ps_setDirection(lua_State *L)
+{
+   check_particles(L, 1)->ps.direction = luaL_checknumber(L, 2);
+   return 0;
+}
+
+static int ps_getDirection(lua_State *L)
+{
+   lua_pushnumber(L, check_particles(L, 1)->ps.direction);
+   return 1;
+}
+
+static int ps_setSpread(lua_State *L)
+{
+   check_particles(L, 1)->ps.spread = luaL_checknumber(L, 2);
+   return 0;
+}
+
+static int ps_getSpread(lua_State *L)
+{
+   lua_pushnumber(L, check_particles(L, 1)->ps.spread);
+   return 1;
+}
+
+static int ps_setLinearAcceleration(lua_State *L)
+{
+   particles_t *ps = &check_particles(L, 1)->ps;
+   ps->ax_min = luaL_checknumber(L, 2);
+   ps->ay_min = luaL_checknumber(L, 3);
+   ps->ax_max = luaL_optnumber(L, 4, ps->ax_min);
+   ps->ay_max = luaL_optnumber(L, 5, ps->ay_min);
+   return 0;
+}
+
+static int ps_getLinearAcceleration(lua_State *L)
+{
+   particles_t *ps = &check_particles(L, 1)->ps;
+   lua_pushnumber(L, ps->ax_min);
+   lua_pushnumber(L, ps->ay_min);
+   lua_pushnumber(L, ps->ax_max);
+   lua_pushnumber(L, ps->ay_max);
+   return 4;
+}
+
+// colors are given as r, g, b, a numbers or as { r, g, b, a } tables.
+static int ps_setColors(lua_State *L)
+{
+   particles_t *ps = &check_particles(L, 1)->ps;
+   int n = lua_gettop(L) - 1;
+   bool tables = lua_istable(L, 2);
+   int count = tables ? n : n / 4;
+
+   if (count < 1 || count > PARTICLES_MAX_COLORS || (!tables && n % 4 != 0))
+      return luaL_error(L, "ParticleSystem:setColors requires 1 to %d colors.", PARTICLES_MAX_COLORS);
+
+   for (int i = 0; i < count; i++)
+   {
+      int c[4];
+
+      if (tables)
+      {
+         luaL_checktype(L, i + 2, LUA_TTABLE);
+         for (int j = 0; j < 4; j++)
+         {
+            lua_rawgeti(L, i + 2, j + 1);
+            c[j] = j < 3 ? luaL_checkint(L, -1) : luaL_optint(L, -1, 255);
+            lua_pop(L, 1);
+         }
+      }
+      else
+      {
+         for (int j = 0; j < 4; j++)
+            c[j] = luaL_checkint(L, 2 + i * 4 + j);
+      }
+
+      for (int j = 0; j < 4; j++)
+         c[j] = MAX(MIN(c[j], 255), 0);
+
+      ps->colors[i] = (c[3] << 24) | (c[0] << 16) | (c[1] << 8) | c[2];
+   }
+
+   ps->nb_colors = count;
+   return 0;
+}
+
+static int ps_getColors(lua_State *L)
+{
+   particles_t *ps = &check_particles(L, 1)->ps;
+
+   for (unsigned i = 0; i < ps->nb_colors; i++)
+   {
+      uint32_t c = ps->colors[i];
+      lua_pushnumber(L, (c >> 16) & 0xff);
+      lua_pushnumber(L, (c >> 8) & 0xff);
+      lua_pushnumber(L, c & 0xff);
+      lua_pushnumber(L, c >> 24);
+   }
+
+   return ps->nb_colors * 4;
+}
+
+static int ps_setSizes(lua_State *L)
+{
+   particles_t *ps = &check_particles(L, 1)->ps;
+   int count = lua_gettop(L) - 1;
+
+   if (count < 1 || count > PARTICLES_MAX_SIZES)
+      return luaL_error(L, "ParticleSystem:setSizes requires 1 to %d sizes.", PARTICLES_MAX_SIZES);
+
+   for (int i = 0; i < count; i++)
+      ps->sizes[i] = luaL_checknumber(L, i + 2);
+
+   ps->nb_sizes = count;
+   return 0;
+}
+
+static int ps_getSizes(lua_State *L)
+{
+   particles_t *ps = &check_particles(L, 1)->ps;
+
+   for (unsigned i = 0; i < ps->nb_sizes; i++)
+      lua_pushnumber(L, ps->sizes[i]);
+
+   return ps->nb_sizes;
+}
+
+static int ps_setPosition(lua_State *L)
+{
+   particles_t *ps = &check_particles(L, 1)->ps;
+   ps->emitter_x = luaL_checknumber(L, 2);
+   ps->emitter_y = luaL_checknumber(L, 3);
+   return 0;
+}
+
+static int ps_getPosition(lua_State *L)
+{
+   particles_t *ps = &check_particles(L, 1)->ps;
+   return push_range(L, ps->emitter_x, ps->emitter_y);
+}
+
+static int ps_setBufferSize(lua_State *L)
+{
+   gfx_ParticleSystem *self = check_particles(L, 1);
+   int size = luaL_checkint(L, 2);
+
+   if (size <= 0)
+      return luaL_error(L, "ParticleSystem:setBufferSize requires a positive size, %d given.", size);
+
+   particles_resize(&self->ps, size);
+   return 0;
+}
+
+static int ps_getBufferSize(lua_State *L)
+{
+   lua_pushnumber(L, check_particles(L, 1)->ps.capacity);
+   return 1;
+}
+
+static int ps_getCount(lua_State *L)
+{
+   lua_pushnumber(L, check_particles(L, 1)->ps.count);
+   return 1;
+}
+
+static int ps_getTexture(lua_State *L)
+{
+   gfx_ParticleSystem *self = check_particles(L, 1);
+   lua_rawgeti(L, LUA_REGISTRYINDEX, self->image_ref);
+   return 1;
+}
+
+static int ps_gc(lua_State *L)
+{
+   gfx_ParticleSystem *self = check_particles(L, 1);
+   particles_free(&self->ps);
+   luaL_unref(L, LUA_REGISTRYINDEX, self->image_ref);
+   self->image_ref = LUA_NOREF;
+   return 0;
+}
+
+static int gfx_newParticleSystem(lua_State *L)
+{
+   int n = lua_gettop(L);
+
+   if (n < 1 || n > 2)
+      return luaL_error(L, "lutro.graphics.newParticleSystem requires 1 or 2 arguments, %d given.", n);
+
+   gfx_Image *image = (gfx_Image*)luaL_checkudata(L, 1, "Image");
+   int capacity = luaL_optint(L, 2, 1000);
+
+   if (capacity <= 0)
+      return luaL_error(L, "lutro.graphics.newParticleSystem requires a positive size, %d given.", capacity);
+
+   gfx_ParticleSystem *self = (gfx_ParticleSystem*)lua_newuserdata(L, sizeof(gfx_ParticleSystem));
+   self->image = image;
+   particles_init(&self->ps, capacity, rand());
+
+   lua_pushvalue(L, 1);
+   self->image_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+   if (luaL_newmetatable(L, "ParticleSystem") != 0)
+   {
+      static luaL_Reg ps_funcs[] = {
+         { "type",                  ps_type },
+         { "start",                 ps_start },
+         { "stop",                  ps_stop },
+         { "pause",                 ps_pause },
+         { "reset",                 ps_reset },
+         { "isActive",              ps_isActive },
+         { "isPaused",              ps_isPaused },
+         { "isStopped",             ps_isStopped },
+         { "emit",                  ps_emit },
+         { "update",                ps_update },
+         { "setEmissionRate",       ps_setEmissionRate },
+         { "getEmissionRate",       ps_getEmissionRate },
+         { "setEmitterLifetime",    ps_setEmitterLifetime },
+         { "getEmitterLifetime",    ps_getEmitterLifetime },
+         { "setParticleLifetime",   ps_setParticleLifetime },
+         { "getParticleLifetime",   ps_getParticleLifetime },
+         { "setSpeed",              ps_setSpeed },
+         { "getSpeed",              ps_getSpeed },
+         { "setDirection",          ps_setDirection },
+         { "getDirection",          ps_getDirection },
+         { "setSpread",             ps_setSpread },
+         { "getSpread",             ps_getSpread },
+         { "setLinearAcceleration", ps_setLinearAcceleration },
+         { "getLinearAcceleration", ps_getLinearAcceleration },
+         { "setColors",             ps_setColors },
+         { "getColors",             ps_getColors },
+         { "setSizes",              ps_setSizes },
+         { "getSizes",              ps_getSizes },
+         { "setPosition",           ps_setPosition },
+         { "getPosition",           ps_getPosition },
+         { "moveTo",                ps_setPosition },
+         { "setBufferSize",         ps_setBufferSize },
+         { "getBufferSize",         ps_getBufferSize },
+         { "getCount",              ps_getCount },
+         { "getTexture",            ps_getTexture },
+         { "getImage",              ps_getTexture },
+         { "__gc",                  ps_gc },
+         {NULL, NULL}
+      };
+
+      lua_pushvalue(L, -1);
+
+      lua_setfield(L, -2, "__index");
+
+      luaL_setfuncs(L, ps_funcs, 0);
+   }
+
+   lua_setmetatable(L, -2);
+
+   return 1;
+}
+
+static const char *mesh_modes[] = { "fan", "strip", "triangles", NULL };
+
+static gfx_Mesh *check_mesh(lua_State *L, int ndx)
+{
+   return (gfx_Mesh*)luaL_checkudata(L, ndx, "Mesh");
+}
+
+static int mesh_type(lua_State *L)
+{
+   check_mesh(L, 1);
+   lua_pushstring(L, "Mesh");
+   return 1;
+}
+
+// reads x, y, u, v, r, g, b, a from the table at index ndx, the texture
+// coordinates defaulting to 0 and the color to white.
+static void check_vertex(lua_State *L, int ndx, mesh_vertex_t *vertex)
+{
+   float f[8];
+   static const float defaults[8] = { 0, 0, 0, 0, 255, 255, 255, 255 };
+
+   luaL_checktype(L, ndx, LUA_TTABLE);
+
+   for (int i = 0; i < 8; i++)
+   {
+      lua_rawgeti(L, ndx, i + 1);
+      f[i] = i < 2 ? luaL_checknumber(L, -1) : luaL_optnumber(L, -1, defaults[i]);
+      lua_pop(L, 1);
+   }
+
+   uint32_t c[4];
+   for (int i = 0; i < 4; i++)
+      c[i] = MAX(MIN((int)f[4 + i], 255), 0);
+
+   vertex->x = f[0];
+   vertex->y = f[1];
+   vertex->u = f[2];
+   vertex->v = f[3];
+   vertex->color = (c[3] << 24) | (c[0] << 16) | (c[1] << 8) | c[2];
+}
+
+static unsigned check_vertex_index(lua_State *L, gfx_Mesh *self, int ndx)
+{
+   int i = luaL_checkint(L, ndx);
+
+   if (i < 1 || i > (int)self->mesh.count)
+      luaL_error(L, "Mesh invalid vertex index %d, the mesh has %d.", i, self->mesh.count);
+
+   return i - 1;
+}
+
+static int mesh_setVertex(lua_State *L)
+{
+   gfx_Mesh *self = check_mesh(L, 1);
+   unsigned i = check_vertex_index(L, self, 2);
+
+   if (lua_istable(L, 3))
+   {
+      check_vertex(L, 3, &self->mesh.vertices[i]);
+      return 0;
+   }
+
+   // the vertex given as separate numbers.
+   int top = lua_gettop(L);
+   lua_createtable(L, 8, 0);
+   for (int k = 0; k < 8 && 3 + k <= top; k++)
+   {
+      lua_pushvalue(L, 3 + k);
+      lua_rawseti(L, -2, k + 1);
+   }
+   check_vertex(L, lua_gettop(L), &self->mesh.vertices[i]);
+   return 0;
+}
+
+static int mesh_getVertex(lua_State *L)
+{
+   gfx_Mesh *self = check_mesh(L, 1);
+   const mesh_vertex_t *v = &self->mesh.vertices[check_vertex_index(L, self, 2)];
+
+   lua_pushnumber(L, v->x);
+   lua_pushnumber(L, v->y);
+   lua_pushnumber(L, v->u);
+   lua_pushnumber(L, v->v);
+   lua_pushnumber(L, (v->color >> 16) & 0xff);
+   lua_pushnumber(L, (v->color >> 8) & 0xff);
+   lua_pushnumber(L, v->color & 0xff);
+   lua_pushnumber(L, v->color >> 24);
+   return 8;
+}
+
+static int mesh_setVertices(lua_State *L)
+{
+   gfx_Mesh *self = check_mesh(L, 1);
+   luaL_checktype(L, 2, LUA_TTABLE);
+   unsigned start = lua_isnoneornil(L, 3) ? 0 : check_vertex_index(L, self, 3);
+   unsigned count = MIN(lua_objlen(L, 2), self->mesh.count - start);
+
+   for (unsigned i = 0; i < count; i++)
+   {
+      lua_rawgeti(L, 2, i + 1);
+      check_vertex(L, -1, &self->mesh.vertices[start + i]);
+      lua_pop(L, 1);
    }
 
    return 0;
 }
 
-static int gfx_ellipse(lua_State *L)
+static int mesh_getVertexCount(lua_State *L)
 {
-   int n = lua_gettop(L);
-   gfx_Canvas *canvas;
+   lua_pushnumber(L, check_mesh(L, 1)->mesh.count);
+   return 1;
+}
 
-   if ((n != 5) && (n != 6))
-      return luaL_error(L, "lutro.graphics.ellipse requires 5 or 6 arguments, %d given.", n);
+// a table of 1-based vertex indices or the indices themselves, nothing
+// going back to using the vertices in order.
+static int mesh_setVertexMap(lua_State *L)
+{
+   gfx_Mesh *self = check_mesh(L, 1);
+   bool table = lua_istable(L, 2);
+   int count = table ? (int)lua_objlen(L, 2) : lua_gettop(L) - 1;
 
-   const char* mode = luaL_checkstring(L, 1);
-   int x = luaL_checknumber(L, 2);
-   int y = luaL_checknumber(L, 3);
-   int x_radius = luaL_checknumber(L, 4);
-   int y_radius = luaL_checknumber(L, 5);
-   int nb_segments = 0;
-   if (n == 6)
-     nb_segments = luaL_checknumber(L, 6);
-   if (nb_segments <= 0)
-     nb_segments = MAX(10, MAX(x_radius, y_radius));
+   lutro_free(self->mesh.indices);
+   self->mesh.indices = NULL;
+   self->mesh.nb_indices = 0;
 
-   canvas = get_canvas_ref(L, cur_canv);
+   if (count == 0)
+      return 0;
 
-   if (!strcmp(mode, "fill"))
-   {
-      pntr_fill_ellipse(canvas, x, y, x_radius, y_radius, nb_segments);
-   }
-   else if (!strcmp(mode, "line"))
-   {
-      pntr_strike_ellipse(canvas, x, y, x_radius, y_radius, nb_segments);
-   }
-   else
+   uint32_t *indices = lutro_malloc(count * sizeof(uint32_t));
+
+   for (int i = 0; i < count; i++)
    {
-      return luaL_error(L, "lutro.graphics.circle's available modes are : fill or line", n);
+      if (table)
+         lua_rawgeti(L, 2, i + 1);
+      else
+         lua_pushvalue(L, i + 2);
+
+      int index = lua_tointeger(L, -1);
+      lua_pop(L, 1);
+
+      if (index < 1 || index > (int)self->mesh.count)
+      {
+         lutro_free(indices);
+         return luaL_error(L, "Mesh:setVertexMap invalid vertex index %d, the mesh has %d.", index, self->mesh.count);
+      }
+
+      indices[i] = index - 1;
    }
 
+   self->mesh.indices = indices;
+   self->mesh.nb_indices = count;
    return 0;
 }
 
-static int gfx_point(lua_State *L)
+static int mesh_getVertexMap(lua_State *L)
 {
-   int n = lua_gettop(L);
-   gfx_Canvas *canvas;
-
-   if (n != 2)
-      return luaL_error(L, "lutro.graphics.point requires 2 arguments, %d given.", n);
+   gfx_Mesh *self = check_mesh(L, 1);
 
-   int x = luaL_checknumber(L, 1);
-   int y = luaL_checknumber(L, 2);
-
-   canvas = get_canvas_ref(L, cur_canv);
-
-   if (x > canvas->target->width || x < 0 || y > canvas->target->height || y < 0)
+   if (!self->mesh.indices)
       return 0;
 
-   canvas->target->data[y * (canvas->target->pitch >> 2) + x] = canvas->foreground;
+   lua_createtable(L, self->mesh.nb_indices, 0);
+   for (unsigned i = 0; i < self->mesh.nb_indices; i++)
+   {
+      lua_pushnumber(L, self->mesh.indices[i] + 1);
+      lua_rawseti(L, -2, i + 1);
+   }
+   return 1;
+}
 
+static int mesh_setDrawMode(lua_State *L)
+{
+   check_mesh(L, 1)->mesh.mode = luaL_checkoption(L, 2, NULL, mesh_modes);
    return 0;
 }
 
-/**
- * lutro.graphics.points(x, y, ... )
- *
- * https://love2d.org/wiki/love.graphics.points
- */
-static int gfx_points(lua_State *L)
+static int mesh_getDrawMode(lua_State *L)
 {
-   int n = lua_gettop(L), i, x, y;
-   gfx_Canvas *canvas;
+   lua_pushstring(L, mesh_modes[check_mesh(L, 1)->mesh.mode]);
+   return 1;
+}
 
-   if (n == 1) {
-      // TODO: Implement drawing Point tables https://love2d.org/wiki/love.graphics.points
-      return luaL_error(L, "lutro.graphics.points does not currently support drawing Point types in a table.");
-   }
-   if (n < 2)
-      return luaL_error(L, "lutro.graphics.points requires at least 2 arguments, %d given.", n);
-   if (n & 1)
-      return luaL_error(L, "lutro.graphics.points requires an even amount of arguments, %d arguments given.", n);
+static int mesh_setTexture(lua_State *L)
+{
+   gfx_Mesh *self = check_mesh(L, 1);
+   gfx_Image *image = lua_isnoneornil(L, 2) ? NULL : (gfx_Image*)luaL_checkudata(L, 2, "Image");
 
-   canvas = get_canvas_ref(L, cur_canv);
+   luaL_unref(L, LUA_REGISTRYINDEX, self->image_ref);
+   self->image_ref = LUA_NOREF;
+   self->image = image;
 
-   for (i = 1; i < n; i += 2)
+   if (image)
    {
-      x = luaL_checknumber(L, i);
-      y = luaL_checknumber(L, i + 1);
+      lua_pushvalue(L, 2);
+      self->image_ref = luaL_ref(L, LUA_REGISTRYINDEX);
+   }
+   return 0;
+}
 
-      if (x > canvas->target->width || x < 0 || y > canvas->target->height || y < 0)
-         // Skip if the point is out of the canvas.
-         continue;
+static int mesh_getTexture(lua_State *L)
+{
+   gfx_Mesh *self = check_mesh(L, 1);
 
-      canvas->target->data[y * (canvas->target->pitch >> 2) + x] = canvas->foreground;
-   }
+   if (!self->image)
+      return 0;
+
+   lua_rawgeti(L, LUA_REGISTRYINDEX, self->image_ref);
+   return 1;
+}
 
+static int mesh_gc(lua_State *L)
+{
+   gfx_Mesh *self = check_mesh(L, 1);
+   lutro_free(self->mesh.vertices);
+   lutro_free(self->mesh.indices);
+   self->mesh.vertices = NULL;
+   self->mesh.indices = NULL;
+   luaL_unref(L, LUA_REGISTRYINDEX, self->image_ref);
+   self->image_ref = LUA_NOREF;
    return 0;
 }
 
-static int gfx_line(lua_State *L)
+static int gfx_newMesh(lua_State *L)
 {
    int n = lua_gettop(L);
-   gfx_Canvas *canvas;
 
-   if (n != 4)
-      return luaL_error(L, "lutro.graphics.line requires 4 arguments, %d given.", n);
+   if (n < 1 || n > 3)
+      return luaL_error(L, "lutro.graphics.newMesh requires 1 to 3 arguments, %d given.", n);
 
-   int x1 = luaL_checknumber(L, 1);
-   int y1 = luaL_checknumber(L, 2);
-   int x2 = luaL_checknumber(L, 3);
-   int y2 = luaL_checknumber(L, 4);
+   // either the vertices or how many there are, all at the origin.
+   int count = lua_istable(L, 1) ? (int)lua_objlen(L, 1) : luaL_checkint(L, 1);
+   unsigned mode = luaL_checkoption(L, 2, "fan", mesh_modes);
 
-   canvas = get_canvas_ref(L, cur_canv);
+   if (count < 3)
+      return luaL_error(L, "lutro.graphics.newMesh requires at least 3 vertices, %d given.", count);
 
-   pntr_strike_line(canvas, x1, y1, x2, y2);
+   gfx_Mesh *self = (gfx_Mesh*)lua_newuserdata(L, sizeof(gfx_Mesh));
+   memset(self, 0, sizeof(*self));
+   self->image_ref = LUA_NOREF;
+   self->mesh.mode = mode;
 
-   return 0;
-}
+   if (luaL_newmetatable(L, "Mesh") != 0)
+   {
+      static luaL_Reg mesh_funcs[] = {
+         { "type",           mesh_type },
+         { "setVertex",      mesh_setVertex },
+         { "getVertex",      mesh_getVertex },
+         { "setVertices",    mesh_setVertices },
+         { "getVertexCount", mesh_getVertexCount },
+         { "setVertexMap",   mesh_setVertexMap },
+         { "getVertexMap",   mesh_getVertexMap },
+         { "setDrawMode",    mesh_setDrawMode },
+         { "getDrawMode",    mesh_getDrawMode },
+         { "setTexture",     mesh_setTexture },
+         { "getTexture",     mesh_getTexture },
+         { "__gc",           mesh_gc },
+         {NULL, NULL}
+      };
 
-/* TODO: move this elsewhere, we will certainly need it a lot */
-void *checkudata (lua_State *L, int ud, const char *tname) {
-   void *p = lua_touserdata(L, ud);
-   if (p != NULL)
-   {  /* value is a userdata? */
-      if (lua_getmetatable(L, ud))
-      {  /* does it have a metatable? */
-         lua_getfield(L, LUA_REGISTRYINDEX, tname);  /* get correct metatable */
-         if (lua_rawequal(L, -1, -2))
-         {  /* does it have the correct mt? */
-            lua_pop(L, 2);  /* remove both metatables */
-            return p;
-         }
+      lua_pushvalue(L, -1);
+
+      lua_setfield(L, -2, "__index");
+
+      luaL_setfuncs(L, mesh_funcs, 0);
+   }
+
+   lua_setmetatable(L, -2);
+
+   // set up once the mesh is collectable, the vertices being checked.
+   self->mesh.vertices = lutro_calloc(count, sizeof(mesh_vertex_t));
+   self->mesh.count = count;
+
+   for (int i = 0; i < count; i++)
+   {
+      self->mesh.vertices[i].color = 0xffffffff;
+
+      if (lua_istable(L, 1))
+      {
+         lua_rawgeti(L, 1, i + 1);
+         check_vertex(L, -1, &self->mesh.vertices[i]);
+         lua_pop(L, 1);
       }
    }
-   return NULL; /* to avoid warnings */
-}
 
-#define OPTNUMBER(L, ndx, def) (lua_isnumber(L, ndx) ? lua_tonumber(L, ndx) : def)
+   return 1;
+}
 
 static int gfx_draw(lua_State *L)
 {
@@ -929,9 +2655,48 @@ static int gfx_draw(lua_State *L)
    if (p == NULL)
    {
       img = (gfx_Image*)checkudata(L, 1, "Image");
+      gfx_Mesh *mesh = img ? NULL : (gfx_Mesh*)checkudata(L, 1, "Mesh");
+
+      if (mesh)
+      {
+         // meshes take the full transform, their vertices being placed with it.
+         // and keep sub-pixel positions.
+         float x, y, r, sx, sy;
+         check_placement(L, 1, false, &x, &y, &r, &sx, &sy);
+         canvas = get_canvas_ref(L, cur_canv);
+         pntr_draw_mesh(canvas, mesh->image ? mesh->image->data : NULL, &mesh->mesh, x, y, r, sx, sy);
+         return 0;
+      }
 
       if (img == NULL)
       {
+         gfx_Text *text = (gfx_Text*)checkudata(L, 1, "Text");
+         gfx_SpriteBatch *batch = text ? NULL : (gfx_SpriteBatch*)checkudata(L, 1, "SpriteBatch");
+         gfx_TileLayer *layer = text || batch ? NULL : (gfx_TileLayer*)checkudata(L, 1, "TileLayer");
+         gfx_ParticleSystem *particles = text || batch || layer ? NULL : (gfx_ParticleSystem*)checkudata(L, 1, "ParticleSystem");
+
+         if (text || batch || layer || particles)
+         {
+            // text, batches, tile layers and particles only move, their own
+            // sprites carry any other transform.
+            int x = OPTNUMBER(L, 2, 0);
+            int y = OPTNUMBER(L, 3, 0);
+            canvas = get_canvas_ref(L, cur_canv);
+
+            if (canvas->queue)
+               keep_until_flush(L, 1);
+
+            if (text)
+               pntr_draw_text(canvas, text->font, &text->layout, x, y);
+            else if (batch)
+               pntr_draw_sprites(canvas, batch->image->data, batch->sprites, batch->count, x, y);
+            else if (layer)
+               pntr_draw_tiles(canvas, layer->image->data, &layer->layer, x, y);
+            else
+               pntr_draw_particles(canvas, particles->image->data, &particles->ps, x, y);
+            return 0;
+         }
+
          cnv = get_canvas_ndx(L, 1);
          data = cnv->target;
       }
@@ -949,31 +2714,10 @@ static int gfx_draw(lua_State *L)
       start = 2;
    }
 
-   int x = OPTNUMBER(L, start + 1, 0);
-   int y = OPTNUMBER(L, start + 2, 0);
-   float r = OPTNUMBER(L, start + 3, 0);
-   float sx = OPTNUMBER(L, start + 4, 1);
-   float sy = OPTNUMBER(L, start + 5, sx);
-   int ox = OPTNUMBER(L, start + 6, 0);
-   int oy = OPTNUMBER(L, start + 7, 0);
-   // TODO: Make use of the kx ky shearing numbers in lutro.graphics.draw()
-   // int kx = OPTNUMBER(L, start + 8, 0);
-   // int ky = OPTNUMBER(L, start + 9, 0);
-
-#ifndef HAVE_TRANSFORM
-   // if transformations are not enabled, we set them to default values here
-   // in order to prevent them from having any unexpected effects whatsoever.
-   sx = 1;
-   sy = 1;
-   r = 0;
-#endif
+   sprite_t args;
+   check_draw_args(L, start, &args);
 
-   rect_t drect = {
-      x - ox * sx,
-      y - oy * sy,
-      (int)data->width,
-      (int)data->height
-   };
+   rect_t drect = { args.x, args.y, (int)data->width, (int)data->height };
 
    rect_t srect = {
       0, 0,
@@ -983,9 +2727,8 @@ static int gfx_draw(lua_State *L)
 
    canvas = get_canvas_ref(L, cur_canv);
    pntr_push(canvas);
-   pntr_rotate(canvas, r);
-   pntr_scale(canvas, sx, sy);
-   pntr_rotate(canvas, r);
+   pntr_rotate(canvas, args.r);
+   pntr_scale(canvas, args.sx, args.sy);
 
    if (quad != NULL)
    {
@@ -997,6 +2740,10 @@ static int gfx_draw(lua_State *L)
       drect.width = quad->w;
       drect.height = quad->h;
    }
+
+   if (canvas->queue)
+      keep_until_flush(L, 1);
+
    pntr_draw(canvas, data, &srect, &drect);
 
    pntr_pop(canvas);
@@ -1021,6 +2768,7 @@ static int gfx_print(lua_State *L)
    int dest_x = luaL_checknumber(L, 2);
    int dest_y = luaL_checknumber(L, 3);
 
+   keep_font_until_flush(L, canvas);
    pntr_print(canvas, dest_x, dest_y, message, 0);
 
    return 0;
@@ -1045,6 +2793,8 @@ static int gfx_printf(lua_State *L)
    int limit  = luaL_checknumber(L, 4);
    const char* align = luaL_checkstring(L, 5);
 
+   keep_font_until_flush(L, canvas);
+
    if (!strcmp(align, "right"))
       pntr_print(canvas, dest_x + limit - pntr_text_width(canvas, message), dest_y, message, limit);
    else if (!strcmp(align, "center"))
@@ -1060,16 +2810,128 @@ static int gfx_setDefaultFilter(lua_State *L)
    return 0;
 }
 
+static const char *line_styles[] = { "smooth", "rough", NULL };
+
 static int gfx_setLineStyle(lua_State *L)
 {
+   int n = lua_gettop(L);
+   gfx_Canvas *canvas;
+
+   if (n != 1)
+      return luaL_error(L, "lutro.graphics.setLineStyle requires 1 argument, %d given.", n);
+
+   int style = luaL_checkoption(L, 1, NULL, line_styles);
+
+   canvas = get_canvas_ref(L, cur_canv);
+   canvas->line_style = style;
+
+   return 0;
+}
+
+static int gfx_getLineStyle(lua_State *L)
+{
+   gfx_Canvas *canvas = get_canvas_ref(L, cur_canv);
+
+   lua_pushstring(L, line_styles[canvas->line_style]);
+
+   return 1;
+}
+
+static const char *fill_rules[] = { "nonzero", "evenodd", NULL };
+
+/* lutro extension, picks how self-overlapping polygons are filled. */
+static int gfx_setFillRule(lua_State *L)
+{
+   int n = lua_gettop(L);
+   gfx_Canvas *canvas;
+
+   if (n != 1)
+      return luaL_error(L, "lutro.graphics.setFillRule requires 1 argument, %d given.", n);
+
+   int rule = luaL_checkoption(L, 1, NULL, fill_rules);
+
+   canvas = get_canvas_ref(L, cur_canv);
+   canvas->fill_rule = rule;
+
+   return 0;
+}
+
+static int gfx_getFillRule(lua_State *L)
+{
+   gfx_Canvas *canvas = get_canvas_ref(L, cur_canv);
+
+   lua_pushstring(L, fill_rules[canvas->fill_rule]);
+
+   return 1;
+}
+
+// the first ones in PNTR_BLEND_* order, then the names of older love2d versions.
+static const char *blend_modes[] = {
+   "alpha", "replace", "add", "subtract", "multiply",
+   "additive", "subtractive", "multiplicative", "premultiplied", NULL
+};
+static const unsigned blend_mode_values[] = {
+   PNTR_BLEND_ALPHA, PNTR_BLEND_REPLACE, PNTR_BLEND_ADD, PNTR_BLEND_SUBTRACT, PNTR_BLEND_MULTIPLY,
+   PNTR_BLEND_ADD, PNTR_BLEND_SUBTRACT, PNTR_BLEND_MULTIPLY, PNTR_BLEND_ALPHA | PNTR_BLEND_PREMULTIPLIED
+};
+static const char *blend_alpha_modes[] = { "alphamultiply", "premultiplied", NULL };
+
+static int gfx_setBlendMode(lua_State *L)
+{
+   int n = lua_gettop(L);
+   gfx_Canvas *canvas;
+
+   if (n < 1 || n > 2)
+      return luaL_error(L, "lutro.graphics.setBlendMode requires 1 or 2 arguments, %d given.", n);
+
+   unsigned mode = blend_mode_values[luaL_checkoption(L, 1, NULL, blend_modes)];
+   if (luaL_checkoption(L, 2, "alphamultiply", blend_alpha_modes))
+      mode |= PNTR_BLEND_PREMULTIPLIED;
+
+   canvas = get_canvas_ref(L, cur_canv);
+   canvas->blend_mode = mode;
+
    return 0;
 }
 
+static int gfx_getBlendMode(lua_State *L)
+{
+   gfx_Canvas *canvas = get_canvas_ref(L, cur_canv);
+   unsigned mode = canvas->blend_mode;
+
+   lua_pushstring(L, blend_modes[mode & ~PNTR_BLEND_PREMULTIPLIED]);
+   lua_pushstring(L, blend_alpha_modes[(mode & PNTR_BLEND_PREMULTIPLIED) != 0]);
+
+   return 2;
+}
+
 static int gfx_setLineWidth(lua_State *L)
 {
+   int n = lua_gettop(L);
+   gfx_Canvas *canvas;
+
+   if (n != 1)
+      return luaL_error(L, "lutro.graphics.setLineWidth requires 1 argument, %d given.", n);
+
+   float width = luaL_checknumber(L, 1);
+   if (width <= 0)
+      return luaL_error(L, "lutro.graphics.setLineWidth requires a positive width.");
+
+   canvas = get_canvas_ref(L, cur_canv);
+   canvas->line_width = width;
+
    return 0;
 }
 
+static int gfx_getLineWidth(lua_State *L)
+{
+   gfx_Canvas *canvas = get_canvas_ref(L, cur_canv);
+
+   lua_pushnumber(L, canvas->line_width);
+
+   return 1;
+}
+
 static int gfx_scale(lua_State *L)
 {
    int n = lua_gettop(L);
@@ -1103,6 +2965,50 @@ static int gfx_rotate(lua_State *L)
    return 0;
 }
 
+static int gfx_setSpriteCacheBudget(lua_State *L)
+{
+   int n = lua_gettop(L);
+
+   if (n != 1)
+      return luaL_error(L, "lutro.graphics.setSpriteCacheBudget requires 1 argument, %d given.", n);
+
+   lua_Number budget = luaL_checknumber(L, 1);
+   if (budget < 0)
+      return luaL_error(L, "lutro.graphics.setSpriteCacheBudget requires a budget of 0 bytes or more.");
+
+   pntr_cache_set_budget(sprite_cache, (size_t)budget);
+
+   return 0;
+}
+
+static int gfx_getSpriteCacheBudget(lua_State *L)
+{
+   pntr_cache_stats_t stats;
+   pntr_cache_get_stats(sprite_cache, &stats);
+
+   lua_pushnumber(L, stats.budget);
+
+   return 1;
+}
+
+static int gfx_getSpriteCacheStats(lua_State *L)
+{
+   pntr_cache_stats_t stats;
+   pntr_cache_get_stats(sprite_cache, &stats);
+
+   lua_createtable(L, 0, 4);
+   lua_pushnumber(L, stats.hits);
+   lua_setfield(L, -2, "hits");
+   lua_pushnumber(L, stats.misses);
+   lua_setfield(L, -2, "misses");
+   lua_pushnumber(L, stats.sprites);
+   lua_setfield(L, -2, "sprites");
+   lua_pushnumber(L, stats.bytes);
+   lua_setfield(L, -2, "bytes");
+
+   return 1;
+}
+
 static int gfx_getWidth(lua_State *L)
 {
    lua_pushnumber(L, settings.width);
@@ -1204,14 +3110,26 @@ int lutro_graphics_preload(lua_State *L)
       { "draw",         gfx_draw },
       { "getBackgroundColor", gfx_getBackgroundColor },
       { "getColor",     gfx_getColor },
+      { "getBlendMode", gfx_getBlendMode },
+      { "getFillRule",  gfx_getFillRule },
       { "getFont",      gfx_getFont },
       { "getHeight",    gfx_getHeight },
+      { "getLineStyle", gfx_getLineStyle },
+      { "getLineWidth", gfx_getLineWidth },
+      { "getSpriteCacheBudget", gfx_getSpriteCacheBudget },
+      { "getSpriteCacheStats", gfx_getSpriteCacheStats },
       { "getWidth",     gfx_getWidth },
       { "getCanvas",    gfx_getCanvas },
       { "line",         gfx_line },
+      { "newAtlas",     gfx_newAtlas },
       { "newImage",     gfx_newImage },
       { "newImageFont", gfx_newImageFont },
       { "newQuad",      gfx_newQuad },
+      { "newSpriteBatch", gfx_newSpriteBatch },
+      { "newTileLayer", gfx_newTileLayer },
+      { "newMesh",      gfx_newMesh },
+      { "newParticleSystem", gfx_newParticleSystem },
+      { "newText",      gfx_newText },
       { "newCanvas",    gfx_newCanvas },
       { "point",        gfx_point },
       { "points",       gfx_points },
@@ -1234,11 +3152,17 @@ int lutro_graphics_preload(lua_State *L)
       { "setBackgroundColor", gfx_setBackgroundColor },
       { "setColor",     gfx_setColor },
       { "setDefaultFilter", gfx_setDefaultFilter },
+      { "setBlendMode", gfx_setBlendMode },
+      { "setFillRule",  gfx_setFillRule },
       { "setFont",      gfx_setFont },
       { "setLineStyle", gfx_setLineStyle },
       { "setLineWidth", gfx_setLineWidth },
       { "setScissor",   gfx_setScissor },
+      { "setSpriteCacheBudget", gfx_setSpriteCacheBudget },
       { "setCanvas",    gfx_setCanvas },
+
+      // for unit testing purposes only.
+      { "_drawDeferred", gfx_drawDeferred },
       { NULL, NULL }
    };
 
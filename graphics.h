@@ -11,6 +11,12 @@ typedef struct
    int ref;
 } gfx_Image;
 
+typedef struct
+{
+   pntr_atlas_t *atlas;
+   unsigned limit; /* images larger than this in either dimension stand alone */
+} gfx_Atlas;
+
 typedef struct
 {
    unsigned x;
@@ -21,6 +27,42 @@ typedef struct
    unsigned sh;
 } gfx_Quad;
 
+typedef struct
+{
+   font_t *font;
+   int font_ref;
+   text_layout_t layout;
+} gfx_Text;
+
+typedef struct
+{
+   gfx_Image *image;
+   int image_ref;
+   sprite_t *sprites;
+   unsigned count, capacity;
+} gfx_SpriteBatch;
+
+typedef struct
+{
+   gfx_Image *image;
+   int image_ref;
+   tile_layer_t layer;
+} gfx_TileLayer;
+
+typedef struct
+{
+   gfx_Image *image;
+   int image_ref;
+   particles_t ps;
+} gfx_ParticleSystem;
+
+typedef struct
+{
+   gfx_Image *image; /* NULL when untextured */
+   int image_ref;
+   mesh_t mesh;
+} gfx_Mesh;
+
 typedef struct
 {
    int r;
@@ -32,10 +74,29 @@ typedef struct
 typedef painter_t gfx_Canvas;
 
 void lutro_graphics_init(lua_State* L);
+void lutro_graphics_deinit(void);
 int lutro_graphics_preload(lua_State *L);
 
 void lutro_graphics_reinit(lua_State *L);
 void lutro_graphics_begin_frame(lua_State *L);
 void lutro_graphics_end_frame(lua_State *L);
 
+/* rasterizes the draw calls deferred so far, see settings.deferred_draw. */
+void lutro_graphics_flush(void);
+
+/* whether the screen changed since the last call. */
+bool lutro_graphics_frame_changed(lua_State *L);
+
+/* lends frontend memory the size of the screen for the next frame to be
+ * drawn into, whatever it holds, or NULL once the frame is handed over.
+ * The default canvas only moves there once the frame begins, and back to
+ * lutro's own buffer along with the frame on NULL, so the screen still
+ * reads as the frame drawn last in between. In RGB565, the memory is in
+ * that format and only receives the packed frame. */
+void lutro_graphics_lend_framebuffer(void *data, size_t pitch);
+
+/* the pixels of the frame drawn last and their pitch, in
+ * settings.pixel_format. */
+const void *lutro_graphics_framebuffer(size_t *pitch);
+
 #endif // GRAPHICS_H
@@ -2,13 +2,25 @@
 #include "image.h"
 #include "lutro.h"
 #include "painter.h"
+#include "painter_blend.h"
+#include "painter_atlas.h"
+#include "image_cache.h"
 #include "compat/strl.h"
+#include "file/file_path.h"
 #include "lutro_stb_image.h"
+#include "lutro_workers.h"
 
 #include <stdlib.h>
 #include <string.h>
 
 static int l_newImageData(lua_State *L);
+static int l_newImageDataAsync(lua_State *L);
+static int l_purgeCache(lua_State *L);
+static int l_getCacheStats(lua_State *L);
+static int l_setCacheBudget(lua_State *L);
+static int l_getCacheBudget(lua_State *L);
+static int l_setDiskCache(lua_State *L);
+static int l_getDiskCache(lua_State *L);
 static int l_getWidth(lua_State *L);
 static int l_getHeight(lua_State *L);
 static int l_getPixel(lua_State *L);
@@ -16,11 +28,19 @@ static int l_setPixel(lua_State *L);
 static int l_getDimensions(lua_State *L);
 static int l_type(lua_State *L);
 static int l_gc(lua_State *L);
+static void free_bitmap(bitmap_t *self);
 
 int lutro_image_preload(lua_State *L)
 {
    static const luaL_Reg img_funcs[] =  {
       { "newImageData", l_newImageData },
+      { "newImageDataAsync", l_newImageDataAsync },
+      { "purgeCache", l_purgeCache },
+      { "getCacheStats", l_getCacheStats },
+      { "setCacheBudget", l_setCacheBudget },
+      { "getCacheBudget", l_getCacheBudget },
+      { "setDiskCache", l_setDiskCache },
+      { "getDiskCache", l_getDiskCache },
       {NULL, NULL}
    };
 
@@ -33,6 +53,14 @@ void lutro_image_init(void)
 {
 }
 
+void lutro_image_deinit(void)
+{
+   // the Lua state is gone, and every ImageData along with it.
+   image_cache_set_budget(0);
+   image_cache_purge();
+   image_cache_set_directory(NULL);
+}
+
 void *image_data_create(lua_State *L, bitmap_t* self)
 {
    if (luaL_newmetatable(L, "ImageData") != 0)
@@ -63,29 +91,119 @@ void *image_data_create(lua_State *L, bitmap_t* self)
    return self;
 }
 
-void *image_data_create_from_path(lua_State *L, const char *path)
+unsigned image_check_flags(lua_State *L, int index, unsigned *given)
+{
+   static const struct { const char *name; unsigned flag; } fields[] = {
+      { "premultiplied", IMAGE_PREMULTIPLIED },
+      { "indexed",       IMAGE_INDEXED },
+   };
+   unsigned flags = settings.premultiplied_images ? IMAGE_PREMULTIPLIED : 0;
+
+   *given = 0;
+   if (lua_isnoneornil(L, index))
+      return flags;
+
+   luaL_checktype(L, index, LUA_TTABLE);
+   for (unsigned i = 0; i < sizeof(fields) / sizeof(fields[0]); i++)
+   {
+      lua_getfield(L, index, fields[i].name);
+      if (!lua_isnil(L, -1))
+      {
+         flags = lua_toboolean(L, -1) ? flags | fields[i].flag : flags & ~fields[i].flag;
+         *given |= fields[i].flag;
+      }
+      lua_pop(L, 1);
+   }
+
+   return flags;
+}
+
+// decodes the file at fullpath into a blank bitmap, on any thread.
+static void decode_path(bitmap_t *self, const char *fullpath, unsigned flags)
+{
+   self->premultiplied = (flags & IMAGE_PREMULTIPLIED) != 0;
+
+   // images without a palette are decoded as usual.
+   if ((flags & IMAGE_INDEXED) && lutro_stb_image_load_indexed(fullpath, &self->indices,
+            &self->palette, &self->width, &self->height, self->premultiplied))
+      self->pitch = self->width;
+   else
+   {
+      lutro_stb_image_load(fullpath, &self->data, &self->width, &self->height, self->premultiplied);
+      self->pitch = self->width << 2;
+   }
+}
+
+void *image_data_create_from_path(lua_State *L, const char *path, unsigned flags)
 {
    char fullpath[PATH_MAX_LENGTH];
    strlcpy(fullpath, settings.gamedir, sizeof(fullpath));
    strlcat(fullpath, path, sizeof(fullpath));
 
    bitmap_t* self = (bitmap_t*)lua_newuserdata(L, sizeof(bitmap_t));
+   memset(self, 0, sizeof(bitmap_t));
 
-   lutro_stb_image_load(fullpath, &self->data, &self->width, &self->height);
-
-   self->pitch = self->width << 2;
+   if (!image_cache_find(fullpath, flags, self))
+   {
+      decode_path(self, fullpath, flags);
+      bitmap_build_spans(self);
+      image_cache_add(fullpath, flags, self);
+   }
 
    return image_data_create(L, self);
 }
 
-void *image_data_create_from_dimensions(lua_State *L, int width, int height)
+void *image_data_create_in_atlas(lua_State *L, const char *path, unsigned flags, pntr_atlas_t *atlas, unsigned limit)
+{
+   bitmap_t *self = image_data_create_from_path(L, path, flags);
+
+   if (!self->data || self->width > limit || self->height > limit)
+      return self;
+
+   // the decoded pixels move to the page, row by row, or are copied there
+   // from the cache.
+   bitmap_t decoded = *self;
+
+   if (pntr_atlas_place(atlas, self, self->width, self->height))
+   {
+      for (unsigned y = 0; y < self->height; y++)
+         memcpy((uint8_t*)self->data + y * self->pitch, (uint8_t*)decoded.data + y * decoded.pitch, self->width << 2);
+
+      if (decoded.shared)
+      {
+         image_cache_release(&decoded);
+         self->shared = NULL;
+         self->spans = NULL;
+         bitmap_build_spans(self);
+      }
+      else
+         lutro_free(decoded.data);
+   }
+
+   return self;
+}
+
+void *image_data_create_from_dimensions(lua_State *L, int width, int height, unsigned flags)
 {
    bitmap_t* self = (bitmap_t*)lua_newuserdata(L, sizeof(bitmap_t));
+   memset(self, 0, sizeof(bitmap_t));
 
    self->width = width;
    self->height = height;
-   self->pitch = self->width << 2;
-   self->data = (uint32_t*)lutro_calloc(1, sizeof(uint32_t)*self->width*self->height);
+   self->premultiplied = (flags & IMAGE_PREMULTIPLIED) != 0;
+
+   // transparent black, whichever the form.
+   if (flags & IMAGE_INDEXED)
+   {
+      self->pitch = self->width;
+      self->indices = (uint8_t*)lutro_calloc(1, self->width*self->height);
+      self->palette = (uint32_t*)lutro_calloc(BITMAP_PALETTE_SIZE, sizeof(uint32_t));
+   }
+   else
+   {
+      self->pitch = self->width << 2;
+      self->data = (uint32_t*)lutro_calloc(1, sizeof(uint32_t)*self->width*self->height);
+   }
 
    return image_data_create(L, self);
 }
@@ -94,21 +212,167 @@ static int l_newImageData(lua_State *L)
 {
    int n = lua_gettop(L);
 
-   if (n != 1 && n != 2)
-      return luaL_error(L, "lutro.image.newImageData requires 1 or 2 arguments, %d given.", n);
+   if (n < 1 || n > 3)
+      return luaL_error(L, "lutro.image.newImageData requires 1 to 3 arguments, %d given.", n);
 
-   if (n == 1)
+   unsigned given;
+   if (n == 1 || lua_istable(L, 2))
    {
+      unsigned flags = image_check_flags(L, 2, &given);
       const char* path = luaL_checkstring(L, 1);
-      image_data_create_from_path(L, path);
+      image_data_create_from_path(L, path, flags);
    }
-   else if (n == 2)
+   else
    {
+      // images created blank are only premultiplied when asked to.
+      unsigned flags = image_check_flags(L, 3, &given) & (given | ~IMAGE_PREMULTIPLIED);
       int width = luaL_checknumber(L, 1);
       int height = luaL_checknumber(L, 2);
-      image_data_create_from_dimensions(L, width, height);
+      image_data_create_from_dimensions(L, width, height, flags);
+   }
+
+   return 1;
+}
+
+// an image decoding on a worker, see lutro.image.newImageDataAsync.
+typedef struct
+{
+   char fullpath[PATH_MAX_LENGTH];
+   unsigned flags;
+   bitmap_t bmp;       // decoded by the task, then moved to the ImageData
+   lutro_task_t *task; // NULL once done
+   int ref;            // the ImageData
+} image_decode_t;
+
+static void decode_task(void *data, unsigned index)
+{
+   image_decode_t *self = (image_decode_t*)data;
+   (void)index;
+
+   decode_path(&self->bmp, self->fullpath, self->flags);
+}
+
+// moves the decoded pixels to an ImageData once the task is done, which
+// only waits for it when asked to. Returns whether it is published.
+static bool decode_publish(lua_State *L, image_decode_t *self, bool wait)
+{
+   if (self->ref != LUA_NOREF)
+      return true;
+
+   // images found in the cache had no task.
+   if (self->task)
+   {
+      if (wait)
+         lutro_workers_wait(self->task);
+      else if (!lutro_workers_done(self->task))
+         return false;
+
+      lutro_workers_release(self->task);
+      self->task = NULL;
+
+      // spans and serials are only ever built on the Lua thread.
+      bitmap_build_spans(&self->bmp);
+      image_cache_add(self->fullpath, self->flags, &self->bmp);
    }
 
+   bitmap_t *bmp = (bitmap_t*)lua_newuserdata(L, sizeof(bitmap_t));
+   *bmp = self->bmp;
+   memset(&self->bmp, 0, sizeof(bitmap_t));
+
+   image_data_create(L, bmp);
+   self->ref = luaL_ref(L, LUA_REGISTRYINDEX);
+
+   return true;
+}
+
+static int decode_isReady(lua_State *L)
+{
+   image_decode_t *self = (image_decode_t*)luaL_checkudata(L, 1, "ImageDecode");
+   lua_pushboolean(L, decode_publish(L, self, false));
+   return 1;
+}
+
+static int decode_getImageData(lua_State *L)
+{
+   image_decode_t *self = (image_decode_t*)luaL_checkudata(L, 1, "ImageDecode");
+
+   if (decode_publish(L, self, lua_toboolean(L, 2)))
+      lua_rawgeti(L, LUA_REGISTRYINDEX, self->ref);
+   else
+      lua_pushnil(L);
+
+   return 1;
+}
+
+static int decode_type(lua_State *L)
+{
+   lua_pushstring(L, "ImageDecode");
+   return 1;
+}
+
+static int decode_gc(lua_State *L)
+{
+   image_decode_t *self = (image_decode_t*)luaL_checkudata(L, 1, "ImageDecode");
+
+   // a decode still queued is dropped, a running one finished first.
+   lutro_workers_release(self->task);
+   self->task = NULL;
+   free_bitmap(&self->bmp);
+
+   luaL_unref(L, LUA_REGISTRYINDEX, self->ref);
+   self->ref = LUA_NOREF;
+   return 0;
+}
+
+static int l_newImageDataAsync(lua_State *L)
+{
+   int n = lua_gettop(L);
+
+   if (n < 1 || n > 2)
+      return luaL_error(L, "lutro.image.newImageDataAsync requires 1 or 2 arguments, %d given.", n);
+
+   unsigned given;
+   const char *path = luaL_checkstring(L, 1);
+   unsigned flags = image_check_flags(L, 2, &given);
+
+   image_decode_t *self = (image_decode_t*)lua_newuserdata(L, sizeof(image_decode_t));
+   memset(self, 0, sizeof(image_decode_t));
+   strlcpy(self->fullpath, settings.gamedir, sizeof(self->fullpath));
+   strlcat(self->fullpath, path, sizeof(self->fullpath));
+   self->flags = flags;
+   self->ref = LUA_NOREF;
+
+   if (luaL_newmetatable(L, "ImageDecode") != 0)
+   {
+      static luaL_Reg decode_funcs[] = {
+         { "isReady",      decode_isReady },
+         { "getImageData", decode_getImageData },
+         { "type",         decode_type },
+         { "__gc",         decode_gc },
+         {NULL, NULL}
+      };
+
+      lua_pushvalue(L, -1);
+      lua_setfield(L, -2, "__index");
+
+      luaL_setfuncs(L, decode_funcs, 0);
+
+      // a coroutine waiting yields until the next check, once resumed, while
+      // the main thread blocks.
+      luaL_loadstring(L,
+            "local self = ...\n"
+            "if coroutine.running() then\n"
+            "   while not self:isReady() do coroutine.yield() end\n"
+            "end\n"
+            "return self:getImageData(true)\n");
+      lua_setfield(L, -2, "wait");
+   }
+
+   lua_setmetatable(L, -2);
+
+   if (!image_cache_find(self->fullpath, flags, &self->bmp))
+      self->task = lutro_workers_post(decode_task, self);
+
    return 1;
 }
 
@@ -148,10 +412,12 @@ static int l_getPixel(lua_State *L)
    int g = 0;
    int b = 0;
 
-   if (self->data) {
-      uint32_t* data = self->data;
-
-      uint32_t color = data[y * (self->pitch >> 2) + x];
+   if (self->data || self->indices) {
+      uint32_t color = self->indices
+         ? self->palette[self->indices[y * self->pitch + x]]
+         : self->data[y * (self->pitch >> 2) + x];
+      if (self->premultiplied)
+         color = pntr_unpremultiply(color);
 
       a = ((color & ALPHA_MASK) >> ALPHA_SHIFT);
       r = ((color & RED_MASK) >> RED_SHIFT);
@@ -183,8 +449,31 @@ static int l_setPixel(lua_State *L)
 
    lua_pop(L, n);
 
-   if (self->data)
-      self->data[y * (self->pitch >> 2) + x] = (c.a<<24) | (c.r<<16) | (c.g<<8) | c.b;
+   // an Image sharing these pixels may have been drawn to the deferred frame.
+   lutro_graphics_flush();
+   image_cache_detach(self);
+
+   uint32_t color = (c.a<<24) | (c.r<<16) | (c.g<<8) | c.b;
+   if (self->premultiplied)
+      color = pntr_premultiply(color);
+
+   if (self->indices)
+   {
+      // indexed pixels can only take the colors of their palette.
+      int index = 0;
+      while (index < BITMAP_PALETTE_SIZE && self->palette[index] != color)
+         index++;
+
+      if (index == BITMAP_PALETTE_SIZE)
+         return luaL_error(L, "ImageData:setPixel color %d, %d, %d, %d is not in the palette.", c.r, c.g, c.b, c.a);
+
+      self->indices[y * self->pitch + x] = index;
+   }
+   else if (self->data)
+      self->data[y * (self->pitch >> 2) + x] = color;
+
+   // the opacity runs are rebuilt when the ImageData is next turned into an Image.
+   bitmap_free_spans(self);
 
    return 0;
 }
@@ -197,12 +486,129 @@ static int l_getDimensions(lua_State *L)
    return 2;
 }
 
-static int l_gc(lua_State *L)
+static void free_bitmap(bitmap_t *self)
 {
-   bitmap_t* self = (bitmap_t*)luaL_checkudata(L, 1, "ImageData");
-   if (self->data) {
+   if (self->shared) {
+      image_cache_release(self);
+      return;
+   }
+   if (self->atlas) {
+      pntr_atlas_release(self->atlas);
+      self->atlas = NULL;
+      self->data = NULL;
+   }
+   else if (self->data) {
       lutro_free(self->data);
       self->data = NULL;
    }
+   if (self->indices) {
+      lutro_free(self->indices);
+      lutro_free(self->palette);
+      self->indices = NULL;
+      self->palette = NULL;
+   }
+   bitmap_free_spans(self);
+}
+
+static int l_gc(lua_State *L)
+{
+   bitmap_t* self = (bitmap_t*)luaL_checkudata(L, 1, "ImageData");
+   free_bitmap(self);
    return 0;
 }
+
+static int l_purgeCache(lua_State *L)
+{
+   image_cache_purge();
+   return 0;
+}
+
+static int l_getCacheStats(lua_State *L)
+{
+   image_cache_stats_t stats;
+   image_cache_get_stats(&stats);
+
+   lua_createtable(L, 0, 8);
+   lua_pushnumber(L, stats.hits);
+   lua_setfield(L, -2, "hits");
+   lua_pushnumber(L, stats.misses);
+   lua_setfield(L, -2, "misses");
+   lua_pushnumber(L, stats.disk_hits);
+   lua_setfield(L, -2, "diskHits");
+   lua_pushnumber(L, stats.disk_writes);
+   lua_setfield(L, -2, "diskWrites");
+   lua_pushnumber(L, stats.images);
+   lua_setfield(L, -2, "images");
+   lua_pushnumber(L, stats.unused);
+   lua_setfield(L, -2, "unused");
+   lua_pushnumber(L, stats.bytes);
+   lua_setfield(L, -2, "bytes");
+   lua_pushnumber(L, stats.unused_bytes);
+   lua_setfield(L, -2, "unusedBytes");
+
+   return 1;
+}
+
+static int l_setCacheBudget(lua_State *L)
+{
+   int n = lua_gettop(L);
+
+   if (n != 1)
+      return luaL_error(L, "lutro.image.setCacheBudget requires 1 argument, %d given.", n);
+
+   lua_Number budget = luaL_checknumber(L, 1);
+   if (budget < 0)
+      return luaL_error(L, "lutro.image.setCacheBudget requires a budget of 0 bytes or more.");
+
+   image_cache_set_budget((size_t)budget);
+
+   return 0;
+}
+
+static int l_getCacheBudget(lua_State *L)
+{
+   image_cache_stats_t stats;
+   image_cache_get_stats(&stats);
+
+   lua_pushnumber(L, stats.budget);
+
+   return 1;
+}
+
+/**
+ * enabled = lutro.image.setDiskCache(enabled)
+ *
+ * Caches the images decoded on disk, in the save directory, for the next
+ * loads to map them instead of decoding them again. Returns false when
+ * there is no save directory to write to.
+ */
+static int l_setDiskCache(lua_State *L)
+{
+   int n = lua_gettop(L);
+
+   if (n != 1)
+      return luaL_error(L, "lutro.image.setDiskCache requires 1 argument, %d given.", n);
+
+   const char *savedir = NULL;
+   char directory[PATH_MAX_LENGTH];
+   bool enabled = false;
+
+   if (!lua_toboolean(L, 1))
+      image_cache_set_directory(NULL);
+   else if ((*settings.environ_cb)(RETRO_ENVIRONMENT_GET_SAVE_DIRECTORY, &savedir) && savedir && *savedir)
+   {
+      fill_pathname_join(directory, savedir, "lutro_image_cache", sizeof(directory));
+      enabled = image_cache_set_directory(directory);
+   }
+
+   lua_pushboolean(L, enabled);
+
+   return 1;
+}
+
+static int l_getDiskCache(lua_State *L)
+{
+   lua_pushboolean(L, image_cache_get_directory() != NULL);
+
+   return 1;
+}
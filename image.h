@@ -6,6 +6,7 @@
 #include <stdio.h>
 #include <stdbool.h>
 #include "runtime.h"
+#include "painter.h"
 
 #if defined(ABGR)
 #define ALPHA_SHIFT 24
@@ -30,8 +31,24 @@
 #endif
 
 void lutro_image_init(void);
+void lutro_image_deinit(void);
 int lutro_image_preload(lua_State *L);
 
-void *image_data_create_from_path(lua_State *L, const char *path);
+enum {
+   IMAGE_PREMULTIPLIED = 1 << 0, /* see bitmap_set_premultiplied() */
+   IMAGE_INDEXED       = 1 << 1  /* palette PNGs keep their palette */
+};
+
+/* flags, IMAGE_*, pick the form of the decoded pixels. */
+void *image_data_create_from_path(lua_State *L, const char *path, unsigned flags);
+
+/* same, small 32 bits images being placed on a page of the atlas, see
+ * painter_atlas.h. Images wider or taller than limit stand alone. */
+void *image_data_create_in_atlas(lua_State *L, const char *path, unsigned flags, pntr_atlas_t *atlas, unsigned limit);
+
+/* IMAGE_* flags from an optional settings table, defaulting to the conf,
+ * given collecting the ones the table sets. */
+unsigned image_check_flags(lua_State *L, int index, unsigned *given);
+void *image_data_create_from_dimensions(lua_State *L, int width, int height, unsigned flags);
 
 #endif // IMAGE_H
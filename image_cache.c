@@ -0,0 +1,706 @@
+#include <stdlib.h>
+#include <string.h>
+#include <stdio.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <memmap.h>
+#include <compat/strl.h>
+#include <file/file_path.h>
+#include <streams/file_stream.h>
+
+#if !defined(_WIN32)
+#include <unistd.h>
+#endif
+
+#include "lutro.h"
+#include "image.h"
+#include "image_cache.h"
+
+#ifndef O_BINARY
+#define O_BINARY 0
+#endif
+#ifndef PROT_READ
+#define PROT_READ 0x1
+#endif
+#ifndef MAP_PRIVATE
+#define MAP_PRIVATE 0x2
+#endif
+#ifndef MAP_FAILED
+#define MAP_FAILED ((void*)-1)
+#endif
+
+#define DISK_VERSION 1
+#define DISK_ALIGNMENT 64 // of the pixels in the file
+
+// Images cached on disk start with this header, followed by the path of
+// the file decoded. The pixels or indices come next at data_offset, rows
+// pitch bytes apart, then the palette of indexed images, then the spans
+// rows and runs when the image has any, each at its offset.
+typedef struct
+{
+   char magic[8];         // "LUTROIMG"
+   uint32_t version;
+   uint32_t byte_order;   // 0x01020304, as the CPU writing it stores it
+   uint32_t red_shift;    // of the pixels, RED_SHIFT
+   uint32_t flags;
+   uint32_t width, height, pitch;
+   uint32_t indexed, premultiplied;
+   uint32_t path_length;
+   uint32_t data_offset, palette_offset, spans_offset;
+   uint32_t run_count;
+   uint32_t reserved;
+   int64_t size, mtime;   // of the file when decoded
+} disk_header_t;
+
+struct image_cache_entry_s
+{
+   char *path;
+   unsigned flags;
+   int64_t size, mtime; // of the file when decoded
+
+   bitmap_t bmp; // owns the pixels, unless they are in map
+   size_t bytes;
+   void *map;    // the file cached on disk the pixels were read from
+   size_t map_size;
+   unsigned refs;
+   bool stale;   // the file changed since, and it is no longer found
+
+   image_cache_entry_t *chain;       // in its bucket
+   image_cache_entry_t *prev, *next; // in the unused list, least recently used first
+};
+
+static struct
+{
+   image_cache_entry_t **buckets;
+   unsigned nb_buckets; // a power of two
+   unsigned count, unused;
+   size_t bytes, unused_bytes, budget;
+   uint64_t hits, misses, disk_hits, disk_writes;
+
+   image_cache_entry_t *first_unused, *last_unused;
+   char *directory; // of the files cached on disk, NULL when not cached
+} cache;
+
+static bool file_stamp(const char *path, int64_t *size, int64_t *mtime)
+{
+   struct stat st;
+
+   if (stat(path, &st) != 0)
+      return false;
+
+   *size  = st.st_size;
+   *mtime = st.st_mtime;
+   return true;
+}
+
+// FNV-1a over the path, then the flags.
+static uint32_t hash_key(const char *path, unsigned flags)
+{
+   uint32_t h = 2166136261u;
+
+   for (const uint8_t *c = (const uint8_t*)path; *c; c++)
+      h = (h ^ *c) * 16777619u;
+
+   return (h ^ flags) * 16777619u;
+}
+
+static image_cache_entry_t **bucket_of(const char *path, unsigned flags)
+{
+   return &cache.buckets[hash_key(path, flags) & (cache.nb_buckets - 1)];
+}
+
+static image_cache_entry_t *lookup(const char *path, unsigned flags)
+{
+   if (!cache.buckets)
+      return NULL;
+
+   image_cache_entry_t *e = *bucket_of(path, flags);
+   while (e && (e->flags != flags || strcmp(e->path, path) != 0))
+      e = e->chain;
+
+   return e;
+}
+
+static void grow_buckets(void)
+{
+   unsigned nb_buckets = cache.nb_buckets ? cache.nb_buckets * 2 : 64;
+   image_cache_entry_t **buckets = lutro_calloc(nb_buckets, sizeof(image_cache_entry_t*));
+
+   for (unsigned i = 0; i < cache.nb_buckets; i++)
+   {
+      image_cache_entry_t *e = cache.buckets[i];
+      while (e)
+      {
+         image_cache_entry_t *next = e->chain;
+         image_cache_entry_t **bucket = &buckets[hash_key(e->path, e->flags) & (nb_buckets - 1)];
+         e->chain = *bucket;
+         *bucket = e;
+         e = next;
+      }
+   }
+
+   lutro_free(cache.buckets);
+   cache.buckets = buckets;
+   cache.nb_buckets = nb_buckets;
+}
+
+static void unused_unlink(image_cache_entry_t *e)
+{
+   if (e->prev)
+      e->prev->next = e->next;
+   else
+      cache.first_unused = e->next;
+
+   if (e->next)
+      e->next->prev = e->prev;
+   else
+      cache.last_unused = e->prev;
+
+   e->prev = e->next = NULL;
+   cache.unused--;
+   cache.unused_bytes -= e->bytes;
+}
+
+static void unused_push(image_cache_entry_t *e)
+{
+   e->prev = cache.last_unused;
+   e->next = NULL;
+
+   if (cache.last_unused)
+      cache.last_unused->next = e;
+   else
+      cache.first_unused = e;
+   cache.last_unused = e;
+
+   cache.unused++;
+   cache.unused_bytes += e->bytes;
+}
+
+// takes the entry out of its bucket, for it not to be found any more.
+static void unhash(image_cache_entry_t *e)
+{
+   image_cache_entry_t **link = bucket_of(e->path, e->flags);
+
+   while (*link != e)
+      link = &(*link)->chain;
+   *link = e->chain;
+
+   e->stale = true;
+   cache.count--;
+   cache.bytes -= e->bytes;
+}
+
+#if defined(HAVE_MMAN) || defined(_WIN32)
+static void *map_file(const char *path, size_t *length)
+{
+   struct stat st;
+   void *map = MAP_FAILED;
+   int fd = open(path, O_RDONLY | O_BINARY);
+
+   if (fd < 0)
+      return NULL;
+
+   // private, for the pixels to never write back to the file.
+   if (fstat(fd, &st) == 0 && st.st_size > 0)
+   {
+      *length = st.st_size;
+      map = mmap(NULL, *length, PROT_READ, MAP_PRIVATE, fd, 0);
+   }
+
+   close(fd);
+   return map == MAP_FAILED ? NULL : map;
+}
+
+static void unmap_file(void *map, size_t length)
+{
+   munmap(map, length);
+}
+#else
+// without mmap, the file is read whole.
+static void *map_file(const char *path, size_t *length)
+{
+   void *buf;
+   int64_t len;
+
+   if (filestream_read_file(path, &buf, &len) <= 0)
+      return NULL;
+
+   *length = len;
+   return buf;
+}
+
+static void unmap_file(void *map, size_t length)
+{
+   (void)length;
+   free(map); // Allocated in libretro:filestream_read_file
+}
+#endif
+
+static void free_entry(image_cache_entry_t *e)
+{
+   if (e->map)
+      unmap_file(e->map, e->map_size);
+   else
+   {
+      lutro_free(e->bmp.data);
+      lutro_free(e->bmp.indices);
+      lutro_free(e->bmp.palette);
+   }
+   bitmap_free_spans(&e->bmp);
+   lutro_free(e->path);
+   lutro_free(e);
+}
+
+// frees an entry no bitmap references.
+static void drop(image_cache_entry_t *e)
+{
+   unused_unlink(e);
+   if (!e->stale)
+      unhash(e);
+   free_entry(e);
+}
+
+static void trim(void)
+{
+   while (cache.first_unused && cache.unused_bytes > cache.budget)
+      drop(cache.first_unused);
+}
+
+static void share(image_cache_entry_t *e, bitmap_t *bmp)
+{
+   *bmp = e->bmp;
+   bmp->shared = e;
+}
+
+static size_t pixel_bytes(const bitmap_t *bmp)
+{
+   return (size_t)bmp->pitch * bmp->height;
+}
+
+// hashes a new entry for the pixels of bmp, referenced once.
+static image_cache_entry_t *new_entry(const char *fullpath, unsigned flags,
+      int64_t size, int64_t mtime, const bitmap_t *bmp)
+{
+   if (cache.count >= cache.nb_buckets)
+      grow_buckets();
+
+   size_t length = strlen(fullpath) + 1;
+   image_cache_entry_t *e = lutro_calloc(1, sizeof(image_cache_entry_t));
+   e->path = lutro_malloc(length);
+   memcpy(e->path, fullpath, length);
+   e->flags = flags;
+   e->size  = size;
+   e->mtime = mtime;
+   e->refs  = 1;
+
+   e->bmp = *bmp;
+   e->bytes = pixel_bytes(bmp);
+   if (bmp->indices)
+      e->bytes += BITMAP_PALETTE_SIZE * sizeof(uint32_t);
+
+   image_cache_entry_t **bucket = bucket_of(fullpath, flags);
+   e->chain = *bucket;
+   *bucket = e;
+
+   cache.count++;
+   cache.bytes += e->bytes;
+
+   return e;
+}
+
+// FNV-1a again, 64 bits wide for the name of the file cached on disk.
+static bool disk_path(const char *fullpath, unsigned flags, char *path, size_t size)
+{
+   uint64_t h = 14695981039346656037ull;
+   char name[32];
+
+   if (!cache.directory)
+      return false;
+
+   for (const uint8_t *c = (const uint8_t*)fullpath; *c; c++)
+      h = (h ^ *c) * 1099511628211ull;
+   h = (h ^ flags) * 1099511628211ull;
+
+   snprintf(name, sizeof(name), "%08x%08x.img", (unsigned)(h >> 32), (unsigned)h);
+   fill_pathname_join(path, cache.directory, name, size);
+   return true;
+}
+
+static uint64_t align(uint64_t offset, unsigned alignment)
+{
+   return (offset + alignment - 1) & ~(uint64_t)(alignment - 1);
+}
+
+// sets the offsets from the rest of the header, returning the size of the
+// file, or 0 when it would be too big.
+static uint64_t disk_layout(disk_header_t *h)
+{
+   uint64_t end = align(sizeof(*h) + h->path_length, DISK_ALIGNMENT);
+
+   h->data_offset = end;
+   end += (uint64_t)h->pitch * h->height;
+
+   h->palette_offset = 0;
+   if (h->indexed)
+   {
+      end = align(end, sizeof(uint32_t));
+      h->palette_offset = end;
+      end += BITMAP_PALETTE_SIZE * sizeof(uint32_t);
+   }
+
+   // images with runs too short to be worth it have no spans.
+   h->spans_offset = 0;
+   if (h->run_count)
+   {
+      end = align(end, sizeof(uint32_t));
+      h->spans_offset = end;
+      end += ((uint64_t)h->height + 1 + h->run_count) * sizeof(uint32_t);
+   }
+
+   return end <= UINT32_MAX ? end : 0;
+}
+
+// what identifies the file decoded and the build reading the image.
+static void disk_identity(disk_header_t *h, const char *fullpath, unsigned flags,
+      int64_t size, int64_t mtime)
+{
+   memcpy(h->magic, "LUTROIMG", 8);
+   h->version     = DISK_VERSION;
+   h->byte_order  = 0x01020304;
+   h->red_shift   = RED_SHIFT;
+   h->flags       = flags;
+   h->path_length = strlen(fullpath);
+   h->reserved    = 0;
+   h->size        = size;
+   h->mtime       = mtime;
+}
+
+// rows must start at 0 and go up to the run count, each row ending with
+// a run up to the width.
+static bool disk_spans_valid(const uint32_t *rows, const uint32_t *runs, const disk_header_t *h)
+{
+   if (rows[0] != 0 || rows[h->height] != h->run_count)
+      return false;
+
+   for (unsigned y = 0; y < h->height; y++)
+   {
+      uint32_t end = 0;
+
+      if (rows[y + 1] <= rows[y] || rows[y + 1] > h->run_count)
+         return false;
+
+      for (uint32_t r = rows[y]; r < rows[y + 1]; r++)
+      {
+         if ((runs[r] >> 2) <= end || (runs[r] & 3) > BITMAP_SPAN_BLENDED)
+            return false;
+         end = runs[r] >> 2;
+      }
+
+      if (end != h->width)
+         return false;
+   }
+
+   return true;
+}
+
+// whether the file cached on disk, length bytes long, holds the image
+// decoded from fullpath as it is now.
+static bool disk_valid(const void *map, size_t length, const char *fullpath, unsigned flags,
+      int64_t size, int64_t mtime)
+{
+   const disk_header_t *h = map;
+   disk_header_t expected;
+
+   if (length < sizeof(*h))
+      return false;
+
+   expected = *h;
+   disk_identity(&expected, fullpath, flags, size, mtime);
+   uint64_t end = disk_layout(&expected);
+
+   if (memcmp(h, &expected, sizeof(*h)) != 0 || end == 0 || end > length
+         || h->width == 0 || h->height == 0
+         || h->pitch < (uint64_t)h->width * (h->indexed ? 1 : 4)
+         || memcmp((const char*)map + sizeof(*h), fullpath, h->path_length) != 0)
+      return false;
+
+   if (!h->spans_offset)
+      return true;
+
+   const uint32_t *rows = (const uint32_t*)((const uint8_t*)map + h->spans_offset);
+   return disk_spans_valid(rows, rows + h->height + 1, h);
+}
+
+static image_cache_entry_t *disk_load(const char *fullpath, unsigned flags, int64_t size, int64_t mtime)
+{
+   char path[PATH_MAX_LENGTH];
+   size_t length;
+   void *map;
+
+   if (!disk_path(fullpath, flags, path, sizeof(path)) || !(map = map_file(path, &length)))
+      return NULL;
+
+   if (!disk_valid(map, length, fullpath, flags, size, mtime))
+   {
+      unmap_file(map, length);
+      return NULL;
+   }
+
+   const disk_header_t *h = map;
+   uint8_t *base = map;
+   bitmap_t bmp = { 0 };
+
+   bmp.width  = h->width;
+   bmp.height = h->height;
+   bmp.pitch  = h->pitch;
+   bmp.premultiplied = h->premultiplied != 0;
+   if (h->indexed)
+   {
+      bmp.indices = base + h->data_offset;
+      bmp.palette = (uint32_t*)(base + h->palette_offset);
+   }
+   else
+      bmp.data = (uint32_t*)(base + h->data_offset);
+
+   if (h->spans_offset)
+   {
+      uint32_t *rows = (uint32_t*)(base + h->spans_offset);
+      bitmap_use_spans(&bmp, rows, rows + h->height + 1);
+   }
+   else
+      bitmap_build_spans(&bmp);
+
+   image_cache_entry_t *e = new_entry(fullpath, flags, size, mtime, &bmp);
+   e->map = map;
+   e->map_size = length;
+
+   cache.disk_hits++;
+   return e;
+}
+
+// pads the file from *pos up to offset, then writes len bytes.
+static bool disk_write(RFILE *file, int64_t *pos, int64_t offset, const void *data, int64_t len)
+{
+   static const uint8_t padding[DISK_ALIGNMENT] = { 0 };
+   int64_t pad = offset - *pos;
+
+   if (pad > 0 && filestream_write(file, padding, pad) != pad)
+      return false;
+
+   *pos = offset + len;
+   return filestream_write(file, data, len) == len;
+}
+
+// writes the image to a temporary file renamed into place, for a file cut
+// short to never be found.
+static void disk_store(const char *fullpath, unsigned flags, int64_t size, int64_t mtime, const bitmap_t *bmp)
+{
+   char path[PATH_MAX_LENGTH], temp[PATH_MAX_LENGTH];
+   disk_header_t h;
+   int64_t pos = 0;
+
+   memset(&h, 0, sizeof(h));
+   disk_identity(&h, fullpath, flags, size, mtime);
+   h.width         = bmp->width;
+   h.height        = bmp->height;
+   h.pitch         = bmp->pitch;
+   h.indexed       = bmp->indices != NULL;
+   h.premultiplied = bmp->premultiplied;
+   h.run_count     = bmp->spans ? bmp->spans->rows[bmp->height] : 0;
+
+   if (!disk_path(fullpath, flags, path, sizeof(path)) || !disk_layout(&h))
+      return;
+
+   strlcpy(temp, path, sizeof(temp));
+   strlcat(temp, ".tmp", sizeof(temp));
+
+   RFILE *file = filestream_open(temp, RETRO_VFS_FILE_ACCESS_WRITE, RETRO_VFS_FILE_ACCESS_HINT_NONE);
+   if (!file)
+      return;
+
+   bool written = disk_write(file, &pos, 0, &h, sizeof(h))
+      && disk_write(file, &pos, pos, fullpath, h.path_length)
+      && disk_write(file, &pos, h.data_offset, bmp->indices ? (void*)bmp->indices : (void*)bmp->data, pixel_bytes(bmp))
+      && (!h.indexed || disk_write(file, &pos, h.palette_offset, bmp->palette, BITMAP_PALETTE_SIZE * sizeof(uint32_t)))
+      && (!h.spans_offset || disk_write(file, &pos, h.spans_offset, bmp->spans->rows,
+               ((int64_t)bmp->height + 1 + h.run_count) * sizeof(uint32_t)));
+
+   if (filestream_close(file) != 0)
+      written = false;
+
+   // renaming over a file fails on some systems.
+   if (written)
+   {
+      filestream_delete(path);
+      written = filestream_rename(temp, path) == 0;
+   }
+
+   if (written)
+      cache.disk_writes++;
+   else
+      filestream_delete(temp);
+}
+
+bool image_cache_find(const char *fullpath, unsigned flags, bitmap_t *bmp)
+{
+   image_cache_entry_t *e = lookup(fullpath, flags);
+   int64_t size, mtime;
+
+   if (!file_stamp(fullpath, &size, &mtime))
+   {
+      cache.misses++;
+      return false;
+   }
+
+   // bitmaps still sharing the former pixels keep them.
+   if (e && (e->size != size || e->mtime != mtime))
+   {
+      if (e->refs == 0)
+         drop(e);
+      else
+         unhash(e);
+      e = NULL;
+   }
+
+   if (e)
+   {
+      cache.hits++;
+      if (e->refs++ == 0)
+         unused_unlink(e);
+   }
+   else if (!(e = disk_load(fullpath, flags, size, mtime)))
+   {
+      cache.misses++;
+      return false;
+   }
+
+   share(e, bmp);
+   return true;
+}
+
+void image_cache_add(const char *fullpath, unsigned flags, bitmap_t *bmp)
+{
+   int64_t size, mtime;
+
+   if ((!bmp->data && !bmp->indices) || bmp->shared || bmp->atlas)
+      return;
+
+   // the file may have been decoded twice at once, the first decode staying.
+   if (lookup(fullpath, flags) || !file_stamp(fullpath, &size, &mtime))
+      return;
+
+   bmp->shared = new_entry(fullpath, flags, size, mtime, bmp);
+   disk_store(fullpath, flags, size, mtime, bmp);
+}
+
+void image_cache_release(bitmap_t *bmp)
+{
+   image_cache_entry_t *e = bmp->shared;
+
+   if (!e)
+      return;
+
+   bmp->data    = NULL;
+   bmp->indices = NULL;
+   bmp->palette = NULL;
+   bmp->spans   = NULL;
+   bmp->serial  = 0;
+   bmp->shared  = NULL;
+
+   if (--e->refs > 0)
+      return;
+
+   if (e->stale)
+   {
+      free_entry(e);
+      return;
+   }
+
+   unused_push(e);
+   trim();
+}
+
+void image_cache_detach(bitmap_t *bmp)
+{
+   image_cache_entry_t *e = bmp->shared;
+
+   if (!e)
+      return;
+
+   size_t size = e->bmp.pitch * e->bmp.height;
+   uint32_t *data = NULL, *palette = NULL;
+   uint8_t *indices = NULL;
+
+   if (e->bmp.data)
+   {
+      data = lutro_malloc(size);
+      memcpy(data, e->bmp.data, size);
+   }
+
+   if (e->bmp.indices)
+   {
+      indices = lutro_malloc(size);
+      memcpy(indices, e->bmp.indices, size);
+      palette = lutro_malloc(BITMAP_PALETTE_SIZE * sizeof(uint32_t));
+      memcpy(palette, e->bmp.palette, BITMAP_PALETTE_SIZE * sizeof(uint32_t));
+   }
+
+   image_cache_release(bmp);
+
+   bmp->data    = data;
+   bmp->indices = indices;
+   bmp->palette = palette;
+   bitmap_build_spans(bmp);
+}
+
+void image_cache_purge(void)
+{
+   while (cache.first_unused)
+      drop(cache.first_unused);
+
+   if (cache.count == 0)
+   {
+      lutro_free(cache.buckets);
+      cache.buckets = NULL;
+      cache.nb_buckets = 0;
+   }
+}
+
+void image_cache_set_budget(size_t budget)
+{
+   cache.budget = budget;
+   trim();
+}
+
+bool image_cache_set_directory(const char *directory)
+{
+   lutro_free(cache.directory);
+   cache.directory = NULL;
+
+   if (!directory || (!path_is_directory(directory) && !path_mkdir(directory)))
+      return false;
+
+   size_t length = strlen(directory) + 1;
+   cache.directory = lutro_malloc(length);
+   memcpy(cache.directory, directory, length);
+   return true;
+}
+
+const char *image_cache_get_directory(void)
+{
+   return cache.directory;
+}
+
+void image_cache_get_stats(image_cache_stats_t *stats)
+{
+   stats->hits         = cache.hits;
+   stats->misses       = cache.misses;
+   stats->disk_hits    = cache.disk_hits;
+   stats->disk_writes  = cache.disk_writes;
+   stats->images       = cache.count;
+   stats->unused       = cache.unused;
+   stats->bytes        = cache.bytes;
+   stats->unused_bytes = cache.unused_bytes;
+   stats->budget       = cache.budget;
+}
@@ -0,0 +1,63 @@
+#ifndef IMAGE_CACHE_H
+#define IMAGE_CACHE_H
+
+#include "painter.h"
+
+/* Decoded image cache.
+ *
+ * Bitmaps loaded from the same file with the same IMAGE_* flags share the
+ * pixels decoded the first time, for as long as the size and modification
+ * time of the file stay the same. Each of them references the cached image
+ * through its shared field: the pixels, palette and spans then belong to
+ * the cache, and must be made the bitmap's own before they change, see
+ * image_cache_detach.
+ *
+ * Images no bitmap references any more stay cached while they fit in the
+ * budget, the least recently used going first, or until purged. The cache
+ * is only used from the Lua thread.
+ *
+ * Once given a directory, the cache also writes each image it decodes
+ * there, in the byte order and channel order of the running build, and
+ * later maps that file read-only instead of decoding it again, for as long
+ * as the size and modification time of the source file stay the same.
+ */
+
+typedef struct
+{
+   uint64_t hits, misses;
+   uint64_t disk_hits;  /* found on disk only, neither hits nor misses */
+   uint64_t disk_writes;
+   unsigned images;     /* cached, be they used or not */
+   unsigned unused;     /* referenced by no bitmap */
+   size_t bytes;        /* of the pixels of the cached images */
+   size_t unused_bytes;
+   size_t budget;
+} image_cache_stats_t;
+
+/* has the blank bitmap share the pixels cached for the file, and returns
+ * whether there were any. */
+bool image_cache_find(const char *fullpath, unsigned flags, bitmap_t *bmp);
+
+/* caches the pixels just decoded from the file into bmp, which then shares
+ * them. Failed decodes are not cached. */
+void image_cache_add(const char *fullpath, unsigned flags, bitmap_t *bmp);
+
+/* drops the reference bmp holds, if any, leaving it blank. */
+void image_cache_release(bitmap_t *bmp);
+
+/* gives bmp a copy of the pixels it shares, if any, with spans of its own. */
+void image_cache_detach(bitmap_t *bmp);
+
+/* frees the unused images. */
+void image_cache_purge(void);
+
+/* frees the least recently used unused images until the others fit. */
+void image_cache_set_budget(size_t budget);
+void image_cache_get_stats(image_cache_stats_t *stats);
+
+/* caches images on disk in the directory, created when missing, or no more
+ * with NULL. Returns whether they now are. */
+bool image_cache_set_directory(const char *directory);
+const char *image_cache_get_directory(void);
+
+#endif // IMAGE_CACHE_H
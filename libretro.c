@@ -29,6 +29,9 @@ static retro_input_state_t input_state_cb;
 
 double frame_time = 0;
 
+// the frontend accepts NULL frames, showing the previous one again.
+static bool can_dupe = false;
+
 static void check_variables(void)
 {
    struct retro_variable var = {0};
@@ -43,6 +46,18 @@ static void check_variables(void)
    }
 }
 
+// the pixel format can only be negotiated as the game loads.
+static enum retro_pixel_format pixel_format_option(void)
+{
+   struct retro_variable var = {0};
+
+   var.key = "lutro_pixel_format";
+   if (environ_cb(RETRO_ENVIRONMENT_GET_VARIABLE, &var) && var.value && !strcmp(var.value, "rgb565"))
+      return RETRO_PIXEL_FORMAT_RGB565;
+
+   return RETRO_PIXEL_FORMAT_XRGB8888;
+}
+
 static void emit_audio(void)
 {
    lutro_mixer_render(audio_buffer);
@@ -187,8 +202,35 @@ void retro_run(void)
 
    input_poll_cb();
 
+   // drawing straight into the frontend's framebuffer spares it a copy. It
+   // must read back fast, blending reading what was drawn before, unless
+   // the frame is only packed into it.
+   bool packed = settings.pixel_format == RETRO_PIXEL_FORMAT_RGB565;
+   struct retro_framebuffer fb = { 0 };
+   fb.width  = settings.width;
+   fb.height = settings.height;
+   fb.access_flags = packed ? RETRO_MEMORY_ACCESS_WRITE : RETRO_MEMORY_ACCESS_READ | RETRO_MEMORY_ACCESS_WRITE;
+
+   if (environ_cb(RETRO_ENVIRONMENT_GET_CURRENT_SOFTWARE_FRAMEBUFFER, &fb) && fb.data
+         && fb.format == settings.pixel_format && (packed || (fb.memory_flags & RETRO_MEMORY_TYPE_CACHED))
+         && fb.width == (unsigned)settings.width && fb.height == (unsigned)settings.height
+         && fb.pitch % (packed ? 2 : 4) == 0)
+      lutro_lend_framebuffer(fb.data, fb.pitch);
+
    lutro_run(frame_time);
-   video_cb(settings.framebuffer, settings.width, settings.height, settings.pitch);
+
+   // unchanged frames are not even packed.
+   if (can_dupe && !lutro_frame_changed())
+      video_cb(NULL, settings.width, settings.height, 0);
+   else
+   {
+      size_t pitch;
+      const void *frame = lutro_framebuffer(&pitch);
+      video_cb(frame, settings.width, settings.height, pitch);
+   }
+
+   // the memory is only lent for the frame.
+   lutro_lend_framebuffer(NULL, 0);
    emit_audio();
 }
 
@@ -222,12 +264,22 @@ bool retro_load_game(const struct retro_game_info *info)
    // Apply the initial core option values.
    check_variables();
 
-   enum retro_pixel_format fmt = RETRO_PIXEL_FORMAT_XRGB8888;
-   if (!environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt))
+   enum retro_pixel_format fmt = pixel_format_option();
+   if (fmt == RETRO_PIXEL_FORMAT_RGB565 && !environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt))
+   {
+      log_cb(RETRO_LOG_INFO, "RGB565 is not supported, falling back to XRGB_8888.\n");
+      fmt = RETRO_PIXEL_FORMAT_XRGB8888;
+   }
+
+   if (fmt == RETRO_PIXEL_FORMAT_XRGB8888 && !environ_cb(RETRO_ENVIRONMENT_SET_PIXEL_FORMAT, &fmt))
    {
       log_cb(RETRO_LOG_INFO, "XRGB_8888 is not supported.\n");
       return false;
    }
+   settings.pixel_format = fmt;
+
+   if (!environ_cb(RETRO_ENVIRONMENT_GET_CAN_DUPE, &can_dupe))
+      can_dupe = false;
 
    struct retro_frame_time_callback frame_cb = { frame_time_cb, 1000000 / 60 };
    environ_cb(RETRO_ENVIRONMENT_SET_FRAME_TIME_CALLBACK, &frame_cb);
@@ -42,6 +42,17 @@ struct retro_core_option_definition option_defs_us[] = {
       },
       "mouse"                                     /* default_value */
    },
+   {
+      "lutro_pixel_format",
+      "Pixel Format",
+      "Format of the frames handed to the frontend. 'RGB565' halves the memory they take, for hosts short on bandwidth, at the cost of color depth. Requires a restart.",
+      {
+         { "xrgb8888", "XRGB8888" },
+         { "rgb565",   "RGB565" },
+         { NULL, NULL },
+      },
+      "xrgb8888"
+   },
    { NULL, NULL, NULL, {{0}}, NULL },
 };
 
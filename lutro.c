@@ -59,8 +59,12 @@ lutro_settings_t settings = {
    .height = 240,
    .pitch = 0,
    .framebuffer = NULL,
+   .pixel_format = RETRO_PIXEL_FORMAT_XRGB8888,
    .live_enable = 0,
    .live_call_load = 0,
+   .deferred_draw = 0,
+   .draw_threads = 0,
+   .premultiplied_images = 0,
    .input_cb = NULL,
    .delta = 0,
    .deltaCounter = 0,
@@ -221,12 +225,14 @@ static void init_feature_flags(lua_State *L)
       lua_setfield(L, -2, capname)
 
    #define CAPABILITY(cap) _CAPABILITY(#cap, cap)
+   #define CAPABILITY_AS(capname, cap) _CAPABILITY(capname, cap)
 
    CAPABILITY(HAVE_COMPOSITION);
    CAPABILITY(HAVE_TRANSFORM);
    CAPABILITY(HAVE_INOTIFY);
    CAPABILITY(HAVE_JIT);
    CAPABILITY(HAVE_LUASOCKET);
+   CAPABILITY_AS("HAVE_THREADS", LUTRO_HAVE_THREADS);
 
    // for unit testing purposes only.
    #define _VERIFY_AS_TRUE  1
@@ -239,6 +245,7 @@ static void init_feature_flags(lua_State *L)
 
    #undef STR
    #undef CAPABILITY
+   #undef CAPABILITY_AS
 
    lua_setfield(L, -2, "featureflags");
    lua_pop(L, 1);
@@ -373,6 +380,9 @@ void lutro_deinit(void)
    lua_gc(L, LUA_GCSTEP, 0);
    lua_close(L);
 
+   lutro_graphics_deinit();
+   lutro_image_deinit();
+
    lutro_audio_deinit();
    lutro_filesystem_deinit();
 
@@ -579,13 +589,19 @@ int lutro_load(const char *path)
       lua_getfield(L, -2, "height");
       lua_getfield(L, -3, "live_enable");
       lua_getfield(L, -4, "live_call_load");
-
-      settings.width          = lua_tointeger(L, -4);
-      settings.height         = lua_tointeger(L, -3);
-      settings.live_enable    = lua_toboolean(L, -2);
-      settings.live_call_load = lua_toboolean(L, -1);
-
-      lua_pop(L, 4);
+      lua_getfield(L, -5, "deferred_draw");
+      lua_getfield(L, -6, "draw_threads");
+      lua_getfield(L, -7, "premultiplied_images");
+
+      settings.width          = lua_tointeger(L, -7);
+      settings.height         = lua_tointeger(L, -6);
+      settings.live_enable    = lua_toboolean(L, -5);
+      settings.live_call_load = lua_toboolean(L, -4);
+      settings.deferred_draw  = lua_toboolean(L, -3);
+      settings.draw_threads   = lua_tointeger(L, -2);
+      settings.premultiplied_images = lua_toboolean(L, -1);
+
+      lua_pop(L, 7);
       player_checked_stack_end(L, 0);
    }
 
@@ -704,6 +720,21 @@ void lutro_run(double delta)
    lua_gc(L, LUA_GCSTEP, 0);
 }
 
+bool lutro_frame_changed(void)
+{
+   return lutro_graphics_frame_changed(L);
+}
+
+void lutro_lend_framebuffer(void *data, size_t pitch)
+{
+   lutro_graphics_lend_framebuffer(data, pitch);
+}
+
+const void *lutro_framebuffer(size_t *pitch)
+{
+   return lutro_graphics_framebuffer(pitch);
+}
+
 void lutro_reset(void)
 {
    player_checked_stack_begin(L);
@@ -21,10 +21,14 @@ typedef struct lutro_settings_t {
    int height;
    int pitch;
    int pitch_pixels; // pitch in pixels to avoid recalculating it all the time
-   uint32_t *framebuffer;
+   uint32_t *framebuffer; // 32 bits pixels whatever the pixel format
+   enum retro_pixel_format pixel_format; // of the frames handed to the frontend
    retro_input_state_t input_cb;
    int live_enable;
    int live_call_load;
+   int deferred_draw;  // record draw calls and rasterize them at the end of the frame
+   int draw_threads;   // threads rasterizing deferred frames, 0 for one per core
+   int premultiplied_images; // decode images premultiplied by default
    char gamedir[PATH_MAX_LENGTH];
    char identity[PATH_MAX_LENGTH];
    double delta;
@@ -42,6 +46,9 @@ void lutro_deinit(void);
 
 int lutro_load(const char *path);
 void lutro_run(double delta);
+bool lutro_frame_changed(void);
+void lutro_lend_framebuffer(void *data, size_t pitch);
+const void *lutro_framebuffer(size_t *pitch);
 void lutro_reset(void);
 size_t lutro_serialize_size(void);
 bool lutro_serialize(void *data_, size_t size);
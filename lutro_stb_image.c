@@ -1,5 +1,7 @@
 #include <stdint.h>
+#include <string.h>
 #include "lutro_stb_image.h"
+#include "painter_blend.h"
 #include "streams/file_stream.h"
 
 #define STB_IMAGE_IMPLEMENTATION
@@ -12,11 +14,12 @@
 #include "stb/stb_image.h"
 
 /**
- * Load the given image into the data buffer.
+ * Load the given image into the data buffer, with its colors multiplied by
+ * their alpha when premultiply is set.
  *
  * @return 1 on success, 0 on error.
  */
-int lutro_stb_image_load(const char* filename, uint32_t** data, unsigned int* width, unsigned int* height) {
+int lutro_stb_image_load(const char* filename, uint32_t** data, unsigned int* width, unsigned int* height, bool premultiply) {
    void* buf;
    int64_t len;
    int x, y, channels_in_file;
@@ -42,23 +45,124 @@ int lutro_stb_image_load(const char* filename, uint32_t** data, unsigned int* wi
       return 0;
    }
 
-   // Flip the bits to have them in the format Lutro uses.
-   {
-      int rValue = 0;
-      int bValue = 2;
-      for (int xIndex = 0; xIndex < x; xIndex++) {
-         for (int yIndex = 0; yIndex < y; yIndex++) {
-            int index = xIndex + x * yIndex;
-            stbi_uc tmp;
-            tmp = output[index * channels + rValue];
-            output[index * channels + rValue] = output[index * channels + bValue];
-            output[index * channels + bValue] = tmp;
-         }
-      }
-   }
+   // Turn the RGBA bytes into the pixels Lutro uses, a row at a time for
+   // the pass to stream through memory once.
+   for (int row = 0; row < y; row++)
+      pntr_unpack_rgba((uint32_t*)output + (size_t)row * x, x, premultiply);
 
    // Return the output as a success.
    *data = (uint32_t*)output;
 
    return 1;
 }
+
+/**
+ * Read the palette of a palette PNG, alpha coming from its tRNS chunk.
+ *
+ * @return the number of colors, 0 if the image has no palette.
+ */
+static int png_palette(const stbi_uc* buf, int64_t len, uint32_t* palette) {
+   static const stbi_uc signature[8] = { 137, 80, 78, 71, 13, 10, 26, 10 };
+   int64_t pos = 8;
+   int size = 0;
+
+   if (len < 8 || memcmp(buf, signature, 8) != 0)
+      return 0;
+
+   // the palette chunks come before the image data.
+   while (pos + 12 <= len) {
+      const stbi_uc* chunk = buf + pos;
+      uint32_t length = ((uint32_t)chunk[0] << 24) | (chunk[1] << 16) | (chunk[2] << 8) | chunk[3];
+      const stbi_uc* data = chunk + 8;
+
+      if (length > len - pos - 12 || memcmp(chunk + 4, "IDAT", 4) == 0)
+         break;
+
+      if (memcmp(chunk + 4, "IHDR", 4) == 0) {
+         // color type 3 is indexed
+         if (length < 13 || data[9] != 3)
+            return 0;
+      }
+      else if (memcmp(chunk + 4, "PLTE", 4) == 0) {
+         size = length / 3 > 256 ? 256 : length / 3;
+         for (int i = 0; i < size; i++)
+            palette[i] = 0xff000000 | (data[3 * i] << 16) | (data[3 * i + 1] << 8) | data[3 * i + 2];
+      }
+      else if (memcmp(chunk + 4, "tRNS", 4) == 0) {
+         for (int i = 0; i < size && i < (int)length; i++)
+            palette[i] = (palette[i] & 0x00ffffff) | ((uint32_t)data[i] << 24);
+      }
+
+      pos += 12 + length;
+   }
+
+   return size;
+}
+
+/**
+ * Load the given palette PNG as 8 bits indices in its palette, the colors of
+ * which are multiplied by their alpha when premultiply is set. Colors found
+ * more than once in the palette are all drawn with their first index.
+ *
+ * @return 1 on success, 0 on error or when the image has no palette.
+ */
+int lutro_stb_image_load_indexed(const char* filename, uint8_t** indices, uint32_t** palette, unsigned int* width, unsigned int* height, bool premultiply) {
+   void* buf;
+   int64_t len;
+   int x, y, channels_in_file;
+   uint32_t colors[256];
+   // palette colors hashed to their index plus one, 0 when free.
+   uint16_t slots[512] = { 0 };
+
+   *indices = NULL;
+   *palette = NULL;
+
+   if (filestream_read_file(filename, &buf, &len) <= 0) {
+      fprintf(stderr, "failed to read file %s\n", filename);
+      return 0;
+   }
+
+   int size = png_palette((const stbi_uc*)buf, len, colors);
+   stbi_uc* output = size ? stbi_load_from_memory((stbi_uc const*)buf, (int)len, &x, &y, &channels_in_file, 4) : NULL;
+   free(buf); // Allocated in libretro:filestream_read_file, don't trace it on ludo
+
+   if (output == NULL)
+      return 0;
+
+   for (int i = 0; i < size; i++) {
+      unsigned slot = (colors[i] * 2654435761u) >> 23;
+      while (slots[slot] && colors[slots[slot] - 1] != colors[i])
+         slot = (slot + 1) % 512;
+      if (!slots[slot])
+         slots[slot] = i + 1;
+   }
+
+   uint8_t* out = lutro_malloc((size_t)x * y);
+   for (int i = 0; i < x * y; i++) {
+      const stbi_uc* px = output + i * 4;
+      uint32_t color = ((uint32_t)px[3] << 24) | (px[0] << 16) | (px[1] << 8) | px[2];
+      unsigned slot = (color * 2654435761u) >> 23;
+
+      while (slots[slot] && colors[slots[slot] - 1] != color)
+         slot = (slot + 1) % 512;
+
+      if (!slots[slot]) {
+         // not a color of the palette after all, which stb should not do.
+         lutro_free(out);
+         stbi_image_free(output);
+         return 0;
+      }
+      out[i] = slots[slot] - 1;
+   }
+   stbi_image_free(output);
+
+   *palette = lutro_calloc(256, sizeof(uint32_t));
+   for (int i = 0; i < size; i++)
+      (*palette)[i] = premultiply ? pntr_premultiply(colors[i]) : colors[i];
+
+   *indices = out;
+   *width = x;
+   *height = y;
+
+   return 1;
+}
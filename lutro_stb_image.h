@@ -2,7 +2,11 @@
 #define LUTRO_STB_IMAGE
 
 #include <stdint.h>
+#include <boolean.h>
 
-int lutro_stb_image_load(const char* filename, uint32_t** data, unsigned int* width, unsigned int* height);
+int lutro_stb_image_load(const char* filename, uint32_t** data, unsigned int* width, unsigned int* height, bool premultiply);
+
+/* keeps palette PNGs indexed, returning 0 for the other images. */
+int lutro_stb_image_load_indexed(const char* filename, uint8_t** indices, uint32_t** palette, unsigned int* width, unsigned int* height, bool premultiply);
 
 #endif
@@ -0,0 +1,334 @@
+#include <stdint.h>
+#include <string.h>
+#include <retro_miscellaneous.h>
+#include <features/features_cpu.h>
+
+#ifdef LUTRO_HAVE_THREADS
+#include <pthread.h>
+#endif
+
+#include "lutro.h"
+#include "lutro_workers.h"
+
+#define MAX_WORKERS 32
+
+enum
+{
+   TASK_QUEUED,
+   TASK_RUNNING,
+   TASK_DONE
+};
+
+struct lutro_task_s
+{
+   lutro_work_fn fn;
+   void *data;
+   int state;          // protected by lock while the pool is started
+   lutro_task_t *next; // in the queue
+};
+
+static struct
+{
+   unsigned count;
+#ifdef LUTRO_HAVE_THREADS
+   // threads started, caller included: the one past count, if any, only
+   // runs background tasks.
+   unsigned spawned;
+   bool started;
+   pthread_t threads[MAX_WORKERS];
+   pthread_mutex_t lock;
+   pthread_cond_t wake;
+   pthread_cond_t done;
+   pthread_cond_t task_done;
+
+   // current job, protected by lock.
+   lutro_work_fn fn;
+   void *data;
+   unsigned next;
+   unsigned total;
+   unsigned pending;
+   bool quit;
+#endif
+
+   // background tasks no worker has started yet, kept across restarts.
+   lutro_task_t *first_task, *last_task;
+} pool = { .count = 1 };
+
+static bool has_threads(void)
+{
+#ifdef LUTRO_HAVE_THREADS
+   return pool.started && pool.spawned > 1;
+#else
+   return false;
+#endif
+}
+
+static void lock_pool(void)
+{
+#ifdef LUTRO_HAVE_THREADS
+   if (pool.started)
+      pthread_mutex_lock(&pool.lock);
+#endif
+}
+
+static void unlock_pool(void)
+{
+#ifdef LUTRO_HAVE_THREADS
+   if (pool.started)
+      pthread_mutex_unlock(&pool.lock);
+#endif
+}
+
+// takes a queued task off the queue. called with the lock held.
+static void unlink_task(lutro_task_t *task)
+{
+   lutro_task_t **link = &pool.first_task;
+   lutro_task_t *prev = NULL;
+
+   while (*link != task)
+   {
+      prev = *link;
+      link = &prev->next;
+   }
+
+   *link = task->next;
+   if (pool.last_task == task)
+      pool.last_task = prev;
+   task->next = NULL;
+}
+
+// runs a task taken off the queue. called with the lock held.
+static void run_task(lutro_task_t *task)
+{
+   task->state = TASK_RUNNING;
+   unlock_pool();
+   task->fn(task->data, 0);
+   lock_pool();
+   task->state = TASK_DONE;
+
+#ifdef LUTRO_HAVE_THREADS
+   if (pool.started)
+      pthread_cond_broadcast(&pool.task_done);
+#endif
+}
+
+#ifdef LUTRO_HAVE_THREADS
+// runs items of the current job until none is left. called with the lock held.
+static void run_items(void)
+{
+   while (pool.next < pool.total)
+   {
+      unsigned index = pool.next++;
+      lutro_work_fn fn = pool.fn;
+      void *data = pool.data;
+
+      pthread_mutex_unlock(&pool.lock);
+      fn(data, index);
+      pthread_mutex_lock(&pool.lock);
+
+      if (--pool.pending == 0)
+         pthread_cond_signal(&pool.done);
+   }
+}
+
+static void *worker_main(void *arg)
+{
+   unsigned index = (unsigned)(uintptr_t)arg;
+
+   pthread_mutex_lock(&pool.lock);
+   while (!pool.quit)
+   {
+      if (pool.next < pool.total && index < pool.count)
+         run_items();
+      else if (pool.first_task)
+      {
+         lutro_task_t *task = pool.first_task;
+         unlink_task(task);
+         run_task(task);
+      }
+      else
+         pthread_cond_wait(&pool.wake, &pool.lock);
+   }
+   pthread_mutex_unlock(&pool.lock);
+
+   return NULL;
+}
+#endif
+
+void lutro_workers_init(unsigned count)
+{
+   lutro_workers_deinit();
+
+   if (count == 0)
+      count = cpu_features_get_core_amount();
+
+   pool.count = MAX(1, MIN(count, MAX_WORKERS));
+
+#ifdef LUTRO_HAVE_THREADS
+   pthread_mutex_init(&pool.lock, NULL);
+   pthread_cond_init(&pool.wake, NULL);
+   pthread_cond_init(&pool.done, NULL);
+   pthread_cond_init(&pool.task_done, NULL);
+   pool.next = pool.total = pool.pending = 0;
+   pool.quit = false;
+   pool.started = true;
+
+   for (pool.spawned = 1; pool.spawned < pool.count; ++pool.spawned)
+   {
+      if (pthread_create(&pool.threads[pool.spawned], NULL, worker_main, (void*)(uintptr_t)pool.spawned) != 0)
+      {
+         pool.count = pool.spawned;
+         break;
+      }
+   }
+#else
+   pool.count = 1;
+#endif
+}
+
+void lutro_workers_deinit(void)
+{
+#ifdef LUTRO_HAVE_THREADS
+   if (!pool.started)
+      return;
+
+   if (pool.spawned > 1)
+   {
+      pthread_mutex_lock(&pool.lock);
+      pool.quit = true;
+      pthread_cond_broadcast(&pool.wake);
+      pthread_mutex_unlock(&pool.lock);
+
+      for (unsigned i = 1; i < pool.spawned; ++i)
+         pthread_join(pool.threads[i], NULL);
+   }
+
+   pthread_cond_destroy(&pool.task_done);
+   pthread_cond_destroy(&pool.done);
+   pthread_cond_destroy(&pool.wake);
+   pthread_mutex_destroy(&pool.lock);
+   pool.started = false;
+   pool.count = pool.spawned = 1;
+#endif
+}
+
+unsigned lutro_workers_count(void)
+{
+   return pool.count;
+}
+
+void lutro_workers_run(lutro_work_fn fn, void *data, unsigned total)
+{
+#ifdef LUTRO_HAVE_THREADS
+   if (pool.count > 1 && total > 1)
+   {
+      pthread_mutex_lock(&pool.lock);
+      pool.fn      = fn;
+      pool.data    = data;
+      pool.next    = 0;
+      pool.total   = total;
+      pool.pending = total;
+      pthread_cond_broadcast(&pool.wake);
+
+      run_items();
+      while (pool.pending > 0)
+         pthread_cond_wait(&pool.done, &pool.lock);
+
+      pool.next = pool.total = 0;
+      pthread_mutex_unlock(&pool.lock);
+      return;
+   }
+#endif
+
+   for (unsigned i = 0; i < total; ++i)
+      fn(data, i);
+}
+
+lutro_task_t *lutro_workers_post(lutro_work_fn fn, void *data)
+{
+   lutro_task_t *task = lutro_calloc(1, sizeof(lutro_task_t));
+   task->fn   = fn;
+   task->data = data;
+
+#ifdef LUTRO_HAVE_THREADS
+   // one thread at least, even on a single core, leaves the caller free.
+   if (!pool.started)
+      lutro_workers_init(MAX(2, cpu_features_get_core_amount()));
+
+   // a pool started for drawing alone gets a thread of its own for tasks,
+   // which stays out of lutro_workers_run.
+   if (pool.spawned == 1 && pthread_create(&pool.threads[1], NULL, worker_main, (void*)(uintptr_t)1) == 0)
+      pool.spawned = 2;
+#endif
+
+   if (!has_threads())
+   {
+      fn(data, 0);
+      task->state = TASK_DONE;
+      return task;
+   }
+
+#ifdef LUTRO_HAVE_THREADS
+   pthread_mutex_lock(&pool.lock);
+   task->state = TASK_QUEUED;
+   if (pool.last_task)
+      pool.last_task->next = task;
+   else
+      pool.first_task = task;
+   pool.last_task = task;
+   pthread_cond_signal(&pool.wake);
+   pthread_mutex_unlock(&pool.lock);
+#endif
+
+   return task;
+}
+
+bool lutro_workers_done(lutro_task_t *task)
+{
+   // the tasks queued before the threads stopped have nothing else to run them.
+   if (!has_threads())
+      lutro_workers_wait(task);
+
+   lock_pool();
+   bool done = task->state == TASK_DONE;
+   unlock_pool();
+
+   return done;
+}
+
+void lutro_workers_wait(lutro_task_t *task)
+{
+   lock_pool();
+
+   if (task->state == TASK_QUEUED)
+   {
+      unlink_task(task);
+      run_task(task);
+   }
+
+#ifdef LUTRO_HAVE_THREADS
+   while (task->state != TASK_DONE)
+      pthread_cond_wait(&pool.task_done, &pool.lock);
+#endif
+
+   unlock_pool();
+}
+
+void lutro_workers_release(lutro_task_t *task)
+{
+   if (!task)
+      return;
+
+   lock_pool();
+
+   if (task->state == TASK_QUEUED)
+      unlink_task(task);
+
+#ifdef LUTRO_HAVE_THREADS
+   while (task->state == TASK_RUNNING)
+      pthread_cond_wait(&pool.task_done, &pool.lock);
+#endif
+
+   unlock_pool();
+   lutro_free(task);
+}
@@ -0,0 +1,46 @@
+#ifndef LUTRO_WORKERS_H
+#define LUTRO_WORKERS_H
+
+#include <stdbool.h>
+
+/* Small pool of worker threads used to split CPU heavy work (rasterization)
+ * across cores. Without LUTRO_HAVE_THREADS every job simply runs on the calling
+ * thread, so callers never need a separate code path. */
+
+typedef void (*lutro_work_fn)(void *data, unsigned index);
+
+/* starts count - 1 threads, the calling thread being the last worker.
+ * count 0 picks the number of CPU cores. */
+void lutro_workers_init(unsigned count);
+void lutro_workers_deinit(void);
+
+/* number of threads taking part in lutro_workers_run, caller included. */
+unsigned lutro_workers_count(void);
+
+/* calls fn(data, i) for every i in [0, total), in no particular order nor
+ * thread, and returns once all of them are done. */
+void lutro_workers_run(lutro_work_fn fn, void *data, unsigned total);
+
+/* Background tasks, for work spanning frames (image decoding).
+ *
+ * A task is one call to fn(data, 0) that worker threads pick up whenever
+ * no lutro_workers_run job is pending, in the order they were posted. The
+ * pool is started on the first post, and keeps one thread at least for
+ * tasks whatever the number taking part in lutro_workers_run. Without
+ * worker threads, a task runs in lutro_workers_post itself. */
+typedef struct lutro_task_s lutro_task_t;
+
+lutro_task_t *lutro_workers_post(lutro_work_fn fn, void *data);
+
+/* whether the task has run, which never blocks. */
+bool lutro_workers_done(lutro_task_t *task);
+
+/* returns once the task has run, running it on the calling thread when no
+ * worker has started it yet. */
+void lutro_workers_wait(lutro_task_t *task);
+
+/* frees the task, cancelling it when it has not started, or waiting for it
+ * when it has. */
+void lutro_workers_release(lutro_task_t *task);
+
+#endif // LUTRO_WORKERS_H
@@ -9,6 +9,10 @@
 
 #include "lutro.h"
 #include "painter.h"
+#include "painter_blend.h"
+#include "painter_queue.h"
+#include "painter_dirty.h"
+#include "painter_cache.h"
 #include "image.h"
 #include "lutro_stb_image.h"
 
@@ -17,27 +21,70 @@
 #define _USE_MATH_DEFINES
 #include <math.h>
 
-#ifdef HAVE_COMPOSITION
-/* from http://www.codeguru.com/cpp/cpp/algorithms/general/article.php/c15989/Tip-An-Optimized-Formula-for-Alpha-Blending-Pixels.htm */
-#define COMPOSE_FAST(S, D, A) (((S * A) + (D * (256U - A))) >> 8U)
-#define DISASSEMBLE_RGB(COLOR, R, G, B) \
-   R = ((COLOR & RED_MASK) >> RED_SHIFT);\
-   G = ((COLOR & GREEN_MASK) >> GREEN_SHIFT);\
-   B = ((COLOR & BLUE_MASK) >> BLUE_SHIFT);
+// source pixels gathered per chunk when a blit cannot read its source row directly.
+#define PNTR_SPAN_CHUNK 256
+
+#ifdef HAVE_TRANSFORM
+// scaled and rotated blits step through the source in 16.16 fixed-point.
+static const uint32_t k_binexp = 16;
+static const uint32_t k_binexp_center = 1 << 15;
 #endif
 
-static int strpos(const uint32_t *haystack, uint32_t needle)
+static unsigned glyph_slot(uint32_t c)
+{
+   return (c * 2654435761u) >> (32 - FONT_GLYPH_BITS);
+}
+
+// index of codepoint c in font->characters, -1 when the font lacks it.
+static int font_glyph(const font_t *font, uint32_t c)
 {
-   // Note on performance a hash table would be much faster here
-   for (int i = 0; i < MAX_FONT_CHAR; i++) {
-      if (haystack[i] == 0)
-         break;
-      if (haystack[i] == needle)
-         return i;
+   for (unsigned slot = glyph_slot(c); font->glyph_index[slot]; slot = (slot + 1) % FONT_GLYPH_SLOTS)
+   {
+      int pos = font->glyph_index[slot] - 1;
+      if (font->characters[pos] == c)
+         return pos;
    }
+
    return -1;
 }
 
+// fills the glyph index, the first occurrence of a character winning.
+static void font_build_index(font_t *font)
+{
+   memset(font->glyph_index, 0, sizeof(font->glyph_index));
+
+   for (int i = 0; i < MAX_FONT_CHAR && font->characters[i]; i++)
+   {
+      uint32_t c = font->characters[i];
+      unsigned slot = glyph_slot(c);
+
+      if (font_glyph(font, c) >= 0)
+         continue;
+
+      while (font->glyph_index[slot])
+         slot = (slot + 1) % FONT_GLYPH_SLOTS;
+      font->glyph_index[slot] = i + 1;
+   }
+}
+
+// utf8_walk, minding sequences cut short by the end of the string.
+static uint32_t walk_codepoint(const char **text)
+{
+   const uint8_t first = **text;
+   int len = first < 0x80 ? 1 : first < 0xE0 ? 2 : first < 0xF0 ? 3 : 4;
+
+   for (int i = 1; i < len; i++)
+   {
+      if ((*text)[i] == '\0')
+      {
+         *text += i;
+         return 0xFFFD;
+      }
+   }
+
+   return utf8_walk(text);
+}
+
 void pntr_reset(painter_t *p)
 {
    p->background = 0xff000000;
@@ -48,39 +95,63 @@ void pntr_reset(painter_t *p)
    p->clip.width  = p->target->width;
    p->clip.height = p->target->height;
 
+   p->line_width = 1;
+   p->line_style = PNTR_LINE_SMOOTH;
+   p->fill_rule  = PNTR_FILL_NONZERO;
+   p->blend_mode = PNTR_BLEND_ALPHA;
+
    pntr_origin(p, true);
 }
 
 
+// narrows the pixels a primitive may touch to the target, and to the clip
+// when the primitive honours it, then reports them to the dirty tracker.
+static rect_t touch(painter_t *p, rect_t bounds, bool clipped)
+{
+   rect_t target_rect = { 0, 0, p->target->width, p->target->height };
+
+   bounds = rect_intersect(&bounds, &target_rect);
+   if (clipped)
+      bounds = rect_intersect(&bounds, &p->clip);
+
+   if (p->dirty && !rect_is_null(&bounds))
+      pntr_dirty_add(p, &bounds);
+
+   return bounds;
+}
+
 void pntr_clear(painter_t *p)
 {
    if (!p->target->data)
       return;
 
-   uint32_t color  = p->background;
-
-   if (p->clip.x == 0 && p->clip.width == p->target->width
-      && p->clip.y == 0 && p->clip.height == p->target->height)
+   if (p->queue || p->dirty)
    {
-      // this loop might be optimized by the compiler in comparison with
-      // the alternative loop below.
-      uint32_t *begin = p->target->data;
-      uint32_t *end   = p->target->data + p->target->height * (p->target->pitch >> 2);
-      while (begin < end)
+      rect_t bounds = touch(p, p->clip, true);
+
+      if (p->queue)
       {
-         *begin++ = color;
+         if (!rect_is_null(&bounds))
+            pntr_queue_clear(p, &bounds);
+         return;
       }
    }
-   else
+
+   size_t row_size = p->target->pitch >> 2;
+   uint32_t color  = p->background;
+   rect_t target_rect = {
+      0, 0, p->target->width, p->target->height
+   };
+   rect_t drect = rect_intersect(&p->clip, &target_rect);
+
+   if (rect_is_null(&drect))
+      return;
+
+   uint32_t *row = p->target->data + drect.y * row_size + drect.x;
+   for (int y = 0; y < drect.height; ++y, row += row_size)
    {
-      // less efficient loop than above, but can handle clipping rect.
-      for (uint32_t x = MAX(0, p->clip.x); x < MIN(p->clip.x + p->clip.width, p->target->width); ++x)
-      {
-         for (uint32_t y = MAX(0, p->clip.y); y < MAX(p->clip.y + p->clip.height, y < p->target->height); ++y)
-         {
-            p->target->data[x + y * (p->target->pitch >> 2)] = color;
-         }
-      }
+      for (int x = 0; x < drect.width; ++x)
+         row[x] = color;
    }
 }
 
@@ -95,41 +166,259 @@ void pntr_sanitize_clip(painter_t *p)
    p->clip = rect_intersect(&p->clip,  &target_rect);
 }
 
-void pntr_strike_line(painter_t *p, int x1, int y1, int x2, int y2)
+void pntr_plot(painter_t *p, int x, int y)
 {
    if (!p->target->data)
       return;
 
+   if (x < 0 || y < 0 || x >= p->target->width || y >= p->target->height)
+      return;
+
+   if (p->queue || p->dirty)
+   {
+      rect_t bounds = touch(p, (rect_t){ x, y, 1, 1 }, false);
+
+      if (p->queue)
+      {
+         pntr_queue_plot(p, &bounds, x, y);
+         return;
+      }
+   }
+
+   p->target->data[y * (p->target->pitch >> 2) + x] = p->foreground;
+}
+
+// whether drawing with color leaves the target untouched.
+static inline bool invisible(const pntr_blend_kernels_t *blend, uint32_t color)
+{
+   return (color & 0xff000000) == 0 && blend->skip_transparent;
+}
+
+static void fill_span(const pntr_blend_kernels_t *blend, uint32_t *dst, uint32_t color, int count)
+{
+   if ((color & 0xff000000) != 0xff000000 || !blend->copy_opaque)
+   {
+      blend->fill(dst, color, count);
+      return;
+   }
+
+   for (int i = 0; i < count; ++i)
+      dst[i] = color;
+}
+
+static inline int64_t div_floor(int64_t a, int64_t b)
+{
+   int64_t q = a / b;
+   return (a % b != 0 && (a < 0) != (b < 0)) ? q - 1 : q;
+}
+
+// narrows the steps [*first, *last] of a bresenham line to those whose minor
+// coordinate start + dir * k(i) lies in [lo, hi], k being the minor offset at
+// step i as stepped by strike_thin_line.
+static void clip_minor(int64_t *first, int64_t *last, int64_t n, int64_t m, int64_t e0,
+      int start, int dir, int lo, int hi)
+{
+   int64_t kmin = dir > 0 ? lo - start : start - hi;
+   int64_t kmax = dir > 0 ? hi - start : start - lo;
+
+   if (m == 0)
+   {
+      if (kmin > 0 || kmax < 0)
+         *last = *first - 1;
+      return;
+   }
+
+   // k(i) = floor((i * m - e0 + n - 1) / n) is non-decreasing.
+   *first = MAX(*first, -div_floor(-(kmin * n + e0 - n + 1), m));
+   *last  = MIN(*last, div_floor((kmax + 1) * n + e0 - n, m));
+}
+
+// one pixel wide line. Clipping only skips steps, so the pixels drawn are
+// the same whatever the clip.
+static void strike_thin_line(painter_t *p, const pntr_blend_kernels_t *blend, int x1, int y1, int x2, int y2)
+{
+   const rect_t *clip = &p->clip;
+   int dx = abs(x2 - x1), sx = x1 < x2 ? 1 : -1;
+   int dy = abs(y2 - y1), sy = y1 < y2 ? 1 : -1;
+   bool x_major = dx > dy;
+
+   // steps along the major axis, the error term deciding the minor ones.
+   int64_t n  = x_major ? dx : dy;
+   int64_t m  = x_major ? dy : dx;
+   int64_t e0 = n / 2;
+   int64_t first = 0, last = n;
+
+   if (x_major)
+   {
+      clip_minor(&first, &last, n, n, 0, x1, sx, clip->x, clip->x + clip->width - 1);
+      clip_minor(&first, &last, n, m, e0, y1, sy, clip->y, clip->y + clip->height - 1);
+   }
+   else
+   {
+      clip_minor(&first, &last, n, n, 0, y1, sy, clip->y, clip->y + clip->height - 1);
+      clip_minor(&first, &last, n, m, e0, x1, sx, clip->x, clip->x + clip->width - 1);
+   }
+
+   if (first > last)
+      return;
+
+   // the major offset is the step itself, see clip_minor for the minor one.
+   int64_t k   = n > 0 ? div_floor(first * m - e0 + n - 1, n) : 0;
+   int64_t err = e0 - first * m + k * n;
+   int x = x1 + (int)(x_major ? first : k) * sx;
+   int y = y1 + (int)(x_major ? k : first) * sy;
+
+   ptrdiff_t row_size = p->target->pitch >> 2;
+   ptrdiff_t major = x_major ? sx : sy * row_size;
+   ptrdiff_t minor = x_major ? sy * row_size : sx;
+   uint32_t *dst = p->target->data + y * row_size + x;
+   uint32_t color = p->foreground;
+
+   for (int64_t i = first; i <= last; ++i, dst += major)
+   {
+      fill_span(blend, dst, color, 1);
+
+      if (err < m)
+      {
+         err += n;
+         dst += minor;
+      }
+      err -= m;
+   }
+}
+
+// lines wider than a pixel cover the pixels whose center lies in the
+// rectangle of the segment widened by half the width on each side.
+static void strike_wide_line(painter_t *p, const pntr_blend_kernels_t *blend, int x1, int y1, int x2, int y2, const rect_t *bounds)
+{
+   // the same whichever end comes first.
+   if (x2 < x1 || (x2 == x1 && y2 < y1))
+   {
+      int t;
+      t = x1; x1 = x2; x2 = t;
+      t = y1; y1 = y2; y2 = t;
+   }
+
+   // everything is relative to the first end, which keeps the result the same
+   // under integer translation.
+   double ux = x2 - x1, uy = y2 - y1;
+   double len2 = ux * ux + uy * uy;
+   double half = p->line_width * sqrt(len2) / 2;
+
+   if (len2 == 0)
+      return;
+
+   ptrdiff_t row_size = p->target->pitch >> 2;
+   uint32_t *row = p->target->data + bounds->y * row_size;
    uint32_t color = p->foreground;
-   if ((color & 0xff000000) == 0)
+
+   for (int y = bounds->y; y < bounds->y + bounds->height; ++y, row += row_size)
+   {
+      double py = y - y1;
+      double lo = bounds->x - x1, hi = bounds->x + bounds->width - 1 - x1;
+
+      // along the segment: 0 <= px * ux + py * uy <= len2
+      double a0 = -py * uy, a1 = len2 - py * uy;
+      if (ux > 0)
+      {
+         lo = MAX(lo, ceil(a0 / ux));
+         hi = MIN(hi, floor(a1 / ux));
+      }
+      else if (ux < 0)
+      {
+         lo = MAX(lo, ceil(a1 / ux));
+         hi = MIN(hi, floor(a0 / ux));
+      }
+      else if (a0 > 0 || a1 < 0)
+         continue;
+
+      // across it: -half < px * uy - py * ux <= half
+      double c0 = py * ux - half, c1 = py * ux + half;
+      if (uy > 0)
+      {
+         lo = MAX(lo, floor(c0 / uy) + 1);
+         hi = MIN(hi, floor(c1 / uy));
+      }
+      else if (uy < 0)
+      {
+         lo = MAX(lo, ceil(c1 / uy));
+         hi = MIN(hi, ceil(c0 / uy) - 1);
+      }
+      else if (c0 >= 0 || c1 < 0)
+         continue;
+
+      if (lo <= hi)
+         fill_span(blend, row + x1 + (int)lo, color, (int)(hi - lo) + 1);
+   }
+}
+
+void pntr_strike_line(painter_t *p, int x1, int y1, int x2, int y2)
+{
+   if (!p->target->data)
+      return;
+
+   const pntr_blend_kernels_t *blend = pntr_blend_kernels(p->blend_mode);
+   if (invisible(blend, p->foreground))
       return;
 
-   int dx = abs(x2-x1), sx = x1<x2 ? 1 : -1;
-   int dy = abs(y2-y1), sy = y1<y2 ? 1 : -1;
-   int err = (dx>dy ? dx : -dy)/2, e2;
+   x1 += p->trans->tx;
+   y1 += p->trans->ty;
+   x2 += p->trans->tx;
+   y2 += p->trans->ty;
+
+   int margin = p->line_width > 1 ? (int)ceilf(p->line_width / 2) : 0;
+   rect_t bounds = {
+      MIN(x1, x2) - margin, MIN(y1, y2) - margin,
+      abs(x2 - x1) + 1 + 2 * margin, abs(y2 - y1) + 1 + 2 * margin
+   };
+   bounds = touch(p, bounds, true);
+
+   if (rect_is_null(&bounds))
+      return;
 
-   for (;;) {
-      if (y1 >= 0 && y1 < p->target->height)
-         if (x1 >= 0 && x1 < p->target->width)
-            p->target->data[y1 * (p->target->pitch >> 2) + x1] = color;
-      if (x1==x2 && y1==y2) break;
-      e2 = err;
-      if (e2 >-dx) { err -= dy; x1 += sx; }
-      if (e2 < dy) { err += dx; y1 += sy; }
+   if (p->queue)
+   {
+      pntr_queue_strike_line(p, &bounds, x1 - p->trans->tx, y1 - p->trans->ty,
+            x2 - p->trans->tx, y2 - p->trans->ty);
+      return;
    }
+
+   if (p->line_width > 1)
+      strike_wide_line(p, blend, x1, y1, x2, y2, &bounds);
+   else
+      strike_thin_line(p, blend, x1, y1, x2, y2);
 }
 
+// drawn as bands of the outline centered on the rectangle edges, so that
+// corners are square and no pixel is blended twice.
 void pntr_strike_rect(painter_t *p, const rect_t *rect)
 {
-   int x1 = rect->x;
-   int y1 = rect->y;
-   int x2 = x1 + rect->width;
-   int y2 = y1 + rect->height;
+   int width = MAX(1, (int)(p->line_width + 0.5f));
+   int inset = (width - 1) / 2;
+   rect_t outer = {
+      rect->x - inset, rect->y - inset,
+      rect->width + width, rect->height + width
+   };
+   rect_t inner = {
+      outer.x + width, outer.y + width,
+      outer.width - 2 * width, outer.height - 2 * width
+   };
+
+   if (rect_is_null(&inner))
+   {
+      pntr_fill_rect(p, &outer);
+      return;
+   }
+
+   rect_t top    = { outer.x, outer.y, outer.width, width };
+   rect_t bottom = { outer.x, inner.y + inner.height, outer.width, width };
+   rect_t left   = { outer.x, inner.y, width, inner.height };
+   rect_t right  = { inner.x + inner.width, inner.y, width, inner.height };
 
-   pntr_strike_line(p, x1, y1, x1, y2);
-   pntr_strike_line(p, x1, y2, x2, y2);
-   pntr_strike_line(p, x2, y2, x2, y1);
-   pntr_strike_line(p, x2, y1, x1, y1);
+   pntr_fill_rect(p, &top);
+   pntr_fill_rect(p, &left);
+   pntr_fill_rect(p, &right);
+   pntr_fill_rect(p, &bottom);
 }
 
 
@@ -138,6 +427,22 @@ void pntr_fill_rect(painter_t *p, const rect_t *rect)
    if (!p->target->data)
       return;
 
+   if (p->queue || p->dirty)
+   {
+      rect_t bounds = {
+         rect->x + p->trans->tx, rect->y + p->trans->ty,
+         rect->width, rect->height
+      };
+      bounds = touch(p, bounds, true);
+
+      if (p->queue)
+      {
+         if (!rect_is_null(&bounds))
+            pntr_queue_fill_rect(p, &bounds, rect);
+         return;
+      }
+   }
+
    size_t row_size = p->target->pitch >> 2;
    uint32_t color = p->foreground;
    rect_t drect = {
@@ -150,42 +455,176 @@ void pntr_fill_rect(painter_t *p, const rect_t *rect)
    if (rect_is_null(&drect))
       return;
 
-   int x;
-   int xend = drect.x + drect.width;
    uint32_t *row  = p->target->data + drect.y * row_size;
    uint32_t *end  = row + row_size * drect.height;
 
-   if ((color & 0xff000000) == 0)
+   const pntr_blend_kernels_t *blend = pntr_blend_kernels(p->blend_mode);
+   if (invisible(blend, color))
       return;
 
-#ifdef HAVE_COMPOSITION
-   uint32_t sa, sr, sg, sb, da, dr, dg, db, s, d;
    do
    {
-      for (x = drect.x; x < xend; ++x)
+      fill_span(blend, row + drect.x, color, drect.width);
+      row += row_size;
+   } while (row < end);
+}
+
+
+static inline uint32_t span_kind(uint32_t pixel)
+{
+   uint32_t a = pixel >> 24;
+   if (a == 0)
+      return BITMAP_SPAN_TRANSPARENT;
+   return a == 0xff ? BITMAP_SPAN_OPAQUE : BITMAP_SPAN_BLENDED;
+}
+
+// span_kind of pixel (x, y), kinds classifying the palette of indexed bitmaps.
+static inline uint32_t pixel_span_kind(const bitmap_t *bmp, const uint8_t *kinds, unsigned x, unsigned y)
+{
+   if (bmp->indices)
+      return kinds[bmp->indices[y * bmp->pitch + x]];
+   return span_kind(bmp->data[y * (bmp->pitch >> 2) + x]);
+}
+
+// serials tell apart the contents a bitmap had, for the sprite cache.
+static uint32_t new_serial(void)
+{
+   static uint32_t last_serial;
+
+   if (++last_serial == 0)
+      ++last_serial;
+   return last_serial;
+}
+
+void bitmap_build_spans(bitmap_t *bmp)
+{
+   bitmap_free_spans(bmp);
+   bmp->serial = new_serial();
+
+   if ((!bmp->data && !bmp->indices) || bmp->width == 0 || bmp->height == 0)
+      return;
+
+   uint8_t kinds[BITMAP_PALETTE_SIZE];
+   size_t count = 0;
+   unsigned x, y;
+
+   for (x = 0; bmp->indices && x < BITMAP_PALETTE_SIZE; ++x)
+      kinds[x] = span_kind(bmp->palette[x]);
+
+   // first pass only counts the runs, so the table fits in one allocation.
+   for (y = 0; y < bmp->height; ++y)
+   {
+      uint32_t kind = pixel_span_kind(bmp, kinds, 0, y);
+      count++;
+      for (x = 1; x < bmp->width; ++x)
       {
-         s = color;
-         d = row[x];
-         sa = s >> 24;
-         da = d >> 24;
-         DISASSEMBLE_RGB(s, sr, sg, sb);
-         DISASSEMBLE_RGB(d, dr, dg, db);
-         row[x] = ((sa + da * (255 - sa)) << 24) | (COMPOSE_FAST(sr, dr, sa) << 16) | (COMPOSE_FAST(sg, dg, sa) << 8) | (COMPOSE_FAST(sb, db, sa));
+         uint32_t next = pixel_span_kind(bmp, kinds, x, y);
+         if (next != kind)
+         {
+            kind = next;
+            count++;
+         }
       }
+   }
 
-      row += row_size;
-   } while (row < end);
-#else
-   do
+   // when runs average less than 4 pixels the table costs more than it saves.
+   if (count * 4 > (size_t)bmp->width * bmp->height)
+      return;
+
+   bitmap_spans_t *spans = lutro_malloc(sizeof(bitmap_spans_t) + (bmp->height + 1 + count) * sizeof(uint32_t));
+   spans->rows = (uint32_t*)(spans + 1);
+   spans->runs = spans->rows + bmp->height + 1;
+
+   uint32_t *run = spans->runs;
+   for (y = 0; y < bmp->height; ++y)
    {
-      for (x = drect.x; x < xend; ++x)
-         row[x] = color;
+      uint32_t kind = pixel_span_kind(bmp, kinds, 0, y);
 
-      row += row_size;
-   } while (row < end);
-#endif
+      spans->rows[y] = run - spans->runs;
+      for (x = 1; x < bmp->width; ++x)
+      {
+         uint32_t next = pixel_span_kind(bmp, kinds, x, y);
+         if (next != kind)
+         {
+            *run++ = (x << 2) | kind;
+            kind = next;
+         }
+      }
+      *run++ = (bmp->width << 2) | kind;
+   }
+   spans->rows[bmp->height] = run - spans->runs;
+
+   bmp->spans = spans;
+}
+
+void bitmap_free_spans(bitmap_t *bmp)
+{
+   if (bmp->spans)
+   {
+      lutro_free(bmp->spans);
+      bmp->spans = NULL;
+   }
+
+   bmp->serial = 0;
+}
+
+void bitmap_use_spans(bitmap_t *bmp, uint32_t *rows, uint32_t *runs)
+{
+   bitmap_free_spans(bmp);
+   bmp->serial = new_serial();
+
+   bmp->spans = lutro_malloc(sizeof(bitmap_spans_t));
+   bmp->spans->rows = rows;
+   bmp->spans->runs = runs;
+}
+
+void bitmap_set_premultiplied(bitmap_t *bmp, bool premultiplied)
+{
+   if (bmp->premultiplied == premultiplied)
+      return;
+
+   // opacity is kept, and so are the spans.
+   for (unsigned i = 0; bmp->indices && i < BITMAP_PALETTE_SIZE; ++i)
+   {
+      uint32_t color = bmp->palette[i];
+      bmp->palette[i] = premultiplied ? pntr_premultiply(color) : pntr_unpremultiply(color);
+   }
+
+   for (unsigned y = 0; bmp->data && y < bmp->height; ++y)
+   {
+      uint32_t *row = bmp->data + y * (bmp->pitch >> 2);
+      for (unsigned x = 0; x < bmp->width; ++x)
+         row[x] = premultiplied ? pntr_premultiply(row[x]) : pntr_unpremultiply(row[x]);
+   }
+
+   bmp->premultiplied = premultiplied;
+
+   if (bmp->serial)
+      bmp->serial = new_serial();
 }
 
+void bitmap_set_palette(bitmap_t *bmp, const uint32_t *colors, unsigned first, unsigned count)
+{
+   bool rebuild = false;
+
+   if (!bmp->indices || first >= BITMAP_PALETTE_SIZE)
+      return;
+
+   count = MIN(count, BITMAP_PALETTE_SIZE - first);
+   for (unsigned i = 0; i < count; ++i)
+   {
+      uint32_t color = bmp->premultiplied ? pntr_premultiply(colors[i]) : colors[i];
+
+      // the runs only depend on the opacity of the colors.
+      rebuild = rebuild || span_kind(color) != span_kind(bmp->palette[first + i]);
+      bmp->palette[first + i] = color;
+   }
+
+   if (rebuild && bmp->spans)
+      bitmap_build_spans(bmp);
+   else if (bmp->serial)
+      bmp->serial = new_serial();
+}
 
 rect_t rect_intersect(const rect_t *a, const rect_t *b)
 {
@@ -201,432 +640,1770 @@ rect_t rect_intersect(const rect_t *a, const rect_t *b)
 }
 
 
-int rect_is_null(const rect_t *r)
-{
-   return r->width <= 0 || r->height <= 0;
+int rect_is_null(const rect_t *r)
+{
+   return r->width <= 0 || r->height <= 0;
+}
+
+void pntr_strike_poly(painter_t *p, const int *points, int nb_points)
+{
+   if ((nb_points % 2) != 0)
+      return;
+
+   if (invisible(pntr_blend_kernels(p->blend_mode), p->foreground))
+      return;
+
+   for (int i = 0; i < (nb_points / 2); ++i)
+   {
+      int x1 = points[2 * i];
+      int y1 = points[(2 * i) + 1];
+      int x2, y2;
+      if (i < ((nb_points / 2) - 1))
+      {
+         x2 = points[2 * (i + 1)];
+         y2 = points[(2 * (i + 1)) + 1];
+      }
+      else
+      {
+         x2 = points[0];
+         y2 = points[1];
+      }
+
+      pntr_strike_line(p, x1, y1, x2, y2);
+   }
+}
+
+typedef struct
+{
+   int y0, y1;    // rows [y0, y1) sampled at their center
+   int winding;   // +1 going down, -1 going up
+   int64_t x;     // 16.16 crossing with the current row center
+   int64_t step;  // 16.16 change of x from a row to the next
+} poly_edge_t;
+
+static int compare_edge_y(const void *a, const void *b)
+{
+   return ((const poly_edge_t*)a)->y0 - ((const poly_edge_t*)b)->y0;
+}
+
+void pntr_fill_poly(painter_t *p, const int *points, int nb_points)
+{
+   if (!p->target->data)
+      return;
+
+   if ((nb_points % 2) != 0 || nb_points < 6)
+      return;
+
+   uint32_t color = p->foreground;
+   const pntr_blend_kernels_t *blend = pntr_blend_kernels(p->blend_mode);
+   if (invisible(blend, color))
+      return;
+
+   const int tx = p->trans->tx, ty = p->trans->ty;
+   int xmin = points[0], xmax = points[0];
+   int ymin = points[1], ymax = points[1];
+   for (int i = 2; i < nb_points; i += 2)
+   {
+      xmin = MIN(xmin, points[i]);
+      xmax = MAX(xmax, points[i]);
+      ymin = MIN(ymin, points[i + 1]);
+      ymax = MAX(ymax, points[i + 1]);
+   }
+
+   rect_t bounds = { xmin + tx, ymin + ty, xmax - xmin, ymax - ymin };
+   bounds = touch(p, bounds, true);
+
+   if (rect_is_null(&bounds))
+      return;
+
+   if (p->queue)
+   {
+      pntr_queue_fill_poly(p, &bounds, points, nb_points);
+      return;
+   }
+
+   // edge table, sorted by first row. Pixels are sampled at their center
+   // and vertices lie on pixel corners, so a polygon covers the same pixels
+   // as a rectangle with the same corners.
+   poly_edge_t edges_buf[32];
+   poly_edge_t *edges = edges_buf;
+   int nb_vertices = nb_points / 2;
+   int nb_edges = 0;
+
+   if (nb_vertices > (int)ARRAY_SIZE(edges_buf))
+      edges = lutro_malloc(nb_vertices * sizeof(poly_edge_t));
+
+   for (int i = 0; i < nb_vertices; ++i)
+   {
+      int j = (i + 1) % nb_vertices;
+      int x0 = points[2 * i] + tx, y0 = points[2 * i + 1] + ty;
+      int x1 = points[2 * j] + tx, y1 = points[2 * j + 1] + ty;
+      int winding = 1;
+
+      if (y0 == y1)
+         continue;
+
+      if (y0 > y1)
+      {
+         int t;
+         t = x0; x0 = x1; x1 = t;
+         t = y0; y0 = y1; y1 = t;
+         winding = -1;
+      }
+
+      poly_edge_t *e = &edges[nb_edges++];
+      e->y0 = y0;
+      e->y1 = y1;
+      e->winding = winding;
+      // rounded down so that crossings never move right of the exact ones.
+      e->step = div_floor((int64_t)(x1 - x0) << 16, y1 - y0);
+      e->x = ((int64_t)x0 << 16) + div_floor((int64_t)(x1 - x0) << 16, 2 * (y1 - y0));
+   }
+
+   qsort(edges, nb_edges, sizeof(poly_edge_t), compare_edge_y);
+
+   // active edges, kept sorted by crossing.
+   poly_edge_t *active_buf[32];
+   poly_edge_t **active = active_buf;
+   int nb_active = 0, next = 0;
+
+   if (nb_edges > (int)ARRAY_SIZE(active_buf))
+      active = lutro_malloc(nb_edges * sizeof(poly_edge_t*));
+
+   const int x_lo = bounds.x, x_hi = bounds.x + bounds.width;
+   const bool even_odd = p->fill_rule == PNTR_FILL_EVENODD;
+   size_t row_size = p->target->pitch >> 2;
+   uint32_t *row = p->target->data + bounds.y * row_size;
+
+   for (int y = bounds.y; y < bounds.y + bounds.height; ++y, row += row_size)
+   {
+      int k = 0;
+
+      // retire the edges ending above this row and step the others.
+      for (int i = 0; i < nb_active; ++i)
+      {
+         poly_edge_t *e = active[i];
+         if (e->y1 <= y)
+            continue;
+
+         e->x += e->step;
+         active[k++] = e;
+      }
+      nb_active = k;
+
+      for (; next < nb_edges && edges[next].y0 <= y; ++next)
+      {
+         poly_edge_t *e = &edges[next];
+         if (e->y1 <= y)
+            continue;
+
+         // edges starting above the clip join at their crossing with this row.
+         e->x += e->step * (y - e->y0);
+         active[nb_active++] = e;
+      }
+
+      // the order barely changes from a row to the next.
+      for (int i = 1; i < nb_active; ++i)
+      {
+         poly_edge_t *e = active[i];
+         int j = i;
+         for (; j > 0 && active[j - 1]->x > e->x; --j)
+            active[j] = active[j - 1];
+         active[j] = e;
+      }
+
+      int winding = 0;
+      for (int i = 0; i + 1 < nb_active; ++i)
+      {
+         winding += active[i]->winding;
+
+         if (even_odd ? !(winding & 1) : winding == 0)
+            continue;
+
+         // pixel centers within [x, next x)
+         int x0 = (int)((active[i]->x + 0x7fff) >> 16);
+         int x1 = (int)((active[i + 1]->x + 0x7fff) >> 16);
+         x0 = MAX(x0, x_lo);
+         x1 = MIN(x1, x_hi);
+
+         if (x0 < x1)
+            fill_span(blend, row + x0, color, x1 - x0);
+      }
+   }
+
+   if (edges != edges_buf)
+      lutro_free(edges);
+   if (active != active_buf)
+      lutro_free(active);
+}
+
+// past these radii the products of ellipse_rows could overflow.
+#define PNTR_ELLIPSE_MAX_RADIUS 16384
+
+// the faceted look love2d gives with an explicit segment count.
+static int *ellipse_polygon(int x, int y, int radius_x, int radius_y, int nb_segments)
+{
+   int *points = lutro_malloc(2 * nb_segments * sizeof(int));
+
+   for (int i = 0; i < nb_segments; ++i)
+   {
+      points[2 * i]     = x + (radius_x * cos(2 * i * M_PI / nb_segments));
+      points[2 * i + 1] = y + (radius_y * sin(2 * i * M_PI / nb_segments));
+   }
+
+   return points;
+}
+
+// Half widths of the rows of an ellipse centered on a pixel: row dy, for dy
+// in [0, ry], spans the pixels whose center lies in the ellipse of radii
+// rx + 1/2 and ry + 1/2. The test is exact, and walks the edge from the
+// middle row outwards since rows only get narrower.
+static void ellipse_rows(int rx, int ry, int *half)
+{
+   const int64_t a  = (int64_t)(2 * rx + 1) * (2 * rx + 1);
+   const int64_t b  = (int64_t)(2 * ry + 1) * (2 * ry + 1);
+   const int64_t ab = a * b;
+   int64_t dx = rx;
+
+   for (int64_t dy = 0; dy <= ry; ++dy)
+   {
+      while (dx > 0 && 4 * (dx * dx * b + dy * dy * a) > ab)
+         dx--;
+      half[dy] = (int)dx;
+   }
+}
+
+// fills row y from x0 to x1 included, within bounds.
+static void fill_row(painter_t *p, const pntr_blend_kernels_t *blend, const rect_t *bounds, int y, int x0, int x1)
+{
+   if (y < bounds->y || y >= bounds->y + bounds->height)
+      return;
+
+   x0 = MAX(x0, bounds->x);
+   x1 = MIN(x1, bounds->x + bounds->width - 1);
+
+   if (x0 <= x1)
+      fill_span(blend, p->target->data + y * (p->target->pitch >> 2) + x0, p->foreground, x1 - x0 + 1);
+}
+
+void pntr_strike_ellipse(painter_t *p, int x, int y, int radius_x, int radius_y, int nb_segments)
+{
+   int rx = abs(radius_x), ry = abs(radius_y);
+
+   if (nb_segments > 0 || MAX(rx, ry) > PNTR_ELLIPSE_MAX_RADIUS)
+   {
+      nb_segments = nb_segments > 0 ? nb_segments : 1024;
+
+      int *points = ellipse_polygon(x, y, radius_x, radius_y, nb_segments);
+      pntr_strike_poly(p, points, 2 * nb_segments);
+      lutro_free(points);
+      return;
+   }
+
+   if (!p->target->data)
+      return;
+
+   const pntr_blend_kernels_t *blend = pntr_blend_kernels(p->blend_mode);
+   if (invisible(blend, p->foreground))
+      return;
+
+   // wide outlines are the ring between two ellipses centered on the path.
+   int width = MAX(1, (int)(p->line_width + 0.5f));
+   int outer_x = rx + width / 2, outer_y = ry + width / 2;
+   int inner_x = outer_x - width, inner_y = outer_y - width;
+
+   int cx = x + p->trans->tx, cy = y + p->trans->ty;
+   rect_t bounds = { cx - outer_x, cy - outer_y, 2 * outer_x + 1, 2 * outer_y + 1 };
+   bounds = touch(p, bounds, true);
+
+   if (rect_is_null(&bounds))
+      return;
+
+   if (p->queue)
+   {
+      pntr_queue_strike_ellipse(p, &bounds, x, y, rx, ry);
+      return;
+   }
+
+   int rows_buf[256];
+   int nb_rows = outer_y + 1 + MAX(inner_y + 1, 0);
+   int *outer = nb_rows <= (int)ARRAY_SIZE(rows_buf) ? rows_buf : lutro_malloc(nb_rows * sizeof(int));
+   int *inner = outer + outer_y + 1;
+
+   ellipse_rows(outer_x, outer_y, outer);
+   if (width > 1 && inner_x >= 0 && inner_y >= 0)
+      ellipse_rows(inner_x, inner_y, inner);
+
+   for (int dy = 0; dy <= outer_y; ++dy)
+   {
+      int o = outer[dy];
+      int h = -1; // half width of the hole, none when negative
+
+      if (width == 1)
+      {
+         // the pixels of the fill with a neighbour outside of it.
+         if (dy < outer_y)
+            h = MIN(outer[dy + 1], o - 1);
+      }
+      else if (inner_x >= 0 && dy <= inner_y)
+         h = inner[dy];
+
+      for (int side = -1; side <= 1; side += 2)
+      {
+         if (dy == 0 && side > 0)
+            break;
+
+         int row = cy + side * dy;
+         if (h < 0)
+            fill_row(p, blend, &bounds, row, cx - o, cx + o);
+         else
+         {
+            fill_row(p, blend, &bounds, row, cx - o, cx - h - 1);
+            fill_row(p, blend, &bounds, row, cx + h + 1, cx + o);
+         }
+      }
+   }
+
+   if (outer != rows_buf)
+      lutro_free(outer);
+}
+
+void pntr_fill_ellipse(painter_t *p, int x, int y, int radius_x, int radius_y, int nb_segments)
+{
+   int rx = abs(radius_x), ry = abs(radius_y);
+
+   if (nb_segments > 0 || MAX(rx, ry) > PNTR_ELLIPSE_MAX_RADIUS)
+   {
+      nb_segments = nb_segments > 0 ? nb_segments : 1024;
+
+      int *points = ellipse_polygon(x, y, radius_x, radius_y, nb_segments);
+      pntr_fill_poly(p, points, 2 * nb_segments);
+      lutro_free(points);
+      return;
+   }
+
+   if (!p->target->data)
+      return;
+
+   const pntr_blend_kernels_t *blend = pntr_blend_kernels(p->blend_mode);
+   if (invisible(blend, p->foreground))
+      return;
+
+   int cx = x + p->trans->tx, cy = y + p->trans->ty;
+   rect_t bounds = { cx - rx, cy - ry, 2 * rx + 1, 2 * ry + 1 };
+   bounds = touch(p, bounds, true);
+
+   if (rect_is_null(&bounds))
+      return;
+
+   if (p->queue)
+   {
+      pntr_queue_fill_ellipse(p, &bounds, x, y, rx, ry);
+      return;
+   }
+
+   int rows_buf[256];
+   int *half = ry < (int)ARRAY_SIZE(rows_buf) ? rows_buf : lutro_malloc((ry + 1) * sizeof(int));
+
+   ellipse_rows(rx, ry, half);
+
+   for (int dy = 0; dy <= ry; ++dy)
+   {
+      fill_row(p, blend, &bounds, cy - dy, cx - half[dy], cx + half[dy]);
+      if (dy > 0)
+         fill_row(p, blend, &bounds, cy + dy, cx - half[dy], cx + half[dy]);
+   }
+
+   if (half != rows_buf)
+      lutro_free(half);
+}
+
+// kernels drawing bmp with the blend mode of the painter.
+static const pntr_blend_kernels_t *draw_kernels(const painter_t *p, const bitmap_t *bmp)
+{
+   if (bmp->premultiplied)
+      return pntr_blend_kernels(p->blend_mode | PNTR_BLEND_PREMULTIPLIED);
+   return pntr_blend_kernels(p->blend_mode);
+}
+
+// whether the transparent runs of bmp leave the target untouched, those of
+// premultiplied bitmaps being black.
+static inline bool skips_transparent(const pntr_blend_kernels_t *blend, const bitmap_t *bmp)
+{
+   return bmp->premultiplied ? blend->skip_clear : blend->skip_transparent;
+}
+
+// blits columns [x0, x0 + count) of a source row, skipping its transparent
+// runs and copying its opaque ones when the blend mode allows it.
+static void draw_span_runs(const pntr_blend_kernels_t *blend, uint32_t *dst, const uint32_t *src_row,
+      const bitmap_spans_t *spans, uint32_t row, int x0, int count)
+{
+   const uint32_t *run  = spans->runs + spans->rows[row];
+   const uint32_t *last = spans->runs + spans->rows[row + 1];
+   int xend = x0 + count;
+   int x    = x0;
+
+   // find the first run ending after x0
+   const uint32_t *hi = last;
+   while (run < hi)
+   {
+      const uint32_t *mid = run + (hi - run) / 2;
+      if ((int)(*mid >> 2) <= x0)
+         run = mid + 1;
+      else
+         hi = mid;
+   }
+
+   for (; run < last && x < xend; ++run)
+   {
+      int run_end = MIN((int)(*run >> 2), xend);
+
+      switch (*run & 3)
+      {
+         case BITMAP_SPAN_OPAQUE:
+            if (blend->copy_opaque)
+            {
+               memcpy(dst + (x - x0), src_row + x, (run_end - x) * sizeof(uint32_t));
+               break;
+            }
+            /* fallthrough */
+         case BITMAP_SPAN_BLENDED:
+            blend->span(dst + (x - x0), src_row + x, run_end - x);
+            break;
+         default:
+            break;
+      }
+
+      x = run_end;
+   }
+}
+
+// pixels [x, x + count) of row y, indexed bitmaps being looked up in their
+// palette into buf, which holds count pixels.
+static inline const uint32_t *bitmap_row(const bitmap_t *bmp, int y, int x, int count, uint32_t *buf)
+{
+   if (!bmp->indices)
+      return bmp->data + y * (bmp->pitch >> 2) + x;
+
+   const uint8_t *index = bmp->indices + y * bmp->pitch + x;
+   const uint32_t *palette = bmp->palette;
+   for (int i = 0; i < count; ++i)
+      buf[i] = palette[index[i]];
+
+   return buf;
+}
+
+#ifdef HAVE_TRANSFORM
+static inline int32_t to_fixed(float f)
+{
+   f *= (float)(1 << k_binexp);
+   // out of range steps only occur with spans narrower than a pixel.
+   f = MAX(MIN(f, 2147483520.0f), -2147483520.0f);
+   return (int32_t)lrintf(f);
+}
+
+// Narrows [*x0, *x1) to the pixels i for which 0 <= start + i * step < limit.
+static void clip_range(int64_t start, int64_t step, int64_t limit, int *x0, int *x1)
+{
+   int64_t lo, hi;
+
+   if (step == 0)
+   {
+      if (start < 0 || start >= limit)
+         *x1 = *x0;
+      return;
+   }
+
+   if (step > 0)
+   {
+      lo = -div_floor(start, step);
+      hi = -div_floor(start - limit, step);
+   }
+   else
+   {
+      lo = div_floor(start - limit, -step) + 1;
+      hi = div_floor(start, -step) + 1;
+   }
+
+   if (lo > *x0)
+      *x0 = (int)MIN(lo, (int64_t)*x1);
+   if (hi < *x1)
+      *x1 = (int)MAX(hi, (int64_t)*x0);
+}
+
+// pixels a rotated blit of srect may touch, relative to where its top-left
+// corner lands.
+static rect_t rotated_box(const painter_transform_t *t, const rect_t *srect)
+{
+   const float cs = cosf(t->r);
+   const float sn = sinf(t->r);
+
+   float min_x = 0, max_x = 0, min_y = 0, max_y = 0;
+   for (int i = 1; i < 4; ++i)
+   {
+      float u = (i & 1) ? srect->width  * t->sx : 0;
+      float v = (i & 2) ? srect->height * t->sy : 0;
+      float cx = u * cs - v * sn;
+      float cy = u * sn + v * cs;
+      min_x = MIN(min_x, cx);
+      max_x = MAX(max_x, cx);
+      min_y = MIN(min_y, cy);
+      max_y = MAX(max_y, cy);
+   }
+
+   rect_t box = {
+      (int)floorf(min_x), (int)floorf(min_y),
+      (int)ceilf(max_x) - (int)floorf(min_x),
+      (int)ceilf(max_y) - (int)floorf(min_y)
+   };
+   return box;
+}
+
+// Rotated blit: the source rect is scaled and rotated about its top-left
+// corner, which lands on (x, y). Source coordinates are an exact linear
+// function of the destination pixel in 16.16 fixed-point, so each row of the
+// bounding box is narrowed to the pixels that map inside the source rect and
+// walked incrementally. Being relative to (x, y), the result does not depend
+// on the clip.
+static void draw_rotated(painter_t *p, const pntr_blend_kernels_t *blend, const bitmap_t *bmp, const rect_t *src_rect, int x, int y)
+{
+   const rect_t bmp_rect = { 0, 0, (int)bmp->width, (int)bmp->height };
+   const rect_t srect = rect_intersect(src_rect, &bmp_rect);
+
+   // a zero scale collapses the sprite to nothing.
+   if (rect_is_null(&srect) || p->trans->sx == 0 || p->trans->sy == 0)
+      return;
+
+   const float cs = cosf(p->trans->r);
+   const float sn = sinf(p->trans->r);
+   const float sx = p->trans->sx;
+   const float sy = p->trans->sy;
+
+   rect_t box = rotated_box(p->trans, &srect);
+   box.x += x;
+   box.y += y;
+   box = rect_intersect(&box, &p->clip);
+
+   if (rect_is_null(&box))
+      return;
+
+   // source position of the center of destination pixel (x + i, y + j):
+   // u = u0 + i * du_dx + j * du_dy, likewise for v.
+   const int32_t du_dx = to_fixed( cs / sx), du_dy = to_fixed(sn / sx);
+   const int32_t dv_dx = to_fixed(-sn / sy), dv_dy = to_fixed(cs / sy);
+   const int32_t u0 = (du_dx + du_dy) / 2;
+   const int32_t v0 = (dv_dx + dv_dy) / 2;
+   const int64_t max_u = (int64_t)srect.width << k_binexp;
+   const int64_t max_v = (int64_t)srect.height << k_binexp;
+
+   size_t dst_skip = p->target->pitch >> 2;
+   size_t src_skip = bmp->indices ? bmp->pitch : bmp->pitch >> 2;
+
+   uint32_t *dst = p->target->data + dst_skip * box.y + box.x;
+   const uint32_t *src = bmp->data + src_skip * srect.y + srect.x;
+   const uint8_t *index = bmp->indices + src_skip * srect.y + srect.x;
+   uint32_t line[PNTR_SPAN_CHUNK];
+
+   for (int row = box.y; row < box.y + box.height; ++row, dst += dst_skip)
+   {
+      int64_t u_row = u0 + (int64_t)(row - y) * du_dy + (int64_t)(box.x - x) * du_dx;
+      int64_t v_row = v0 + (int64_t)(row - y) * dv_dy + (int64_t)(box.x - x) * dv_dx;
+
+      int x0 = 0, x1 = box.width;
+      clip_range(u_row, du_dx, max_u, &x0, &x1);
+      clip_range(v_row, dv_dx, max_v, &x0, &x1);
+
+      for (int col = x0; col < x1; col += PNTR_SPAN_CHUNK)
+      {
+         int count = MIN(x1 - col, PNTR_SPAN_CHUNK);
+         // in range, hence 32 bits are enough from here on.
+         int32_t u = (int32_t)(u_row + (int64_t)col * du_dx);
+         int32_t v = (int32_t)(v_row + (int64_t)col * dv_dx);
+
+         if (bmp->indices)
+         {
+            for (int i = 0; i < count; ++i, u += du_dx, v += dv_dx)
+               line[i] = bmp->palette[index[(v >> k_binexp) * src_skip + (u >> k_binexp)]];
+         }
+         else
+         {
+            for (int i = 0; i < count; ++i, u += du_dx, v += dv_dx)
+               line[i] = src[(v >> k_binexp) * src_skip + (u >> k_binexp)];
+         }
+
+         blend->span(dst + col, line, count);
+      }
+   }
+}
+#endif
+
+// 1:1 blit of src to drect, both within their bitmaps, drawing the part
+// of drect within rect only.
+static void blit(painter_t *p, const pntr_blend_kernels_t *blend, const bitmap_t *bmp, const rect_t *src, const rect_t *drect, const rect_t *rect)
+{
+   size_t dst_skip = p->target->pitch >> 2;
+
+   const int src_x = src->x + rect->x - drect->x;
+   const int src_y = src->y + rect->y - drect->y;
+   uint32_t *dst = p->target->data + dst_skip * rect->y + rect->x;
+   const bool runs = bmp->spans && skips_transparent(blend, bmp);
+
+   // indexed rows are looked up a chunk at a time.
+   const int chunk = bmp->indices ? PNTR_SPAN_CHUNK : rect->width;
+   uint32_t line[PNTR_SPAN_CHUNK];
+
+   for (int y = src_y; y < src_y + rect->height; ++y, dst += dst_skip)
+   {
+      for (int col = 0; col < rect->width; col += chunk)
+      {
+         int count = MIN(rect->width - col, chunk);
+         int x = src_x + col;
+         const uint32_t *src_row = bitmap_row(bmp, y, x, count, line) - x;
+
+         if (runs)
+            draw_span_runs(blend, dst + col, src_row, bmp->spans, y, x, count);
+         else
+            blend->span(dst + col, src_row + x, count);
+      }
+   }
+}
+
+#ifdef HAVE_TRANSFORM
+// One axis of a scaled blit. Destination pixel d samples the source pixel
+// under its center, floor((d + 1/2) / scale), counting from the far end
+// when mirrored. Integer scales divide exactly.
+typedef struct
+{
+   int length;     // destination pixels
+   int factor;     // integer scale, 0 when fractional
+   uint32_t inv;   // source pixels per destination pixel, 16.16
+   bool reversed;
+} scale_axis_t;
+
+static scale_axis_t scale_axis(float scale, int length)
+{
+   scale_axis_t axis;
+   float abs_scale = fabsf(scale);
+
+   axis.length   = length;
+   axis.factor   = abs_scale == floorf(abs_scale) && abs_scale <= 65536.0f ? (int)abs_scale : 0;
+   axis.inv      = (1 << k_binexp) / abs_scale;
+   axis.reversed = scale < 0;
+
+   return axis;
+}
+
+static inline int axis_sample(const scale_axis_t *axis, int d)
+{
+   if (axis->reversed)
+      d = axis->length - 1 - d;
+
+   if (axis->factor)
+      return d / axis->factor;
+
+   return ((uint64_t)(2 * d + 1) * axis->inv) >> (k_binexp + 1);
+}
+
+// how many destination pixels sample within the first avail source pixels
+// of the axis; samples only grow with d.
+static int fit_axis(const scale_axis_t *axis, int avail)
+{
+   scale_axis_t forward = *axis;
+   int lo = 0, hi = axis->length;
+
+   forward.reversed = false;
+   while (lo < hi)
+   {
+      int mid = lo + (hi - lo) / 2;
+      if (axis_sample(&forward, mid) < avail)
+         lo = mid + 1;
+      else
+         hi = mid;
+   }
+
+   return lo;
+}
+
+// line[i] = row[(d0 + i) / factor], each source pixel repeated factor times.
+static inline void gather_repeat(uint32_t *line, const uint32_t *row, int d0, int count, int factor)
+{
+   const uint32_t *src = row + d0 / factor;
+   int run = factor - d0 % factor;
+
+   for (int i = 0; i < count; run = factor)
+   {
+      uint32_t c = *src++;
+      for (int end = MIN(i + run, count); i < end; ++i)
+         line[i] = c;
+   }
+}
+
+enum
+{
+   GATHER_DIRECT,  // 1:1, the source row is drawn as is
+   GATHER_MIRROR,  // 1:1 mirrored
+   GATHER_REPEAT2,
+   GATHER_REPEAT3,
+   GATHER_REPEAT4,
+   GATHER_REPEAT,  // other integer scales
+   GATHER_TABLE    // anything else, through a column table
+};
+
+// Scaled or mirrored blit of srect to drect, clipped to rect. The kernel
+// gathering source rows is chosen once, fractional scales looking their
+// columns up in a table built for the blit, and a gathered row is reused
+// as long as the destination rows sample the same source row.
+static void draw_scaled(painter_t *p, const pntr_blend_kernels_t *blend, const bitmap_t *bmp, const rect_t *srect,
+      const rect_t *drect, const rect_t *rect, const scale_axis_t *ax, const scale_axis_t *ay)
+{
+   const int x_off = rect->x - drect->x;
+   const int y_off = rect->y - drect->y;
+   const int cols  = rect->width;
+
+   size_t dst_skip = p->target->pitch >> 2;
+   size_t src_skip = bmp->pitch >> 2;
+
+   int kernel = GATHER_TABLE;
+   if (ax->factor == 1)
+      kernel = ax->reversed ? GATHER_MIRROR : GATHER_DIRECT;
+   else if (ax->factor && !ax->reversed)
+      kernel = ax->factor == 2 ? GATHER_REPEAT2 : ax->factor == 3 ? GATHER_REPEAT3
+         : ax->factor == 4 ? GATHER_REPEAT4 : GATHER_REPEAT;
+
+   uint32_t line_buf[PNTR_SPAN_CHUNK];
+   uint32_t *line = line_buf;
+   int *columns = NULL;
+
+   if (kernel != GATHER_DIRECT)
+   {
+      size_t needed = cols * (kernel == GATHER_TABLE ? 2 : 1);
+      if (needed > ARRAY_SIZE(line_buf))
+         line = lutro_malloc(needed * sizeof(uint32_t));
+
+      if (kernel == GATHER_TABLE)
+      {
+         columns = (int*)(line + cols);
+         for (int i = 0; i < cols; ++i)
+            columns[i] = axis_sample(ax, x_off + i);
+      }
+   }
+
+   // indexed source rows are looked up in the palette whole, once each.
+   const int row_width = MIN(srect->width, (int)bmp->width - srect->x);
+   uint32_t row_buf[PNTR_SPAN_CHUNK];
+   uint32_t *expanded = NULL;
+   int expanded_y = -1;
+
+   if (bmp->indices)
+      expanded = row_width <= PNTR_SPAN_CHUNK ? row_buf : lutro_malloc(row_width * sizeof(uint32_t));
+
+   uint32_t *dst = p->target->data + dst_skip * rect->y + rect->x;
+   int last_y = -1;
+
+   for (int y = y_off; y < y_off + rect->height; ++y, dst += dst_skip)
+   {
+      int src_y = srect->y + axis_sample(ay, y);
+      const uint32_t *row = expanded;
+
+      if (!expanded)
+         row = bmp->data + src_y * src_skip + srect->x;
+      else if (src_y != expanded_y)
+      {
+         bitmap_row(bmp, src_y, srect->x, row_width, expanded);
+         expanded_y = src_y;
+      }
+
+      if (kernel == GATHER_DIRECT)
+      {
+         if (bmp->spans && skips_transparent(blend, bmp))
+            draw_span_runs(blend, dst, row - srect->x, bmp->spans, src_y, srect->x + x_off, cols);
+         else
+            blend->span(dst, row + x_off, cols);
+         continue;
+      }
+
+      if (src_y != last_y)
+      {
+         switch (kernel)
+         {
+            case GATHER_MIRROR:
+            {
+               const uint32_t *src = row + ax->length - 1 - x_off;
+               for (int i = 0; i < cols; ++i)
+                  line[i] = src[-i];
+               break;
+            }
+            case GATHER_REPEAT2:
+               gather_repeat(line, row, x_off, cols, 2);
+               break;
+            case GATHER_REPEAT3:
+               gather_repeat(line, row, x_off, cols, 3);
+               break;
+            case GATHER_REPEAT4:
+               gather_repeat(line, row, x_off, cols, 4);
+               break;
+            case GATHER_REPEAT:
+               gather_repeat(line, row, x_off, cols, ax->factor);
+               break;
+            default:
+               for (int i = 0; i < cols; ++i)
+                  line[i] = row[columns[i]];
+               break;
+         }
+         last_y = src_y;
+      }
+
+      blend->span(dst, line, cols);
+   }
+
+   if (line != line_buf)
+      lutro_free(line);
+   if (expanded && expanded != row_buf)
+      lutro_free(expanded);
+}
+#endif
+
+// target pixels a blit may touch, the rotated case staying within a circle
+// around its pivot.
+static rect_t draw_bounds(const painter_t *p, const rect_t *src_rect, const rect_t *dst_rect)
+{
+   rect_t bounds = {
+      dst_rect->x + p->trans->tx, dst_rect->y + p->trans->ty,
+      src_rect->width, src_rect->height
+   };
+
+#ifdef HAVE_TRANSFORM
+   const painter_transform_t *t = p->trans;
+   float w = src_rect->width * t->sx;
+   float h = src_rect->height * t->sy;
+
+   if (t->r != 0.0f)
+   {
+      int radius = (int)ceilf(sqrtf(w * w + h * h));
+      bounds.x -= radius;
+      bounds.y -= radius;
+      bounds.width = bounds.height = 2 * radius;
+   }
+   else
+   {
+      bounds.width  = (int)fabsf(w);
+      bounds.height = (int)fabsf(h);
+      if (w < 0)
+         bounds.x -= bounds.width;
+      if (h < 0)
+         bounds.y -= bounds.height;
+   }
+#endif
+
+   // a pixel of margin absorbs the rounding of the blitter.
+   bounds.x -= 1;
+   bounds.y -= 1;
+   bounds.width  += 2;
+   bounds.height += 2;
+
+   return bounds;
+}
+
+#ifdef HAVE_TRANSFORM
+// resamples src of bmp as the transform of the key would into a new sprite
+// of the cache, or returns NULL when it does not fit.
+static const bitmap_t *cache_sprite(pntr_cache_t *cache, const bitmap_t *bmp, const pntr_cache_key_t *key, int *x, int *y)
+{
+   painter_t sp;
+   memset(&sp, 0, sizeof(sp));
+   sp.trans = &sp.stack[0];
+   sp.trans->r  = (float)(key->r * (2.0 * M_PI / PNTR_CACHE_ANGLE_STEPS));
+   sp.trans->sx = key->sx / (float)PNTR_CACHE_SCALE_STEPS;
+   sp.trans->sy = key->sy / (float)PNTR_CACHE_SCALE_STEPS;
+   sp.blend_mode = PNTR_BLEND_REPLACE;
+
+   rect_t box;
+   if (sp.trans->r != 0.0f)
+   {
+      const rect_t bmp_rect = { 0, 0, (int)bmp->width, (int)bmp->height };
+      const rect_t srect = rect_intersect(&key->src, &bmp_rect);
+      box = rotated_box(sp.trans, &srect);
+   }
+   else
+   {
+      // as pntr_draw sizes and mirrors its destination.
+      box.width  = key->src.width * fabsf(sp.trans->sx);
+      box.height = key->src.height * fabsf(sp.trans->sy);
+      box.x = sp.trans->sx < 0 ? -box.width : 0;
+      box.y = sp.trans->sy < 0 ? -box.height : 0;
+   }
+
+   if (rect_is_null(&box))
+      return NULL;
+
+   bitmap_t *sprite = pntr_cache_add(cache, key, box.width, box.height, box.x, box.y);
+   if (!sprite)
+      return NULL;
+
+   const rect_t dst = { -box.x, -box.y, key->src.width, key->src.height };
+   sp.target = sprite;
+   sp.clip.width  = box.width;
+   sp.clip.height = box.height;
+   pntr_draw(&sp, bmp, &key->src, &dst);
+
+   sprite->premultiplied = bmp->premultiplied;
+   bitmap_build_spans(sprite);
+
+   *x = box.x;
+   *y = box.y;
+   return sprite;
+}
+
+// Draws a scaled, mirrored or rotated bitmap as its sprite in the cache of
+// the painter, blitted 1:1. The transparent pixels around a sprite must
+// leave the target untouched for it to look the same as the bitmap drawn
+// directly. Returns false when the draw is left to pntr_draw.
+static bool draw_cached(painter_t *p, const bitmap_t *bmp, const rect_t *src_rect, const rect_t *dst_rect)
+{
+   painter_transform_t *t = p->trans;
+
+   if ((t->r == 0.0f && t->sx == 1.0f && t->sy == 1.0f) || !bmp->serial
+         || !skips_transparent(draw_kernels(p, bmp), bmp))
+      return false;
+
+   if (src_rect->x < 0 || src_rect->y < 0 || src_rect->x >= (int)bmp->width || src_rect->y >= (int)bmp->height
+         || fabsf(t->sx) > 256.0f || fabsf(t->sy) > 256.0f)
+      return false;
+
+   pntr_cache_key_t key;
+   key.serial = bmp->serial;
+   key.src = *src_rect;
+   key.sx = (int32_t)lrintf(t->sx * PNTR_CACHE_SCALE_STEPS);
+   key.sy = (int32_t)lrintf(t->sy * PNTR_CACHE_SCALE_STEPS);
+   key.r  = (int32_t)lrint(fmod(t->r, 2.0 * M_PI) * (PNTR_CACHE_ANGLE_STEPS / (2.0 * M_PI)));
+
+   if (key.sx == 0 || key.sy == 0)
+      return false;
+   if (key.r == 0 && key.sx == PNTR_CACHE_SCALE_STEPS && key.sy == PNTR_CACHE_SCALE_STEPS)
+      return false;
+
+   int x, y;
+   const bitmap_t *sprite = pntr_cache_find(p->cache, &key, &x, &y);
+   if (!sprite)
+      sprite = cache_sprite(p->cache, bmp, &key, &x, &y);
+   if (!sprite)
+      return false;
+
+   const rect_t src = { 0, 0, (int)sprite->width, (int)sprite->height };
+   const rect_t dst = { dst_rect->x + x, dst_rect->y + y, src.width, src.height };
+   const painter_transform_t saved = *t;
+
+   t->r = 0.0f;
+   t->sx = t->sy = 1.0f;
+   pntr_draw(p, sprite, &src, &dst);
+   *t = saved;
+
+   return true;
+}
+#endif
+
+void pntr_draw(painter_t *p, const bitmap_t *bmp, const rect_t *src_rect, const rect_t *dst_rect)
+{
+   if (!p->target->data)
+      return;
+
+#ifdef HAVE_TRANSFORM
+   if (p->cache && draw_cached(p, bmp, src_rect, dst_rect))
+      return;
+#endif
+
+   if (p->queue || p->dirty)
+   {
+      rect_t bounds = touch(p, draw_bounds(p, src_rect, dst_rect), true);
+
+      if (p->queue)
+      {
+         if (rect_is_null(&bounds))
+            return;
+
+         // drawing the target onto itself must see everything recorded so far.
+         if (bmp->data != p->target->data)
+         {
+            pntr_queue_draw(p, &bounds, bmp, src_rect, dst_rect);
+            return;
+         }
+
+         pntr_queue_flush(p->queue);
+      }
+   }
+
+   const pntr_blend_kernels_t *blend = draw_kernels(p, bmp);
+   rect_t srect = *src_rect, drect = *dst_rect;
+
+   drect.x += p->trans->tx;
+   drect.y += p->trans->ty;
+
+   if (srect.x >= bmp->width || srect.y >= bmp->height)
+      return;
+
+#ifdef HAVE_TRANSFORM
+   float abs_sx = fabsf(p->trans->sx);
+   float abs_sy = fabsf(p->trans->sy);
+
+   drect.width  = srect.width * abs_sx;
+   drect.height = srect.height * abs_sy;
+
+   // give up if scaling is small enough that division becomes untenable
+   if (abs_sx < 1.0/k_binexp_center || abs_sy < 1.0/k_binexp_center)
+      return;
+
+   if (p->trans->r != 0.0f)
+   {
+      draw_rotated(p, blend, bmp, &srect, drect.x, drect.y);
+      return;
+   }
+
+   scale_axis_t ax = scale_axis(p->trans->sx, drect.width);
+   scale_axis_t ay = scale_axis(p->trans->sy, drect.height);
+
+   // negative scaling reverses the top-left and bottom-right corners like so:
+   if (ax.reversed)
+      drect.x -= drect.width;
+   if (ay.reversed)
+      drect.y -= drect.height;
+
+   // the pixels sampling past the bitmap are cut, from the far end of the
+   // source which mirroring brings to the near end of the destination.
+   int fit = fit_axis(&ax, bmp->width - srect.x);
+   if (ax.reversed)
+      drect.x += drect.width - fit;
+   drect.width = ax.length = fit;
+
+   fit = fit_axis(&ay, bmp->height - srect.y);
+   if (ay.reversed)
+      drect.y += drect.height - fit;
+   drect.height = ay.length = fit;
+#else
+   drect.width  = MIN(srect.width, (int)bmp->width - srect.x);
+   drect.height = MIN(srect.height, (int)bmp->height - srect.y);
+#endif
+
+   rect_t clipped = rect_intersect(&drect, &p->clip);
+
+   if (rect_is_null(&clipped) || rect_is_null(&srect))
+      return;
+
+#ifdef HAVE_TRANSFORM
+   if (ax.factor != 1 || ax.reversed || ay.factor != 1 || ay.reversed)
+   {
+      draw_scaled(p, blend, bmp, &srect, &drect, &clipped, &ax, &ay);
+      return;
+   }
+#endif
+
+   blit(p, blend, bmp, &srect, &drect, &clipped);
 }
 
-void pntr_strike_poly(painter_t *p, const int *points, int nb_points)
+
+void pntr_draw_sprites(painter_t *p, const bitmap_t *bmp, const sprite_t *sprites, unsigned count, int x, int y)
 {
-   if ((nb_points % 2) != 0)
+   if (!p->target->data)
       return;
 
-   uint32_t color = p->foreground;
-   if ((color & 0xff000000) == 0)
-      return;
+   // drawing the target onto itself must go through the queue flush.
+   const bool plain = !p->queue && bmp->data != p->target->data;
+   const pntr_blend_kernels_t *blend = draw_kernels(p, bmp);
 
-   for (int i = 0; i < (nb_points / 2); ++i)
+   for (unsigned i = 0; i < count; i++)
    {
-      int x1 = points[2 * i];
-      int y1 = points[(2 * i) + 1];
-      int x2, y2;
-      if (i < ((nb_points / 2) - 1))
-      {
-         x2 = points[2 * (i + 1)];
-         y2 = points[(2 * (i + 1)) + 1];
-      }
-      else
+      const sprite_t *sprite = &sprites[i];
+      rect_t drect = { x + sprite->x, y + sprite->y, sprite->src.width, sprite->src.height };
+
+      if (!plain || sprite->r != 0.0f || sprite->sx != 1.0f || sprite->sy != 1.0f)
       {
-         x2 = points[0];
-         y2 = points[1];
+         // the transform of each sprite replaces the painter's, as with
+         // lutro.graphics.draw, saved here as the stack may be full.
+         const painter_transform_t saved = *p->trans;
+         pntr_rotate(p, sprite->r);
+         pntr_scale(p, sprite->sx, sprite->sy);
+         pntr_draw(p, bmp, &sprite->src, &drect);
+         *p->trans = saved;
+         continue;
       }
 
-      pntr_strike_line(p, x1, y1, x2, y2);
+      const rect_t *src = &sprite->src;
+      if (src->x < 0 || src->y < 0 || src->x >= (int)bmp->width || src->y >= (int)bmp->height)
+         continue;
+
+      drect.x += p->trans->tx;
+      drect.y += p->trans->ty;
+      drect.width  = MIN(drect.width, (int)bmp->width - src->x);
+      drect.height = MIN(drect.height, (int)bmp->height - src->y);
+
+      rect_t rect = touch(p, drect, true);
+      if (!rect_is_null(&rect))
+         blit(p, blend, bmp, src, &drect, &rect);
    }
 }
 
-void pntr_fill_poly(painter_t *p, const int *points, int nb_points)
+void pntr_draw_tiles(painter_t *p, const bitmap_t *atlas, const tile_layer_t *layer, int x, int y)
 {
-   if (!p->target->data)
+   if (!p->target->data || !layer->tiles)
       return;
 
-   if ((nb_points % 2) != 0)
-      return;
+   const int tw = layer->tile_width;
+   const int th = layer->tile_height;
+   const int columns = atlas->width / tw;
+   const unsigned count = columns * (atlas->height / th);
 
-   uint32_t color = p->foreground;
-   if ((color & 0xff000000) == 0)
+   x += p->trans->tx;
+   y += p->trans->ty;
+
+   // only the cells meeting the clip are visited.
+   rect_t area = { x, y, layer->width * tw, layer->height * th };
+   rect_t target_rect = { 0, 0, p->target->width, p->target->height };
+   rect_t view = rect_intersect(&target_rect, &p->clip);
+   rect_t visible = rect_intersect(&area, &view);
+
+   if (rect_is_null(&visible) || count == 0)
       return;
 
-   // find the top-most and bottom-most points
-   int ymin = p->target->height + 1;
-   int ymax = -1;
-   for (int i = 0; i < (nb_points / 2); ++i)
-   {
-      ymin = MIN(ymin, points[(2 * i) + 1]);
-      ymax = MAX(ymax, points[(2 * i) + 1]);
-   }
+   const int col0 = (visible.x - x) / tw;
+   const int row0 = (visible.y - y) / th;
+   const int col1 = (visible.x + visible.width - 1 - x) / tw;
+   const int row1 = (visible.y + visible.height - 1 - y) / th;
 
-   // Note: the following algorithm is correct for convex polygons only.
-   // However, the polygon fill function in Love2D is also incorrect for non-convex polygons.
-   for (int yy = ymin; yy <= ymax; ++yy)
+   // drawing the target onto itself must go through the queue flush.
+   if (p->queue || atlas->data == p->target->data)
    {
-      int xmin = p->target->width + 1;
-      int xmax = -1;
-      for (int i = 0; i < (nb_points / 2); ++i)
+      // tiles are drawn 1:1 as sprites are, whatever the painter's
+      // transform, saved here as the stack may be full.
+      const painter_transform_t saved = *p->trans;
+      pntr_rotate(p, 0.0f);
+      pntr_scale(p, 1.0f, 1.0f);
+
+      for (int row = row0; row <= row1; row++)
       {
-         int x1 = points[2 * i];
-         int y1 = points[(2 * i) + 1];
-         int x2, y2;
-         if (i < ((nb_points / 2) - 1))
-         {
-            x2 = points[2 * (i + 1)];
-            y2 = points[(2 * (i + 1)) + 1];
-         }
-         else
-         {
-            x2 = points[0];
-            y2 = points[1];
-         }
+         const uint16_t *tiles = layer->tiles + row * layer->width;
 
-         if ((y1 > yy) != (y2 > yy))
+         for (int col = col0; col <= col1; col++)
          {
-            int testx = x1 + ((x2 - x1) * (yy - y1)) / (y2 - y1);
-            xmin = MIN(xmin, testx);
-            xmax = MAX(xmax, testx);
+            unsigned tile = tiles[col];
+            if (tile == 0 || tile > count)
+               continue;
+
+            rect_t src = { (tile - 1) % columns * tw, (tile - 1) / columns * th, tw, th };
+            rect_t drect = { x - p->trans->tx + col * tw, y - p->trans->ty + row * th, tw, th };
+            pntr_draw(p, atlas, &src, &drect);
          }
       }
 
-      for (int xx = xmin; xx <= xmax; ++xx)
+      *p->trans = saved;
+      return;
+   }
+
+   touch(p, visible, false);
+
+   const pntr_blend_kernels_t *blend = draw_kernels(p, atlas);
+
+   // cells within these bounds need no clipping.
+   const int inner_col0 = col0 + (x + col0 * tw < view.x);
+   const int inner_row0 = row0 + (y + row0 * th < view.y);
+   const int inner_col1 = col1 - (x + (col1 + 1) * tw > view.x + view.width);
+   const int inner_row1 = row1 - (y + (row1 + 1) * th > view.y + view.height);
+
+   for (int row = row0; row <= row1; row++)
+   {
+      const uint16_t *tiles = layer->tiles + row * layer->width;
+      const bool inner_row = row >= inner_row0 && row <= inner_row1;
+
+      for (int col = col0; col <= col1; col++)
       {
-         if (yy >= 0 && yy < p->target->height)
-            if (xx >= 0 && xx < p->target->width)
-               p->target->data[yy * (p->target->pitch >> 2) + xx] = color;
+         unsigned tile = tiles[col];
+         if (tile == 0 || tile > count)
+            continue;
+
+         rect_t src = { (tile - 1) % columns * tw, (tile - 1) / columns * th, tw, th };
+         rect_t drect = { x + col * tw, y + row * th, tw, th };
+
+         if (inner_row && col >= inner_col0 && col <= inner_col1)
+            blit(p, blend, atlas, &src, &drect, &drect);
+         else
+         {
+            rect_t rect = rect_intersect(&drect, &view);
+            blit(p, blend, atlas, &src, &drect, &rect);
+         }
       }
    }
 }
 
-void pntr_strike_ellipse(painter_t *p, int x, int y, int radius_x, int radius_y, int nb_segments)
+// multiplies the channels of c by factors out of 256.
+static inline uint32_t tint_pixel(uint32_t c, const uint32_t *f)
 {
-   for (int i = 0; i < nb_segments; ++i)
-   {
-      int x1 = x + (radius_x * cos(2 * i * M_PI / nb_segments));
-      int y1 = y + (radius_y * sin(2 * i * M_PI / nb_segments));
-      int x2 = x + (radius_x * cos(2 * (i + 1) * M_PI / nb_segments));
-      int y2 = y + (radius_y * sin(2 * (i + 1) * M_PI / nb_segments));
-      pntr_strike_line(p, x1, y1, x2, y2);
-   }
+   return ((c & 0xff) * f[0] >> 8)
+      | (((c >> 8) & 0xff) * f[1] >> 8) << 8
+      | (((c >> 16) & 0xff) * f[2] >> 8) << 16
+      | ((c >> 24) * f[3] >> 8) << 24;
 }
 
-void pntr_fill_ellipse(painter_t *p, int x, int y, int radius_x, int radius_y, int nb_segments)
+// draws the whole of bmp stretched over drect, sampling the source pixel
+// under the center of each pixel of the part within rect, multiplied by the
+// straight color tint.
+static void blit_tinted(painter_t *p, const pntr_blend_kernels_t *blend, const bitmap_t *bmp,
+      const rect_t *drect, const rect_t *rect, uint32_t tint)
 {
-   if (!p->target->data)
-      return;
+   uint32_t f[4];
+   uint32_t ta = tint >> 24;
 
-   uint32_t color = p->foreground;
-   if ((color & 0xff000000) == 0)
-      return;
+   for (int i = 0; i < 4; i++)
+   {
+      uint32_t t = (tint >> (i * 8)) & 0xff;
+      // premultiplied pixels take a premultiplied tint.
+      if (bmp->premultiplied && i < 3)
+         t = t * (ta + (ta >> 7)) >> 8;
+      f[i] = t + (t >> 7);
+   }
+
+   size_t dst_skip = p->target->pitch >> 2;
+   uint32_t *dst = p->target->data + dst_skip * rect->y + rect->x;
+   uint32_t line[PNTR_SPAN_CHUNK];
 
-   for (int yy = y - radius_y; yy <= y + radius_y; ++yy)
+   const int64_t sw = bmp->width, sh = bmp->height;
+   const int64_t step = (sw << 16) / drect->width;
+   // steps from the left of drect wherever rect starts, so that clipping
+   // leaves the pixels kept alone.
+   const int64_t start = (sw << 16) / (2 * drect->width) + (rect->x - drect->x) * step;
+
+   for (int y = rect->y; y < rect->y + rect->height; ++y, dst += dst_skip)
    {
-      int xmin = p->target->width + 1;
-      int xmax = -1;
-      for (int i = 0; i < nb_segments; ++i)
+      int sy = (2 * (y - drect->y) + 1) * sh / (2 * drect->height);
+      const uint32_t *row = bmp->indices ? NULL : bmp->data + sy * (bmp->pitch >> 2);
+      const uint8_t *index = bmp->indices ? bmp->indices + sy * bmp->pitch : NULL;
+      int64_t pos = start;
+
+      for (int col = 0; col < rect->width; col += PNTR_SPAN_CHUNK)
       {
-         int x1 = x + (radius_x * cos(2 * i * M_PI / nb_segments));
-         int y1 = y + (radius_y * sin(2 * i * M_PI / nb_segments));
-         int x2 = x + (radius_x * cos(2 * (i + 1) * M_PI / nb_segments));
-         int y2 = y + (radius_y * sin(2 * (i + 1) * M_PI / nb_segments));
+         int count = MIN(rect->width - col, PNTR_SPAN_CHUNK);
 
-         if ((y1 > yy) != (y2 > yy))
+         for (int i = 0; i < count; i++, pos += step)
          {
-            int testx = x1 + ((x2 - x1) * (yy - y1)) / (y2 - y1);
-            xmin = MIN(xmin, testx);
-            xmax = MAX(xmax, testx);
+            int sx = (int)(pos >> 16);
+            uint32_t c = index ? bmp->palette[index[sx]] : row[sx];
+            line[i] = tint_pixel(c, f);
          }
-      }
 
-      for (int xx = xmin; xx <= xmax; ++xx)
-      {
-         if (yy >= 0 && yy < p->target->height)
-            if (xx >= 0 && xx < p->target->width)
-               p->target->data[yy * (p->target->pitch >> 2) + xx] = color;
+         blend->span(dst + col, line, count);
       }
    }
 }
 
-void pntr_draw(painter_t *p, const bitmap_t *bmp, const rect_t *src_rect, const rect_t *dst_rect)
+void pntr_draw_tinted(painter_t *p, const bitmap_t *bmp, const rect_t *dst_rect, uint32_t tint)
 {
-   if (!p->target->data)
+   if (!p->target->data || bmp->width == 0 || bmp->height == 0 || dst_rect->width <= 0 || dst_rect->height <= 0)
       return;
 
-   rect_t srect = *src_rect, drect = *dst_rect;
+   const pntr_blend_kernels_t *blend = draw_kernels(p, bmp);
+   if (invisible(blend, tint))
+      return;
 
+   rect_t drect = *dst_rect;
    drect.x += p->trans->tx;
    drect.y += p->trans->ty;
 
-#ifdef HAVE_TRANSFORM
-   // stored as 0 or 0xffffffff for masking properties.
-   const uint32_t is_x_reversed = (p->trans->sx < 0) ? 0xffffffff : 0;
-   const uint32_t is_y_reversed = (p->trans->sy < 0) ? 0xffffffff : 0;
-
-   float abs_sx = is_x_reversed ? -p->trans->sx : p->trans->sx;
-   float abs_sy = is_y_reversed ? -p->trans->sy : p->trans->sy;
-
-   drect.width  = srect.width * abs_sx;
-   drect.height = srect.height * abs_sy;
-
-   const uint32_t k_binexp = 16;
-   const uint32_t k_binexp_center = (1 << (k_binexp - 1));
-
-   // give up if scaling is small enough that division becomes untenable
-   if (abs_sx < 1.0/k_binexp_center || abs_sy < 1.0/k_binexp_center)
+   rect_t rect = touch(p, drect, true);
+   if (rect_is_null(&rect))
       return;
 
-   const uint32_t inv_scale_x = (1 << k_binexp) / abs_sx;
-   const uint32_t inv_scale_y = (1 << k_binexp) / abs_sy;
+   if (p->queue)
+   {
+      // drawing the target onto itself must see everything recorded so far.
+      if (bmp->data != p->target->data)
+      {
+         pntr_queue_draw_tinted(p, &rect, bmp, dst_rect, tint);
+         return;
+      }
 
-   #define SCALE_DST_TO_SRC(axis, a) (((a) * inv_scale_##axis + k_binexp_center) >> k_binexp)
+      pntr_queue_flush(p->queue);
+   }
 
-   // negative scaling reverses the top-left and bottom-right corners like so:
-   if (is_x_reversed)
+   if (tint == 0xffffffff && drect.width == bmp->width && drect.height == bmp->height)
    {
-      drect.x -= drect.width;
+      const rect_t whole = { 0, 0, bmp->width, bmp->height };
+      blit(p, blend, bmp, &whole, &drect, &rect);
    }
-   if (is_y_reversed)
+   else
+      blit_tinted(p, blend, bmp, &drect, &rect, tint);
+}
+
+void pntr_draw_particles(painter_t *p, const bitmap_t *bmp, const particles_t *ps, int x, int y)
+{
+   if (!p->target->data || ps->count == 0 || bmp->width == 0 || bmp->height == 0)
+      return;
+
+   // each particle is recorded on its own when deferred, so they are drawn
+   // as they are now whatever later updates do.
+   for (unsigned i = 0; i < ps->count; i++)
    {
-      drect.y -= drect.height;
+      float size = particles_size(ps, i);
+      int w = (int)lrintf(bmp->width * size);
+      int h = (int)lrintf(bmp->height * size);
+
+      // centered on the particle.
+      rect_t drect = { x + (int)lrintf(ps->x[i] - w * 0.5f), y + (int)lrintf(ps->y[i] - h * 0.5f), w, h };
+      pntr_draw_tinted(p, bmp, &drect, particles_color(ps, i));
    }
-#else
-   drect.width  = srect.width;
-   drect.height = srect.height;
+}
 
-   #define SCALE_DST_TO_SRC(axis, a) (a)
-   #define is_x_reversed 0
-   #define is_y_reversed 0
-#endif
+// attribute f of a triangle as the plane f0 + dx * x + dy * y, x and y
+// being relative to its first vertex so that it does not depend on where
+// the target starts.
+typedef struct
+{
+   double f0, dx, dy;
+} mesh_plane_t;
+
+static mesh_plane_t mesh_plane(double bx, double by, double cx, double cy,
+      double fa, double fb, double fc, double det)
+{
+   mesh_plane_t plane;
+   plane.dx = ((fb - fa) * cy - (fc - fa) * by) / det;
+   plane.dy = ((fc - fa) * bx - (fb - fa) * cx) / det;
+   plane.f0 = fa;
+   return plane;
+}
+
+static inline int32_t plane_fixed(const mesh_plane_t *plane, double x, double y)
+{
+   return (int32_t)lrint((plane->f0 + plane->dx * x + plane->dy * y) * 65536.0);
+}
+
+static inline uint32_t channel(uint32_t color, int shift)
+{
+   return (color >> shift) & 0xff;
+}
+
+// fills the pixels of the triangle whose centers lie within its edges, the
+// top and left edges included and the others not so that triangles sharing
+// an edge meet without overlapping.
+void pntr_fill_triangle(painter_t *p, const bitmap_t *bmp, const mesh_point_t *a, const mesh_point_t *b, const mesh_point_t *c)
+{
+   const int64_t one = 1 << PNTR_MESH_SUBPIXEL;
+   const int64_t half = one >> 1;
+
+   if (!p->target->data)
+      return;
+
+   int64_t area = (b->x - a->x) * (c->y - a->y) - (b->y - a->y) * (c->x - a->x);
+   if (area == 0)
+      return;
 
-   // crop source rect to destination
-   if (drect.x < 0)
+   // clockwise on screen from here on.
+   if (area < 0)
    {
-      srect.width += SCALE_DST_TO_SRC(x, drect.x);
-      if (!is_x_reversed)
-      {
-         // (crop from left side of source)
-         srect.x  += SCALE_DST_TO_SRC(x, -drect.x);
-      }
-      drect.width += drect.x;
-      drect.x      = 0;
+      const mesh_point_t *t = b;
+      b = c;
+      c = t;
    }
 
-   if (drect.y < 0)
+   int64_t min_x = MIN(a->x, MIN(b->x, c->x)), max_x = MAX(a->x, MAX(b->x, c->x));
+   int64_t min_y = MIN(a->y, MIN(b->y, c->y)), max_y = MAX(a->y, MAX(b->y, c->y));
+
+   rect_t bounds;
+   bounds.x = (int)div_floor(min_x, one);
+   bounds.y = (int)div_floor(min_y, one);
+   bounds.width  = (int)div_floor(max_x + one - 1, one) - bounds.x;
+   bounds.height = (int)div_floor(max_y + one - 1, one) - bounds.y;
+
+   rect_t rect = touch(p, bounds, true);
+   if (rect_is_null(&rect))
+      return;
+
+   if (p->queue)
    {
-      srect.height += SCALE_DST_TO_SRC(y, drect.y);
-      if (!is_y_reversed)
+      // drawing the target onto itself must see everything recorded so far.
+      if (!bmp || bmp->data != p->target->data)
       {
-         // (crop from top of source)
-         srect.y   += SCALE_DST_TO_SRC(y, -drect.y);
+         pntr_queue_fill_triangle(p, &rect, bmp, a, b, c);
+         return;
       }
-      drect.height += drect.y;
-      drect.y       = 0;
+
+      pntr_queue_flush(p->queue);
    }
 
-   rect_t drect_clipped = rect_intersect(&drect, &p->clip);
+   const pntr_blend_kernels_t *blend = bmp ? draw_kernels(p, bmp) : pntr_blend_kernels(p->blend_mode);
+   const bool tinted = a->color != 0xffffffff || b->color != 0xffffffff || c->color != 0xffffffff;
 
-   // (note: this can never be negative, so srect.x, srect.y remain positive)
-   srect.x      += SCALE_DST_TO_SRC(x, drect_clipped.x      - drect.x);
-   srect.width  -= SCALE_DST_TO_SRC(x, drect.width - drect_clipped.width);
-   srect.y      += SCALE_DST_TO_SRC(y, drect_clipped.y      - drect.y);
-   srect.height -= SCALE_DST_TO_SRC(y, drect.height - drect_clipped.height);
+   const mesh_point_t *v[3] = { a, b, c };
+   int64_t edge_dx[3], edge_dy[3], edge_bias[3];
 
-   drect = drect_clipped;
+   for (int i = 0; i < 3; i++)
+   {
+      const mesh_point_t *v0 = v[i], *v1 = v[(i + 1) % 3];
+      edge_dx[i] = v1->x - v0->x;
+      edge_dy[i] = v1->y - v0->y;
+      bool top_left = edge_dy[i] < 0 || (edge_dy[i] == 0 && edge_dx[i] > 0);
+      edge_bias[i] = top_left ? 0 : 1;
+   }
 
-   // ensure source rect is cropped to source bounds
-   if (srect.x + srect.width > bmp->width)
+   const double ax = (double)a->x / one, ay = (double)a->y / one;
+   const double bx = (double)(b->x - a->x) / one, by = (double)(b->y - a->y) / one;
+   const double cx = (double)(c->x - a->x) / one, cy = (double)(c->y - a->y) / one;
+   const double det = bx * cy - by * cx;
+   mesh_plane_t pu = { 0, 0, 0 }, pv = { 0, 0, 0 }, pc[4];
+
+   if (bmp)
    {
-      srect.width = bmp->width - srect.x;
+      pu = mesh_plane(bx, by, cx, cy, a->u * bmp->width, b->u * bmp->width, c->u * bmp->width, det);
+      pv = mesh_plane(bx, by, cx, cy, a->v * bmp->height, b->v * bmp->height, c->v * bmp->height, det);
    }
-   if (srect.y + srect.height > bmp->height)
+
+   if (tinted)
    {
-      srect.height = bmp->height - srect.y;
+      for (int i = 0; i < 4; i++)
+         pc[i] = mesh_plane(bx, by, cx, cy, channel(a->color, i * 8), channel(b->color, i * 8),
+               channel(c->color, i * 8), det);
    }
 
-   // ensure we won't exceed the bitmap's data during the upcoming blit:
-   #ifdef HAVE_TRANSFORM
-      // temporary implementation
-      // TODO: replace this.
-      if (srect.x >= bmp->width || srect.y >= bmp->height)
-         return;
-      while (srect.x + SCALE_DST_TO_SRC(x, drect.width) > bmp->width)
+   const int32_t du = (int32_t)lrint(pu.dx * 65536.0);
+   const int32_t dv = (int32_t)lrint(pv.dx * 65536.0);
+   int32_t dc[4];
+   for (int i = 0; i < 4 && tinted; i++)
+      dc[i] = (int32_t)lrint(pc[i].dx * 65536.0);
+
+   size_t dst_skip = p->target->pitch >> 2;
+   uint32_t *dst_row = p->target->data + dst_skip * rect.y;
+   uint32_t line[PNTR_SPAN_CHUNK];
+
+   for (int y = rect.y; y < rect.y + rect.height; y++, dst_row += dst_skip)
+   {
+      const int64_t py = (int64_t)y * one + half;
+      int64_t xl = rect.x, xr = rect.x + rect.width - 1;
+
+      // each edge bounds the span on one side, E(x) = row - dy * one * x.
+      for (int i = 0; i < 3 && xl <= xr; i++)
       {
-         drect.width--;
+         int64_t row = edge_dx[i] * (py - v[i]->y) - edge_dy[i] * (half - v[i]->x);
+         int64_t step = -edge_dy[i] * one;
+
+         if (step > 0)
+            xl = MAX(xl, -div_floor(row - edge_bias[i], step));
+         else if (step < 0)
+            xr = MIN(xr, div_floor(row - edge_bias[i], -step));
+         else if (row < edge_bias[i])
+            xr = xl - 1;
       }
-      while (srect.y + SCALE_DST_TO_SRC(y, drect.height) > bmp->height)
+
+      if (xl > xr)
+         continue;
+
+      // attributes step from the left of the triangle bounds wherever the
+      // span starts, so that clipping it leaves the pixels it keeps alone.
+      const double rx = bounds.x + 0.5 - ax, ry = y + 0.5 - ay;
+      const int64_t skip = xl - bounds.x;
+      int32_t u  = (int32_t)(plane_fixed(&pu, rx, ry) + skip * du);
+      int32_t tv = (int32_t)(plane_fixed(&pv, rx, ry) + skip * dv);
+      int32_t col[4];
+      for (int i = 0; i < 4 && tinted; i++)
+         col[i] = (int32_t)(plane_fixed(&pc[i], rx, ry) + skip * dc[i]);
+
+      for (int x = (int)xl; x <= xr; x += PNTR_SPAN_CHUNK)
       {
-         drect.height--;
+         int count = (int)MIN(xr + 1 - x, PNTR_SPAN_CHUNK);
+
+         for (int i = 0; i < count; i++)
+         {
+            uint32_t pixel = 0xffffffff;
+
+            if (bmp)
+            {
+               int sx = MAX(MIN(u >> 16, (int)bmp->width - 1), 0);
+               int sy = MAX(MIN(tv >> 16, (int)bmp->height - 1), 0);
+               pixel = bmp->indices
+                  ? bmp->palette[bmp->indices[sy * bmp->pitch + sx]]
+                  : bmp->data[sy * (bmp->pitch >> 2) + sx];
+               u += du;
+               tv += dv;
+            }
+
+            if (tinted)
+            {
+               uint32_t f[4];
+               for (int k = 0; k < 4; k++)
+               {
+                  f[k] = MAX(MIN(col[k] >> 16, 255), 0);
+                  col[k] += dc[k];
+               }
+
+               // premultiplied pixels take a premultiplied tint.
+               if (bmp && bmp->premultiplied)
+                  for (int k = 0; k < 3; k++)
+                     f[k] = f[k] * (f[3] + (f[3] >> 7)) >> 8;
+
+               for (int k = 0; k < 4; k++)
+                  f[k] += f[k] >> 7;
+
+               pixel = tint_pixel(pixel, f);
+            }
+
+            line[i] = pixel;
+         }
+
+         blend->span(dst_row + x, line, count);
       }
-   #else
-      drect.width = MIN(drect.width, srect.width);
-      drect.height = MIN(drect.height, srect.height);
-   #endif
+   }
+}
+
+void pntr_draw_mesh(painter_t *p, const bitmap_t *bmp, const mesh_t *mesh, float x, float y, float r, float sx, float sy)
+{
+   unsigned count = mesh->indices ? mesh->nb_indices : mesh->count;
 
-   if (rect_is_null(&drect) || rect_is_null(&srect) || p->trans->sx == 0 || p->trans->sy == 0)
+   if (!p->target->data || count < 3)
       return;
 
-   size_t dst_skip = p->target->pitch >> 2;
-   size_t src_skip = bmp->pitch >> 2;
+   if (bmp && (bmp->width == 0 || bmp->height == 0))
+      return;
 
-   uint32_t *dst = p->target->data + dst_skip * drect.y + drect.x;
-   uint32_t *src = bmp->data + src_skip * srect.y + srect.x;
+   // the whole batch of vertices is placed once, whatever triangles they
+   // end up in. Each triangle takes a copy of its own when deferred, so the
+   // mesh is drawn as it is now whatever later changes do.
+   mesh_point_t buf[64];
+   mesh_point_t *points = mesh->count <= 64 ? buf : lutro_malloc(mesh->count * sizeof(mesh_point_t));
 
-   int rows_left = drect.height;
-   int cols = drect.width;
-   int x = 0;
+   const float cr = cosf(r), sr = sinf(r);
+   const double one = 1 << PNTR_MESH_SUBPIXEL;
+   // keeps the edge functions of any triangle within 64 bits.
+   const double limit = 1 << 20;
 
-#ifdef HAVE_TRANSFORM
-   uint32_t y = 0;
-#endif
-#ifdef HAVE_COMPOSITION
-   uint32_t sa, sr, sg, sb, da, dr, dg, db, s, d;
-#else
-   uint32_t s;
-#endif
-   while (rows_left--)
+   x += p->trans->tx;
+   y += p->trans->ty;
+
+   for (unsigned i = 0; i < mesh->count; i++)
    {
-      for (x = 0; x < cols; ++x)
-      {
-#ifdef HAVE_TRANSFORM
-         uint32_t xo = (x & ~is_x_reversed) | ((cols - x - 1) & is_x_reversed);
-         uint32_t yo = (y & ~is_y_reversed) | ((drect.height - y - 1) & is_y_reversed);
-         uint32_t xi = SCALE_DST_TO_SRC(x, xo);
-         uint32_t yi = SCALE_DST_TO_SRC(y, yo);
-         s = src[xi + yi * src_skip];
-#else
-         s = src[x];
-#endif
-#ifdef HAVE_COMPOSITION
-         d = dst[x];
-         sa = s >> 24;
-         da = d >> 24;
-         DISASSEMBLE_RGB(s, sr, sg, sb);
-         DISASSEMBLE_RGB(d, dr, dg, db);
-         dst[x] = ((sa + da * (255 - sa)) << 24) | (COMPOSE_FAST(sr, dr, sa) << 16) | (COMPOSE_FAST(sg, dg, sa) << 8) | (COMPOSE_FAST(sb, db, sa));
-#else
-         if (s & 0xff000000)
-         dst[x] = s;
-#endif
-      }
+      const mesh_vertex_t *v = &mesh->vertices[i];
+      double px = x + v->x * sx * cr - v->y * sy * sr;
+      double py = y + v->x * sx * sr + v->y * sy * cr;
+
+      px = MAX(MIN(px, limit), -limit);
+      py = MAX(MIN(py, limit), -limit);
+
+      points[i].x     = llrint(px * one);
+      points[i].y     = llrint(py * one);
+      points[i].u     = v->u;
+      points[i].v     = v->v;
+      points[i].color = v->color;
+   }
 
-      dst += dst_skip;
-#ifdef HAVE_TRANSFORM
-      y += 1;
-#else
-      src += src_skip;
-#endif
+   for (unsigned i = 0; i + 2 < count; i += mesh->mode == PNTR_MESH_TRIANGLES ? 3 : 1)
+   {
+      unsigned k[3] = { i, i + 1, i + 2 };
+
+      if (mesh->mode == PNTR_MESH_FAN)
+         k[0] = 0;
+
+      if (mesh->indices)
+         for (int j = 0; j < 3; j++)
+            k[j] = mesh->indices[k[j]];
+
+      if (k[0] < mesh->count && k[1] < mesh->count && k[2] < mesh->count)
+         pntr_fill_triangle(p, bmp, &points[k[0]], &points[k[1]], &points[k[2]]);
    }
+
+   if (points != buf)
+      lutro_free(points);
 }
 
+void text_layout_init(text_layout_t *layout, glyph_t *buf, unsigned capacity)
+{
+   memset(layout, 0, sizeof(*layout));
+   layout->glyphs   = buf;
+   layout->capacity = buf ? capacity : 0;
+}
 
-void pntr_print(painter_t *p, int x, int y, const char *text, int limit)
+void text_layout_free(text_layout_t *layout)
 {
-   assert(p->font != NULL);
+   if (layout->owned)
+      lutro_free(layout->glyphs);
 
-   if (p->font->flags & FONT_FREETYPE)
+   memset(layout, 0, sizeof(*layout));
+}
+
+void text_layout_clear(text_layout_t *layout)
+{
+   layout->count = 0;
+   memset(&layout->bounds, 0, sizeof(layout->bounds));
+}
+
+static glyph_t *text_layout_push(text_layout_t *layout)
+{
+   if (layout->count == layout->capacity)
    {
+      unsigned capacity = MAX(layout->capacity * 2, 32);
+      glyph_t *glyphs = lutro_malloc(capacity * sizeof(glyph_t));
 
+      if (layout->count)
+         memcpy(glyphs, layout->glyphs, layout->count * sizeof(glyph_t));
+      if (layout->owned)
+         lutro_free(layout->glyphs);
+
+      layout->glyphs   = glyphs;
+      layout->capacity = capacity;
+      layout->owned    = true;
    }
-   else
+
+   return &layout->glyphs[layout->count++];
+}
+
+void text_layout_add(text_layout_t *layout, const font_t *font, const char *text, int x, int y, int limit)
+{
+   const bitmap_t *atlas = &font->atlas;
+
+   int pen_x = x, pen_y = y;
+
+   while (*text)
    {
-      bitmap_t *atlas = &p->font->atlas;
-      font_t *font = p->font;
+      uint32_t c = walk_codepoint(&text);
+      int pos = font_glyph(font, c);
+      if (pos < 0)
+         continue;
 
-      rect_t drect = {
-         x, y, p->target->width, atlas->height
-      };
+      rect_t src = { font->separators[pos] + 1, 0, 0, atlas->height };
+      src.width = font->separators[pos + 1] - src.x;
 
-      rect_t srect = {
-         0, 0, 0, atlas->height
-      };
+      // the pen moves on by the width found between the separators, even
+      // for glyphs with nothing to draw.
+      rect_t dst = { pen_x, pen_y, MIN(src.width, (int)atlas->width - src.x), atlas->height };
+
+      if (dst.width > 0 && dst.height > 0)
+      {
+         glyph_t *glyph = text_layout_push(layout);
+         glyph->src = src;
+         glyph->src.width = dst.width;
+         glyph->dst = dst;
 
-      size_t char_nb = utf8len(text);
-      uint32_t *utf32 = NULL;
-      // Avoid to call malloc for small string rendering
-      uint32_t buf[256];
-      if (char_nb < 256) {
-         utf32 = buf;
-      } else {
-         utf32 = lutro_malloc(char_nb * 4);
+         if (layout->count == 1)
+            layout->bounds = dst;
+         else
+         {
+            int x1 = MAX(layout->bounds.x + layout->bounds.width, dst.x + dst.width);
+            int y1 = MAX(layout->bounds.y + layout->bounds.height, dst.y + dst.height);
+            layout->bounds.x = MIN(layout->bounds.x, dst.x);
+            layout->bounds.y = MIN(layout->bounds.y, dst.y);
+            layout->bounds.width  = x1 - layout->bounds.x;
+            layout->bounds.height = y1 - layout->bounds.y;
+         }
       }
-      utf8_conv_utf32(utf32, char_nb, text, strlen(text));
 
-      for(int i = 0; i < char_nb; i++)
+      pen_x += src.width + font->extraspacing;
+
+      if (limit > 0 && pen_x - x > limit)
       {
-         uint32_t c = utf32[i];
-         int pos = strpos(font->characters, c);
-         if (pos < 0)
-            continue;
+         pen_x = x;
+         pen_y += atlas->height;
+      }
 
-         srect.x = font->separators[pos] + 1;
-         drect.width = srect.width = font->separators[pos+1] - srect.x;
+      if (c == '\n')
+      {
+         pen_x = x;
+         pen_y += atlas->height;
+      }
+   }
+}
 
-         pntr_draw(p, atlas, &srect, &drect);
+void pntr_draw_text(painter_t *p, const font_t *font, const text_layout_t *layout, int x, int y)
+{
+   const bitmap_t *atlas = &font->atlas;
 
-         drect.x += srect.width + font->extraspacing;
+   if (!p->target->data || layout->count == 0)
+      return;
 
-         if (limit > 0 && drect.x - x > limit)
-         {
-            drect.x = x;
-	         drect.y += atlas->height;
-		   }
+   bool plain = !p->queue && atlas->data != p->target->data;
+#ifdef HAVE_TRANSFORM
+   plain = plain && p->trans->sx == 1.0f && p->trans->sy == 1.0f && p->trans->r == 0.0f;
+#endif
 
-		   if (c == '\n')
-		   {
-            drect.x = x;
-	         drect.y += atlas->height;
-		   }
+   if (!plain)
+   {
+      // transforms and recording are left to the general blitter.
+      for (unsigned i = 0; i < layout->count; i++)
+      {
+         rect_t dst = layout->glyphs[i].dst;
+         dst.x += x;
+         dst.y += y;
+         pntr_draw(p, atlas, &layout->glyphs[i].src, &dst);
       }
+      return;
+   }
+
+   x += p->trans->tx;
+   y += p->trans->ty;
 
-      if (utf32 != buf)
-         lutro_free(utf32);
+   rect_t run = layout->bounds;
+   run.x += x;
+   run.y += y;
+
+   rect_t clipped = touch(p, run, true);
+   if (rect_is_null(&clipped))
+      return;
+
+   // runs entirely visible need no clipping glyph by glyph.
+   const bool visible = memcmp(&run, &clipped, sizeof(rect_t)) == 0;
+   const pntr_blend_kernels_t *blend = draw_kernels(p, atlas);
+
+   for (unsigned i = 0; i < layout->count; i++)
+   {
+      const glyph_t *glyph = &layout->glyphs[i];
+
+      rect_t drect = glyph->dst;
+      drect.x += x;
+      drect.y += y;
+
+      rect_t rect = visible ? drect : rect_intersect(&drect, &clipped);
+      if (!rect_is_null(&rect))
+         blit(p, blend, atlas, &glyph->src, &drect, &rect);
    }
 }
 
-
-int pntr_text_width(painter_t *p, const char *text)
+void pntr_print(painter_t *p, int x, int y, const char *text, int limit)
 {
-   int width = 0;
    assert(p->font != NULL);
 
    if (p->font->flags & FONT_FREETYPE)
-   {
+      return;
 
-   }
-   else
-   {
-      font_t *font = p->font;
+   // Avoid to call malloc for small string rendering
+   glyph_t buf[128];
+   text_layout_t layout;
 
-      int glyph_x, glyph_width;
+   text_layout_init(&layout, buf, ARRAY_SIZE(buf));
+   text_layout_add(&layout, p->font, text, 0, 0, limit);
+   pntr_draw_text(p, p->font, &layout, x, y);
+   text_layout_free(&layout);
+}
 
-      size_t char_nb = utf8len(text);
-      uint32_t *utf32 = NULL;
-      // Avoid to call malloc for small string rendering
-      uint32_t buf[256];
-      if (char_nb < 256) {
-         utf32 = buf;
-      } else {
-         utf32 = lutro_malloc(char_nb * 4);
-      }
-      utf8_conv_utf32(utf32, char_nb, text, strlen(text));
+int font_text_width(const font_t *font, const char *text)
+{
+   int width = 0;
 
-      for(int i = 0; i < char_nb; i++)
-      {
-         uint32_t c = utf32[i];
-         int pos = strpos(font->characters, c);
-         if (pos < 0)
-            continue;
+   if (font->flags & FONT_FREETYPE)
+      return 0;
 
-         glyph_x = font->separators[pos] + 1;
-         glyph_width = font->separators[pos+1] - glyph_x;
+   while (*text)
+   {
+      int pos = font_glyph(font, walk_codepoint(&text));
+      if (pos < 0)
+         continue;
 
-         width += glyph_width + font->extraspacing;
-      }
+      int glyph_x = font->separators[pos] + 1;
+      int glyph_width = font->separators[pos+1] - glyph_x;
 
-      if (utf32 != buf)
-         lutro_free(utf32);
+      width += glyph_width + font->extraspacing;
    }
 
    return width;
 }
 
+int pntr_text_width(painter_t *p, const char *text)
+{
+   assert(p->font != NULL);
+
+   return font_text_width(p->font, text);
+}
+
 #if defined(__QNX__) || defined(_MSC_VER)
 // declared in libretro.c for QNX and MSC but not exposed via header file. prototype is missing.
 extern int vasprintf(char **strp, const char *fmt, va_list ap);
@@ -646,7 +2423,7 @@ void pntr_printf(painter_t *p, int x, int y, const char *format, ...)
 
 bool pntr_push(painter_t *p)
 {
-   if (p->stack_pos == ARRAY_SIZE(p->stack))
+   if (p->stack_pos == ARRAY_SIZE(p->stack) - 1)
       return false;
 
    memcpy(&p->stack[p->stack_pos + 1], &p->stack[p->stack_pos], sizeof(p->stack[0]));
@@ -714,8 +2491,9 @@ font_t *font_load_filename(const char *filename, const char *characters, unsigne
 
    bitmap_t *atlas = &font->atlas;
 
-   lutro_stb_image_load(filename, &atlas->data, &atlas->width, &atlas->height);
+   lutro_stb_image_load(filename, &atlas->data, &atlas->width, &atlas->height, false);
    atlas->pitch = atlas->width << 2;
+   bitmap_build_spans(atlas);
 
    uint32_t separator = atlas->data[0];
    int max_separators = MAX_FONT_CHAR;
@@ -734,6 +2512,7 @@ font_t *font_load_filename(const char *filename, const char *characters, unsigne
        fprintf(stderr, "Font atlas is too big. It will be truncated !\n");
    }
    utf8_conv_utf32(font->characters, MAX_FONT_CHAR, characters, strlen(characters));
+   font_build_index(font);
 
    return font;
 }
@@ -744,10 +2523,25 @@ font_t *font_load_bitmap(const bitmap_t *atlas, const char *characters, unsigned
    font->owner = lutro_calloc(1, sizeof(uint32_t));
 
    // Deep copy data from atlas to give ownership. It also matches the behavior
-   // of font_load_filename that allocate a buffer for the atlas
+   // of font_load_filename that allocate a buffer for the atlas, indexed
+   // atlases being looked up in their palette.
    font->atlas = *atlas;
-   font->atlas.data = lutro_malloc(atlas->pitch * atlas->height);
-   memcpy(font->atlas.data, atlas->data, atlas->pitch * atlas->height);
+   font->atlas.pitch = atlas->width << 2;
+   font->atlas.data = lutro_malloc(font->atlas.pitch * atlas->height);
+   font->atlas.spans = NULL;
+   font->atlas.indices = NULL;
+   font->atlas.palette = NULL;
+   font->atlas.atlas = NULL;
+   font->atlas.shared = NULL;
+
+   for (unsigned y = 0; y < atlas->height; ++y)
+   {
+      uint32_t *row = font->atlas.data + y * atlas->width;
+      const uint32_t *src = bitmap_row(atlas, y, 0, atlas->width, row);
+      if (src != row)
+         memcpy(row, src, font->atlas.pitch);
+   }
+   bitmap_build_spans(&font->atlas);
 
    flags &= ~FONT_FREETYPE;
 
@@ -771,6 +2565,7 @@ font_t *font_load_bitmap(const bitmap_t *atlas, const char *characters, unsigned
       fprintf(stderr, "Font atlas is too big. It will be truncated !\n");
    }
    utf8_conv_utf32(font->characters, MAX_FONT_CHAR, characters, strlen(characters));
+   font_build_index(font);
 
    return font;
 }
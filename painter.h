@@ -5,8 +5,15 @@
 #include <stdint.h>
 #include <boolean.h>
 
+#include "particles.h"
+
 #define MAX_FONT_CHAR 256
 
+/* slots of the codepoint to glyph index of a font, twice MAX_FONT_CHAR so
+ * that probes stay short. */
+#define FONT_GLYPH_BITS  9
+#define FONT_GLYPH_SLOTS (1 << FONT_GLYPH_BITS)
+
 enum {
    FONT_FREETYPE = 1 << 1,
    FONT_BOLD     = 1 << 2,
@@ -14,11 +21,41 @@ enum {
    FONT_STRIKE   = 1 << 4
 };
 
+enum {
+   BITMAP_SPAN_TRANSPARENT = 0,
+   BITMAP_SPAN_OPAQUE      = 1,
+   BITMAP_SPAN_BLENDED     = 2
+};
+
+/* Per-row opacity runs of a bitmap. The runs of row y are
+ * runs[rows[y]] .. runs[rows[y + 1] - 1]; each one is encoded as
+ * (end_x << 2) | BITMAP_SPAN_*, end_x being exclusive. */
+typedef struct
+{
+   uint32_t *rows;
+   uint32_t *runs;
+} bitmap_spans_t;
+
+#define BITMAP_PALETTE_SIZE 256
+
+typedef struct pntr_atlas_s pntr_atlas_t;
+typedef struct image_cache_entry_s image_cache_entry_t;
+
+/* Either 32 bits pixels in data, or, for indexed bitmaps, 8 bits indices
+ * in a palette, data being NULL then. Only sources may be indexed, pitch
+ * counting bytes in either case. */
 typedef struct
 {
    uint32_t *data;
    unsigned width, height;
    size_t pitch;
+   bitmap_spans_t *spans; /* optional, see bitmap_build_spans() */
+   bool premultiplied;    /* rgb is multiplied by alpha, see bitmap_set_premultiplied() */
+   uint8_t *indices;      /* indexed bitmaps only */
+   uint32_t *palette;     /* BITMAP_PALETTE_SIZE colors, see bitmap_set_palette() */
+   pntr_atlas_t *atlas;   /* when set, data lies on one of its pages, see painter_atlas.h */
+   image_cache_entry_t *shared; /* when set, the pixels belong to the image cache, see image_cache.h */
+   uint32_t serial;       /* nonzero while the pixels are known not to change, see bitmap_build_spans() */
 } bitmap_t;
 
 typedef struct
@@ -32,6 +69,9 @@ typedef struct
    int  separators[MAX_FONT_CHAR];
    uint32_t characters[MAX_FONT_CHAR];
    int extraspacing;
+
+   /* hashes codepoints to their index in characters plus one, 0 when free */
+   uint16_t glyph_index[FONT_GLYPH_SLOTS];
 } font_t;
 
 typedef struct
@@ -39,6 +79,75 @@ typedef struct
    int x, y, width, height;
 } rect_t;
 
+typedef struct
+{
+   rect_t src; /* in the font atlas */
+   rect_t dst; /* relative to the position the text is drawn at */
+} glyph_t;
+
+typedef struct
+{
+   rect_t src;     /* in the bitmap */
+   int x, y;       /* where the top-left corner of src lands */
+   float r;        /* rotation about (x, y) */
+   float sx, sy;   /* scale */
+} sprite_t;
+
+/* A map of width x height cells, each showing tiles[row * width + col] of
+ * the atlas cut in tile_width x tile_height tiles numbered from 1 in
+ * reading order; 0 leaves a cell empty. */
+typedef struct
+{
+   uint16_t *tiles;
+   unsigned width, height;           /* in tiles */
+   unsigned tile_width, tile_height; /* in pixels */
+} tile_layer_t;
+
+typedef struct
+{
+   float x, y;
+   float u, v;     /* texture coordinates, 0 to 1 across the bitmap */
+   uint32_t color; /* straight ARGB the texture is multiplied by */
+} mesh_vertex_t;
+
+enum {
+   PNTR_MESH_FAN = 0,
+   PNTR_MESH_STRIP,
+   PNTR_MESH_TRIANGLES
+};
+
+/* Triangles made of the vertices taken in order, or in the order of the
+ * indices when set, as a fan, a strip or separate triangles. */
+typedef struct
+{
+   mesh_vertex_t *vertices;
+   unsigned count;
+   uint32_t *indices;
+   unsigned nb_indices;
+   unsigned mode; /* PNTR_MESH_* */
+} mesh_t;
+
+/* mesh vertices are placed with this many bits of subpixel precision. */
+#define PNTR_MESH_SUBPIXEL 8
+
+/* A mesh vertex placed on the target. */
+typedef struct
+{
+   int64_t x, y;   /* in target pixels, fixed point */
+   float u, v;
+   uint32_t color;
+} mesh_point_t;
+
+/* Glyphs of a string laid out with a font, which can be drawn as many
+ * times as needed without looking them up again. */
+typedef struct
+{
+   glyph_t *glyphs;
+   unsigned count, capacity;
+   bool owned;    /* whether glyphs was allocated by the layout */
+   rect_t bounds; /* union of the glyph destinations */
+} text_layout_t;
+
 typedef struct
 {
    /* translation */
@@ -51,7 +160,20 @@ typedef struct
    float sy;
 } painter_transform_t;
 
+enum {
+   PNTR_LINE_SMOOTH = 0,
+   PNTR_LINE_ROUGH
+};
+
+enum {
+   PNTR_FILL_NONZERO = 0,
+   PNTR_FILL_EVENODD
+};
+
 typedef struct painter_s painter_t;
+typedef struct pntr_queue_s pntr_queue_t;
+typedef struct pntr_dirty_s pntr_dirty_t;
+typedef struct pntr_cache_s pntr_cache_t;
 
 struct painter_s
 {
@@ -60,29 +182,67 @@ struct painter_s
 
    bitmap_t *target;
    font_t   *font;
+   int      font_ref; /* Lua registry reference keeping font alive */
    rect_t   clip;
 
    painter_transform_t *trans;
    painter_transform_t stack[64];
    size_t stack_pos;
 
+   float line_width;
+   unsigned line_style; /* PNTR_LINE_*, lines are always drawn rough for now */
+   unsigned fill_rule;  /* PNTR_FILL_*, for polygons */
+   unsigned blend_mode; /* PNTR_BLEND_*, see painter_blend.h */
+
    painter_t *parent;
+
+   /* when set, drawing is recorded there instead, see painter_queue.h */
+   pntr_queue_t *queue;
+
+   /* when set, collects the pixels drawing touches, see painter_dirty.h */
+   pntr_dirty_t *dirty;
+
+   /* when set, keeps the bitmaps drawn scaled or rotated, see painter_cache.h */
+   pntr_cache_t *cache;
 };
 
 void pntr_reset(painter_t *p);
 void pntr_clear(painter_t *p);
 void pntr_sanitize_clip(painter_t *p);
+void pntr_plot(painter_t *p, int x, int y);
 void pntr_strike_line(painter_t *p, int x1, int y1, int x2, int y2);
 void pntr_strike_rect(painter_t *p, const rect_t *rect);
 void pntr_fill_rect(painter_t *p, const rect_t *rect);
 void pntr_strike_poly(painter_t *p, const int *points, int nb_points);
 void pntr_fill_poly(painter_t *p, const int *points, int nb_points);
+/* ellipses centered on pixel (x, y); nb_segments > 0 draws a polygon with
+ * that many sides instead of the exact shape. */
 void pntr_strike_ellipse(painter_t *p, int x, int y, int radius_x, int radius_y, int nb_segments);
 void pntr_fill_ellipse(painter_t *p, int x, int y, int radius_x, int radius_y, int nb_segments);
 void pntr_draw(painter_t *p, const bitmap_t *bmp, const rect_t *src_rect, const rect_t *dst_rect);
 void pntr_print(painter_t *p, int x, int y, const char *text, int limit);
 int  pntr_text_width(painter_t *p, const char *text);
 void pntr_printf(painter_t *p, int x, int y, const char *format, ...);
+void pntr_draw_text(painter_t *p, const font_t *font, const text_layout_t *layout, int x, int y);
+/* draws the sprites offset by (x, y), each as pntr_draw would with its own
+ * rotation and scale in place of the painter's. */
+void pntr_draw_sprites(painter_t *p, const bitmap_t *bmp, const sprite_t *sprites, unsigned count, int x, int y);
+/* draws the tiles of the layer meeting the clip, 1:1 with its top-left
+ * corner at (x, y). */
+void pntr_draw_tiles(painter_t *p, const bitmap_t *atlas, const tile_layer_t *layer, int x, int y);
+/* draws each particle as bmp centered on it, scaled by its size and
+ * multiplied by its color, the system being offset by (x, y). */
+void pntr_draw_particles(painter_t *p, const bitmap_t *bmp, const particles_t *ps, int x, int y);
+/* draws the whole of bmp stretched over dst_rect, offset by the translation
+ * only, multiplied by the straight color tint. */
+void pntr_draw_tinted(painter_t *p, const bitmap_t *bmp, const rect_t *dst_rect, uint32_t tint);
+/* draws the triangles of the mesh textured with bmp, or in plain vertex
+ * colors without one, its vertices rotated by r and scaled by (sx, sy)
+ * about (x, y). */
+void pntr_draw_mesh(painter_t *p, const bitmap_t *bmp, const mesh_t *mesh, float x, float y, float r, float sx, float sy);
+/* fills a triangle of vertices already placed by pntr_draw_mesh, the
+ * transform being ignored. */
+void pntr_fill_triangle(painter_t *p, const bitmap_t *bmp, const mesh_point_t *a, const mesh_point_t *b, const mesh_point_t *c);
 
 /* Transformations */
 bool pntr_push(painter_t *p);
@@ -94,6 +254,33 @@ void pntr_translate(painter_t *p, int x, int y);
 
 font_t *font_load_filename(const char *filename, const char *characters, unsigned flags);
 font_t *font_load_bitmap(const bitmap_t *bmp, const char *characters, unsigned flags);
+int font_text_width(const font_t *font, const char *text);
+
+/* buf, when given, holds the first capacity glyphs and is never freed. */
+void text_layout_init(text_layout_t *layout, glyph_t *buf, unsigned capacity);
+void text_layout_free(text_layout_t *layout);
+void text_layout_clear(text_layout_t *layout);
+/* appends text as pntr_print would draw it at (x, y). */
+void text_layout_add(text_layout_t *layout, const font_t *font, const char *text, int x, int y, int limit);
+
+/* Classifies the bitmap pixels into transparent/opaque/blended runs so that
+ * pntr_draw can skip or copy them. Must be called again (or the spans freed)
+ * whenever the pixels change. Building gives the bitmap a new serial and
+ * freeing clears it. */
+void bitmap_build_spans(bitmap_t *bmp);
+void bitmap_free_spans(bitmap_t *bmp);
+
+/* gives the bitmap spans built before for the same pixels, along with a new
+ * serial. The table is not copied and must outlive them. */
+void bitmap_use_spans(bitmap_t *bmp, uint32_t *rows, uint32_t *runs);
+
+/* Converts the pixels to or from the premultiplied form, which drawing
+ * blends with one multiplication less per channel. */
+void bitmap_set_premultiplied(bitmap_t *bmp, bool premultiplied);
+
+/* Replaces colors [first, first + count) of the palette of an indexed
+ * bitmap, colors being straight, and keeps the spans up to date. */
+void bitmap_set_palette(bitmap_t *bmp, const uint32_t *colors, unsigned first, unsigned count);
 
 rect_t rect_intersect(const rect_t *a, const rect_t *b);
 int rect_is_null(const rect_t *r);
@@ -0,0 +1,188 @@
+#include <stdlib.h>
+#include <string.h>
+#include <retro_miscellaneous.h>
+
+#include "lutro.h"
+#include "painter_atlas.h"
+
+// the top of the area packed so far over columns [x, x + width).
+typedef struct
+{
+   unsigned x, y, width;
+} skyline_node_t;
+
+typedef struct
+{
+   uint32_t *data;
+   skyline_node_t *nodes; // left to right, covering the page width
+   unsigned nb_nodes;
+} atlas_page_t;
+
+struct pntr_atlas_s
+{
+   unsigned size;
+   unsigned refs;
+   atlas_page_t *pages;
+   unsigned nb_pages;
+};
+
+pntr_atlas_t *pntr_atlas_new(unsigned page_size)
+{
+   pntr_atlas_t *atlas = lutro_calloc(1, sizeof(pntr_atlas_t));
+   atlas->size = page_size;
+   atlas->refs = 1;
+   return atlas;
+}
+
+void pntr_atlas_release(pntr_atlas_t *atlas)
+{
+   if (--atlas->refs > 0)
+      return;
+
+   for (unsigned i = 0; i < atlas->nb_pages; i++)
+   {
+      lutro_free(atlas->pages[i].data);
+      lutro_free(atlas->pages[i].nodes);
+   }
+
+   lutro_free(atlas->pages);
+   lutro_free(atlas);
+}
+
+static atlas_page_t *add_page(pntr_atlas_t *atlas)
+{
+   atlas_page_t *pages = lutro_malloc((atlas->nb_pages + 1) * sizeof(atlas_page_t));
+   if (atlas->nb_pages)
+      memcpy(pages, atlas->pages, atlas->nb_pages * sizeof(atlas_page_t));
+   lutro_free(atlas->pages);
+   atlas->pages = pages;
+
+   atlas_page_t *page = &pages[atlas->nb_pages++];
+   page->data = lutro_calloc((size_t)atlas->size * atlas->size, sizeof(uint32_t));
+   // there can never be more nodes than columns, plus one being placed.
+   page->nodes = lutro_malloc((atlas->size + 1) * sizeof(skyline_node_t));
+   page->nodes[0].x = 0;
+   page->nodes[0].y = 0;
+   page->nodes[0].width = atlas->size;
+   page->nb_nodes = 1;
+
+   return page;
+}
+
+// lowest top a width wide area starting at node i can sit on, or -1 when
+// it would stick out of the page.
+static int skyline_fit(const pntr_atlas_t *atlas, const atlas_page_t *page, unsigned i,
+      unsigned width, unsigned height)
+{
+   if (page->nodes[i].x + width > atlas->size)
+      return -1;
+
+   unsigned y = 0;
+   for (unsigned left = width; left > 0; i++)
+   {
+      y = MAX(y, page->nodes[i].y);
+      left -= MIN(left, page->nodes[i].width);
+   }
+
+   return y + height <= atlas->size ? (int)y : -1;
+}
+
+// raises the skyline over the area placed at node i.
+static void skyline_add(atlas_page_t *page, unsigned i, unsigned y, unsigned width, unsigned height)
+{
+   skyline_node_t node = { page->nodes[i].x, y + height, width };
+
+   memmove(&page->nodes[i + 1], &page->nodes[i], (page->nb_nodes - i) * sizeof(skyline_node_t));
+   page->nodes[i] = node;
+   page->nb_nodes++;
+
+   // the nodes now under the new one shrink or go.
+   unsigned end = node.x + node.width;
+   unsigned j = i + 1;
+   while (j < page->nb_nodes && page->nodes[j].x < end)
+   {
+      skyline_node_t *next = &page->nodes[j];
+      unsigned next_end = next->x + next->width;
+
+      if (next_end <= end)
+      {
+         memmove(next, next + 1, (page->nb_nodes - j - 1) * sizeof(skyline_node_t));
+         page->nb_nodes--;
+         continue;
+      }
+
+      next->width = next_end - end;
+      next->x = end;
+      break;
+   }
+
+   // neighbours at the same height merge.
+   for (j = 0; j + 1 < page->nb_nodes; )
+   {
+      skyline_node_t *a = &page->nodes[j], *b = a + 1;
+      if (a->y != b->y)
+      {
+         j++;
+         continue;
+      }
+
+      a->width += b->width;
+      memmove(b, b + 1, (page->nb_nodes - j - 2) * sizeof(skyline_node_t));
+      page->nb_nodes--;
+   }
+}
+
+bool pntr_atlas_place(pntr_atlas_t *atlas, bitmap_t *bmp, unsigned width, unsigned height)
+{
+   if (width == 0 || height == 0 || width > atlas->size || height > atlas->size)
+      return false;
+
+   // bottom-left: the lowest spot on any page, the leftmost among those.
+   atlas_page_t *best_page = NULL;
+   unsigned best_node = 0;
+   int best_y = -1;
+
+   for (unsigned p = 0; p < atlas->nb_pages && best_y != 0; p++)
+   {
+      atlas_page_t *page = &atlas->pages[p];
+      for (unsigned i = 0; i < page->nb_nodes; i++)
+      {
+         int y = skyline_fit(atlas, page, i, width, height);
+         if (y >= 0 && (best_y < 0 || y < best_y))
+         {
+            best_page = page;
+            best_node = i;
+            best_y = y;
+         }
+      }
+   }
+
+   if (!best_page)
+   {
+      best_page = add_page(atlas);
+      best_node = 0;
+      best_y = 0;
+   }
+
+   unsigned x = best_page->nodes[best_node].x;
+   skyline_add(best_page, best_node, best_y, width, height);
+
+   bmp->data   = best_page->data + (size_t)best_y * atlas->size + x;
+   bmp->width  = width;
+   bmp->height = height;
+   bmp->pitch  = atlas->size << 2;
+   bmp->atlas  = atlas;
+   atlas->refs++;
+
+   return true;
+}
+
+unsigned pntr_atlas_page_count(const pntr_atlas_t *atlas)
+{
+   return atlas->nb_pages;
+}
+
+unsigned pntr_atlas_page_size(const pntr_atlas_t *atlas)
+{
+   return atlas->size;
+}
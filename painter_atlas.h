@@ -0,0 +1,31 @@
+#ifndef PAINTER_ATLAS_H
+#define PAINTER_ATLAS_H
+
+#include "painter.h"
+
+/* Atlas pages.
+ *
+ * Small bitmaps are packed together into shared pages of 32 bits pixels,
+ * so that sprites drawn together are read from nearby memory. A bitmap
+ * placed on a page keeps its own width and height, data pointing at its
+ * top-left pixel and pitch being the page's, which the blitters handle
+ * like any other bitmap.
+ *
+ * Room is found with a skyline packer and never given back: the pages are
+ * freed once the atlas and every bitmap placed on it have been released.
+ */
+
+pntr_atlas_t *pntr_atlas_new(unsigned page_size);
+
+/* drops a reference to the atlas, be it its creator's or a bitmap's. */
+void pntr_atlas_release(pntr_atlas_t *atlas);
+
+/* points bmp at a free, transparent width x height area of a page, opening
+ * a new page when none has room, and has it reference the atlas. Returns
+ * false when the size does not fit in a page. */
+bool pntr_atlas_place(pntr_atlas_t *atlas, bitmap_t *bmp, unsigned width, unsigned height);
+
+unsigned pntr_atlas_page_count(const pntr_atlas_t *atlas);
+unsigned pntr_atlas_page_size(const pntr_atlas_t *atlas);
+
+#endif // PAINTER_ATLAS_H
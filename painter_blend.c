@@ -0,0 +1,706 @@
+#include <stdint.h>
+#include <string.h>
+#include <features/features_cpu.h>
+
+#include "painter_blend.h"
+#include "image.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__SSE2__) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define PNTR_BLEND_SSE2 1
+#include <emmintrin.h>
+// AVX2 kernels are compiled with a per-function target so that the rest of the
+// core keeps running on CPUs without AVX2.
+#if defined(_MSC_VER) || defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5)
+#define PNTR_BLEND_AVX2 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#define PNTR_TARGET_AVX2
+#else
+#define PNTR_TARGET_AVX2 __attribute__((target("avx2")))
+#endif
+#endif
+#endif
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#define PNTR_BLEND_NEON 1
+#include <arm_neon.h>
+#endif
+
+/* from http://www.codeguru.com/cpp/cpp/algorithms/general/article.php/c15989/Tip-An-Optimized-Formula-for-Alpha-Blending-Pixels.htm
+ * The source alpha is widened from [0, 255] to [0, 256] so that fully
+ * transparent and fully opaque pixels come out exact, which lets the blitter
+ * skip or copy those runs without changing the result. */
+#define BLEND_WEIGHT(A) ((A) + ((A) >> 7))
+#define COMPOSE_FAST(S, D, A) (((S * A) + (D * (256U - A))) >> 8U)
+#define DISASSEMBLE_RGB(COLOR, R, G, B) \
+   R = ((COLOR & RED_MASK) >> RED_SHIFT);\
+   G = ((COLOR & GREEN_MASK) >> GREEN_SHIFT);\
+   B = ((COLOR & BLUE_MASK) >> BLUE_SHIFT);
+
+static inline uint32_t blend_pixel(uint32_t s, uint32_t d)
+{
+   uint32_t sa, sr, sg, sb, da, dr, dg, db;
+   sa = BLEND_WEIGHT(s >> 24);
+   da = d >> 24;
+   DISASSEMBLE_RGB(s, sr, sg, sb);
+   DISASSEMBLE_RGB(d, dr, dg, db);
+   return (COMPOSE_FAST(255U, da, sa) << ALPHA_SHIFT)
+      | (COMPOSE_FAST(sr, dr, sa) << RED_SHIFT)
+      | (COMPOSE_FAST(sg, dg, sa) << GREEN_SHIFT)
+      | (COMPOSE_FAST(sb, db, sa) << BLUE_SHIFT);
+}
+
+void pntr_blend_span_c(uint32_t *dst, const uint32_t *src, int count)
+{
+   for (int i = 0; i < count; ++i)
+      dst[i] = blend_pixel(src[i], dst[i]);
+}
+
+void pntr_blend_fill_c(uint32_t *dst, uint32_t color, int count)
+{
+   for (int i = 0; i < count; ++i)
+      dst[i] = blend_pixel(color, dst[i]);
+}
+
+/* The other modes apply the same formula to the three color bytes, whatever
+ * their order, the alpha byte always being the top one. */
+#define DEFINE_BLEND_MODE(NAME, CHANNEL, ALPHA) \
+static inline uint32_t NAME##_pixel(uint32_t s, uint32_t d) \
+{ \
+   uint32_t w = BLEND_WEIGHT(s >> 24); \
+   (void)w; \
+   return ((uint32_t)(ALPHA) << 24) \
+      | (CHANNEL((s >> 16) & 0xff, (d >> 16) & 0xff, w) << 16) \
+      | (CHANNEL((s >> 8) & 0xff, (d >> 8) & 0xff, w) << 8) \
+      | CHANNEL(s & 0xff, d & 0xff, w); \
+} \
+static void NAME##_span(uint32_t *dst, const uint32_t *src, int count) \
+{ \
+   for (int i = 0; i < count; ++i) \
+      dst[i] = NAME##_pixel(src[i], dst[i]); \
+} \
+static void NAME##_fill(uint32_t *dst, uint32_t color, int count) \
+{ \
+   for (int i = 0; i < count; ++i) \
+      dst[i] = NAME##_pixel(color, dst[i]); \
+}
+
+static inline uint32_t saturate(uint32_t c)
+{
+   return c > 255 ? 255 : c;
+}
+
+// a * b / 255, rounded to the nearest.
+static inline uint32_t mul255(uint32_t a, uint32_t b)
+{
+   uint32_t t = a * b + 128;
+   return (t + (t >> 8)) >> 8;
+}
+
+static inline uint32_t premultiplied_channel(uint32_t s, uint32_t d, uint32_t w)
+{
+   return saturate(s + ((d * (256 - w)) >> 8));
+}
+
+static inline uint32_t add_channel(uint32_t s, uint32_t d, uint32_t w)
+{
+   return saturate(d + ((s * w) >> 8));
+}
+
+static inline uint32_t add_premultiplied_channel(uint32_t s, uint32_t d, uint32_t w)
+{
+   (void)w;
+   return saturate(d + s);
+}
+
+static inline uint32_t subtract_channel(uint32_t s, uint32_t d, uint32_t w)
+{
+   s = (s * w) >> 8;
+   return d > s ? d - s : 0;
+}
+
+static inline uint32_t subtract_premultiplied_channel(uint32_t s, uint32_t d, uint32_t w)
+{
+   (void)w;
+   return d > s ? d - s : 0;
+}
+
+static inline uint32_t multiply_channel(uint32_t s, uint32_t d, uint32_t w)
+{
+   return COMPOSE_FAST(mul255(s, d), d, w);
+}
+
+static inline uint32_t multiply_premultiplied_channel(uint32_t s, uint32_t d, uint32_t w)
+{
+   return saturate(mul255(s, d) + ((d * (256 - w)) >> 8));
+}
+
+DEFINE_BLEND_MODE(premultiplied, premultiplied_channel, premultiplied_channel(s >> 24, d >> 24, w))
+DEFINE_BLEND_MODE(add, add_channel, d >> 24)
+DEFINE_BLEND_MODE(add_premultiplied, add_premultiplied_channel, d >> 24)
+DEFINE_BLEND_MODE(subtract, subtract_channel, d >> 24)
+DEFINE_BLEND_MODE(subtract_premultiplied, subtract_premultiplied_channel, d >> 24)
+DEFINE_BLEND_MODE(multiply, multiply_channel, d >> 24)
+DEFINE_BLEND_MODE(multiply_premultiplied, multiply_premultiplied_channel, d >> 24)
+
+static void replace_span(uint32_t *dst, const uint32_t *src, int count)
+{
+   memcpy(dst, src, count * sizeof(uint32_t));
+}
+
+static void replace_fill(uint32_t *dst, uint32_t color, int count)
+{
+   for (int i = 0; i < count; ++i)
+      dst[i] = color;
+}
+
+void pntr_pack_rgb565_c(uint16_t *dst, const uint32_t *src, int count)
+{
+   for (int i = 0; i < count; ++i)
+   {
+      uint32_t r, g, b;
+      DISASSEMBLE_RGB(src[i], r, g, b);
+      dst[i] = (uint16_t)(((r >> 3) << 11) | ((g >> 2) << 5) | (b >> 3));
+   }
+}
+
+#ifndef HAVE_COMPOSITION
+// without composition, alpha blending is an alpha test.
+static void alpha_test_span(uint32_t *dst, const uint32_t *src, int count)
+{
+   for (int i = 0; i < count; ++i)
+   {
+      if (src[i] & 0xff000000)
+         dst[i] = src[i];
+   }
+}
+
+static const pntr_blend_kernels_t alpha_test = {
+   "alpha test", alpha_test_span, replace_fill, 1, 1, 1
+};
+#endif
+
+// premultiplied alpha gets its SIMD kernels from pntr_blend_init().
+static pntr_blend_kernels_t modes[2][PNTR_BLEND_MODES] = {
+   {
+      { "alpha",    NULL,          NULL,          1, 1, 1 }, // pntr_blend
+      { "replace",  replace_span,  replace_fill,  1, 0, 0 },
+      { "add",      add_span,      add_fill,      0, 1, 1 },
+      { "subtract", subtract_span, subtract_fill, 0, 1, 1 },
+      { "multiply", multiply_span, multiply_fill, 0, 1, 1 },
+   },
+   {
+      { "c",                      premultiplied_span,          premultiplied_fill,          1, 0, 1 },
+      { "replace",                replace_span,                replace_fill,                1, 0, 0 },
+      { "add premultiplied",      add_premultiplied_span,      add_premultiplied_fill,      0, 0, 1 },
+      { "subtract premultiplied", subtract_premultiplied_span, subtract_premultiplied_fill, 0, 0, 1 },
+      { "multiply premultiplied", multiply_premultiplied_span, multiply_premultiplied_fill, 0, 0, 1 },
+   }
+};
+
+const pntr_blend_kernels_t *pntr_blend_kernels(unsigned mode)
+{
+   unsigned premultiplied = (mode & PNTR_BLEND_PREMULTIPLIED) != 0;
+
+   mode &= ~PNTR_BLEND_PREMULTIPLIED;
+   if (mode >= PNTR_BLEND_MODES)
+      mode = PNTR_BLEND_ALPHA;
+
+   if (mode == PNTR_BLEND_ALPHA)
+   {
+#ifndef HAVE_COMPOSITION
+      return &alpha_test;
+#endif
+      if (!premultiplied)
+         return &pntr_blend;
+   }
+
+   return &modes[premultiplied][mode];
+}
+
+uint32_t pntr_premultiply(uint32_t color)
+{
+   uint32_t a = color >> 24;
+
+   return (color & 0xff000000)
+      | (mul255((color >> 16) & 0xff, a) << 16)
+      | (mul255((color >> 8) & 0xff, a) << 8)
+      | mul255(color & 0xff, a);
+}
+
+void pntr_unpack_rgba_c(uint32_t *pixels, int count, int premultiply)
+{
+   for (int i = 0; i < count; ++i)
+   {
+      const uint8_t *p = (const uint8_t*)(pixels + i);
+      uint32_t color = ((uint32_t)p[3] << 24) | ((uint32_t)p[0] << 16) | ((uint32_t)p[1] << 8) | p[2];
+      pixels[i] = premultiply ? pntr_premultiply(color) : color;
+   }
+}
+
+uint32_t pntr_unpremultiply(uint32_t color)
+{
+   uint32_t a = color >> 24;
+
+   if (a == 0)
+      return 0;
+
+   return (color & 0xff000000)
+      | (saturate((((color >> 16) & 0xff) * 255 + a / 2) / a) << 16)
+      | (saturate((((color >> 8) & 0xff) * 255 + a / 2) / a) << 8)
+      | saturate(((color & 0xff) * 255 + a / 2) / a);
+}
+
+/* The SIMD kernels below compose all four bytes of a pixel with the same
+ * formula, the source alpha byte being forced to 255 so that it yields the
+ * destination alpha. They do not depend on the channel order selected by ABGR.
+ * Every intermediate fits in 16 bits: S * A + D * (256 - A) <= 255 * 256. */
+
+#ifdef PNTR_BLEND_SSE2
+static inline __m128i blend4_sse2(__m128i s, __m128i d)
+{
+   const __m128i zero       = _mm_setzero_si128();
+   const __m128i k256       = _mm_set1_epi16(256);
+   const __m128i alpha_mask = _mm_set1_epi32(0xff000000);
+
+   __m128i a32  = _mm_srli_epi32(s, 24);
+   a32          = _mm_add_epi32(a32, _mm_srli_epi32(a32, 7));
+   __m128i a16  = _mm_or_si128(a32, _mm_slli_epi32(a32, 16));
+   __m128i a_lo = _mm_unpacklo_epi32(a16, a16);
+   __m128i a_hi = _mm_unpackhi_epi32(a16, a16);
+
+   s = _mm_or_si128(s, alpha_mask);
+
+   __m128i lo = _mm_add_epi16(
+         _mm_mullo_epi16(_mm_unpacklo_epi8(s, zero), a_lo),
+         _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), _mm_sub_epi16(k256, a_lo)));
+   __m128i hi = _mm_add_epi16(
+         _mm_mullo_epi16(_mm_unpackhi_epi8(s, zero), a_hi),
+         _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), _mm_sub_epi16(k256, a_hi)));
+
+   return _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8));
+}
+
+static void blend_span_sse2(uint32_t *dst, const uint32_t *src, int count)
+{
+   int i = 0;
+   for (; i + 4 <= count; i += 4)
+   {
+      __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+      __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+      _mm_storeu_si128((__m128i*)(dst + i), blend4_sse2(s, d));
+   }
+   pntr_blend_span_c(dst + i, src + i, count - i);
+}
+
+static void blend_fill_sse2(uint32_t *dst, uint32_t color, int count)
+{
+   int i = 0;
+   const __m128i s = _mm_set1_epi32((int)color);
+   for (; i + 4 <= count; i += 4)
+   {
+      __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+      _mm_storeu_si128((__m128i*)(dst + i), blend4_sse2(s, d));
+   }
+   pntr_blend_fill_c(dst + i, color, count - i);
+}
+
+// premultiplied sources only weigh the destination, the four bytes alike.
+static inline __m128i premultiplied4_sse2(__m128i s, __m128i d)
+{
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i k256 = _mm_set1_epi16(256);
+
+   __m128i a32  = _mm_srli_epi32(s, 24);
+   a32          = _mm_add_epi32(a32, _mm_srli_epi32(a32, 7));
+   __m128i a16  = _mm_or_si128(a32, _mm_slli_epi32(a32, 16));
+   __m128i a_lo = _mm_sub_epi16(k256, _mm_unpacklo_epi32(a16, a16));
+   __m128i a_hi = _mm_sub_epi16(k256, _mm_unpackhi_epi32(a16, a16));
+
+   __m128i lo = _mm_mullo_epi16(_mm_unpacklo_epi8(d, zero), a_lo);
+   __m128i hi = _mm_mullo_epi16(_mm_unpackhi_epi8(d, zero), a_hi);
+
+   return _mm_adds_epu8(s, _mm_packus_epi16(_mm_srli_epi16(lo, 8), _mm_srli_epi16(hi, 8)));
+}
+
+static void premultiplied_span_sse2(uint32_t *dst, const uint32_t *src, int count)
+{
+   int i = 0;
+   for (; i + 4 <= count; i += 4)
+   {
+      __m128i s = _mm_loadu_si128((const __m128i*)(src + i));
+      __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+      _mm_storeu_si128((__m128i*)(dst + i), premultiplied4_sse2(s, d));
+   }
+   premultiplied_span(dst + i, src + i, count - i);
+}
+
+static void premultiplied_fill_sse2(uint32_t *dst, uint32_t color, int count)
+{
+   int i = 0;
+   const __m128i s = _mm_set1_epi32((int)color);
+   for (; i + 4 <= count; i += 4)
+   {
+      __m128i d = _mm_loadu_si128((const __m128i*)(dst + i));
+      _mm_storeu_si128((__m128i*)(dst + i), premultiplied4_sse2(s, d));
+   }
+   premultiplied_fill(dst + i, color, count - i);
+}
+
+#ifndef ABGR
+// like the NEON one, for XRGB pixels only.
+static void pack_rgb565_sse2(uint16_t *dst, const uint32_t *src, int count)
+{
+   const __m128i red   = _mm_set1_epi32(0xf800);
+   const __m128i green = _mm_set1_epi32(0x07e0);
+   const __m128i blue  = _mm_set1_epi32(0x001f);
+
+   int i = 0;
+   for (; i + 8 <= count; i += 8)
+   {
+      __m128i p[2];
+      for (int k = 0; k < 2; k++)
+      {
+         __m128i s = _mm_loadu_si128((const __m128i*)(src + i + 4 * k));
+         p[k] = _mm_or_si128(_mm_or_si128(
+                  _mm_and_si128(_mm_srli_epi32(s, 8), red),
+                  _mm_and_si128(_mm_srli_epi32(s, 5), green)),
+               _mm_and_si128(_mm_srli_epi32(s, 3), blue));
+         // sign extended, so that the signed saturation of the pack keeps them.
+         p[k] = _mm_srai_epi32(_mm_slli_epi32(p[k], 16), 16);
+      }
+      _mm_storeu_si128((__m128i*)(dst + i), _mm_packs_epi32(p[0], p[1]));
+   }
+   pntr_pack_rgb565_c(dst + i, src + i, count - i);
+}
+#endif
+
+// the red and blue bytes swap places, then the colors go through mul255
+// 16 bits wide, alpha being multiplied by 255 to stay the same.
+static inline __m128i premultiply4_sse2(__m128i p)
+{
+   const __m128i zero  = _mm_setzero_si128();
+   const __m128i k128  = _mm_set1_epi16(128);
+   const __m128i alpha = _mm_set_epi16(255, 0, 0, 0, 255, 0, 0, 0);
+
+   __m128i a32  = _mm_srli_epi32(p, 24);
+   __m128i a16  = _mm_or_si128(a32, _mm_slli_epi32(a32, 16));
+   __m128i a_lo = _mm_or_si128(_mm_unpacklo_epi32(a16, a16), alpha);
+   __m128i a_hi = _mm_or_si128(_mm_unpackhi_epi32(a16, a16), alpha);
+
+   __m128i lo = _mm_add_epi16(_mm_mullo_epi16(_mm_unpacklo_epi8(p, zero), a_lo), k128);
+   __m128i hi = _mm_add_epi16(_mm_mullo_epi16(_mm_unpackhi_epi8(p, zero), a_hi), k128);
+   lo = _mm_srli_epi16(_mm_add_epi16(lo, _mm_srli_epi16(lo, 8)), 8);
+   hi = _mm_srli_epi16(_mm_add_epi16(hi, _mm_srli_epi16(hi, 8)), 8);
+
+   return _mm_packus_epi16(lo, hi);
+}
+
+static void unpack_rgba_sse2(uint32_t *pixels, int count, int premultiply)
+{
+   const __m128i ga = _mm_set1_epi32(0xff00ff00);
+   const __m128i rb = _mm_set1_epi32(0x000000ff);
+
+   int i = 0;
+   for (; i + 4 <= count; i += 4)
+   {
+      __m128i p = _mm_loadu_si128((const __m128i*)(pixels + i));
+      p = _mm_or_si128(_mm_and_si128(p, ga), _mm_or_si128(
+               _mm_and_si128(_mm_srli_epi32(p, 16), rb),
+               _mm_slli_epi32(_mm_and_si128(p, rb), 16)));
+      if (premultiply)
+         p = premultiply4_sse2(p);
+      _mm_storeu_si128((__m128i*)(pixels + i), p);
+   }
+   pntr_unpack_rgba_c(pixels + i, count - i, premultiply);
+}
+#endif
+
+#ifdef PNTR_BLEND_AVX2
+PNTR_TARGET_AVX2
+static inline __m256i blend8_avx2(__m256i s, __m256i d)
+{
+   const __m256i zero       = _mm256_setzero_si256();
+   const __m256i k256       = _mm256_set1_epi16(256);
+   const __m256i alpha_mask = _mm256_set1_epi32(0xff000000);
+
+   // unpack/pack work within 128-bit lanes, which keeps pixel order intact.
+   __m256i a32  = _mm256_srli_epi32(s, 24);
+   a32          = _mm256_add_epi32(a32, _mm256_srli_epi32(a32, 7));
+   __m256i a16  = _mm256_or_si256(a32, _mm256_slli_epi32(a32, 16));
+   __m256i a_lo = _mm256_unpacklo_epi32(a16, a16);
+   __m256i a_hi = _mm256_unpackhi_epi32(a16, a16);
+
+   s = _mm256_or_si256(s, alpha_mask);
+
+   __m256i lo = _mm256_add_epi16(
+         _mm256_mullo_epi16(_mm256_unpacklo_epi8(s, zero), a_lo),
+         _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), _mm256_sub_epi16(k256, a_lo)));
+   __m256i hi = _mm256_add_epi16(
+         _mm256_mullo_epi16(_mm256_unpackhi_epi8(s, zero), a_hi),
+         _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), _mm256_sub_epi16(k256, a_hi)));
+
+   return _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8));
+}
+
+PNTR_TARGET_AVX2
+static void blend_span_avx2(uint32_t *dst, const uint32_t *src, int count)
+{
+   int i = 0;
+   for (; i + 8 <= count; i += 8)
+   {
+      __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+      __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+      _mm256_storeu_si256((__m256i*)(dst + i), blend8_avx2(s, d));
+   }
+   blend_span_sse2(dst + i, src + i, count - i);
+}
+
+PNTR_TARGET_AVX2
+static void blend_fill_avx2(uint32_t *dst, uint32_t color, int count)
+{
+   int i = 0;
+   const __m256i s = _mm256_set1_epi32((int)color);
+   for (; i + 8 <= count; i += 8)
+   {
+      __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+      _mm256_storeu_si256((__m256i*)(dst + i), blend8_avx2(s, d));
+   }
+   blend_fill_sse2(dst + i, color, count - i);
+}
+
+PNTR_TARGET_AVX2
+static inline __m256i premultiplied8_avx2(__m256i s, __m256i d)
+{
+   const __m256i zero = _mm256_setzero_si256();
+   const __m256i k256 = _mm256_set1_epi16(256);
+
+   __m256i a32  = _mm256_srli_epi32(s, 24);
+   a32          = _mm256_add_epi32(a32, _mm256_srli_epi32(a32, 7));
+   __m256i a16  = _mm256_or_si256(a32, _mm256_slli_epi32(a32, 16));
+   __m256i a_lo = _mm256_sub_epi16(k256, _mm256_unpacklo_epi32(a16, a16));
+   __m256i a_hi = _mm256_sub_epi16(k256, _mm256_unpackhi_epi32(a16, a16));
+
+   __m256i lo = _mm256_mullo_epi16(_mm256_unpacklo_epi8(d, zero), a_lo);
+   __m256i hi = _mm256_mullo_epi16(_mm256_unpackhi_epi8(d, zero), a_hi);
+
+   return _mm256_adds_epu8(s, _mm256_packus_epi16(_mm256_srli_epi16(lo, 8), _mm256_srli_epi16(hi, 8)));
+}
+
+PNTR_TARGET_AVX2
+static void premultiplied_span_avx2(uint32_t *dst, const uint32_t *src, int count)
+{
+   int i = 0;
+   for (; i + 8 <= count; i += 8)
+   {
+      __m256i s = _mm256_loadu_si256((const __m256i*)(src + i));
+      __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+      _mm256_storeu_si256((__m256i*)(dst + i), premultiplied8_avx2(s, d));
+   }
+   premultiplied_span_sse2(dst + i, src + i, count - i);
+}
+
+PNTR_TARGET_AVX2
+static void premultiplied_fill_avx2(uint32_t *dst, uint32_t color, int count)
+{
+   int i = 0;
+   const __m256i s = _mm256_set1_epi32((int)color);
+   for (; i + 8 <= count; i += 8)
+   {
+      __m256i d = _mm256_loadu_si256((const __m256i*)(dst + i));
+      _mm256_storeu_si256((__m256i*)(dst + i), premultiplied8_avx2(s, d));
+   }
+   premultiplied_fill_sse2(dst + i, color, count - i);
+}
+#endif
+
+#ifdef PNTR_BLEND_NEON
+static inline uint32x4_t blend4_neon(uint32x4_t s, uint32x4_t d)
+{
+   const uint16x8_t k256 = vdupq_n_u16(256);
+
+   uint32x4_t a32  = vshrq_n_u32(s, 24);
+   a32             = vaddq_u32(a32, vshrq_n_u32(a32, 7));
+   uint32x4_t a16  = vorrq_u32(a32, vshlq_n_u32(a32, 16));
+   uint32x4x2_t a  = vzipq_u32(a16, a16);
+   uint16x8_t a_lo = vreinterpretq_u16_u32(a.val[0]);
+   uint16x8_t a_hi = vreinterpretq_u16_u32(a.val[1]);
+
+   uint8x16_t s8 = vreinterpretq_u8_u32(vorrq_u32(s, vdupq_n_u32(0xff000000)));
+   uint8x16_t d8 = vreinterpretq_u8_u32(d);
+
+   uint16x8_t lo = vmlaq_u16(vmulq_u16(vmovl_u8(vget_low_u8(s8)), a_lo),
+         vmovl_u8(vget_low_u8(d8)), vsubq_u16(k256, a_lo));
+   uint16x8_t hi = vmlaq_u16(vmulq_u16(vmovl_u8(vget_high_u8(s8)), a_hi),
+         vmovl_u8(vget_high_u8(d8)), vsubq_u16(k256, a_hi));
+
+   return vreinterpretq_u32_u8(vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8)));
+}
+
+static void blend_span_neon(uint32_t *dst, const uint32_t *src, int count)
+{
+   int i = 0;
+   for (; i + 4 <= count; i += 4)
+      vst1q_u32(dst + i, blend4_neon(vld1q_u32(src + i), vld1q_u32(dst + i)));
+   pntr_blend_span_c(dst + i, src + i, count - i);
+}
+
+static void blend_fill_neon(uint32_t *dst, uint32_t color, int count)
+{
+   int i = 0;
+   const uint32x4_t s = vdupq_n_u32(color);
+   for (; i + 4 <= count; i += 4)
+      vst1q_u32(dst + i, blend4_neon(s, vld1q_u32(dst + i)));
+   pntr_blend_fill_c(dst + i, color, count - i);
+}
+
+static inline uint32x4_t premultiplied4_neon(uint32x4_t s, uint32x4_t d)
+{
+   const uint16x8_t k256 = vdupq_n_u16(256);
+
+   uint32x4_t a32  = vshrq_n_u32(s, 24);
+   a32             = vaddq_u32(a32, vshrq_n_u32(a32, 7));
+   uint32x4_t a16  = vorrq_u32(a32, vshlq_n_u32(a32, 16));
+   uint32x4x2_t a  = vzipq_u32(a16, a16);
+   uint16x8_t a_lo = vsubq_u16(k256, vreinterpretq_u16_u32(a.val[0]));
+   uint16x8_t a_hi = vsubq_u16(k256, vreinterpretq_u16_u32(a.val[1]));
+
+   uint8x16_t d8 = vreinterpretq_u8_u32(d);
+   uint16x8_t lo = vmulq_u16(vmovl_u8(vget_low_u8(d8)), a_lo);
+   uint16x8_t hi = vmulq_u16(vmovl_u8(vget_high_u8(d8)), a_hi);
+
+   return vreinterpretq_u32_u8(vqaddq_u8(vreinterpretq_u8_u32(s),
+            vcombine_u8(vshrn_n_u16(lo, 8), vshrn_n_u16(hi, 8))));
+}
+
+static void premultiplied_span_neon(uint32_t *dst, const uint32_t *src, int count)
+{
+   int i = 0;
+   for (; i + 4 <= count; i += 4)
+      vst1q_u32(dst + i, premultiplied4_neon(vld1q_u32(src + i), vld1q_u32(dst + i)));
+   premultiplied_span(dst + i, src + i, count - i);
+}
+
+static void premultiplied_fill_neon(uint32_t *dst, uint32_t color, int count)
+{
+   int i = 0;
+   const uint32x4_t s = vdupq_n_u32(color);
+   for (; i + 4 <= count; i += 4)
+      vst1q_u32(dst + i, premultiplied4_neon(s, vld1q_u32(dst + i)));
+   premultiplied_fill(dst + i, color, count - i);
+}
+
+#ifndef ABGR
+// the top bits of each channel are shifted right into place under the
+// channel above it.
+static void pack_rgb565_neon(uint16_t *dst, const uint32_t *src, int count)
+{
+   int i = 0;
+   for (; i + 8 <= count; i += 8)
+   {
+      uint8x8x4_t s = vld4_u8((const uint8_t*)(src + i));
+      uint16x8_t p = vshll_n_u8(s.val[2], 8);
+      p = vsriq_n_u16(p, vshll_n_u8(s.val[1], 8), 5);
+      p = vsriq_n_u16(p, vshll_n_u8(s.val[0], 8), 11);
+      vst1q_u16(dst + i, p);
+   }
+   pntr_pack_rgb565_c(dst + i, src + i, count - i);
+}
+#endif
+
+// rounds as mul255 does: (t + ((t + 128) >> 8) + 128) >> 8, t = c * a.
+static inline uint8x8_t premultiply8_neon(uint8x8_t c, uint8x8_t a)
+{
+   uint16x8_t t = vmull_u8(c, a);
+   return vraddhn_u16(t, vrshrq_n_u16(t, 8));
+}
+
+static void unpack_rgba_neon(uint32_t *pixels, int count, int premultiply)
+{
+   int i = 0;
+   for (; i + 8 <= count; i += 8)
+   {
+      uint8x8x4_t p = vld4_u8((const uint8_t*)(pixels + i));
+      uint8x8_t r = p.val[0];
+      p.val[0] = p.val[2];
+      p.val[2] = r;
+      if (premultiply)
+      {
+         p.val[0] = premultiply8_neon(p.val[0], p.val[3]);
+         p.val[1] = premultiply8_neon(p.val[1], p.val[3]);
+         p.val[2] = premultiply8_neon(p.val[2], p.val[3]);
+      }
+      vst4_u8((uint8_t*)(pixels + i), p);
+   }
+   pntr_unpack_rgba_c(pixels + i, count - i, premultiply);
+}
+#endif
+
+pntr_blend_kernels_t pntr_blend = {
+   "c", pntr_blend_span_c, pntr_blend_fill_c, 1, 1, 1
+};
+
+pntr_pack_fn pntr_pack_rgb565 = pntr_pack_rgb565_c;
+pntr_unpack_fn pntr_unpack_rgba = pntr_unpack_rgba_c;
+
+void pntr_blend_init(void)
+{
+   uint64_t cpu = cpu_features_get();
+   pntr_blend_kernels_t *premultiplied = &modes[1][PNTR_BLEND_ALPHA];
+   (void)cpu;
+
+   pntr_blend.name = "c";
+   pntr_blend.span = pntr_blend_span_c;
+   pntr_blend.fill = pntr_blend_fill_c;
+   premultiplied->name = "c";
+   premultiplied->span = premultiplied_span;
+   premultiplied->fill = premultiplied_fill;
+   pntr_pack_rgb565 = pntr_pack_rgb565_c;
+   pntr_unpack_rgba = pntr_unpack_rgba_c;
+
+#ifdef PNTR_BLEND_SSE2
+   if (cpu & RETRO_SIMD_SSE2)
+   {
+      pntr_blend.name = "sse2";
+      pntr_blend.span = blend_span_sse2;
+      pntr_blend.fill = blend_fill_sse2;
+      premultiplied->name = "sse2";
+      premultiplied->span = premultiplied_span_sse2;
+      premultiplied->fill = premultiplied_fill_sse2;
+#ifndef ABGR
+      pntr_pack_rgb565 = pack_rgb565_sse2;
+#endif
+      pntr_unpack_rgba = unpack_rgba_sse2;
+   }
+#endif
+#ifdef PNTR_BLEND_AVX2
+   if ((cpu & RETRO_SIMD_AVX2) && (cpu & RETRO_SIMD_SSE2))
+   {
+      pntr_blend.name = "avx2";
+      pntr_blend.span = blend_span_avx2;
+      pntr_blend.fill = blend_fill_avx2;
+      premultiplied->name = "avx2";
+      premultiplied->span = premultiplied_span_avx2;
+      premultiplied->fill = premultiplied_fill_avx2;
+   }
+#endif
+#ifdef PNTR_BLEND_NEON
+#if defined(__aarch64__) || defined(_M_ARM64)
+   // NEON is part of the base ARMv8 instruction set.
+   cpu |= RETRO_SIMD_NEON;
+#endif
+   if (cpu & RETRO_SIMD_NEON)
+   {
+      pntr_blend.name = "neon";
+      pntr_blend.span = blend_span_neon;
+      pntr_blend.fill = blend_fill_neon;
+      premultiplied->name = "neon";
+      premultiplied->span = premultiplied_span_neon;
+      premultiplied->fill = premultiplied_fill_neon;
+#ifndef ABGR
+      pntr_pack_rgb565 = pack_rgb565_neon;
+#endif
+      pntr_unpack_rgba = unpack_rgba_neon;
+   }
+#endif
+}
@@ -0,0 +1,96 @@
+#ifndef PAINTER_BLEND_H
+#define PAINTER_BLEND_H
+
+#include <stdint.h>
+
+/* Span kernels used by the painter to composite a run of pixels.
+ *
+ * All kernels must produce exactly the same output as the scalar reference
+ * implementation (pntr_blend_*_c):
+ *
+ *    w   = sa + (sa >> 7)
+ *    rgb = (src * w + dst * (256 - w)) >> 8
+ *    a   = (255 * w + da * (256 - w)) >> 8
+ *
+ * A fully transparent source leaves the destination untouched and a fully
+ * opaque one replaces it.
+ */
+
+/* Blend modes, following love2d's. Alpha is the src-over above, the others
+ * have kernels of their own with the formulas below, w being the widened
+ * source alpha:
+ *
+ *    replace   rgb = src, a = sa
+ *    add       rgb = min(dst + src * w / 256, 255), a = da
+ *    subtract  rgb = max(dst - src * w / 256, 0), a = da
+ *    multiply  rgb = src-over of src * dst / 255, a = da
+ *
+ * PNTR_BLEND_PREMULTIPLIED may be or'ed to any of them but replace, the
+ * source rgb then being taken as already multiplied by its alpha: alpha
+ * becomes min(src + dst * (256 - w) / 256, 255) for all four channels,
+ * which spares the multiplication of the source, multiply likewise with
+ * src * dst / 255 for src, and add and subtract leave out the weighting by
+ * w. Transparent source pixels are only skipped then when they are black,
+ * as in bitmaps premultiplied by lutro. */
+enum
+{
+   PNTR_BLEND_ALPHA = 0,
+   PNTR_BLEND_REPLACE,
+   PNTR_BLEND_ADD,
+   PNTR_BLEND_SUBTRACT,
+   PNTR_BLEND_MULTIPLY,
+   PNTR_BLEND_MODES,
+
+   PNTR_BLEND_PREMULTIPLIED = 8
+};
+
+typedef void (*pntr_blend_span_fn)(uint32_t *dst, const uint32_t *src, int count);
+typedef void (*pntr_blend_fill_fn)(uint32_t *dst, uint32_t color, int count);
+
+typedef struct
+{
+   const char *name;
+   pntr_blend_span_fn span; /* composites a row of source pixels */
+   pntr_blend_fill_fn fill; /* composites a constant color */
+   int copy_opaque;         /* an opaque source pixel replaces the destination */
+   int skip_transparent;    /* a fully transparent one leaves it untouched */
+   int skip_clear;          /* a fully transparent black one leaves it untouched */
+} pntr_blend_kernels_t;
+
+/* src-over, with the fastest kernels supported by the running CPU. */
+extern pntr_blend_kernels_t pntr_blend;
+
+/* picks the fastest kernels supported by the running CPU. */
+void pntr_blend_init(void);
+
+/* kernels of a PNTR_BLEND_* mode, unknown modes falling back to alpha. */
+const pntr_blend_kernels_t *pntr_blend_kernels(unsigned mode);
+
+/* converts a color from and to the premultiplied form, which loses
+ * precision the more transparent the color is. */
+uint32_t pntr_premultiply(uint32_t color);
+uint32_t pntr_unpremultiply(uint32_t color);
+
+void pntr_blend_span_c(uint32_t *dst, const uint32_t *src, int count);
+void pntr_blend_fill_c(uint32_t *dst, uint32_t color, int count);
+
+/* Packs a row of 32 bits pixels to RGB565, keeping the top bits of each
+ * channel and dropping alpha, for frames handed over in that format. */
+typedef void (*pntr_pack_fn)(uint16_t *dst, const uint32_t *src, int count);
+
+/* the fastest packer supported by the running CPU, see pntr_blend_init. */
+extern pntr_pack_fn pntr_pack_rgb565;
+
+void pntr_pack_rgb565_c(uint16_t *dst, const uint32_t *src, int count);
+
+/* Turns a row of R, G, B, A bytes, as decoded from PNGs, into 32 bits
+ * pixels in place, multiplying the colors by their alpha as
+ * pntr_premultiply does when premultiply is set. */
+typedef void (*pntr_unpack_fn)(uint32_t *pixels, int count, int premultiply);
+
+/* the fastest unpacker supported by the running CPU, see pntr_blend_init. */
+extern pntr_unpack_fn pntr_unpack_rgba;
+
+void pntr_unpack_rgba_c(uint32_t *pixels, int count, int premultiply);
+
+#endif // PAINTER_BLEND_H
@@ -0,0 +1,241 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "lutro.h"
+#include "painter_cache.h"
+
+// hashes of the keys missed once lately, as many as fit in the slots.
+#define PNTR_CACHE_SEEN_SLOTS 1024
+
+typedef struct cache_entry_s cache_entry_t;
+
+struct cache_entry_s
+{
+   pntr_cache_key_t key;
+   bitmap_t bmp;
+   int x, y;
+   size_t bytes;
+
+   cache_entry_t *prev, *next; // most recently used first
+   cache_entry_t *chain;       // in its bucket, or in the dropped list
+};
+
+struct pntr_cache_s
+{
+   size_t budget;
+   size_t bytes;
+   unsigned count;
+   uint64_t hits, misses;
+
+   cache_entry_t **buckets;
+   unsigned nb_buckets; // a power of two
+   cache_entry_t *first, *last;
+   cache_entry_t *dropped;
+
+   uint32_t seen[PNTR_CACHE_SEEN_SLOTS];
+};
+
+// FNV-1a over the key, which has no padding.
+static uint32_t hash_key(const pntr_cache_key_t *key)
+{
+   const uint8_t *bytes = (const uint8_t*)key;
+   uint32_t h = 2166136261u;
+
+   for (size_t i = 0; i < sizeof(*key); i++)
+      h = (h ^ bytes[i]) * 16777619u;
+
+   return h;
+}
+
+static cache_entry_t **bucket_of(pntr_cache_t *c, const pntr_cache_key_t *key)
+{
+   return &c->buckets[hash_key(key) & (c->nb_buckets - 1)];
+}
+
+static void lru_unlink(pntr_cache_t *c, cache_entry_t *e)
+{
+   if (e->prev)
+      e->prev->next = e->next;
+   else
+      c->first = e->next;
+
+   if (e->next)
+      e->next->prev = e->prev;
+   else
+      c->last = e->prev;
+}
+
+static void lru_push(pntr_cache_t *c, cache_entry_t *e)
+{
+   e->prev = NULL;
+   e->next = c->first;
+
+   if (c->first)
+      c->first->prev = e;
+   else
+      c->last = e;
+   c->first = e;
+}
+
+// moves the least recently used sprite to the dropped list.
+static void drop_last(pntr_cache_t *c)
+{
+   cache_entry_t *e = c->last;
+   cache_entry_t **link = bucket_of(c, &e->key);
+
+   while (*link != e)
+      link = &(*link)->chain;
+   *link = e->chain;
+
+   lru_unlink(c, e);
+   c->bytes -= e->bytes;
+   c->count--;
+
+   e->chain = c->dropped;
+   c->dropped = e;
+}
+
+static void grow_buckets(pntr_cache_t *c)
+{
+   unsigned nb_buckets = c->nb_buckets ? c->nb_buckets * 2 : 64;
+   cache_entry_t **buckets = lutro_calloc(nb_buckets, sizeof(cache_entry_t*));
+
+   for (unsigned i = 0; i < c->nb_buckets; i++)
+   {
+      cache_entry_t *e = c->buckets[i];
+      while (e)
+      {
+         cache_entry_t *next = e->chain;
+         cache_entry_t **bucket = &buckets[hash_key(&e->key) & (nb_buckets - 1)];
+         e->chain = *bucket;
+         *bucket = e;
+         e = next;
+      }
+   }
+
+   lutro_free(c->buckets);
+   c->buckets = buckets;
+   c->nb_buckets = nb_buckets;
+}
+
+pntr_cache_t *pntr_cache_new(size_t budget)
+{
+   pntr_cache_t *c = lutro_calloc(1, sizeof(pntr_cache_t));
+   c->budget = budget;
+   grow_buckets(c);
+   return c;
+}
+
+void pntr_cache_free(pntr_cache_t *c)
+{
+   if (!c)
+      return;
+
+   pntr_cache_set_budget(c, 0);
+   pntr_cache_collect(c);
+   lutro_free(c->buckets);
+   lutro_free(c);
+}
+
+void pntr_cache_set_budget(pntr_cache_t *c, size_t budget)
+{
+   c->budget = budget;
+   while (c->last && c->bytes > c->budget)
+      drop_last(c);
+}
+
+void pntr_cache_get_stats(const pntr_cache_t *c, pntr_cache_stats_t *stats)
+{
+   stats->hits    = c->hits;
+   stats->misses  = c->misses;
+   stats->sprites = c->count;
+   stats->bytes   = c->bytes;
+   stats->budget  = c->budget;
+}
+
+void pntr_cache_collect(pntr_cache_t *c)
+{
+   while (c->dropped)
+   {
+      cache_entry_t *e = c->dropped;
+      c->dropped = e->chain;
+
+      bitmap_free_spans(&e->bmp);
+      lutro_free(e->bmp.data);
+      lutro_free(e);
+   }
+}
+
+const bitmap_t *pntr_cache_find(pntr_cache_t *c, const pntr_cache_key_t *key, int *x, int *y)
+{
+   // without a budget, draws are not even counted.
+   if (c->budget == 0)
+      return NULL;
+
+   cache_entry_t *e = *bucket_of(c, key);
+
+   while (e && memcmp(&e->key, key, sizeof(*key)) != 0)
+      e = e->chain;
+
+   if (!e)
+   {
+      c->misses++;
+      return NULL;
+   }
+
+   c->hits++;
+   if (e != c->first)
+   {
+      lru_unlink(c, e);
+      lru_push(c, e);
+   }
+
+   *x = e->x;
+   *y = e->y;
+   return &e->bmp;
+}
+
+bitmap_t *pntr_cache_add(pntr_cache_t *c, const pntr_cache_key_t *key, unsigned width, unsigned height, int x, int y)
+{
+   size_t bytes = (size_t)width * height * sizeof(uint32_t);
+
+   if (bytes == 0 || bytes > c->budget)
+      return NULL;
+
+   // a transform changing every frame would only churn the cache, so a key
+   // gets cached the second time it misses.
+   uint32_t hash = hash_key(key) | 1;
+   uint32_t *seen = &c->seen[(hash >> 1) & (PNTR_CACHE_SEEN_SLOTS - 1)];
+   if (*seen != hash)
+   {
+      *seen = hash;
+      return NULL;
+   }
+   *seen = 0;
+
+   while (c->last && c->bytes + bytes > c->budget)
+      drop_last(c);
+
+   if (c->count >= c->nb_buckets)
+      grow_buckets(c);
+
+   cache_entry_t *e = lutro_calloc(1, sizeof(cache_entry_t));
+   e->key = *key;
+   e->x = x;
+   e->y = y;
+   e->bytes = bytes;
+   e->bmp.data   = lutro_calloc(1, bytes);
+   e->bmp.width  = width;
+   e->bmp.height = height;
+   e->bmp.pitch  = width << 2;
+
+   cache_entry_t **bucket = bucket_of(c, key);
+   e->chain = *bucket;
+   *bucket = e;
+   lru_push(c, e);
+
+   c->bytes += bytes;
+   c->count++;
+
+   return &e->bmp;
+}
@@ -0,0 +1,65 @@
+#ifndef PAINTER_CACHE_H
+#define PAINTER_CACHE_H
+
+#include "painter.h"
+
+/* Transformed sprite cache.
+ *
+ * Drawing a bitmap scaled, mirrored or rotated resamples it every time.
+ * While a cache is attached to a painter, pntr_draw instead resamples the
+ * sprite once into a bitmap of its own, keyed by the bitmap serial, the
+ * source rect and the transform rounded to PNTR_CACHE_SCALE_STEPS and
+ * PNTR_CACHE_ANGLE_STEPS, and draws with the same key blit it 1:1. Only
+ * bitmaps with a serial are cached, their pixels being known not to change
+ * until it does.
+ *
+ * The least recently used sprites are dropped once the pixels of the
+ * cached ones would exceed the budget. Deferred draws may still read them
+ * until their queue is flushed, so their memory is only freed by
+ * pntr_cache_collect.
+ *
+ * The cache is only used from the thread drawing, never by the workers.
+ */
+
+#define PNTR_CACHE_SCALE_STEPS 1024 /* per unit of scale */
+#define PNTR_CACHE_ANGLE_STEPS 4096 /* per turn */
+
+typedef struct
+{
+   uint32_t serial; /* of the bitmap */
+   rect_t src;
+   int32_t sx, sy;  /* in PNTR_CACHE_SCALE_STEPS, negative when mirrored */
+   int32_t r;       /* in PNTR_CACHE_ANGLE_STEPS, within a turn either way */
+} pntr_cache_key_t;
+
+typedef struct
+{
+   uint64_t hits, misses;
+   unsigned sprites;
+   size_t bytes;  /* of the pixels of the cached sprites */
+   size_t budget;
+} pntr_cache_stats_t;
+
+/* a budget of 0 leaves the cache empty, and the draws go on uncounted. */
+pntr_cache_t *pntr_cache_new(size_t budget);
+void pntr_cache_free(pntr_cache_t *c);
+
+/* drops the least recently used sprites until the others fit. */
+void pntr_cache_set_budget(pntr_cache_t *c, size_t budget);
+void pntr_cache_get_stats(const pntr_cache_t *c, pntr_cache_stats_t *stats);
+
+/* frees the sprites dropped since the last call, which must come after any
+ * queue that drew them has been flushed. */
+void pntr_cache_collect(pntr_cache_t *c);
+
+/* the sprite cached under key, its top-left corner being (*x, *y) away
+ * from where the transformed source rect is drawn, or NULL on a miss. */
+const bitmap_t *pntr_cache_find(pntr_cache_t *c, const pntr_cache_key_t *key, int *x, int *y);
+
+/* makes room for a transparent width x height sprite under key, offset by
+ * (x, y) as above, for the caller to draw then build the spans of. Returns
+ * NULL when it would not fit in the budget, or when the key has not missed
+ * lately already. */
+bitmap_t *pntr_cache_add(pntr_cache_t *c, const pntr_cache_key_t *key, unsigned width, unsigned height, int x, int y);
+
+#endif // PAINTER_CACHE_H
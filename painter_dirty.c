@@ -0,0 +1,203 @@
+#include <stdlib.h>
+#include <string.h>
+#include <retro_miscellaneous.h>
+
+#include "lutro.h"
+#include "painter_dirty.h"
+
+#define PNTR_DIRTY_TILE_W 32
+#define PNTR_DIRTY_TILE_H 32
+
+enum
+{
+   TILE_DRAWN = 1 << 0, // touched since the last compare
+   TILE_CLEAN = 1 << 1  // holds nothing but clear_color
+};
+
+struct pntr_dirty_s
+{
+   // target size the tiles are laid out for
+   unsigned width, height;
+   unsigned tiles_x, tiles_y;
+   uint8_t *tiles;
+
+   // target pixels as of the last compare, packed
+   uint32_t *shadow;
+   bool shadow_valid;
+
+   uint32_t clear_color;
+};
+
+pntr_dirty_t *pntr_dirty_new(void)
+{
+   return (pntr_dirty_t*)lutro_calloc(1, sizeof(pntr_dirty_t));
+}
+
+void pntr_dirty_free(pntr_dirty_t *d)
+{
+   if (!d)
+      return;
+
+   lutro_free(d->tiles);
+   lutro_free(d->shadow);
+   lutro_free(d);
+}
+
+// lays the tiles out again when the target size changes, forgetting all
+// that was known about its pixels.
+static void layout(pntr_dirty_t *d, const bitmap_t *target)
+{
+   if (d->tiles && d->width == target->width && d->height == target->height)
+      return;
+
+   d->width   = target->width;
+   d->height  = target->height;
+   d->tiles_x = (d->width + PNTR_DIRTY_TILE_W - 1) / PNTR_DIRTY_TILE_W;
+   d->tiles_y = (d->height + PNTR_DIRTY_TILE_H - 1) / PNTR_DIRTY_TILE_H;
+
+   lutro_free(d->tiles);
+   lutro_free(d->shadow);
+   d->tiles  = (uint8_t*)lutro_calloc(d->tiles_x * d->tiles_y, 1);
+   d->shadow = (uint32_t*)lutro_malloc(d->width * d->height * sizeof(uint32_t));
+   d->shadow_valid = false;
+}
+
+static rect_t tile_rect(const pntr_dirty_t *d, unsigned tx, unsigned ty)
+{
+   rect_t r = {
+      tx * PNTR_DIRTY_TILE_W, ty * PNTR_DIRTY_TILE_H,
+      MIN(PNTR_DIRTY_TILE_W, d->width - tx * PNTR_DIRTY_TILE_W),
+      MIN(PNTR_DIRTY_TILE_H, d->height - ty * PNTR_DIRTY_TILE_H)
+   };
+
+   return r;
+}
+
+void pntr_dirty_add(painter_t *p, const rect_t *bounds)
+{
+   pntr_dirty_t *d = p->dirty;
+
+   layout(d, p->target);
+
+   unsigned tx0 = bounds->x / PNTR_DIRTY_TILE_W;
+   unsigned ty0 = bounds->y / PNTR_DIRTY_TILE_H;
+   unsigned tx1 = (bounds->x + bounds->width - 1) / PNTR_DIRTY_TILE_W;
+   unsigned ty1 = (bounds->y + bounds->height - 1) / PNTR_DIRTY_TILE_H;
+
+   for (unsigned ty = ty0; ty <= ty1; ++ty)
+      memset(d->tiles + ty * d->tiles_x + tx0, TILE_DRAWN, tx1 - tx0 + 1);
+}
+
+void pntr_dirty_clear(painter_t *p)
+{
+   pntr_dirty_t *d = p->dirty;
+   bitmap_t *target = p->target;
+   rect_t target_rect = { 0, 0, target->width, target->height };
+
+   if (!target->data)
+      return;
+
+   layout(d, target);
+
+   // partial clears are left to pntr_clear, which marks what it touches.
+   if (memcmp(&p->clip, &target_rect, sizeof(rect_t)) != 0 || p->queue)
+   {
+      pntr_clear(p);
+      return;
+   }
+
+   if (p->background != d->clear_color)
+   {
+      for (unsigned i = 0; i < d->tiles_x * d->tiles_y; ++i)
+         d->tiles[i] &= ~TILE_CLEAN;
+      d->clear_color = p->background;
+   }
+
+   size_t row_size = target->pitch >> 2;
+   uint32_t color  = p->background;
+
+   for (unsigned ty = 0; ty < d->tiles_y; ++ty)
+   {
+      uint8_t *tiles = d->tiles + ty * d->tiles_x;
+      unsigned tx = 0;
+
+      // clears each run of unclean tiles of the row at once.
+      while (tx < d->tiles_x)
+      {
+         if (tiles[tx] & TILE_CLEAN)
+         {
+            tx++;
+            continue;
+         }
+
+         unsigned first = tx;
+         while (tx < d->tiles_x && !(tiles[tx] & TILE_CLEAN))
+            tiles[tx++] = TILE_DRAWN | TILE_CLEAN;
+
+         rect_t r = tile_rect(d, first, ty);
+         r.width  = MIN(tx * PNTR_DIRTY_TILE_W, d->width) - r.x;
+
+         uint32_t *row = target->data + r.y * row_size + r.x;
+         for (int y = 0; y < r.height; ++y, row += row_size)
+         {
+            for (int x = 0; x < r.width; ++x)
+               row[x] = color;
+         }
+      }
+   }
+}
+
+void pntr_dirty_forget(pntr_dirty_t *d)
+{
+   for (unsigned i = 0; d->tiles && i < d->tiles_x * d->tiles_y; ++i)
+      d->tiles[i] = TILE_DRAWN;
+}
+
+bool pntr_dirty_compare(painter_t *p)
+{
+   pntr_dirty_t *d = p->dirty;
+   const bitmap_t *target = p->target;
+   bool changed = false;
+
+   if (!target->data)
+      return false;
+
+   layout(d, target);
+
+   size_t row_size = target->pitch >> 2;
+
+   for (unsigned ty = 0; ty < d->tiles_y; ++ty)
+   {
+      for (unsigned tx = 0; tx < d->tiles_x; ++tx)
+      {
+         uint8_t *tile = &d->tiles[ty * d->tiles_x + tx];
+
+         if (d->shadow_valid && !(*tile & TILE_DRAWN))
+            continue;
+
+         rect_t r = tile_rect(d, tx, ty);
+         const uint32_t *src = target->data + r.y * row_size + r.x;
+         uint32_t *dst = d->shadow + r.y * d->width + r.x;
+         size_t size = r.width * sizeof(uint32_t);
+
+         for (int y = 0; y < r.height; ++y, src += row_size, dst += d->width)
+         {
+            if (d->shadow_valid && memcmp(dst, src, size) == 0)
+               continue;
+
+            memcpy(dst, src, size);
+            changed = true;
+         }
+
+         *tile &= ~TILE_DRAWN;
+      }
+   }
+
+   if (!d->shadow_valid)
+   {
+      d->shadow_valid = true;
+      changed = true;
+   }
+
+   return changed;
+}
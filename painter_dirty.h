@@ -0,0 +1,36 @@
+#ifndef PAINTER_DIRTY_H
+#define PAINTER_DIRTY_H
+
+#include "painter.h"
+
+/* Dirty-region tracking.
+ *
+ * The target is split into coarse tiles and the painter primitives mark the
+ * tiles they may touch. Telling whether a frame changed then only takes
+ * comparing the marked tiles with a copy of the previous frame, and the
+ * tiles left alone since they were cleared need no clearing again.
+ *
+ * Only drawing done through the painter is seen: anything writing to the
+ * target directly must call pntr_dirty_add itself.
+ */
+
+pntr_dirty_t *pntr_dirty_new(void);
+void pntr_dirty_free(pntr_dirty_t *d);
+
+/* marks the tiles overlapping bounds, which must lie within p->target. */
+void pntr_dirty_add(painter_t *p, const rect_t *bounds);
+
+/* same as pntr_clear, skipping the tiles known to hold the background
+ * color already. */
+void pntr_dirty_clear(painter_t *p);
+
+/* compares the tiles marked since the last call with the frame seen then,
+ * and returns whether any pixel changed. */
+bool pntr_dirty_compare(painter_t *p);
+
+/* forgets what was known of the target pixels, for when it was moved to
+ * other memory: the next clear clears every tile and the next compare
+ * checks them all against the frame seen last. */
+void pntr_dirty_forget(pntr_dirty_t *d);
+
+#endif // PAINTER_DIRTY_H
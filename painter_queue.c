@@ -0,0 +1,395 @@
+#include <stdlib.h>
+#include <string.h>
+#include <retro_miscellaneous.h>
+
+#include "lutro.h"
+#include "painter_queue.h"
+#include "lutro_workers.h"
+
+// tiles are wide rather than tall since every rasterizer works by scanlines.
+#define PNTR_TILE_W 128
+#define PNTR_TILE_H 64
+
+enum
+{
+   PNTR_CMD_CLEAR,
+   PNTR_CMD_PLOT,
+   PNTR_CMD_LINE,
+   PNTR_CMD_FILL_RECT,
+   PNTR_CMD_FILL_POLY,
+   PNTR_CMD_STRIKE_ELLIPSE,
+   PNTR_CMD_FILL_ELLIPSE,
+   PNTR_CMD_DRAW,
+   PNTR_CMD_DRAW_TINTED,
+   PNTR_CMD_FILL_TRIANGLE
+};
+
+typedef struct
+{
+   uint32_t foreground;
+   uint32_t background;
+   float line_width;
+   uint32_t fill_rule;
+   uint32_t blend_mode;
+   rect_t clip;
+   painter_transform_t trans;
+} pntr_state_t;
+
+typedef struct
+{
+   uint32_t op;
+   uint32_t state;  // index in pntr_queue_t.states
+   rect_t bounds;   // target pixels the command may touch
+   union
+   {
+      rect_t rect;
+      int coords[4];
+      struct { uint32_t first, count; } poly; // range of pntr_queue_t.points
+      struct { bitmap_t bmp; rect_t src, dst; } draw;
+      struct { bitmap_t bmp; rect_t dst; uint32_t tint; } tinted;
+      struct { bitmap_t bmp; bool textured; uint32_t first; } triangle; // 3 of pntr_queue_t.vertices
+   } u;
+} pntr_cmd_t;
+
+struct pntr_queue_s
+{
+   painter_t *painter;
+
+   pntr_cmd_t *cmds;
+   unsigned cmd_count, cmd_cap;
+
+   pntr_state_t *states;
+   unsigned state_count, state_cap;
+
+   int *points;
+   unsigned point_count, point_cap;
+
+   mesh_point_t *vertices;
+   unsigned vertex_count, vertex_cap;
+
+   // commands binned per tile: tile i replays tile_cmds[tile_start[i] .. tile_start[i + 1] - 1]
+   unsigned tiles_x;
+   uint32_t *tile_start, *tile_next, *tile_cmds;
+   unsigned tile_cap, tile_cmd_cap;
+};
+
+static void *grow(void *ptr, unsigned *cap, unsigned needed, size_t size)
+{
+   if (needed <= *cap)
+      return ptr;
+
+   *cap = MAX(MAX(needed, *cap * 2), 64);
+   return lutro_realloc(ptr, *cap * size);
+}
+
+pntr_queue_t *pntr_queue_new(void)
+{
+   return (pntr_queue_t*)lutro_calloc(1, sizeof(pntr_queue_t));
+}
+
+void pntr_queue_free(pntr_queue_t *q)
+{
+   if (!q)
+      return;
+
+   if (q->painter)
+      q->painter->queue = NULL;
+
+   lutro_free(q->cmds);
+   lutro_free(q->states);
+   lutro_free(q->points);
+   lutro_free(q->vertices);
+   lutro_free(q->tile_start);
+   lutro_free(q->tile_next);
+   lutro_free(q->tile_cmds);
+   lutro_free(q);
+}
+
+void pntr_queue_begin(pntr_queue_t *q, painter_t *p)
+{
+   if (q->painter)
+      pntr_queue_end(q);
+
+   q->painter = p;
+   p->queue = q;
+}
+
+void pntr_queue_end(pntr_queue_t *q)
+{
+   if (!q->painter)
+      return;
+
+   pntr_queue_flush(q);
+   q->painter->queue = NULL;
+   q->painter = NULL;
+}
+
+static pntr_cmd_t *record(painter_t *p, uint32_t op, const rect_t *bounds)
+{
+   pntr_queue_t *q = p->queue;
+
+   pntr_state_t state;
+   memset(&state, 0, sizeof(state));
+   state.foreground = p->foreground;
+   state.background = p->background;
+   state.line_width = p->line_width;
+   state.fill_rule  = p->fill_rule;
+   state.blend_mode = p->blend_mode;
+   state.clip       = p->clip;
+   state.trans      = *p->trans;
+
+   // consecutive commands mostly share the same state.
+   if (q->state_count == 0 || memcmp(&q->states[q->state_count - 1], &state, sizeof(state)))
+   {
+      q->states = grow(q->states, &q->state_cap, q->state_count + 1, sizeof(pntr_state_t));
+      q->states[q->state_count++] = state;
+   }
+
+   q->cmds = grow(q->cmds, &q->cmd_cap, q->cmd_count + 1, sizeof(pntr_cmd_t));
+
+   pntr_cmd_t *cmd = &q->cmds[q->cmd_count++];
+   cmd->op     = op;
+   cmd->state  = q->state_count - 1;
+   cmd->bounds = *bounds;
+
+   return cmd;
+}
+
+void pntr_queue_clear(painter_t *p, const rect_t *bounds)
+{
+   record(p, PNTR_CMD_CLEAR, bounds);
+}
+
+void pntr_queue_plot(painter_t *p, const rect_t *bounds, int x, int y)
+{
+   pntr_cmd_t *cmd = record(p, PNTR_CMD_PLOT, bounds);
+   cmd->u.coords[0] = x;
+   cmd->u.coords[1] = y;
+}
+
+void pntr_queue_strike_line(painter_t *p, const rect_t *bounds, int x1, int y1, int x2, int y2)
+{
+   pntr_cmd_t *cmd = record(p, PNTR_CMD_LINE, bounds);
+   cmd->u.coords[0] = x1;
+   cmd->u.coords[1] = y1;
+   cmd->u.coords[2] = x2;
+   cmd->u.coords[3] = y2;
+}
+
+void pntr_queue_fill_rect(painter_t *p, const rect_t *bounds, const rect_t *rect)
+{
+   pntr_cmd_t *cmd = record(p, PNTR_CMD_FILL_RECT, bounds);
+   cmd->u.rect = *rect;
+}
+
+void pntr_queue_fill_poly(painter_t *p, const rect_t *bounds, const int *points, int nb_points)
+{
+   pntr_queue_t *q = p->queue;
+   pntr_cmd_t *cmd = record(p, PNTR_CMD_FILL_POLY, bounds);
+
+   q->points = grow(q->points, &q->point_cap, q->point_count + nb_points, sizeof(int));
+   memcpy(q->points + q->point_count, points, nb_points * sizeof(int));
+
+   cmd->u.poly.first = q->point_count;
+   cmd->u.poly.count = nb_points;
+   q->point_count += nb_points;
+}
+
+void pntr_queue_strike_ellipse(painter_t *p, const rect_t *bounds, int x, int y, int radius_x, int radius_y)
+{
+   pntr_cmd_t *cmd = record(p, PNTR_CMD_STRIKE_ELLIPSE, bounds);
+   cmd->u.coords[0] = x;
+   cmd->u.coords[1] = y;
+   cmd->u.coords[2] = radius_x;
+   cmd->u.coords[3] = radius_y;
+}
+
+void pntr_queue_fill_ellipse(painter_t *p, const rect_t *bounds, int x, int y, int radius_x, int radius_y)
+{
+   pntr_cmd_t *cmd = record(p, PNTR_CMD_FILL_ELLIPSE, bounds);
+   cmd->u.coords[0] = x;
+   cmd->u.coords[1] = y;
+   cmd->u.coords[2] = radius_x;
+   cmd->u.coords[3] = radius_y;
+}
+
+void pntr_queue_draw(painter_t *p, const rect_t *bounds, const bitmap_t *bmp, const rect_t *src_rect, const rect_t *dst_rect)
+{
+   pntr_cmd_t *cmd = record(p, PNTR_CMD_DRAW, bounds);
+   cmd->u.draw.bmp = *bmp;
+   cmd->u.draw.src = *src_rect;
+   cmd->u.draw.dst = *dst_rect;
+}
+
+void pntr_queue_draw_tinted(painter_t *p, const rect_t *bounds, const bitmap_t *bmp, const rect_t *dst_rect, uint32_t tint)
+{
+   pntr_cmd_t *cmd = record(p, PNTR_CMD_DRAW_TINTED, bounds);
+   cmd->u.tinted.bmp  = *bmp;
+   cmd->u.tinted.dst  = *dst_rect;
+   cmd->u.tinted.tint = tint;
+}
+
+void pntr_queue_fill_triangle(painter_t *p, const rect_t *bounds, const bitmap_t *bmp,
+      const mesh_point_t *a, const mesh_point_t *b, const mesh_point_t *c)
+{
+   pntr_queue_t *q = p->queue;
+   pntr_cmd_t *cmd = record(p, PNTR_CMD_FILL_TRIANGLE, bounds);
+
+   q->vertices = grow(q->vertices, &q->vertex_cap, q->vertex_count + 3, sizeof(mesh_point_t));
+   q->vertices[q->vertex_count + 0] = *a;
+   q->vertices[q->vertex_count + 1] = *b;
+   q->vertices[q->vertex_count + 2] = *c;
+
+   cmd->u.triangle.textured = bmp != NULL;
+   if (bmp)
+      cmd->u.triangle.bmp = *bmp;
+   cmd->u.triangle.first = q->vertex_count;
+   q->vertex_count += 3;
+}
+
+static void replay_tile(void *data, unsigned index)
+{
+   pntr_queue_t *q = (pntr_queue_t*)data;
+   const bitmap_t *target = q->painter->target;
+
+   rect_t target_rect = { 0, 0, target->width, target->height };
+   rect_t tile = {
+      (index % q->tiles_x) * PNTR_TILE_W, (index / q->tiles_x) * PNTR_TILE_H,
+      PNTR_TILE_W, PNTR_TILE_H
+   };
+   tile = rect_intersect(&tile, &target_rect);
+
+   // the tile is drawn through a view of the target, with every coordinate
+   // shifted by the tile origin. All rasterizers confine themselves to their
+   // target and are invariant under integer translation.
+   bitmap_t view = {
+      target->data + tile.y * (target->pitch >> 2) + tile.x,
+      tile.width, tile.height, target->pitch, NULL
+   };
+   rect_t view_rect = { 0, 0, tile.width, tile.height };
+
+   painter_t tp;
+   memset(&tp, 0, sizeof(tp));
+   tp.target = &view;
+   tp.trans  = &tp.stack[0];
+
+   for (uint32_t i = q->tile_start[index]; i < q->tile_start[index + 1]; ++i)
+   {
+      const pntr_cmd_t *cmd = &q->cmds[q->tile_cmds[i]];
+      const pntr_state_t *state = &q->states[cmd->state];
+      const int *c = cmd->u.coords;
+
+      tp.foreground = state->foreground;
+      tp.background = state->background;
+      tp.line_width = state->line_width;
+      tp.fill_rule  = state->fill_rule;
+      tp.blend_mode = state->blend_mode;
+      tp.clip = state->clip;
+      tp.clip.x -= tile.x;
+      tp.clip.y -= tile.y;
+      tp.clip = rect_intersect(&tp.clip, &view_rect);
+
+      *tp.trans = state->trans;
+      tp.trans->tx -= tile.x;
+      tp.trans->ty -= tile.y;
+
+      switch (cmd->op)
+      {
+         case PNTR_CMD_CLEAR:
+            pntr_clear(&tp);
+            break;
+         case PNTR_CMD_PLOT:
+            pntr_plot(&tp, c[0] - tile.x, c[1] - tile.y);
+            break;
+         case PNTR_CMD_LINE:
+            pntr_strike_line(&tp, c[0], c[1], c[2], c[3]);
+            break;
+         case PNTR_CMD_FILL_RECT:
+            pntr_fill_rect(&tp, &cmd->u.rect);
+            break;
+         case PNTR_CMD_FILL_POLY:
+            pntr_fill_poly(&tp, q->points + cmd->u.poly.first, cmd->u.poly.count);
+            break;
+         case PNTR_CMD_STRIKE_ELLIPSE:
+            pntr_strike_ellipse(&tp, c[0], c[1], c[2], c[3], 0);
+            break;
+         case PNTR_CMD_FILL_ELLIPSE:
+            pntr_fill_ellipse(&tp, c[0], c[1], c[2], c[3], 0);
+            break;
+         case PNTR_CMD_DRAW:
+            pntr_draw(&tp, &cmd->u.draw.bmp, &cmd->u.draw.src, &cmd->u.draw.dst);
+            break;
+         case PNTR_CMD_DRAW_TINTED:
+            pntr_draw_tinted(&tp, &cmd->u.tinted.bmp, &cmd->u.tinted.dst, cmd->u.tinted.tint);
+            break;
+         case PNTR_CMD_FILL_TRIANGLE:
+         {
+            // placed vertices skip the transform, they are shifted here.
+            mesh_point_t v[3];
+            for (int k = 0; k < 3; k++)
+            {
+               v[k] = q->vertices[cmd->u.triangle.first + k];
+               v[k].x -= (int64_t)tile.x << PNTR_MESH_SUBPIXEL;
+               v[k].y -= (int64_t)tile.y << PNTR_MESH_SUBPIXEL;
+            }
+            pntr_fill_triangle(&tp, cmd->u.triangle.textured ? &cmd->u.triangle.bmp : NULL, &v[0], &v[1], &v[2]);
+            break;
+         }
+      }
+   }
+}
+
+void pntr_queue_flush(pntr_queue_t *q)
+{
+   const bitmap_t *target = q->painter ? q->painter->target : NULL;
+
+   if (q->cmd_count > 0 && target && target->data)
+   {
+      unsigned tiles_x = (target->width + PNTR_TILE_W - 1) / PNTR_TILE_W;
+      unsigned tiles_y = (target->height + PNTR_TILE_H - 1) / PNTR_TILE_H;
+      unsigned tiles = tiles_x * tiles_y;
+      unsigned i, tx, ty;
+
+      q->tiles_x = tiles_x;
+
+      if (tiles + 1 > q->tile_cap)
+      {
+         q->tile_cap   = tiles + 1;
+         q->tile_start = lutro_realloc(q->tile_start, q->tile_cap * sizeof(uint32_t));
+         q->tile_next  = lutro_realloc(q->tile_next, q->tile_cap * sizeof(uint32_t));
+      }
+      memset(q->tile_start, 0, (tiles + 1) * sizeof(uint32_t));
+
+      // counting sort, which keeps the submission order within each tile.
+      for (i = 0; i < q->cmd_count; ++i)
+      {
+         const rect_t *b = &q->cmds[i].bounds;
+         for (ty = b->y / PNTR_TILE_H; ty <= (b->y + b->height - 1) / PNTR_TILE_H; ++ty)
+            for (tx = b->x / PNTR_TILE_W; tx <= (b->x + b->width - 1) / PNTR_TILE_W; ++tx)
+               q->tile_start[ty * tiles_x + tx + 1]++;
+      }
+
+      for (i = 0; i < tiles; ++i)
+      {
+         q->tile_start[i + 1] += q->tile_start[i];
+         q->tile_next[i] = q->tile_start[i];
+      }
+
+      q->tile_cmds = grow(q->tile_cmds, &q->tile_cmd_cap, q->tile_start[tiles], sizeof(uint32_t));
+
+      for (i = 0; i < q->cmd_count; ++i)
+      {
+         const rect_t *b = &q->cmds[i].bounds;
+         for (ty = b->y / PNTR_TILE_H; ty <= (b->y + b->height - 1) / PNTR_TILE_H; ++ty)
+            for (tx = b->x / PNTR_TILE_W; tx <= (b->x + b->width - 1) / PNTR_TILE_W; ++tx)
+               q->tile_cmds[q->tile_next[ty * tiles_x + tx]++] = i;
+      }
+
+      lutro_workers_run(replay_tile, q, tiles);
+   }
+
+   q->cmd_count   = 0;
+   q->state_count = 0;
+   q->point_count = 0;
+   q->vertex_count = 0;
+}
@@ -0,0 +1,43 @@
+#ifndef PAINTER_QUEUE_H
+#define PAINTER_QUEUE_H
+
+#include "painter.h"
+
+/* Deferred rendering.
+ *
+ * While a queue is attached to a painter, the painter primitives record a
+ * command along with the painter state (colors, clip, transform) instead of
+ * rasterizing. pntr_queue_flush bins the commands into screen tiles and the
+ * worker pool rasterizes the tiles in parallel, each tile replaying its
+ * commands in submission order, so the result is the same as drawing
+ * immediately.
+ *
+ * Recorded bitmaps are read at flush time: their pixels must not change
+ * and their memory must stay alive until then.
+ */
+
+pntr_queue_t *pntr_queue_new(void);
+void pntr_queue_free(pntr_queue_t *q);
+
+/* attaches/detaches the queue, pntr_queue_end flushes first. */
+void pntr_queue_begin(pntr_queue_t *q, painter_t *p);
+void pntr_queue_end(pntr_queue_t *q);
+
+/* rasterizes the pending commands into the painter target. */
+void pntr_queue_flush(pntr_queue_t *q);
+
+/* recorders, called by the painter primitives with the target pixels the
+ * command may touch, never empty. */
+void pntr_queue_clear(painter_t *p, const rect_t *bounds);
+void pntr_queue_plot(painter_t *p, const rect_t *bounds, int x, int y);
+void pntr_queue_strike_line(painter_t *p, const rect_t *bounds, int x1, int y1, int x2, int y2);
+void pntr_queue_fill_rect(painter_t *p, const rect_t *bounds, const rect_t *rect);
+void pntr_queue_fill_poly(painter_t *p, const rect_t *bounds, const int *points, int nb_points);
+void pntr_queue_strike_ellipse(painter_t *p, const rect_t *bounds, int x, int y, int radius_x, int radius_y);
+void pntr_queue_fill_ellipse(painter_t *p, const rect_t *bounds, int x, int y, int radius_x, int radius_y);
+void pntr_queue_draw(painter_t *p, const rect_t *bounds, const bitmap_t *bmp, const rect_t *src_rect, const rect_t *dst_rect);
+void pntr_queue_draw_tinted(painter_t *p, const rect_t *bounds, const bitmap_t *bmp, const rect_t *dst_rect, uint32_t tint);
+void pntr_queue_fill_triangle(painter_t *p, const rect_t *bounds, const bitmap_t *bmp,
+      const mesh_point_t *a, const mesh_point_t *b, const mesh_point_t *c);
+
+#endif // PAINTER_QUEUE_H
@@ -0,0 +1,238 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <retro_miscellaneous.h>
+
+#include "lutro.h"
+#include "particles.h"
+
+#if defined(_MSC_VER) && !defined(__clang__)
+#define restrict __restrict
+#endif
+
+enum
+{
+   FIELD_X = 0,
+   FIELD_Y,
+   FIELD_VX,
+   FIELD_VY,
+   FIELD_AX,
+   FIELD_AY,
+   FIELD_AGE,
+   FIELD_AGE_RATE,
+   FIELD_COUNT
+};
+
+// xorshift32, cheap and the same on every platform unlike rand().
+static float random_unit(particles_t *ps)
+{
+   uint32_t s = ps->seed;
+   s ^= s << 13;
+   s ^= s >> 17;
+   s ^= s << 5;
+   ps->seed = s;
+   return (s >> 8) * (1.0f / 16777216.0f);
+}
+
+static float random_between(particles_t *ps, float min, float max)
+{
+   return min + (max - min) * random_unit(ps);
+}
+
+// all the fields live in one block, capacity floats apart.
+static void set_fields(particles_t *ps, float *block)
+{
+   float **fields[FIELD_COUNT] = {
+      &ps->x, &ps->y, &ps->vx, &ps->vy, &ps->ax, &ps->ay, &ps->age, &ps->age_rate
+   };
+
+   for (int i = 0; i < FIELD_COUNT; i++)
+      *fields[i] = block ? block + i * ps->capacity : NULL;
+}
+
+void particles_init(particles_t *ps, unsigned capacity, uint32_t seed)
+{
+   memset(ps, 0, sizeof(*ps));
+
+   ps->seed = seed ? seed : 1;
+   ps->emitter_lifetime = -1.0f;
+   ps->emitter_left = -1.0f;
+   ps->active = true;
+   ps->life_min = ps->life_max = 1.0f;
+
+   ps->colors[0] = 0xffffffff;
+   ps->nb_colors = 1;
+   ps->sizes[0] = 1.0f;
+   ps->nb_sizes = 1;
+
+   particles_resize(ps, capacity);
+}
+
+void particles_free(particles_t *ps)
+{
+   lutro_free(ps->x);
+   ps->capacity = ps->count = 0;
+   set_fields(ps, NULL);
+}
+
+void particles_resize(particles_t *ps, unsigned capacity)
+{
+   float *old = ps->x;
+   unsigned old_capacity = ps->capacity;
+   unsigned count = MIN(ps->count, capacity);
+
+   float *block = capacity ? lutro_malloc(FIELD_COUNT * capacity * sizeof(float)) : NULL;
+
+   for (int i = 0; i < FIELD_COUNT && count; i++)
+      memcpy(block + i * capacity, old + i * old_capacity, count * sizeof(float));
+
+   lutro_free(old);
+
+   ps->capacity = capacity;
+   ps->count = count;
+   set_fields(ps, block);
+}
+
+void particles_emit(particles_t *ps, unsigned count)
+{
+   count = MIN(count, ps->capacity - ps->count);
+
+   for (unsigned i = ps->count; i < ps->count + count; i++)
+   {
+      float angle = ps->direction + random_between(ps, -0.5f, 0.5f) * ps->spread;
+      float speed = random_between(ps, ps->speed_min, ps->speed_max);
+      float life  = random_between(ps, ps->life_min, ps->life_max);
+
+      ps->x[i]  = ps->emitter_x;
+      ps->y[i]  = ps->emitter_y;
+      ps->vx[i] = cosf(angle) * speed;
+      ps->vy[i] = sinf(angle) * speed;
+      ps->ax[i] = random_between(ps, ps->ax_min, ps->ax_max);
+      ps->ay[i] = random_between(ps, ps->ay_min, ps->ay_max);
+      ps->age[i] = 0.0f;
+      // particles without a lifetime die on their first update.
+      ps->age_rate[i] = life > 0.0f ? 1.0f / life : 1e30f;
+   }
+
+   ps->count += count;
+}
+
+// the hot loop: nothing but independent float arithmetic on each array.
+static void step(unsigned count, float dt,
+      float *restrict x, float *restrict y,
+      float *restrict vx, float *restrict vy,
+      const float *restrict ax, const float *restrict ay,
+      float *restrict age, const float *restrict age_rate)
+{
+   for (unsigned i = 0; i < count; i++)
+   {
+      vx[i] += ax[i] * dt;
+      vy[i] += ay[i] * dt;
+      x[i] += vx[i] * dt;
+      y[i] += vy[i] * dt;
+      age[i] += age_rate[i] * dt;
+   }
+}
+
+// drops the dead particles, keeping the others in order.
+static void retire(particles_t *ps)
+{
+   float *fields[FIELD_COUNT] = {
+      ps->x, ps->y, ps->vx, ps->vy, ps->ax, ps->ay, ps->age, ps->age_rate
+   };
+
+   unsigned i = 0;
+   while (i < ps->count && ps->age[i] < 1.0f)
+      i++;
+
+   unsigned alive = i;
+   for (; i < ps->count; i++)
+   {
+      if (ps->age[i] >= 1.0f)
+         continue;
+
+      for (int f = 0; f < FIELD_COUNT; f++)
+         fields[f][alive] = fields[f][i];
+      alive++;
+   }
+
+   ps->count = alive;
+}
+
+void particles_update(particles_t *ps, float dt)
+{
+   if (dt <= 0.0f)
+      return;
+
+   step(ps->count, dt, ps->x, ps->y, ps->vx, ps->vy, ps->ax, ps->ay, ps->age, ps->age_rate);
+   retire(ps);
+
+   if (!ps->active)
+      return;
+
+   // an emitter running out only emits for the time it had left.
+   float emit_dt = dt;
+   if (ps->emitter_left >= 0.0f)
+   {
+      emit_dt = MIN(dt, ps->emitter_left);
+      ps->emitter_left -= emit_dt;
+   }
+
+   if (ps->rate > 0.0f)
+   {
+      ps->pending += ps->rate * emit_dt;
+      unsigned count = (unsigned)ps->pending;
+      ps->pending -= count;
+      particles_emit(ps, count);
+   }
+
+   if (ps->emitter_lifetime >= 0.0f && ps->emitter_left <= 0.0f)
+      particles_stop(ps);
+}
+
+void particles_stop(particles_t *ps)
+{
+   ps->active = false;
+   ps->pending = 0.0f;
+   ps->emitter_left = ps->emitter_lifetime;
+}
+
+void particles_reset(particles_t *ps)
+{
+   ps->count = 0;
+   ps->pending = 0.0f;
+   ps->emitter_left = ps->emitter_lifetime;
+}
+
+uint32_t particles_color(const particles_t *ps, unsigned i)
+{
+   if (ps->nb_colors == 1)
+      return ps->colors[0];
+
+   float t = MIN(ps->age[i], 1.0f) * (ps->nb_colors - 1);
+   unsigned k = MIN((unsigned)t, ps->nb_colors - 2);
+   float f = t - k;
+
+   uint32_t a = ps->colors[k], b = ps->colors[k + 1];
+   uint32_t color = 0;
+
+   for (int shift = 0; shift < 32; shift += 8)
+   {
+      float ca = (a >> shift) & 0xff;
+      float cb = (b >> shift) & 0xff;
+      color |= (uint32_t)lrintf(ca + (cb - ca) * f) << shift;
+   }
+
+   return color;
+}
+
+float particles_size(const particles_t *ps, unsigned i)
+{
+   if (ps->nb_sizes == 1)
+      return ps->sizes[0];
+
+   float t = MIN(ps->age[i], 1.0f) * (ps->nb_sizes - 1);
+   unsigned k = MIN((unsigned)t, ps->nb_sizes - 2);
+
+   return ps->sizes[k] + (ps->sizes[k + 1] - ps->sizes[k]) * (t - k);
+}
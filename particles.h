@@ -0,0 +1,74 @@
+#ifndef PARTICLES_H
+#define PARTICLES_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Particle simulation.
+ *
+ * Particles are kept as a structure of arrays, one array per attribute, so
+ * that stepping them is a plain loop over floats the compiler can
+ * vectorize. Nothing here knows about Lua nor the painter: particles_update
+ * can be run and timed on its own.
+ */
+
+#define PARTICLES_MAX_COLORS 8
+#define PARTICLES_MAX_SIZES  8
+
+typedef struct
+{
+   /* capacity entries each, the first count being alive, oldest first */
+   float *x, *y;
+   float *vx, *vy;
+   float *ax, *ay;
+   float *age;      /* from 0 at birth to 1 at death */
+   float *age_rate; /* 1 / lifetime */
+   unsigned count, capacity;
+
+   /* emitter */
+   float emitter_x, emitter_y;
+   float rate;             /* particles per second */
+   float pending;          /* fraction of a particle left to emit */
+   float emitter_lifetime; /* in seconds, negative for forever */
+   float emitter_left;
+   bool active;            /* whether updates emit */
+
+   /* settings of new particles, picked at random between min and max */
+   float life_min, life_max;
+   float speed_min, speed_max;
+   float direction, spread;  /* radians, spread is centered on direction */
+   float ax_min, ay_min, ax_max, ay_max;
+
+   /* over the life of each particle, evenly spaced */
+   uint32_t colors[PARTICLES_MAX_COLORS];
+   unsigned nb_colors;
+   float sizes[PARTICLES_MAX_SIZES];
+   unsigned nb_sizes;
+
+   uint32_t seed;
+} particles_t;
+
+void particles_init(particles_t *ps, unsigned capacity, uint32_t seed);
+void particles_free(particles_t *ps);
+
+/* changes the capacity, dropping the newest particles past it. */
+void particles_resize(particles_t *ps, unsigned capacity);
+
+/* emits up to count particles at the emitter right away. */
+void particles_emit(particles_t *ps, unsigned count);
+
+/* moves the particles on by dt seconds, retires the ones past their
+ * lifetime then emits new ones if the emitter is active. */
+void particles_update(particles_t *ps, float dt);
+
+/* stops emitting and rewinds the emitter lifetime. */
+void particles_stop(particles_t *ps);
+
+/* kills every particle and rewinds the emitter lifetime. */
+void particles_reset(particles_t *ps);
+
+/* straight ARGB color and size of particle i, interpolated over its life. */
+uint32_t particles_color(const particles_t *ps, unsigned i);
+float particles_size(const particles_t *ps, unsigned i);
+
+#endif // PARTICLES_H
@@ -17,6 +17,7 @@ function draw_transform_tiles(params)
 
     local scalex = params.scalex or 1
     local scaley = params.scaley or 1
+    local rotation = params.rotation or 0
 
     -- draw multiple fixed scales of the quad onscreen at once.
     -- avoid use of animation since it complicates automated verification 
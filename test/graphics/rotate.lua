@@ -0,0 +1,27 @@
+require("graphics/base_transform")
+
+local rotation = 0
+local flip = 1
+local time = 0
+
+return {
+	intervalTime = 12,
+
+	load = function()
+		load_transform_tiles()
+	end,
+
+	draw = function()
+		draw_transform_tiles{ scalex = flip, scaley = flip, rotation = rotation }
+	end,
+
+	update = function(dt)
+		time = time + dt
+
+		-- step through fixed angles rather than animating, see base_transform.
+		local angles = { math.pi / 6, math.pi / 2, math.pi * 3 / 4, -math.pi / 3 }
+		local i = math.min(math.floor(time / 3) + 1, 4)
+		rotation = angles[i]
+		flip = (i % 2 == 0) and -1 or 1
+	end
+}
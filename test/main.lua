@@ -7,6 +7,7 @@ local availableStates = {
 	"graphics/line",
 	-- ignore this test if lutro compiled without HAVE_TRANSFORM:
 	lutro.featureflags.HAVE_TRANSFORM and "graphics/scale" or false,
+	lutro.featureflags.HAVE_TRANSFORM and "graphics/rotate" or false,
 	"audio/play",
 	"joystick/getJoystickCount",
 	"window/close"
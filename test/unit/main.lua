@@ -13,9 +13,18 @@ package.path = package.path .. './test/?.lua;./test/unit/?.lua;./test/unit/luaun
 -- Load the unit tests.
 require 'tests'
 
--- Set up Lutro to run the tests at load.
+-- Set up Lutro to run the tests at load, and the frame tests after.
 function lutro.load()
 	runTests()
-	io.write("Lutro unit test run complete\n")
-	lutro.event.quit()
+end
+
+function lutro.update()
+	if not updateFrameTests() then
+		io.write("Lutro unit test run complete\n")
+		lutro.event.quit()
+	end
+end
+
+function lutro.draw()
+	drawFrameTests()
 end
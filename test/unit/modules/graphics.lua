@@ -16,7 +16,1660 @@ function lutro.graphics.getBackgroundColorTest()
 	unit.assertEquals(a, 50)
 end
 
+-- Scalar reference of the painter's src-over composition (see painter_blend.h).
+-- Every SIMD blend kernel and the opacity run skipping must match it bit for bit.
+local function compose(s, d, w)
+	return math.floor((s * w + d * (256 - w)) / 256)
+end
+
+local function expectedBlend(sr, sg, sb, sa, dr, dg, db, da)
+	if not lutro.featureflags.HAVE_COMPOSITION then
+		if sa > 0 then return sr, sg, sb, sa end
+		return dr, dg, db, da
+	end
+	local w = sa + math.floor(sa / 128)
+	return compose(sr, dr, w), compose(sg, dg, w), compose(sb, db, w), compose(255, da, w)
+end
+
+local function assertPixel(data, x, y, r, g, b, a)
+	local pr, pg, pb, pa = data:getPixel(x, y)
+	unit.assertEquals({ pr, pg, pb, pa }, { r, g, b, a }, ("pixel %d,%d"):format(x, y))
+end
+
+-- widths that are not a multiple of the vector size exercise the scalar tails.
+local blendWidth, blendHeight = 37, 3
+local background = { 40, 90, 200, 120 }
+
+local function blendCanvas()
+	local canvas = lutro.graphics.newCanvas(blendWidth, blendHeight)
+	lutro.graphics.setCanvas(canvas)
+	lutro.graphics.setBackgroundColor(background)
+	lutro.graphics.clear()
+	return canvas
+end
+
+local function blendSource(x, y)
+	return (x * 37 + y * 11) % 256, (x * 53) % 256, (y * 71 + x) % 256, (x * 29 + y * 97) % 256
+end
+
+function lutro.graphics.drawCompositionTest()
+	local src = lutro.image.newImageData(blendWidth, blendHeight)
+	for y = 0, blendHeight - 1 do
+		for x = 0, blendWidth - 1 do
+			src:setPixel(x, y, blendSource(x, y))
+		end
+	end
+
+	local canvas = blendCanvas()
+	lutro.graphics.draw(lutro.graphics.newImage(src), 0, 0)
+	lutro.graphics.setCanvas()
+
+	local result = canvas:newImageData()
+	for y = 0, blendHeight - 1 do
+		for x = 0, blendWidth - 1 do
+			local sr, sg, sb, sa = blendSource(x, y)
+			assertPixel(result, x, y, expectedBlend(sr, sg, sb, sa, unpack(background)))
+		end
+	end
+end
+
+-- alternating transparent, opaque and blended runs, as found in sprite sheets.
+local function runSource(x, y)
+	local phase = (x + y * 3) % 18
+	local alpha = 0
+	if phase >= 12 then
+		alpha = 40 + phase * 9
+	elseif phase >= 5 then
+		alpha = 255
+	end
+	return (x * 13) % 256, (y * 41) % 256, (x * y) % 256, alpha
+end
+
+function lutro.graphics.drawOpacityRunsTest()
+	local w, h = blendWidth + 8, blendHeight
+	local src = lutro.image.newImageData(w, h)
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			src:setPixel(x, y, runSource(x, y))
+		end
+	end
+
+	-- the quad starts and ends in the middle of runs.
+	local ox = 3
+	local canvas = blendCanvas()
+	local quad = lutro.graphics.newQuad(ox, 0, blendWidth, blendHeight, w, h)
+	lutro.graphics.draw(lutro.graphics.newImage(src), quad, 0, 0)
+	lutro.graphics.setCanvas()
+
+	local result = canvas:newImageData()
+	for y = 0, blendHeight - 1 do
+		for x = 0, blendWidth - 1 do
+			local sr, sg, sb, sa = runSource(x + ox, y)
+			assertPixel(result, x, y, expectedBlend(sr, sg, sb, sa, unpack(background)))
+		end
+	end
+end
+
+function lutro.graphics.fillCompositionTest()
+	local r, g, b, a = lutro.graphics.getColor()
+	local canvas = blendCanvas()
+	lutro.graphics.setColor(200, 100, 50, 77)
+	lutro.graphics.rectangle("fill", 0, 0, blendWidth, blendHeight)
+	lutro.graphics.setColor(r, g, b, a)
+	lutro.graphics.setCanvas()
+
+	local result = canvas:newImageData()
+	for y = 0, blendHeight - 1 do
+		for x = 0, blendWidth - 1 do
+			assertPixel(result, x, y, expectedBlend(200, 100, 50, 77, unpack(background)))
+		end
+	end
+end
+
+-- a * b / 255 rounded to the nearest, as the multiply kernels do.
+local function mul255(a, b)
+	local t = a * b + 128
+	return math.floor((t + math.floor(t / 256)) / 256)
+end
+
+local blendChannels = {
+	add = function(s, d, w, pre)
+		return math.min(d + (pre and s or math.floor(s * w / 256)), 255)
+	end,
+	subtract = function(s, d, w, pre)
+		return math.max(d - (pre and s or math.floor(s * w / 256)), 0)
+	end,
+	multiply = function(s, d, w, pre)
+		if pre then
+			return math.min(mul255(s, d) + math.floor(d * (256 - w) / 256), 255)
+		end
+		return compose(mul255(s, d), d, w)
+	end,
+}
+
+-- Scalar reference of the other blend modes (see painter_blend.h).
+local function expectedMode(mode, pre, sr, sg, sb, sa, dr, dg, db, da)
+	if mode == "replace" then
+		return sr, sg, sb, sa
+	elseif mode == "alpha" and (not pre or not lutro.featureflags.HAVE_COMPOSITION) then
+		return expectedBlend(sr, sg, sb, sa, dr, dg, db, da)
+	end
+
+	local w = sa + math.floor(sa / 128)
+	if mode == "alpha" then
+		local function over(s, d) return math.min(s + math.floor(d * (256 - w) / 256), 255) end
+		return over(sr, dr), over(sg, dg), over(sb, db), over(sa, da)
+	end
+
+	local channel = blendChannels[mode]
+	return channel(sr, dr, w, pre), channel(sg, dg, w, pre), channel(sb, db, w, pre), da
+end
+
+function lutro.graphics.blendModeTest()
+	local w, h = blendWidth + 8, blendHeight
+	local src = lutro.image.newImageData(w, h)
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			src:setPixel(x, y, runSource(x, y))
+		end
+	end
+	local image = lutro.graphics.newImage(src)
+	local quad = lutro.graphics.newQuad(3, 0, blendWidth, blendHeight, w, h)
+	local r, g, b, a = lutro.graphics.getColor()
+
+	for _, mode in ipairs({ "alpha", "replace", "add", "subtract", "multiply" }) do
+		for _, alphamode in ipairs({ "alphamultiply", "premultiplied" }) do
+			local pre = alphamode == "premultiplied"
+
+			-- the image over the first rows, a translucent fill below.
+			local canvas = lutro.graphics.newCanvas(blendWidth, 2 * blendHeight)
+			lutro.graphics.setCanvas(canvas)
+			lutro.graphics.setBackgroundColor(background)
+			lutro.graphics.clear()
+			lutro.graphics.setBlendMode(mode, alphamode)
+			local gotMode, gotAlphaMode = lutro.graphics.getBlendMode()
+			unit.assertEquals({ gotMode, gotAlphaMode }, { mode, alphamode })
+
+			lutro.graphics.setColor(255, 255, 255, 255)
+			lutro.graphics.draw(image, quad, 0, 0)
+			lutro.graphics.setColor(200, 100, 50, 77)
+			lutro.graphics.rectangle("fill", 0, blendHeight, blendWidth, blendHeight)
+			lutro.graphics.setBlendMode("alpha")
+			lutro.graphics.setCanvas()
+
+			local result = canvas:newImageData()
+			for y = 0, blendHeight - 1 do
+				for x = 0, blendWidth - 1 do
+					local sr, sg, sb, sa = runSource(x + 3, y)
+					assertPixel(result, x, y, expectedMode(mode, pre, sr, sg, sb, sa, unpack(background)))
+					assertPixel(result, x, y + blendHeight,
+						expectedMode(mode, pre, 200, 100, 50, 77, unpack(background)))
+				end
+			end
+		end
+	end
+
+	-- older love2d names
+	lutro.graphics.setBlendMode("additive")
+	unit.assertEquals({ lutro.graphics.getBlendMode() }, { "add", "alphamultiply" })
+	lutro.graphics.setBlendMode("premultiplied")
+	unit.assertEquals({ lutro.graphics.getBlendMode() }, { "alpha", "premultiplied" })
+	lutro.graphics.setBlendMode("alpha")
+
+	lutro.graphics.setColor(r, g, b, a)
+end
+
+local function premultiply(r, g, b, a)
+	return mul255(r, a), mul255(g, a), mul255(b, a), a
+end
+
+local function unpremultiply(r, g, b, a)
+	if a == 0 then return 0, 0, 0, 0 end
+	local function channel(c) return math.min(math.floor((c * 255 + math.floor(a / 2)) / a), 255) end
+	return channel(r), channel(g), channel(b), a
+end
+
+function lutro.graphics.premultipliedImageTest()
+	local w, h = blendWidth + 8, blendHeight
+	local src = lutro.image.newImageData(w, h)
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			src:setPixel(x, y, runSource(x, y))
+		end
+	end
+
+	-- the ImageData converts its pixels back.
+	local image = lutro.graphics.newImage(src, { premultiplied = true })
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			assertPixel(src, x, y, unpremultiply(premultiply(runSource(x, y))))
+		end
+	end
+	src:setPixel(0, 0, 100, 150, 200, 255)
+	assertPixel(src, 0, 0, 100, 150, 200, 255)
+	src:setPixel(0, 0, runSource(0, 0))
+
+	local quad = lutro.graphics.newQuad(3, 0, blendWidth, blendHeight, w, h)
+	local r, g, b, a = lutro.graphics.getColor()
+	lutro.graphics.setColor(255, 255, 255, 255)
+
+	for _, mode in ipairs({ "alpha", "add", "multiply" }) do
+		local canvas = blendCanvas()
+		lutro.graphics.setBlendMode(mode)
+		lutro.graphics.draw(image, quad, 0, 0)
+		lutro.graphics.setBlendMode("alpha")
+		lutro.graphics.setCanvas()
+
+		local result = canvas:newImageData()
+		for y = 0, blendHeight - 1 do
+			for x = 0, blendWidth - 1 do
+				local sr, sg, sb, sa = premultiply(runSource(x + 3, y))
+				assertPixel(result, x, y, expectedMode(mode, true, sr, sg, sb, sa, unpack(background)))
+			end
+		end
+	end
+
+	lutro.graphics.setColor(r, g, b, a)
+
+	lutro.graphics.newImage(src, { premultiplied = false })
+	assertPixel(src, 5, 0, runSource(5, 0))
+end
+
+-- alpha-gradient.png has a row per alpha, 37 pixels wide for the scalar tails.
+function lutro.graphics.loadPremultipliedTest()
+	local path = "../graphics/alpha-gradient.png"
+	local straight = lutro.image.newImageData(path, { premultiplied = false })
+	local premultiplied = lutro.image.newImageData(path, { premultiplied = true })
+	local w, h = straight:getDimensions()
+
+	assertPixel(straight, 2, 100, 58, 126, 145, 100)
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			assertPixel(premultiplied, x, y, unpremultiply(premultiply(straight:getPixel(x, y))))
+		end
+	end
+end
+
+-- a quarter turn maps source pixel (x, y) to (-y - 1, x) around the pivot.
+function lutro.graphics.drawRotatedTest()
+	if not lutro.featureflags.HAVE_TRANSFORM then return end
+
+	local w, h = 4, 2
+	local src = lutro.image.newImageData(w, h)
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			src:setPixel(x, y, x * 60, y * 120, 30, 255)
+		end
+	end
+	local img = lutro.graphics.newImage(src)
+
+	for _, origin in ipairs({ { 0, 0 }, { 2, 1 } }) do
+		local px, py = 6, 3
+		local canvas = lutro.graphics.newCanvas(10, 8)
+		lutro.graphics.setCanvas(canvas)
+		lutro.graphics.setBackgroundColor(background)
+		lutro.graphics.clear()
+		lutro.graphics.draw(img, px, py, math.pi / 2, 1, 1, origin[1], origin[2])
+		lutro.graphics.setCanvas()
+
+		local expected = {}
+		for y = 0, h - 1 do
+			for x = 0, w - 1 do
+				local dx = px - (y - origin[2]) - 1
+				local dy = py + (x - origin[1])
+				expected[dy * 10 + dx] = { x * 60, y * 120, 30, 255 }
+			end
+		end
+
+		local result = canvas:newImageData()
+		for y = 0, 7 do
+			for x = 0, 9 do
+				assertPixel(result, x, y, unpack(expected[y * 10 + x] or background))
+			end
+		end
+	end
+end
+
+-- lines step exactly like the plain bresenham loop below, whatever part of
+-- them the scissor cuts off.
+local function bresenham(x1, y1, x2, y2, plot)
+	local dx, sx = math.abs(x2 - x1), x1 < x2 and 1 or -1
+	local dy, sy = math.abs(y2 - y1), y1 < y2 and 1 or -1
+	local err = dx > dy and math.floor(dx / 2) or -math.floor(dy / 2)
+	while true do
+		plot(x1, y1)
+		if x1 == x2 and y1 == y2 then break end
+		local e2 = err
+		if e2 > -dx then err = err - dy; x1 = x1 + sx end
+		if e2 < dy then err = err + dx; y1 = y1 + sy end
+	end
+end
+
+local function lineCanvas(w, h)
+	local canvas = lutro.graphics.newCanvas(w, h)
+	lutro.graphics.setCanvas(canvas)
+	lutro.graphics.setBackgroundColor(0, 0, 0, 255)
+	lutro.graphics.clear()
+	lutro.graphics.setColor(255, 255, 255, 255)
+	return canvas
+end
+
+local function assertCovered(canvas, w, h, covered)
+	local result = canvas:newImageData()
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			local v = covered[y * w + x] and 255 or 0
+			assertPixel(result, x, y, v, v, v, 255)
+		end
+	end
+end
+
+function lutro.graphics.lineClipTest()
+	local w, h = 24, 16
+	local sx, sy, sw, sh = 3, 2, 17, 11
+	local tx, ty = 2, -1
+	local r, g, b, a = lutro.graphics.getColor()
+	local canvas = lineCanvas(w, h)
+	local covered = {}
+	local seed = 7
+
+	local function coord()
+		seed = (seed * 1103515245 + 12345) % 2147483648
+		return seed % 100 - 40
+	end
+
+	lutro.graphics.setScissor(sx, sy, sw, sh)
+	lutro.graphics.translate(tx, ty)
+	for i = 1, 40 do
+		local x1, y1, x2, y2 = coord(), coord(), coord(), coord()
+		lutro.graphics.line(x1, y1, x2, y2)
+		bresenham(x1 + tx, y1 + ty, x2 + tx, y2 + ty, function(x, y)
+			if x >= sx and x < sx + sw and y >= sy and y < sy + sh then
+				covered[y * w + x] = true
+			end
+		end)
+	end
+	lutro.graphics.origin()
+	lutro.graphics.setScissor()
+	lutro.graphics.setColor(r, g, b, a)
+	lutro.graphics.setCanvas()
+
+	assertCovered(canvas, w, h, covered)
+end
+
+function lutro.graphics.lineWidthTest()
+	local w, h = 16, 16
+	local r, g, b, a = lutro.graphics.getColor()
+	local canvas = lineCanvas(w, h)
+	local covered = {}
+
+	-- odd widths are centered on the segment, even ones get their extra
+	-- pixel above or to the right.
+	lutro.graphics.setLineWidth(3)
+	unit.assertEquals(lutro.graphics.getLineWidth(), 3)
+	lutro.graphics.line(2, 3, 10, 3)
+	for x = 2, 10 do
+		for y = 2, 4 do covered[y * w + x] = true end
+	end
+
+	lutro.graphics.setLineWidth(2)
+	lutro.graphics.line(12, 14, 12, 6)
+	for y = 6, 14 do
+		for x = 12, 13 do covered[y * w + x] = true end
+	end
+
+	lutro.graphics.setLineWidth(1)
+	lutro.graphics.setColor(r, g, b, a)
+	lutro.graphics.setCanvas()
+
+	assertCovered(canvas, w, h, covered)
+end
+
+function lutro.graphics.lineStyleTest()
+	unit.assertEquals(lutro.graphics.getLineStyle(), "smooth")
+	lutro.graphics.setLineStyle("rough")
+	unit.assertEquals(lutro.graphics.getLineStyle(), "rough")
+	lutro.graphics.setLineStyle("smooth")
+	unit.assertError(lutro.graphics.setLineStyle, "blurry")
+end
+
+-- pixels whose center is inside the polygon, left edges included.
+local function polygonCoverage(points, w, h, rule, tx, ty, clip)
+	local covered = {}
+	local n = #points / 2
+	for y = clip[2], clip[2] + clip[4] - 1 do
+		for x = clip[1], clip[1] + clip[3] - 1 do
+			local px, py = x + 0.5 - tx, y + 0.5 - ty
+			local winding = 0
+			for i = 0, n - 1 do
+				local j = (i + 1) % n
+				local x0, y0 = points[2 * i + 1], points[2 * i + 2]
+				local x1, y1 = points[2 * j + 1], points[2 * j + 2]
+				if (y0 <= py) ~= (y1 <= py) and px >= x0 + (py - y0) * (x1 - x0) / (y1 - y0) then
+					winding = winding + (y1 > y0 and 1 or -1)
+				end
+			end
+			if (rule == "evenodd" and winding % 2 == 1) or (rule == "nonzero" and winding ~= 0) then
+				covered[y * w + x] = true
+			end
+		end
+	end
+	return covered
+end
+
+function lutro.graphics.fillPolygonTest()
+	local w, h = 24, 20
+	local r, g, b, a = lutro.graphics.getColor()
+	local shapes = {
+		-- concave
+		{ 2, 2, 20, 2, 20, 17, 14, 17, 14, 7, 8, 7, 8, 17, 2, 17 },
+		-- self-intersecting star, its core only filled with nonzero
+		{ 12, 1, 17, 18, 3, 7, 21, 7, 7, 18 },
+	}
+
+	for _, points in ipairs(shapes) do
+		for _, rule in ipairs({ "nonzero", "evenodd" }) do
+			for _, placement in ipairs({ { 0, 0, { 0, 0, w, h } }, { 2, -1, { 3, 4, 15, 11 } } }) do
+				local tx, ty, clip = unpack(placement)
+				local canvas = lineCanvas(w, h)
+				lutro.graphics.setFillRule(rule)
+				lutro.graphics.setScissor(unpack(clip))
+				lutro.graphics.translate(tx, ty)
+				lutro.graphics.polygon("fill", unpack(points))
+				lutro.graphics.origin()
+				lutro.graphics.setScissor()
+				lutro.graphics.setCanvas()
+
+				assertCovered(canvas, w, h, polygonCoverage(points, w, h, rule, tx, ty, clip))
+			end
+		end
+	end
+
+	lutro.graphics.setFillRule("nonzero")
+	unit.assertEquals(lutro.graphics.getFillRule(), "nonzero")
+	lutro.graphics.setColor(r, g, b, a)
+end
+
+-- ellipses cover the pixels whose center is within radii + 1/2 of theirs.
+local function ellipseCoverage(cx, cy, rx, ry, w, h)
+	local a, b = (2 * rx + 1) ^ 2, (2 * ry + 1) ^ 2
+	local inside = {}
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			if 4 * ((x - cx) ^ 2 * b + (y - cy) ^ 2 * a) <= a * b then
+				inside[y * w + x] = true
+			end
+		end
+	end
+	return inside
+end
+
+local function clipCoverage(covered, w, clip)
+	local result = {}
+	for y = clip[2], clip[2] + clip[4] - 1 do
+		for x = clip[1], clip[1] + clip[3] - 1 do
+			result[y * w + x] = covered[y * w + x]
+		end
+	end
+	return result
+end
+
+function lutro.graphics.ellipseTest()
+	local w, h = 32, 24
+	local cx, cy, rx, ry = 13, 11, 9, 6
+	local tx, ty, clip = 2, 1, { 4, 3, 20, 15 }
+	local r, g, b, a = lutro.graphics.getColor()
+
+	local function render(mode, width)
+		local canvas = lineCanvas(w, h)
+		lutro.graphics.setLineWidth(width)
+		lutro.graphics.setScissor(unpack(clip))
+		lutro.graphics.translate(tx, ty)
+		lutro.graphics.ellipse(mode, cx, cy, rx, ry)
+		lutro.graphics.origin()
+		lutro.graphics.setScissor()
+		lutro.graphics.setLineWidth(1)
+		lutro.graphics.setCanvas()
+		return canvas
+	end
+
+	local fill = ellipseCoverage(cx + tx, cy + ty, rx, ry, w, h)
+	assertCovered(render("fill", 1), w, h, clipCoverage(fill, w, clip))
+
+	-- outlines are the pixels of the fill next to a pixel outside of it.
+	local outline = {}
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			local k = y * w + x
+			if fill[k] and not (fill[k - 1] and fill[k + 1] and fill[k - w] and fill[k + w]) then
+				outline[k] = true
+			end
+		end
+	end
+	assertCovered(render("line", 1), w, h, clipCoverage(outline, w, clip))
+
+	-- wide ones the ring between the ellipses half the width away.
+	local outer = ellipseCoverage(cx + tx, cy + ty, rx + 1, ry + 1, w, h)
+	local inner = ellipseCoverage(cx + tx, cy + ty, rx - 2, ry - 2, w, h)
+	local ring = {}
+	for k in pairs(outer) do
+		if not inner[k] then ring[k] = true end
+	end
+	assertCovered(render("line", 3), w, h, clipCoverage(ring, w, clip))
+
+	lutro.graphics.setColor(r, g, b, a)
+end
+
+function lutro.graphics.circleSegmentsTest()
+	local w, h = 24, 24
+	local cx, cy, radius, segments = 11, 12, 9, 7
+	local r, g, b, a = lutro.graphics.getColor()
+
+	local faceted = lineCanvas(w, h)
+	lutro.graphics.circle("fill", cx, cy, radius, segments)
+
+	local points = {}
+	for i = 0, segments - 1 do
+		local angle = 2 * i * math.pi / segments
+		points[#points + 1] = math.floor(cx + radius * math.cos(angle))
+		points[#points + 1] = math.floor(cy + radius * math.sin(angle))
+	end
+	local polygon = lineCanvas(w, h)
+	lutro.graphics.polygon("fill", unpack(points))
+	lutro.graphics.setColor(r, g, b, a)
+	lutro.graphics.setCanvas()
+
+	local expected = polygon:newImageData()
+	local covered = {}
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			covered[y * w + x] = expected:getPixel(x, y) == 255 or nil
+		end
+	end
+	assertCovered(faceted, w, h, covered)
+end
+
+-- a font of "A" (3 pixels wide) and "é" (2 pixels wide), each glyph pixel
+-- telling where it comes from and one of them transparent.
+local fontSeparator = { 255, 0, 255, 255 }
+local fontGlyphs = { ["A"] = 1, ["é"] = 5 }
+local fontWidths = { ["A"] = 3, ["é"] = 2 }
+
+local function fontPixel(x, y)
+	if x == 2 and y == 1 then return 0, 0, 0, 0 end
+	return x * 30, y * 60, 100, 255
+end
+
+local function newTestFont()
+	local data = lutro.image.newImageData(8, 4)
+	for y = 0, 3 do
+		for x = 0, 7 do
+			if y == 0 and (x == 0 or x == 4 or x == 7) then
+				data:setPixel(x, y, unpack(fontSeparator))
+			else
+				data:setPixel(x, y, fontPixel(x, y))
+			end
+		end
+	end
+	return lutro.graphics.newImageFont(lutro.graphics.newImage(data), "Aé")
+end
+
+-- pixels of the canvas after drawing glyphs at their pen positions.
+local function assertGlyphs(canvas, w, h, glyphs, clip)
+	local expected = {}
+	for _, glyph in ipairs(glyphs) do
+		local c, px, py = glyph[1], glyph[2], glyph[3]
+		for y = 0, 3 do
+			for x = 0, fontWidths[c] - 1 do
+				local r, g, b, a = fontPixel(fontGlyphs[c] + x, y)
+				local dx, dy = px + x, py + y
+				local inside = not clip or (dx >= clip[1] and dy >= clip[2]
+					and dx < clip[1] + clip[3] and dy < clip[2] + clip[4])
+				if a > 0 and inside then
+					expected[dy * w + dx] = { r, g, b, a }
+				end
+			end
+		end
+	end
+
+	local result = canvas:newImageData()
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			assertPixel(result, x, y, unpack(expected[y * w + x] or { 0, 0, 0, 255 }))
+		end
+	end
+end
+
+function lutro.graphics.textTest()
+	local w, h = 20, 10
+	local font = newTestFont()
+	local r, g, b, a = lutro.graphics.getColor()
+	-- characters missing from the font are skipped, the others advance by
+	-- their width plus one pixel.
+	local glyphs = { { "A", 3, 2 }, { "é", 7, 2 }, { "A", 10, 2 } }
+
+	unit.assertEquals(font:getWidth("AéxA"), 11)
+
+	local canvas = lineCanvas(w, h)
+	lutro.graphics.setFont(font)
+	lutro.graphics.print("AéxA", 3, 2)
+	lutro.graphics.setCanvas()
+	assertGlyphs(canvas, w, h, glyphs)
+
+	local text = lutro.graphics.newText(font, "AéxA")
+	unit.assertEquals({ text:getDimensions() }, { 10, 4 })
+	unit.assertEquals(text:getFont(), font)
+
+	canvas = lineCanvas(w, h)
+	lutro.graphics.draw(text, 3, 2)
+	lutro.graphics.setCanvas()
+	assertGlyphs(canvas, w, h, glyphs)
+
+	-- the laid out glyphs follow the translation and the scissor.
+	canvas = lineCanvas(w, h)
+	lutro.graphics.setScissor(6, 0, 5, 10)
+	lutro.graphics.translate(2, 1)
+	lutro.graphics.draw(text, 1, 1)
+	lutro.graphics.origin()
+	lutro.graphics.setScissor()
+	lutro.graphics.setCanvas()
+	assertGlyphs(canvas, w, h, glyphs, { 6, 0, 5, 10 })
+
+	text:set("éA")
+	unit.assertEquals(text:getWidth(), 6)
+	text:clear()
+	unit.assertEquals(text:getWidth(), 0)
+	text:add("A", 4, 1)
+	text:add("é", 0, 5)
+	canvas = lineCanvas(w, h)
+	lutro.graphics.draw(text, 1, 0)
+	lutro.graphics.setCanvas()
+	assertGlyphs(canvas, w, h, { { "A", 5, 1 }, { "é", 1, 5 } })
+
+	-- deferred glyphs read the font they were printed with once the frame
+	-- ends, another font set and the former collected by then.
+	canvas = lineCanvas(w, h)
+	lutro.graphics._drawDeferred(canvas, function()
+		lutro.graphics.setFont(newTestFont())
+		lutro.graphics.print("AéxA", 3, 2)
+		lutro.graphics.setFont(font)
+		collectgarbage()
+		collectgarbage()
+	end)
+	lutro.graphics.setCanvas()
+	assertGlyphs(canvas, w, h, glyphs)
+
+	lutro.graphics.setColor(r, g, b, a)
+end
+
+local function assertSameCanvas(a, b, w, h)
+	local da, db = a:newImageData(), b:newImageData()
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			assertPixel(db, x, y, da:getPixel(x, y))
+		end
+	end
+end
+
+function lutro.graphics.spriteBatchTest()
+	local w, h = 48, 40
+	local data = lutro.image.newImageData(9, 7)
+	for y = 0, 6 do
+		for x = 0, 8 do
+			data:setPixel(x, y, x * 28, y * 36, 90, (x + y) % 4 == 0 and 0 or 255)
+		end
+	end
+	local image = lutro.graphics.newImage(data)
+	local quad = lutro.graphics.newQuad(2, 1, 5, 4, 9, 7)
+	local r, g, b, a = lutro.graphics.getColor()
+
+	-- more sprites than the batch was made for, some of them transformed.
+	local sprites = {}
+	local seed = 11
+	local function rnd(n)
+		seed = (seed * 1103515245 + 12345) % 2147483648
+		return seed % n
+	end
+	for i = 1, 40 do
+		local sprite = { rnd(56) - 8, rnd(48) - 8 }
+		if rnd(3) == 0 then table.insert(sprite, 1, quad) end
+		if rnd(4) == 0 then
+			for _, v in ipairs({ rnd(4) * 0.5, 1 + rnd(2), 1 + rnd(2), rnd(3), rnd(3) }) do
+				sprite[#sprite + 1] = v
+			end
+		end
+		sprites[i] = sprite
+	end
+
+	local batch = lutro.graphics.newSpriteBatch(image, 16)
+	unit.assertEquals(batch:getTexture(), image)
+	for i, sprite in ipairs(sprites) do
+		unit.assertEquals(batch:add(unpack(sprite)), i)
+	end
+	unit.assertEquals(batch:getCount(), #sprites)
+	unit.assertEquals(batch:getBufferSize() >= #sprites, true)
+
+	sprites[5] = { quad, 20, 17 }
+	batch:set(5, quad, 20, 17)
+
+	local function render(f)
+		local canvas = lineCanvas(w, h)
+		lutro.graphics.setScissor(3, 2, 40, 33)
+		lutro.graphics.translate(2, -1)
+		f()
+		lutro.graphics.origin()
+		lutro.graphics.setScissor()
+		lutro.graphics.setCanvas()
+		return canvas
+	end
+
+	local expected = render(function()
+		for _, sprite in ipairs(sprites) do
+			local args = { unpack(sprite) }
+			local at = type(args[1]) == "number" and 1 or 2
+			args[at] = args[at] + 4
+			args[at + 1] = args[at + 1] + 3
+			lutro.graphics.draw(image, unpack(args))
+		end
+	end)
+	assertSameCanvas(expected, render(function() lutro.graphics.draw(batch, 4, 3) end), w, h)
+
+	-- transformed sprites leave the transform stack alone, full or not.
+	assertSameCanvas(expected, render(function()
+		local depth = 0
+		while pcall(lutro.graphics.push) do
+			depth = depth + 1
+		end
+		unit.assertEquals(depth, 63)
+		lutro.graphics.draw(batch, 4, 3)
+		for i = 1, depth do
+			lutro.graphics.pop()
+		end
+	end), w, h)
+
+	batch:clear()
+	unit.assertEquals(batch:getCount(), 0)
+	assertSameCanvas(render(function() end), render(function() lutro.graphics.draw(batch) end), w, h)
+
+	lutro.graphics.setColor(r, g, b, a)
+end
+
+function lutro.graphics.tileLayerTest()
+	local w, h = 60, 44
+	local data = lutro.image.newImageData(24, 10)
+	for y = 0, 9 do
+		for x = 0, 23 do
+			data:setPixel(x, y, x * 10, y * 25, 70, (x + y) % 5 == 0 and 0 or 255)
+		end
+	end
+	local image = lutro.graphics.newImage(data)
+
+	-- 4x2 tiles of 6x5, with a row and column of leftover pixels.
+	local tw, th = 6, 5
+	local layer = lutro.graphics.newTileLayer(image, tw, th, 13, 11)
+	unit.assertEquals(layer:getImage(), image)
+	unit.assertEquals({ layer:getDimensions() }, { 13, 11 })
+	unit.assertEquals({ layer:getTileDimensions() }, { tw, th })
+	unit.assertEquals(layer:getTileCount(), 8)
+	unit.assertEquals(layer:getTile(13, 11), 0)
+
+	local rows = {}
+	for y = 1, 11 do
+		rows[y] = {}
+		for x = 1, 13 do
+			rows[y][x] = (x * 3 + y * 5) % 9
+		end
+	end
+	layer:setTiles(rows)
+	rows[2][4] = 8
+	layer:setTile(4, 2, 8)
+	unit.assertEquals(layer:getTile(4, 2), 8)
+	unit.assertEquals(layer:getTile(2, 3), rows[3][2])
+	unit.assertEquals(pcall(layer.setTile, layer, 1, 1, 9), false)
+	unit.assertEquals(pcall(layer.getTile, layer, 14, 1), false)
+
+	-- cells hold 16 bits tile numbers, and maps are counted in ints.
+	local pixels = lutro.graphics.newImage(lutro.image.newImageData(256, 257))
+	local small = lutro.graphics.newTileLayer(pixels, 1, 1, 2, 2)
+	small:setTile(1, 1, 65535)
+	unit.assertEquals(small:getTile(1, 1), 65535)
+	unit.assertEquals(pcall(small.setTile, small, 1, 1, 65536), false)
+	unit.assertEquals(pcall(lutro.graphics.newTileLayer, pixels, 1, 1, 65536, 65536), false)
+
+	local quads = {}
+	for i = 1, 8 do
+		quads[i] = lutro.graphics.newQuad((i - 1) % 4 * tw, math.floor((i - 1) / 4) * th, tw, th, 24, 10)
+	end
+
+	local function render(f)
+		local canvas = lineCanvas(w, h)
+		lutro.graphics.setScissor(3, 2, 51, 37)
+		lutro.graphics.translate(2, -1)
+		f()
+		lutro.graphics.origin()
+		lutro.graphics.setScissor()
+		lutro.graphics.setCanvas()
+		return canvas
+	end
+
+	-- scrolled so the map hangs over every edge of the clip.
+	for _, at in ipairs({ { -7, -4 }, { 10, 9 }, { -40, -30 }, { 58, 40 } }) do
+		local expected = render(function()
+			for y = 1, 11 do
+				for x = 1, 13 do
+					local tile = rows[y][x]
+					if tile > 0 then
+						lutro.graphics.draw(image, quads[tile], at[1] + (x - 1) * tw, at[2] + (y - 1) * th)
+					end
+				end
+			end
+		end)
+		assertSameCanvas(expected, render(function() lutro.graphics.draw(layer, at[1], at[2]) end), w, h)
+	end
+
+	-- deferred tiles leave the transform stack alone, full or not.
+	local expected = render(function() lutro.graphics.draw(layer, 10, 9) end)
+	assertSameCanvas(expected, render(function()
+		local depth = 0
+		while pcall(lutro.graphics.push) do
+			depth = depth + 1
+		end
+		lutro.graphics._drawDeferred(lutro.graphics.getCanvas(), function()
+			lutro.graphics.draw(layer, 10, 9)
+		end)
+		for i = 1, depth do
+			lutro.graphics.pop()
+		end
+	end), w, h)
+
+	layer:fill(0)
+	assertSameCanvas(render(function() end), render(function() lutro.graphics.draw(layer) end), w, h)
+end
+
+local function tint(c, t)
+	return math.floor(c * (t + math.floor(t / 128)) / 256)
+end
+
+function lutro.graphics.particleSystemTest()
+	local data = lutro.image.newImageData(4, 2)
+	for y = 0, 1 do
+		for x = 0, 3 do
+			data:setPixel(x, y, 60 * x, 200 - y * 90, 77, x == 3 and 0 or 255 - x * 40 - y * 30)
+		end
+	end
+	local image = lutro.graphics.newImage(data)
+
+	local ps = lutro.graphics.newParticleSystem(image, 4)
+	unit.assertEquals(ps:getTexture(), image)
+	unit.assertEquals(ps:getBufferSize(), 4)
+	ps:emit(10)
+	unit.assertEquals(ps:getCount(), 4)
+	ps:reset()
+	unit.assertEquals(ps:getCount(), 0)
+
+	-- particles die once their lifetime is over.
+	ps:setParticleLifetime(1)
+	ps:emit(2)
+	ps:update(0.6)
+	unit.assertEquals(ps:getCount(), 2)
+	ps:update(0.6)
+	unit.assertEquals(ps:getCount(), 0)
+
+	-- the emission rate carries fractions over, until the emitter runs out.
+	ps:setBufferSize(100)
+	ps:setParticleLifetime(100)
+	ps:setEmissionRate(10)
+	local counts = {}
+	for i = 1, 4 do
+		ps:update(0.25)
+		counts[i] = ps:getCount()
+	end
+	unit.assertEquals(counts, { 2, 5, 7, 10 })
+	ps:reset()
+	ps:setEmitterLifetime(0.5)
+	ps:update(1)
+	unit.assertEquals(ps:getCount(), 5)
+	unit.assertEquals({ ps:isActive(), ps:isStopped() }, { false, true })
+	ps:update(1)
+	unit.assertEquals(ps:getCount(), 5)
+	ps:setEmitterLifetime(-1)
+	ps:setEmissionRate(0)
+	ps:reset()
+	ps:start()
+
+	-- a single moving particle, halfway through its life.
+	ps:setParticleLifetime(2)
+	ps:setSpeed(10)
+	ps:setDirection(0)
+	ps:setSpread(0)
+	ps:setPosition(10, 8)
+	ps:setColors({ 200, 100, 50, 255 }, { 100, 200, 150, 55 })
+	unit.assertEquals({ ps:getColors() }, { 200, 100, 50, 255, 100, 200, 150, 55 })
+	ps:emit(1)
+	ps:update(1)
+
+	for _, size in ipairs({ 1, 2 }) do
+		ps:setSizes(size)
+		local w, h = 24, 16
+		local canvas = lutro.graphics.newCanvas(w, h)
+		lutro.graphics.setCanvas(canvas)
+		lutro.graphics.setBackgroundColor(background)
+		lutro.graphics.clear()
+		lutro.graphics.draw(ps, 2, 3)
+		lutro.graphics.setCanvas()
+
+		-- centered on (2 + 20, 3 + 8), tinted with the average color.
+		local left, top = 22 - 2 * size, 11 - size
+		local got = canvas:newImageData()
+		for y = 0, h - 1 do
+			for x = 0, w - 1 do
+				local sx, sy = math.floor((x - left) / size), math.floor((y - top) / size)
+				if sx >= 0 and sx < 4 and sy >= 0 and sy < 2 then
+					local r, g, b, a = data:getPixel(sx, sy)
+					assertPixel(got, x, y, expectedBlend(tint(r, 150), tint(g, 150), tint(b, 100), tint(a, 155), unpack(background)))
+				else
+					assertPixel(got, x, y, unpack(background))
+				end
+			end
+		end
+	end
+end
+
+function lutro.graphics.meshTest()
+	local w, h = 40, 30
+	local data = lutro.image.newImageData(7, 5)
+	for y = 0, 4 do
+		for x = 0, 6 do
+			data:setPixel(x, y, x * 36, y * 60, 130, (x * 3 + y) % 4 == 0 and 0 or 90 + x * 20)
+		end
+	end
+	local image = lutro.graphics.newImage(data)
+
+	local corners = { { 0, 0, 0, 0 }, { 7, 0, 1, 0 }, { 7, 5, 1, 1 }, { 0, 5, 0, 1 } }
+	local fan = lutro.graphics.newMesh(corners)
+	fan:setTexture(image)
+	unit.assertEquals(fan:getTexture(), image)
+	unit.assertEquals({ fan:getVertex(3) }, { 7, 5, 1, 1, 255, 255, 255, 255 })
+	unit.assertEquals(fan:getDrawMode(), "fan")
+
+	local strip = lutro.graphics.newMesh({ corners[1], corners[2], corners[4], corners[3] }, "strip")
+	strip:setTexture(image)
+	local triangles = lutro.graphics.newMesh(4, "triangles")
+	triangles:setVertices(corners)
+	triangles:setVertexMap(1, 2, 3, 1, 3, 4)
+	unit.assertEquals(triangles:getVertexMap(), { 1, 2, 3, 1, 3, 4 })
+	triangles:setTexture(image)
+
+	local function render(f)
+		local canvas = lineCanvas(w, h)
+		lutro.graphics.setScissor(3, 2, 33, 25)
+		lutro.graphics.translate(2, -1)
+		f()
+		lutro.graphics.origin()
+		lutro.graphics.setScissor()
+		lutro.graphics.setCanvas()
+		return canvas
+	end
+
+	-- a textured quad samples its texture like an image drawn 1:1, the
+	-- shared edge of its triangles drawn once.
+	local draws = { { -3, -2 }, { 10, 9 }, { 30, 24 } }
+	if lutro.featureflags.HAVE_TRANSFORM then
+		table.insert(draws, { 4, 5, 0, 2, 3 })
+		table.insert(draws, { 30, 6, 0, -3, 2 })
+	end
+	for _, args in ipairs(draws) do
+		local expected = render(function() lutro.graphics.draw(image, unpack(args)) end)
+		for _, mesh in ipairs({ fan, strip, triangles }) do
+			assertSameCanvas(expected, render(function() lutro.graphics.draw(mesh, unpack(args)) end), w, h)
+		end
+	end
+
+	-- positions keep their fraction, as vertices do.
+	local shifted = {}
+	for i = 1, 4 do
+		shifted[i] = { corners[i][1] + 0.6, corners[i][2] + 0.6, corners[i][3], corners[i][4] }
+	end
+	shifted = lutro.graphics.newMesh(shifted)
+	shifted:setTexture(image)
+	local fraction = render(function() lutro.graphics.draw(fan, 10.6, 9.6) end)
+	assertSameCanvas(render(function() lutro.graphics.draw(shifted, 10, 9) end), fraction, w, h)
+	assertPixel(fraction:newImageData(), 12, 11, 0, 0, 0, 255)
+
+	-- vertex colors multiply the texture, or stand alone without one.
+	for i = 1, 4 do
+		fan:setVertex(i, corners[i][1], corners[i][2], corners[i][3], corners[i][4], 200, 100, 50, 160)
+	end
+	unit.assertEquals({ fan:getVertex(2) }, { 7, 0, 1, 0, 200, 100, 50, 160 })
+	for _, textured in ipairs({ true, false }) do
+		fan:setTexture(textured and image or nil)
+		local got = render(function() lutro.graphics.draw(fan, 8, 6) end):newImageData()
+		for y = 0, h - 1 do
+			for x = 0, w - 1 do
+				local sx, sy = x - 10, y - 5
+				if sx >= 0 and sx < 7 and sy >= 0 and sy < 5 and x >= 3 and x < 36 and y >= 2 and y < 27 then
+					local r, g, b, a = 255, 255, 255, 255
+					if textured then r, g, b, a = data:getPixel(sx, sy) end
+					assertPixel(got, x, y, expectedBlend(tint(r, 200), tint(g, 100), tint(b, 50), tint(a, 160), 0, 0, 0, 255))
+				else
+					assertPixel(got, x, y, 0, 0, 0, 255)
+				end
+			end
+		end
+	end
+	unit.assertEquals(fan:getTexture(), nil)
+end
+
+function lutro.graphics.atlasTest()
+	local small, medium, large = "../graphics/grid-transform-32px.png", "../graphics/grid-transform-64px.png", "../graphics/font.png"
+	local atlas = lutro.graphics.newAtlas(128, 64)
+	unit.assertEquals({ atlas:getPageSize(), atlas:getLimit(), atlas:getPageCount() }, { 128, 64, 0 })
+
+	-- two 64px images fit next to the 32px one, the third goes under them
+	-- along with a fourth, the fifth needs a new page; too large to pack,
+	-- the font stands alone.
+	local paths = { small, medium, large, medium, medium, medium }
+	local images, pages = {}, { 1, 1, 1, 1, 1, 2 }
+	for i, path in ipairs(paths) do
+		images[i] = atlas:newImage(path)
+		unit.assertEquals(atlas:getPageCount(), pages[i])
+	end
+
+	local function assertSameImage(a, b)
+		local w, h = b:getDimensions()
+		unit.assertEquals({ a:getDimensions() }, { w, h })
+		local da, db = a:getData(), b:getData()
+		for y = 0, h - 1 do
+			for x = 0, w - 1 do
+				assertPixel(db, x, y, da:getPixel(x, y))
+			end
+		end
+
+		local function render(image)
+			local canvas = lineCanvas(80, 70)
+			lutro.graphics.draw(image, -5, 3)
+			lutro.graphics.draw(image, lutro.graphics.newQuad(3, 5, 20, 30, w, h), 50, 30)
+			if lutro.featureflags.HAVE_TRANSFORM then
+				lutro.graphics.draw(image, 70, 40, 0, -2, 1)
+			end
+			lutro.graphics.setCanvas()
+			return canvas
+		end
+		assertSameCanvas(render(a), render(b), 80, 70)
+	end
+
+	-- images on a page read and draw like standalone ones.
+	for i, path in ipairs(paths) do
+		assertSameImage(lutro.graphics.newImage(path), images[i])
+	end
+
+	-- their pixels stay apart, and so do their lifetimes.
+	local data = images[1]:getData()
+	for y = 0, 31 do
+		data:setPixel(31, y, 1, 2, 3, 4)
+	end
+	assertSameImage(lutro.graphics.newImage(medium), images[2])
+	atlas = nil
+	images[2] = nil
+	collectgarbage()
+	assertSameImage(lutro.graphics.newImage(medium), images[4])
+	assertPixel(images[1]:getData(), 31, 5, 1, 2, 3, 4)
+end
+
+function lutro.graphics.spriteCacheTest()
+	unit.assertEquals(lutro.graphics.getSpriteCacheBudget(), 0)
+	unit.assertEquals(pcall(lutro.graphics.setSpriteCacheBudget, -1), false)
+
+	local data = lutro.image.newImageData(13, 9)
+	for y = 0, 8 do
+		for x = 0, 12 do
+			data:setPixel(x, y, x * 19, y * 28, 90, (x + y) % 3 == 0 and 0 or 255)
+		end
+	end
+	local image = lutro.graphics.newImage(data)
+	local quad = lutro.graphics.newQuad(2, 1, 9, 7, 13, 9)
+
+	-- transforms on the steps of the cache, whose sprites then look the
+	-- same as the image drawn directly.
+	local function render()
+		local canvas = lineCanvas(90, 80)
+		for _ = 1, 3 do
+			lutro.graphics.draw(image, 3, 4, 0, 2, 2)
+			lutro.graphics.draw(image, 60, 2, 0, -1.5, 0.75)
+			lutro.graphics.draw(image, quad, 40, 40, math.pi / 2, 1, -2)
+			lutro.graphics.draw(image, 20, 60, -math.pi / 4, 1.25)
+		end
+		lutro.graphics.setCanvas()
+		return canvas
+	end
+
+	local function assertStats(hits, misses, sprites)
+		local stats = lutro.graphics.getSpriteCacheStats()
+		unit.assertEquals({ stats.hits, stats.misses, stats.sprites }, { hits, misses, sprites })
+		unit.assertEquals(stats.bytes > 0, sprites > 0)
+		unit.assertEquals(stats.bytes <= lutro.graphics.getSpriteCacheBudget(), true)
+	end
+
+	local direct = render()
+	assertStats(0, 0, 0)
+
+	-- each transform is cached the second time it misses and hits from then on.
+	lutro.graphics.setSpriteCacheBudget(1024 * 1024)
+	unit.assertEquals(lutro.graphics.getSpriteCacheBudget(), 1024 * 1024)
+	assertSameCanvas(direct, render(), 90, 80)
+	if lutro.featureflags.HAVE_TRANSFORM then
+		assertStats(4, 8, 4)
+	end
+	assertSameCanvas(direct, render(), 90, 80)
+
+	-- changed pixels are drawn directly until the image is made again,
+	-- which caches them anew.
+	data:setPixel(5, 4, 255, 255, 255, 255)
+	local changed = render()
+	lutro.graphics.setSpriteCacheBudget(0)
+	unit.assertEquals(lutro.graphics.getSpriteCacheStats().sprites, 0)
+	assertSameCanvas(render(), changed, 90, 80)
+
+	image = lutro.graphics.newImage(data)
+	lutro.graphics.setSpriteCacheBudget(1024 * 1024)
+	render()
+	assertSameCanvas(changed, render(), 90, 80)
+
+	-- sprites larger than the budget are never cached.
+	lutro.graphics.setSpriteCacheBudget(64)
+	unit.assertEquals(lutro.graphics.getSpriteCacheStats().sprites, 0)
+	assertSameCanvas(changed, render(), 90, 80)
+	unit.assertEquals(lutro.graphics.getSpriteCacheStats().sprites, 0)
+
+	lutro.graphics.setSpriteCacheBudget(0)
+end
+
+-- wider than a chunk of the blitter, with runs of every opacity.
+local indexedWidth, indexedHeight = 300, 5
+
+local function paletteIndex(x, y)
+	return math.floor((x + y * 7) / 5) % 4
+end
+
+local function drawIndexed(image, w, h)
+	local canvas = lutro.graphics.newCanvas(w, h)
+	lutro.graphics.setCanvas(canvas)
+	lutro.graphics.setBackgroundColor(background)
+	lutro.graphics.clear()
+	lutro.graphics.draw(image, lutro.graphics.newQuad(3, 1, 290, 4, indexedWidth, indexedHeight), 2, 0)
+	lutro.graphics.draw(image, 0, 6, 0, 2, 1.5)
+	lutro.graphics.draw(image, 300, 16, 0, -1, 1)
+	lutro.graphics.draw(image, 40, 24, 0.3, 1.25, 1)
+	lutro.graphics.setCanvas()
+	return canvas
+end
+
+function lutro.graphics.indexedImageTest()
+	local palettes = {
+		{ { 0, 0, 0, 0 }, { 255, 0, 0, 255 }, { 10, 200, 30, 128 }, { 40, 50, 250, 255 } },
+		-- an opaque color turning transparent rebuilds the runs.
+		{ { 0, 0, 0, 0 }, { 9, 8, 7, 0 }, { 200, 100, 0, 255 }, { 1, 2, 3, 60 } },
+	}
+	local w, h = indexedWidth, indexedHeight
+	local indexed = lutro.image.newImageData(w, h, { indexed = true })
+	local image = lutro.graphics.newImage(indexed)
+	unit.assertEquals(lutro.graphics.newImage(lutro.image.newImageData(1, 1)):getPalette(), nil)
+
+	for k, palette in ipairs(palettes) do
+		image:setPalette(palette)
+		local got = image:getPalette()
+		unit.assertEquals(got[2], palette[2])
+		unit.assertEquals(got[256], { 0, 0, 0, 0 })
+
+		local straight = lutro.image.newImageData(w, h)
+		for y = 0, h - 1 do
+			for x = 0, w - 1 do
+				local color = palette[paletteIndex(x, y) + 1]
+				if k == 1 then
+					indexed:setPixel(x, y, unpack(color))
+				end
+				straight:setPixel(x, y, unpack(color))
+				assertPixel(indexed, x, y, unpack(color))
+			end
+		end
+
+		-- every blit kernel expands the palette like the straight pixels.
+		local cw, ch = 320, 40
+		assertSameCanvas(drawIndexed(lutro.graphics.newImage(straight), cw, ch), drawIndexed(image, cw, ch), cw, ch)
+	end
+
+	image:setPalette({ { 1, 1, 1 } }, 255)
+	unit.assertEquals(image:getPalette()[256], { 1, 1, 1, 255 })
+	unit.assertEquals(pcall(indexed.setPixel, indexed, 0, 0, 5, 5, 5, 5), false)
+end
+
+-- scaled draws sample the source pixel under the center of each pixel,
+-- counting from the far end when mirrored.
+local function scaleSample(d, length, scale)
+	if scale < 0 then d = length - 1 - d end
+	scale = math.abs(scale)
+	if scale == math.floor(scale) then return math.floor(d / scale) end
+	local inv = math.floor(65536 / scale)
+	return math.floor((2 * d + 1) * inv / 131072)
+end
+
+function lutro.graphics.drawScaledTest()
+	if not lutro.featureflags.HAVE_TRANSFORM then return end
+
+	local w, h = 64, 48
+	local iw, ih = 7, 5
+	local data = lutro.image.newImageData(iw, ih)
+	for y = 0, ih - 1 do
+		for x = 0, iw - 1 do
+			data:setPixel(x, y, x * 36, y * 50, 200, (x * 3 + y) % 5 == 0 and 0 or 255)
+		end
+	end
+	local image = lutro.graphics.newImage(data)
+	-- the second quad reaches past the image, whose pixels are never drawn.
+	local quads = { false, lutro.graphics.newQuad(1, 1, 5, 4, iw, ih), lutro.graphics.newQuad(4, 2, 6, 5, iw, ih) }
+	local clip = { 3, 2, 55, 41 }
+	local r, g, b, a = lutro.graphics.getColor()
+
+	local scales = {
+		{ 1, 1 }, { -1, 1 }, { 1, -1 }, { -1, -1 },
+		{ 2, 2 }, { 3, 1 }, { 4, -2 }, { -2, 3 }, { 5, 5 },
+		{ 2.5, 1.5 }, { -0.6, 0.7 }, { 1, 0.5 }
+	}
+
+	for _, scale in ipairs(scales) do
+		for _, quad in ipairs(quads) do
+			local sx, sy = scale[1], scale[2]
+			local x, y = 30, 22
+			local canvas = lineCanvas(w, h)
+			lutro.graphics.setScissor(unpack(clip))
+			if quad then
+				lutro.graphics.draw(image, quad, x, y, 0, sx, sy)
+			else
+				lutro.graphics.draw(image, x, y, 0, sx, sy)
+			end
+			lutro.graphics.setScissor()
+			lutro.graphics.setCanvas()
+
+			local sx0, sy0, sw, sh = 0, 0, iw, ih
+			if quad then sx0, sy0, sw, sh = quad:getViewport() end
+			local dw, dh = math.floor(sw * math.abs(sx)), math.floor(sh * math.abs(sy))
+			local x0 = sx < 0 and x - dw or x
+			local y0 = sy < 0 and y - dh or y
+
+			local result = canvas:newImageData()
+			for py = 0, h - 1 do
+				for px = 0, w - 1 do
+					local er, eg, eb, ea = 0, 0, 0, 255
+					local dx, dy = px - x0, py - y0
+					if px >= clip[1] and py >= clip[2] and px < clip[1] + clip[3] and py < clip[2] + clip[4]
+						and dx >= 0 and dy >= 0 and dx < dw and dy < dh then
+						local cx, cy = sx0 + scaleSample(dx, dw, sx), sy0 + scaleSample(dy, dh, sy)
+						if cx < iw and cy < ih then
+							local cr, cg, cb, ca = data:getPixel(cx, cy)
+							if ca > 0 then er, eg, eb, ea = cr, cg, cb, ca end
+						end
+					end
+					assertPixel(result, px, py, er, eg, eb, ea)
+				end
+			end
+		end
+	end
+
+	lutro.graphics.setColor(r, g, b, a)
+end
+
+function lutro.graphics.asyncImageDataTest()
+	local path = "../graphics/grid-transform-64px.png"
+
+	local function assertSame(got, expected)
+		unit.assertEquals({ got:getDimensions() }, { expected:getDimensions() })
+		local w, h = expected:getDimensions()
+		for y = 0, h - 1 do
+			for x = 0, w - 1 do
+				assertPixel(got, x, y, expected:getPixel(x, y))
+			end
+		end
+	end
+
+	local decode = lutro.image.newImageDataAsync(path)
+	unit.assertEquals(decode:type(), "ImageDecode")
+	while not decode:isReady() do end
+	local data = decode:getImageData()
+	assertSame(data, lutro.image.newImageData(path))
+	unit.assertIs(decode:getImageData(), data)
+	unit.assertIs(decode:wait(), data)
+
+	-- the settings go along.
+	decode = lutro.image.newImageDataAsync("../graphics/font.png", { premultiplied = true })
+	local image = lutro.graphics.newImage(decode:wait())
+	assertSame(image:getData(), lutro.image.newImageData("../graphics/font.png", { premultiplied = true }))
+
+	-- a coroutine waits yielding, the main thread blocking.
+	decode = lutro.image.newImageDataAsync(path)
+	local waiting = coroutine.create(function() return decode:wait() end)
+	local ok, result = coroutine.resume(waiting)
+	while coroutine.status(waiting) ~= "dead" do
+		ok, result = coroutine.resume(waiting)
+	end
+	unit.assertTrue(ok)
+	unit.assertIs(result, decode:getImageData())
+
+	-- handles dropped before the decode is done free it all the same.
+	for i = 1, 8 do
+		lutro.image.newImageDataAsync(path)
+	end
+	collectgarbage()
+
+	unit.assertErrorMsgContains("requires 1 or 2 arguments", lutro.image.newImageDataAsync)
+end
+
+function lutro.graphics.imageCacheTest()
+	local path = "../graphics/grid-transform-32px.png"
+	local budget = lutro.image.getCacheBudget()
+	collectgarbage()
+	collectgarbage()
+	lutro.image.setCacheBudget(0)
+	local before = lutro.image.getCacheStats()
+
+	-- a second load shares the pixels of the first.
+	local first = lutro.image.newImageData(path)
+	local second = lutro.image.newImageData(path)
+	local stats = lutro.image.getCacheStats()
+	unit.assertEquals(stats.images, before.images + 1)
+	unit.assertEquals(stats.bytes, before.bytes + 32 * 32 * 4)
+	unit.assertEquals(stats.hits, before.hits + 1)
+
+	-- an Image loaded from the path too, which stays drawable.
+	local image = lutro.graphics.newImage(path)
+	unit.assertEquals(lutro.image.getCacheStats().hits, before.hits + 2)
+	unit.assertNotIs(image:getData(), first)
+
+	-- changing pixels copies them first.
+	local r, g, b, a = first:getPixel(3, 4)
+	first:setPixel(3, 4, 1, 2, 3, 4)
+	assertPixel(first, 3, 4, 1, 2, 3, 4)
+	assertPixel(second, 3, 4, r, g, b, a)
+	assertPixel(image:getData(), 3, 4, r, g, b, a)
+
+	-- other settings decode apart.
+	local premultiplied = lutro.image.newImageData(path, { premultiplied = true })
+	unit.assertEquals(lutro.image.getCacheStats().images, before.images + 2)
+
+	-- without a budget, images go along with their last ImageData.
+	first, second, image, premultiplied = nil, nil, nil, nil
+	collectgarbage()
+	collectgarbage()
+	stats = lutro.image.getCacheStats()
+	unit.assertEquals(stats.images, before.images)
+	unit.assertEquals(stats.unused, 0)
+
+	-- with one, they stay until purged.
+	lutro.image.setCacheBudget(1024 * 1024)
+	lutro.image.newImageData(path)
+	collectgarbage()
+	collectgarbage()
+	stats = lutro.image.getCacheStats()
+	unit.assertEquals(stats.images, before.images + 1)
+	unit.assertEquals(stats.unused, 1)
+	unit.assertEquals(stats.unusedBytes, 32 * 32 * 4)
+
+	local again = lutro.image.newImageDataAsync(path)
+	unit.assertTrue(again:isReady())
+	unit.assertEquals(lutro.image.getCacheStats().unused, 0)
+	again = nil
+	collectgarbage()
+	collectgarbage()
+
+	lutro.image.purgeCache()
+	stats = lutro.image.getCacheStats()
+	unit.assertEquals(stats.images, before.images)
+	unit.assertEquals(stats.unused, 0)
+
+	-- a smaller budget drops what no longer fits.
+	lutro.image.newImageData(path)
+	collectgarbage()
+	collectgarbage()
+	lutro.image.setCacheBudget(100)
+	unit.assertEquals(lutro.image.getCacheStats().unused, 0)
+	unit.assertEquals(lutro.image.getCacheBudget(), 100)
+
+	unit.assertErrorMsgContains("requires a budget of 0 bytes or more", lutro.image.setCacheBudget, -1)
+	lutro.image.setCacheBudget(budget)
+end
+
+-- without a save directory there is nothing to test.
+function lutro.graphics.diskCacheTest()
+	local path = "../graphics/alpha-gradient.png"
+	collectgarbage()
+	collectgarbage()
+	if not lutro.image.setDiskCache(true) then return end
+	unit.assertTrue(lutro.image.getDiskCache())
+	local before = lutro.image.getCacheStats()
+
+	-- the file cached by an earlier run may already be there.
+	local first = lutro.image.newImageData(path, { premultiplied = true })
+	local stats = lutro.image.getCacheStats()
+	unit.assertEquals(stats.diskHits + stats.diskWrites, before.diskHits + before.diskWrites + 1)
+
+	-- once the image is gone, it comes back from the disk.
+	first = nil
+	collectgarbage()
+	collectgarbage()
+	local mapped = lutro.image.newImageData(path, { premultiplied = true })
+	unit.assertEquals(lutro.image.getCacheStats().diskHits, stats.diskHits + 1)
+	unit.assertEquals(lutro.image.getCacheStats().misses, stats.misses)
+
+	-- changing the pixels shared with it leaves it be.
+	local shared = lutro.image.newImageData(path, { premultiplied = true })
+	shared:setPixel(5, 200, 1, 2, 3, 255)
+	assertPixel(shared, 5, 200, 1, 2, 3, 255)
+
+	lutro.image.setDiskCache(false)
+	unit.assertFalse(lutro.image.getDiskCache())
+	local straight = lutro.image.newImageData(path, { premultiplied = false })
+	local w, h = straight:getDimensions()
+	unit.assertEquals({ mapped:getDimensions() }, { w, h })
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			assertPixel(mapped, x, y, unpremultiply(premultiply(straight:getPixel(x, y))))
+		end
+	end
+
+	-- the spans read along draw it as those built when decoding.
+	local function drawn(data)
+		local canvas = lutro.graphics.newCanvas(w, h)
+		lutro.graphics.setCanvas(canvas)
+		lutro.graphics.setBackgroundColor(background)
+		lutro.graphics.clear()
+		lutro.graphics.draw(lutro.graphics.newImage(data), 0, 0)
+		lutro.graphics.setCanvas()
+		return canvas:newImageData()
+	end
+
+	local expected = drawn(mapped)
+	mapped, shared = nil, nil
+	collectgarbage()
+	collectgarbage()
+	local result = drawn(lutro.image.newImageData(path, { premultiplied = true }))
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			assertPixel(result, x, y, expected:getPixel(x, y))
+		end
+	end
+end
+
+-- Deferred rendering bins commands into 128x64 tiles and replays them per
+-- tile, which must draw exactly what immediate rendering does.
+function lutro.graphics.deferredDrawTest()
+	local w, h = 300, 150
+	local src = lutro.image.newImageData(37, 23)
+	for y = 0, 22 do
+		for x = 0, 36 do
+			src:setPixel(x, y, runSource(x, y))
+		end
+	end
+	local image = lutro.graphics.newImage(src)
+	local quad = lutro.graphics.newQuad(3, 2, 30, 19, 37, 23)
+
+	-- every shape straddles a tile edge, at x = 128, 256 or y = 64, 128.
+	local function scene(canvas)
+		local r, g, b, a = lutro.graphics.getColor()
+		lutro.graphics.setCanvas(canvas)
+		lutro.graphics.setBackgroundColor(background)
+		lutro.graphics.clear()
+
+		lutro.graphics.setColor(200, 60, 30, 255)
+		lutro.graphics.rectangle("fill", 100, 40, 60, 50)
+		lutro.graphics.setColor(20, 220, 90, 140)
+		lutro.graphics.polygon("fill", 110, 10, 290, 70, 140, 140, 240, 20)
+		lutro.graphics.setColor(250, 250, 40, 255)
+		lutro.graphics.setLineWidth(3)
+		lutro.graphics.line(0, 0, 299, 149)
+		lutro.graphics.line(10, 140, 280, 5)
+		lutro.graphics.setLineWidth(1)
+		lutro.graphics.ellipse("line", 128, 64, 50, 30)
+		lutro.graphics.circle("fill", 256, 128, 20)
+		lutro.graphics.points(127, 63, 128, 64, 255, 127, 256, 128)
+
+		lutro.graphics.setColor(255, 255, 255, 255)
+		lutro.graphics.draw(image, 110, 50)
+		lutro.graphics.draw(image, quad, 240, 120)
+		lutro.graphics.draw(image, 128, 64, 0.6, 2, 1.5, 18, 11)
+		lutro.graphics.draw(image, 250, 60, 0, -3, 2)
+
+		lutro.graphics.push()
+		lutro.graphics.translate(128, 64)
+		lutro.graphics.rotate(0.3)
+		lutro.graphics.scale(1.5, 1.5)
+		lutro.graphics.rectangle("line", -20, -15, 40, 30)
+		lutro.graphics.draw(image, quad, -10, -10)
+		lutro.graphics.pop()
+
+		lutro.graphics.setScissor(120, 55, 150, 80)
+		lutro.graphics.setColor(90, 40, 240, 200)
+		lutro.graphics.circle("fill", 200, 90, 60)
+		lutro.graphics.draw(image, 250, 120, 0, 2, 2)
+		lutro.graphics.setScissor()
+
+		-- particles and meshes are drawn as they are when drawn, whatever
+		-- happens to them before the queue is flushed.
+		local ps = lutro.graphics.newParticleSystem(image, 8)
+		ps:setParticleLifetime(4)
+		ps:setSpeed(20)
+		ps:setSpread(0)
+		ps:setSizes(0.8, 2.5)
+		ps:setColors({ 255, 255, 255, 255 }, { 60, 250, 120, 100 })
+		for i = 0, 5 do
+			ps:setPosition(110 + i * 30, 40 + i * 17)
+			ps:emit(1)
+			ps:update(0.5)
+		end
+		lutro.graphics.draw(ps, 5, 3)
+		ps:update(1)
+
+		local fan = lutro.graphics.newMesh({
+			{ 128, 64, 0.5, 0.5, 255, 255, 255, 255 }, { 90, 20, 0, 0, 255, 40, 40, 255 },
+			{ 170, 30, 1, 0, 40, 255, 40, 200 }, { 150, 110, 1, 1, 40, 40, 255, 120 },
+			{ 100, 100, 0, 1, 255, 255, 40, 255 }, { 90, 20, 0, 0, 255, 40, 40, 255 }
+		})
+		fan:setTexture(image)
+		local triangles = lutro.graphics.newMesh({
+			{ 230, 100, 0, 0, 250, 20, 200, 255 }, { 290, 110, 0, 0, 20, 250, 200, 160 },
+			{ 250, 145, 0, 0, 200, 200, 20, 255 }
+		}, "triangles")
+		lutro.graphics.draw(fan, 0.4, 0.3)
+		lutro.graphics.draw(fan, 150.5, 20, 0.4, 0.7, 0.8)
+		lutro.graphics.draw(triangles, -0.25, 0.5)
+		fan:setVertex(1, 0, 0, 0, 0, 0, 0, 0, 0)
+		triangles:setVertex(1, 0, 0, 0, 0)
+
+		lutro.graphics.setColor(r, g, b, a)
+		lutro.graphics.setCanvas()
+	end
+
+	local immediate = lutro.graphics.newCanvas(w, h)
+	scene(immediate)
+
+	local deferred = lutro.graphics.newCanvas(w, h)
+	lutro.graphics._drawDeferred(deferred, function() scene(deferred) end)
+
+	local expected = immediate:newImageData()
+	local result = deferred:newImageData()
+	for y = 0, h - 1 do
+		for x = 0, w - 1 do
+			assertPixel(result, x, y, expected:getPixel(x, y))
+		end
+	end
+end
+
+-- Frame tests, see tests.lua.
+
+-- between frames, the screen reads as the frame drawn last, wherever the
+-- frontend had it drawn. The last two frames are the same, their tiles
+-- left alone since cleared needing no clearing again.
+local function screenScene(frame)
+	frame = math.min(frame, 3)
+	local r, g, b, a = lutro.graphics.getColor()
+	lutro.graphics.setBackgroundColor(20 * frame, 90, 200 - 30 * frame)
+	lutro.graphics.clear()
+	lutro.graphics.setColor(240, 120, 10 * frame, 255)
+	lutro.graphics.rectangle("fill", 10 + 17 * frame, 5 + 9 * frame, 40, 30)
+	lutro.graphics.setColor(r, g, b, a)
+end
+
+lutro.graphics.readScreenTest = {
+	frames = 4,
+	draw = screenScene,
+	check = function(frame)
+		local screen = lutro.graphics.getCanvas():newImageData()
+		local w, h = screen:getDimensions()
+		unit.assertEquals({ w, h }, { lutro.graphics.getWidth(), lutro.graphics.getHeight() })
+
+		local canvas = lutro.graphics.newCanvas(w, h)
+		lutro.graphics.setCanvas(canvas)
+		screenScene(frame)
+		lutro.graphics.setCanvas()
+
+		local expected = canvas:newImageData()
+		for y = 0, h - 1 do
+			for x = 0, w - 1 do
+				assertPixel(screen, x, y, expected:getPixel(x, y))
+			end
+		end
+	end
+}
+
 return {
     lutro.graphics.setBackgroundColorTest,
-    lutro.graphics.getBackgroundColorTest
+    lutro.graphics.getBackgroundColorTest,
+    lutro.graphics.drawCompositionTest,
+    lutro.graphics.drawOpacityRunsTest,
+    lutro.graphics.fillCompositionTest,
+    lutro.graphics.blendModeTest,
+    lutro.graphics.premultipliedImageTest,
+    lutro.graphics.loadPremultipliedTest,
+    lutro.graphics.drawRotatedTest,
+    lutro.graphics.deferredDrawTest,
+    lutro.graphics.lineClipTest,
+    lutro.graphics.lineWidthTest,
+    lutro.graphics.lineStyleTest,
+    lutro.graphics.fillPolygonTest,
+    lutro.graphics.ellipseTest,
+    lutro.graphics.circleSegmentsTest,
+    lutro.graphics.textTest,
+    lutro.graphics.spriteBatchTest,
+    lutro.graphics.tileLayerTest,
+    lutro.graphics.particleSystemTest,
+    lutro.graphics.meshTest,
+    lutro.graphics.atlasTest,
+    lutro.graphics.spriteCacheTest,
+    lutro.graphics.indexedImageTest,
+    lutro.graphics.drawScaledTest,
+    lutro.graphics.asyncImageDataTest,
+    lutro.graphics.imageCacheTest,
+    lutro.graphics.diskCacheTest,
+
+    frameTests = {
+        lutro.graphics.readScreenTest
+    }
 }
\ No newline at end of file
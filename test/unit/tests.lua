@@ -16,10 +16,42 @@ function runTests()
 		require 'modules/timer',
 		require 'modules/window'
 	}
+	frameTests = {}
 	for i, moduleTests in ipairs(moduleTests) do
 		for i, functionTest in ipairs(moduleTests) do
 			functionTest()
 		end
+		for i, frameTest in ipairs(moduleTests.frameTests or {}) do
+			table.insert(frameTests, frameTest)
+		end
+	end
+end
+
+-- Frame tests span frames: for each of its frames, a frame test draws in
+-- lutro.draw and checks the result in the lutro.update of the next frame.
+-- Returns whether any is left to run.
+local frameTest, frame = 0, 0
+
+function updateFrameTests()
+	local test = frameTests[frameTest]
+	if test and frame > 0 then
+		test.check(frame)
+	end
+
+	if not test or frame == test.frames then
+		frameTest, frame = frameTest + 1, 0
+		test = frameTests[frameTest]
+	end
+	if test then
+		frame = frame + 1
+	end
+	return test ~= nil
+end
+
+function drawFrameTests()
+	local test = frameTests[frameTest]
+	if test then
+		test.draw(frame)
 	end
 end
 